@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include <stddef.h>
+
+// Layout of the records buffered by libhijacker (see batch_record)
+typedef struct {
+  unsigned long long address;
+  unsigned int size;
+  unsigned int site;
+  void *function;
+} batch_record;
+
+void writefunc(const batch_record *records, size_t count) {
+  size_t i;
+
+  printf("Detected %zu memory writes\n", count);
+
+  for (i = 0; i < count; i++) {
+    printf("\tsite %u wrote %u bytes at <%#08llx>\n", records[i].site, records[i].size, records[i].address);
+  }
+}
+
+void readfunc(const batch_record *records, size_t count) {
+  size_t i;
+
+  printf("Detected %zu memory reads\n", count);
+
+  for (i = 0; i < count; i++) {
+    printf("\tsite %u read %u bytes at <%#08llx>\n", records[i].site, records[i].size, records[i].address);
+  }
+}
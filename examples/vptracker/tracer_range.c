@@ -0,0 +1,18 @@
+#include <stdio.h>
+
+// An access was made at start, start + stride and so on up to end, excluded
+// (see trampoline_mode). A null stride means the same address every time.
+
+void writefunc(unsigned long long start, unsigned long long end, long long stride, unsigned int size) {
+  if (stride == 0)
+    printf("Detected memory writes of %u bytes, repeated at <%#08llx>\n", size, start);
+  else
+    printf("Detected %lld memory writes of %u bytes from <%#08llx> to <%#08llx>\n", (long long) (end - start) / stride, size, start, end);
+}
+
+void readfunc(unsigned long long start, unsigned long long end, long long stride, unsigned int size) {
+  if (stride == 0)
+    printf("Detected memory reads of %u bytes, repeated at <%#08llx>\n", size, start);
+  else
+    printf("Detected %lld memory reads of %u bytes from <%#08llx> to <%#08llx>\n", (long long) (end - start) / stride, size, start, end);
+}
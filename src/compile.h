@@ -87,8 +87,9 @@
 	/// Compile source with several parameters
 	#define compile(what, ...) do {\
 	int status;\
-	if(fork() != 0) {\
-				wait(&status);\
+	pid_t pid;\
+	if((pid = fork()) != 0) {\
+				waitpid(pid, &status, 0);\
 		} else {\
 				if(execlp("gcc", "gcc", what, __VA_ARGS__, (char *)NULL) == -1) {\
 					herror(true, "Unable to launch the compiler '%s' (error %d: '%s')\n", COMPILER, errno, strerror(errno));\
@@ -102,8 +103,9 @@
 
 	#define link(what, ...) do {\
 	int status;\
-	if(fork() != 0) {\
-				wait(&status);\
+	pid_t pid;\
+	if((pid = fork()) != 0) {\
+				waitpid(pid, &status, 0);\
 		} else {\
 				if(execlp("ld", "ld", what, __VA_ARGS__, (char *)NULL) == -1) {\
 					herror(true, "Unable to launch the linker '%s' (error %d: '%s')\n", LINKER, errno, strerror(errno));\
@@ -117,8 +119,9 @@
 
 	#define execute(what, ...) do {\
 	int status;\
-	if(fork() != 0) {\
-				wait(&status);\
+	pid_t pid;\
+	if((pid = fork()) != 0) {\
+				waitpid(pid, &status, 0);\
 		} else {\
 				if(execlp(what, what, __VA_ARGS__, (char *)NULL) == -1) {\
 					herror(true, "Unable to launch '%s'\n", what);\
@@ -0,0 +1,584 @@
+/**
+*                       Copyright (C) 2008-2015 HPDCS Group
+*                       http://www.dis.uniroma1.it/~hpdcs
+*
+*
+* This file is part of the Hijacker static binary instrumentation tool.
+*
+* Hijacker is free software; you can redistribute it and/or modify it under the
+* terms of the GNU General Public License as published by the Free Software
+* Foundation; either version 3 of the License, or (at your option) any later
+* version.
+*
+* Hijacker is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+* A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* hijacker; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*
+* @file archive.c
+* @brief Reading and writing of static archives (GNU 'ar' format)
+*/
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <elf.h>
+
+#include <hijacker.h>
+#include <prints.h>
+
+#include <executables/archive.h>
+
+
+/// Longest name which fits in the member header, along with its '/' terminator
+#define ARCHIVE_SHORT_NAME	15
+
+
+/**
+ * Callback invoked on every global symbol defined by a member.
+ *
+ * @return True to stop the walk
+ */
+typedef bool (*archive_symbol_func)(char *name, void *data);
+
+
+static unsigned char *archive_read_file(char *path, size_t *size) {
+	FILE *fp;
+	long fsize;
+	unsigned char *data;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return NULL;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	fsize = ftell(fp);
+	rewind(fp);
+
+	data = malloc(fsize + 1);
+	if (data == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	if (fread(data, 1, fsize, fp) != (size_t) fsize) {
+		herror(true, "Unable to read the file '%s'!\n", path);
+	}
+
+	fclose(fp);
+
+	*size = fsize;
+	return data;
+}
+
+
+bool is_archive(char *path) {
+	char magic[sizeof(ARCHIVE_MAGIC) - 1];
+	FILE *fp;
+	bool found;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return false;
+	}
+
+	found = fread(magic, 1, sizeof(magic), fp) == sizeof(magic)
+		&& !memcmp(magic, ARCHIVE_MAGIC, sizeof(magic));
+
+	fclose(fp);
+
+	return found;
+}
+
+
+archive_member *archive_new_member(char *name, unsigned char *data, size_t size) {
+	archive_member *member;
+
+	member = calloc(sizeof(archive_member), 1);
+	if (member == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	member->name = strdup(name);
+	if (member->name == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	member->data = data;
+	member->size = size;
+	member->mode = 0644;
+
+	return member;
+}
+
+
+archive_member *archive_load(char *path) {
+	archive_member *first, *last, *member;
+	unsigned char *data, *header;
+	char *longnames, *end;
+	char name[256];
+	size_t size, pos, msize, len;
+	long idx;
+
+	data = archive_read_file(path, &size);
+	if (data == NULL) {
+		return NULL;
+	}
+
+	if (size < strlen(ARCHIVE_MAGIC) || memcmp(data, ARCHIVE_MAGIC, strlen(ARCHIVE_MAGIC))) {
+		free(data);
+		return NULL;
+	}
+
+	first = last = NULL;
+	longnames = NULL;
+	pos = strlen(ARCHIVE_MAGIC);
+
+	// Each member is preceded by a 60-byte header: name (16), date (12),
+	// uid (6), gid (6), mode (8), size (10) and the "`\n" terminator
+	while (pos + ARCHIVE_HEADER_SIZE <= size) {
+		header = data + pos;
+		msize = strtoul((char *) header + 48, NULL, 10);
+
+		if (pos + ARCHIVE_HEADER_SIZE + msize > size) {
+			herror(false, "Archive '%s' is truncated\n", path);
+			break;
+		}
+
+		memcpy(name, header, 16);
+		name[16] = '\0';
+
+		if (!strncmp(name, "//", 2)) {
+			// GNU table of the long names
+			longnames = (char *) header + ARCHIVE_HEADER_SIZE;
+		} else if (name[0] == '/' && (name[1] == ' ' || !strncmp(name, "/SYM64/", 7))) {
+			// Symbol index, which is rebuilt from the members
+		} else {
+			if (name[0] == '/' && longnames) {
+				idx = strtol(name + 1, NULL, 10);
+				end = strchr(longnames + idx, '\n');
+				len = end ? (size_t) (end - longnames - idx) : strlen(longnames + idx);
+				if (len >= sizeof(name)) {
+					len = sizeof(name) - 1;
+				}
+				memcpy(name, longnames + idx, len);
+				name[len] = '\0';
+			}
+
+			// Names are terminated by '/' in the GNU format
+			end = strchr(name, '/');
+			if (end) {
+				*end = '\0';
+			}
+			for (len = strlen(name); len && name[len - 1] == ' '; name[--len] = '\0');
+
+			member = archive_new_member(name, malloc(msize + 1), msize);
+			if (member->data == NULL) {
+				herror(true, "Out of memory!\n");
+			}
+			memcpy(member->data, header + ARCHIVE_HEADER_SIZE, msize);
+
+			member->date = strtoul((char *) header + 16, NULL, 10);
+			member->uid = strtoul((char *) header + 28, NULL, 10);
+			member->gid = strtoul((char *) header + 34, NULL, 10);
+			member->mode = strtoul((char *) header + 40, NULL, 8);
+
+			if (last) {
+				last->next = member;
+			} else {
+				first = member;
+			}
+			last = member;
+		}
+
+		// Members are aligned to even offsets
+		pos += ARCHIVE_HEADER_SIZE + msize + (msize & 1);
+	}
+
+	free(data);
+
+	return first;
+}
+
+
+void archive_free(archive_member *members) {
+	archive_member *next;
+
+	while (members) {
+		next = members->next;
+		free(members->name);
+		free(members->data);
+		free(members);
+		members = next;
+	}
+}
+
+
+// ---------------------------------------------------------------------------
+// ELF members
+// ---------------------------------------------------------------------------
+
+/**
+ * Retrieves a section header of an ELF member, whatever its class.
+ *
+ * @return False if the header lies outside of the member
+ */
+static bool archive_section(archive_member *member, unsigned int i, Elf64_Shdr *shdr) {
+	Elf64_Ehdr *ehdr64 = (Elf64_Ehdr *) member->data;
+	Elf32_Ehdr *ehdr32 = (Elf32_Ehdr *) member->data;
+	Elf32_Shdr *shdr32;
+	size_t offset;
+
+	if (member->data[EI_CLASS] == ELFCLASS64) {
+		offset = ehdr64->e_shoff + (size_t) i * sizeof(Elf64_Shdr);
+		if (i >= ehdr64->e_shnum || offset + sizeof(Elf64_Shdr) > member->size) {
+			return false;
+		}
+		memcpy(shdr, member->data + offset, sizeof(Elf64_Shdr));
+	} else {
+		offset = ehdr32->e_shoff + (size_t) i * sizeof(Elf32_Shdr);
+		if (i >= ehdr32->e_shnum || offset + sizeof(Elf32_Shdr) > member->size) {
+			return false;
+		}
+		shdr32 = (Elf32_Shdr *) (member->data + offset);
+		shdr->sh_name = shdr32->sh_name;
+		shdr->sh_type = shdr32->sh_type;
+		shdr->sh_flags = shdr32->sh_flags;
+		shdr->sh_offset = shdr32->sh_offset;
+		shdr->sh_size = shdr32->sh_size;
+		shdr->sh_link = shdr32->sh_link;
+		shdr->sh_entsize = shdr32->sh_entsize;
+	}
+
+	return shdr->sh_type == SHT_NOBITS || shdr->sh_offset + shdr->sh_size <= member->size;
+}
+
+
+/**
+ * Checks whether a member is a relocatable ELF object.
+ */
+static bool archive_is_object(archive_member *member) {
+	Elf32_Ehdr *ehdr = (Elf32_Ehdr *) member->data;
+
+	if (member->size < sizeof(Elf64_Ehdr) || memcmp(member->data, ELFMAG, SELFMAG)) {
+		return false;
+	}
+
+	if (member->data[EI_CLASS] != ELFCLASS32 && member->data[EI_CLASS] != ELFCLASS64) {
+		return false;
+	}
+
+	// The type is at the same offset in both classes
+	return ehdr->e_type == ET_REL;
+}
+
+
+/**
+ * Walks the global symbols defined by an ELF member.
+ *
+ * @return True if the walk has been stopped by the callback
+ */
+static bool archive_walk_symbols(archive_member *member, archive_symbol_func func, void *data) {
+	Elf64_Shdr symtab, strtab;
+	Elf64_Sym *sym64;
+	Elf32_Sym *sym32;
+	unsigned int i, j, count, bind, shndx, name;
+	bool is64;
+
+	if (!archive_is_object(member)) {
+		return false;
+	}
+
+	is64 = member->data[EI_CLASS] == ELFCLASS64;
+
+	for (i = 0; archive_section(member, i, &symtab); i++) {
+		if (symtab.sh_type != SHT_SYMTAB) {
+			continue;
+		}
+
+		if (!archive_section(member, symtab.sh_link, &strtab)) {
+			return false;
+		}
+
+		count = symtab.sh_size / (is64 ? sizeof(Elf64_Sym) : sizeof(Elf32_Sym));
+
+		for (j = 1; j < count; j++) {
+			if (is64) {
+				sym64 = (Elf64_Sym *) (member->data + symtab.sh_offset) + j;
+				bind = ELF64_ST_BIND(sym64->st_info);
+				shndx = sym64->st_shndx;
+				name = sym64->st_name;
+			} else {
+				sym32 = (Elf32_Sym *) (member->data + symtab.sh_offset) + j;
+				bind = ELF32_ST_BIND(sym32->st_info);
+				shndx = sym32->st_shndx;
+				name = sym32->st_name;
+			}
+
+			if ((bind != STB_GLOBAL && bind != STB_WEAK && bind != STB_GNU_UNIQUE)
+			    || shndx == SHN_UNDEF || name >= strtab.sh_size) {
+				continue;
+			}
+
+			if (memchr(member->data + strtab.sh_offset + name, '\0', strtab.sh_size - name) == NULL) {
+				continue;
+			}
+
+			if (func((char *) member->data + strtab.sh_offset + name, data)) {
+				return true;
+			}
+		}
+
+		// There is a single symbol table in a relocatable object
+		break;
+	}
+
+	return false;
+}
+
+
+bool archive_member_has_code(archive_member *member) {
+	Elf64_Shdr shdr;
+	unsigned int i;
+
+	if (!archive_is_object(member)) {
+		return false;
+	}
+
+	for (i = 0; archive_section(member, i, &shdr); i++) {
+		if ((shdr.sh_flags & SHF_EXECINSTR) && shdr.sh_size > 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+// ---------------------------------------------------------------------------
+// Output archive
+// ---------------------------------------------------------------------------
+
+/// Symbol index being built, along with the member defining each symbol
+typedef struct {
+	char *names;                  // Sequence of NUL-terminated names
+	size_t size;
+	size_t capacity;
+
+	unsigned int *owners;         // Index of the defining member
+	unsigned int count;
+	unsigned int maxcount;
+
+	unsigned int member;          // Member being walked
+} archive_index;
+
+
+static bool archive_index_symbol(char *name, void *data) {
+	archive_index *index = (archive_index *) data;
+	size_t len = strlen(name) + 1;
+
+	if (index->size + len > index->capacity) {
+		index->capacity = (index->size + len) * 2;
+		index->names = realloc(index->names, index->capacity);
+		if (index->names == NULL) {
+			herror(true, "Out of memory!\n");
+		}
+	}
+
+	if (index->count == index->maxcount) {
+		index->maxcount = index->maxcount ? index->maxcount * 2 : 64;
+		index->owners = realloc(index->owners, index->maxcount * sizeof(unsigned int));
+		if (index->owners == NULL) {
+			herror(true, "Out of memory!\n");
+		}
+	}
+
+	memcpy(index->names + index->size, name, len);
+	index->size += len;
+	index->owners[index->count++] = index->member;
+
+	return false;
+}
+
+
+/**
+ * Writes a field of a member header, padded with blanks to its width.
+ *
+ * @param field Start of the field within the header
+ * @param width Width of the field
+ * @param format Format of the value, followed by its arguments
+ */
+static void archive_write_field(char *field, size_t width, const char *format, ...) {
+	char scratch[64];
+	va_list args;
+	int len;
+
+	va_start(args, format);
+	len = vsnprintf(scratch, sizeof(scratch), format, args);
+	va_end(args);
+
+	if (len < 0 || (size_t) len > width) {
+		herror(true, "Value '%s' does not fit in a %zu-byte field of the archive header\n", scratch, width);
+	}
+
+	memset(field, ' ', width);
+	memcpy(field, scratch, len);
+}
+
+
+static void archive_write_header(FILE *fp, char *name, archive_member *member, size_t size) {
+	char header[ARCHIVE_HEADER_SIZE];
+
+	archive_write_field(header, 16, "%s", name);
+	if (member) {
+		archive_write_field(header + 16, 12, "%lu", member->date);
+		archive_write_field(header + 28, 6, "%u", member->uid);
+		archive_write_field(header + 34, 6, "%u", member->gid);
+		archive_write_field(header + 40, 8, "%o", member->mode);
+	} else {
+		memset(header + 16, ' ', 32);
+	}
+	archive_write_field(header + 48, 10, "%zu", size);
+	memcpy(header + 58, "`\n", 2);
+
+	fwrite(header, 1, ARCHIVE_HEADER_SIZE, fp);
+}
+
+
+static void archive_write_be32(FILE *fp, size_t value) {
+	unsigned char bytes[4];
+
+	bytes[0] = value >> 24;
+	bytes[1] = value >> 16;
+	bytes[2] = value >> 8;
+	bytes[3] = value;
+
+	fwrite(bytes, 1, 4, fp);
+}
+
+
+void archive_write(char *path, archive_member *members) {
+	archive_member *member, index_header;
+	archive_index index;
+	char *longnames;
+	char name[32];
+	size_t longsize, len, pos, indexsize;
+	size_t *offsets;
+	unsigned int count, i;
+	FILE *fp;
+
+	memset(&index, 0, sizeof(index));
+
+	// Collect the symbols and the long names
+	longnames = NULL;
+	longsize = 0;
+	count = 0;
+
+	for (member = members; member; member = member->next) {
+		index.member = count++;
+		archive_walk_symbols(member, archive_index_symbol, &index);
+
+		len = strlen(member->name);
+		if (len > ARCHIVE_SHORT_NAME || strchr(member->name, '/') || strchr(member->name, ' ')) {
+			longnames = realloc(longnames, longsize + len + 2);
+			if (longnames == NULL) {
+				herror(true, "Out of memory!\n");
+			}
+			sprintf(longnames + longsize, "%s/\n", member->name);
+			longsize += len + 2;
+		}
+	}
+
+	offsets = malloc((count + 1) * sizeof(size_t));
+	if (offsets == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	// Lay out the archive, to know the offsets of the members' headers
+	indexsize = index.count ? 4 + 4 * index.count + index.size : 0;
+
+	pos = strlen(ARCHIVE_MAGIC);
+	if (index.count) {
+		pos += ARCHIVE_HEADER_SIZE + indexsize + (indexsize & 1);
+	}
+	if (longsize) {
+		pos += ARCHIVE_HEADER_SIZE + longsize + (longsize & 1);
+	}
+
+	for (i = 0, member = members; member; member = member->next, i++) {
+		offsets[i] = pos;
+		pos += ARCHIVE_HEADER_SIZE + member->size + (member->size & 1);
+	}
+
+	if (pos > 0xffffffffUL) {
+		herror(true, "Archive '%s' is too large for a 32-bit symbol index\n", path);
+	}
+
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		herror(true, "Unable to write output archive '%s'!\n", path);
+	}
+
+	fwrite(ARCHIVE_MAGIC, 1, strlen(ARCHIVE_MAGIC), fp);
+
+	// Symbol index: number of symbols, offsets of the defining members'
+	// headers (big endian) and the names, in the same order
+	if (index.count) {
+		memset(&index_header, 0, sizeof(index_header));
+		archive_write_header(fp, "/", &index_header, indexsize);
+
+		archive_write_be32(fp, index.count);
+		for (i = 0; i < index.count; i++) {
+			archive_write_be32(fp, offsets[index.owners[i]]);
+		}
+		fwrite(index.names, 1, index.size, fp);
+
+		if (indexsize & 1) {
+			fputc('\n', fp);
+		}
+	}
+
+	if (longsize) {
+		archive_write_header(fp, "//", NULL, longsize);
+		fwrite(longnames, 1, longsize, fp);
+
+		if (longsize & 1) {
+			fputc('\n', fp);
+		}
+	}
+
+	// Members whose name does not fit in the header refer to the table
+	pos = 0;
+
+	for (member = members; member; member = member->next) {
+		len = strlen(member->name);
+		if (len > ARCHIVE_SHORT_NAME || strchr(member->name, '/') || strchr(member->name, ' ')) {
+			sprintf(name, "/%zu", pos);
+			pos += len + 2;
+		} else {
+			sprintf(name, "%s/", member->name);
+		}
+
+		archive_write_header(fp, name, member, member->size);
+		fwrite(member->data, 1, member->size, fp);
+
+		if (member->size & 1) {
+			fputc('\n', fp);
+		}
+	}
+
+	if (ferror(fp)) {
+		herror(true, "Unable to write output archive '%s'!\n", path);
+	}
+
+	fclose(fp);
+
+	free(offsets);
+	free(longnames);
+	free(index.names);
+	free(index.owners);
+}
@@ -0,0 +1,114 @@
+/**
+*                       Copyright (C) 2008-2015 HPDCS Group
+*                       http://www.dis.uniroma1.it/~hpdcs
+*
+*
+* This file is part of the Hijacker static binary instrumentation tool.
+*
+* Hijacker is free software; you can redistribute it and/or modify it under the
+* terms of the GNU General Public License as published by the Free Software
+* Foundation; either version 3 of the License, or (at your option) any later
+* version.
+*
+* Hijacker is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+* A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* hijacker; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*
+* @file archive.h
+* @brief Reading and writing of static archives (GNU 'ar' format)
+*/
+
+#pragma once
+#ifndef _ARCHIVE_H
+#define _ARCHIVE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+
+/// Magic string at the beginning of static archives
+#define ARCHIVE_MAGIC		"!<arch>\n"
+
+/// Size of the header preceding each member
+#define ARCHIVE_HEADER_SIZE	60
+
+
+/**
+ * A member of a static archive. The symbol index and the table of the
+ * long names are not members: they are dropped upon loading and rebuilt
+ * upon writing.
+ */
+typedef struct _archive_member {
+	char *name;                   // Name of the member, long names resolved
+	unsigned char *data;          // Content of the member
+	size_t size;
+
+	unsigned long date;           // Attributes of the header, kept as they are
+	unsigned int uid;
+	unsigned int gid;
+	unsigned int mode;
+
+	struct _archive_member *next;
+} archive_member;
+
+
+/**
+ * Checks whether a file is a static archive.
+ *
+ * @param path Path of the file
+ *
+ * @return True if the file starts with the archive's magic string
+ */
+bool is_archive(char *path);
+
+/**
+ * Loads the members of a static archive.
+ *
+ * @param path Path of the archive
+ *
+ * @return Pointer to the list of the members, or NULL if the file cannot be
+ * read, is not an archive or is empty
+ */
+archive_member *archive_load(char *path);
+
+/**
+ * Creates a new member, with the attributes of a deterministic archive.
+ *
+ * @param name Name of the member, which is copied
+ * @param data Content of the member, which is owned by the new member
+ * @param size Size of the content
+ *
+ * @return Pointer to the new member
+ */
+archive_member *archive_new_member(char *name, unsigned char *data, size_t size);
+
+/**
+ * Writes a static archive, rebuilding the symbol index from the global
+ * symbols defined by the ELF members.
+ *
+ * @param path Path of the output archive
+ * @param members List of the members, in order
+ */
+void archive_write(char *path, archive_member *members);
+
+/**
+ * Releases a list of members, along with their contents.
+ *
+ * @param members List of the members
+ */
+void archive_free(archive_member *members);
+
+/**
+ * Checks whether a member is a relocatable ELF object with some code.
+ *
+ * @param member Pointer to the member
+ *
+ * @return True if the member has at least a non-empty executable section
+ */
+bool archive_member_has_code(archive_member *member);
+
+#endif /* _ARCHIVE_H */
@@ -47,3 +47,22 @@ void output_object_file(char *pathname) {
 
 	hsuccess();
 }
+
+
+void output_object_image(unsigned char **image, size_t *size) {
+	hprint("Generating the new object file...\n");
+
+	// Switch on file type
+	switch(PROGRAM(type)) {
+
+		case EXECUTABLE_ELF:
+
+			elf_generate_image(image, size);
+			break;
+
+		default:
+			hinternal();
+	}
+
+	hsuccess();
+}
@@ -76,16 +76,18 @@ typedef union {
 typedef struct {
 	FILE *pointer;			// Il file descriptor
 	bool is64;			// 32 o 64 bit?
-	unsigned char *data;		// elf file loaded in memory
+	unsigned char *data;		// elf file mapped in memory (read-only)
+	size_t size;			// size of the mapping
 
 	Elf_Hdr	*hdr;
 	Section_Hdr *sec_hdr;
 	unsigned int secnum;
+	unsigned int sym_strtab;	// Index of the symbols' string table, 0 until looked up
 } elf_file;
 
 
 /// Macro to quickly access ELF-Related data structure
-#define ELF(field) (config.program.e.elf.field)
+#define ELF(field) (job->program.e.elf.field)
 
 /// Macro to get ELF section size by its index
 #define sec_size(sec) ((int)( ELF(is64) ? ELF(sec_hdr)[(sec)].section64.sh_size : ELF(sec_hdr)[(sec)].section32.sh_size ))
@@ -38,28 +38,28 @@
 #include <elf/handle-elf.h>
 #include <elf/emit-elf.h>
 
-/// Hijacked output ELF descriptor
-hijacked_elf hijacked;
+/// Hijacked output ELF descriptor, one for each thread generating a file
+__thread hijacked_elf hijacked;
 
 /**
  * Commodity pointers to default section's payloads
  */
-static section *shstrtab;
-static section *strtab;
-static section *symtab;
-static section *rodata;
-static section *text[MAX_VERSIONS];
-static section *rela_text[MAX_VERSIONS];
-static section *rela_rodata;
-static section *rela_data;
-static section *rela_init_array;
-static section *rela_fini_array;
-static section *data;
-static section *bss;
-static section *tbss;
-static section *tdata;
-static section *init_array;
-static section *fini_array;
+static __thread section *shstrtab;
+static __thread section *strtab;
+static __thread section *symtab;
+static __thread section *rodata;
+static __thread section *text[MAX_VERSIONS];
+static __thread section *rela_text[MAX_VERSIONS];
+static __thread section *rela_rodata;
+static __thread section *rela_data;
+static __thread section *rela_init_array;
+static __thread section *rela_fini_array;
+static __thread section *data;
+static __thread section *bss;
+static __thread section *tbss;
+static __thread section *tdata;
+static __thread section *init_array;
+static __thread section *fini_array;
 
 /**
  * Check if the section has enough available space.
@@ -282,7 +282,11 @@ int elf_write_symbol(section *symtable, symbol *sym, section *strtable) {
 			break;
 
 		case SYMBOL_TLS:
-			if (str_equal(sym->sec->name, ".tdata")) {
+			// Variables of the runtime, defined by its thread-local sections
+			if (sym->sec == NULL) {
+				shndx = SHN_UNDEF;
+			}
+			else if (str_equal(sym->sec->name, ".tdata")) {
 				// FIXME: Credo vada commentato...
 				sym->offset = elf_write_data(tdata, sym->payload, sym->size);
 				sec = tdata;
@@ -418,7 +422,7 @@ unsigned long elf_write_code(section *sec, function *func) {
 
 	size_t size;
 
-	ll_node *rela_node;
+	unsigned int idx;
 	symbol *rela;
 
 	// Compute function size
@@ -457,23 +461,22 @@ unsigned long elf_write_code(section *sec, function *func) {
 				herror(true, "Architecture type not recognized!\n");
 		}
 
-		// Write instruction
-		memcpy(sec->ptr, x86->insn, instr->size);
+		// Write instruction, opaque ones are copied verbatim
+		memcpy(sec->ptr, instr->opaque ? instr->opaque : x86->insn, instr->size);
 
 		sec->ptr = (void *)((char *)sec->ptr + instr->size);
 
 		// For each relocation that apply to this instruction we have to rewrite them
 		// Write relocations within instruction
-		for (rela_node = instr->reference.first; rela_node; rela_node = rela_node->next) {
-			rela = rela_node->elem;
-			rela->relocation.sec = text[PROGRAM(version)];
+		sv_foreach(&instr->reference, idx, rela) {
+			rela->relocation.sec = text[CURRENT(id)];
 
 			addr = rela->relocation.offset;
 
 			hprint("In function '%s' from instruction <%llx> (<%llx>) to sym '%s'\n",
 				func->name, instr->new_addr, instr->orig_addr, rela->name);
 
-			elf_write_reloc(rela_text[PROGRAM(version)], rela, addr, rela->relocation.addend);
+			elf_write_reloc(rela_text[CURRENT(id)], rela, addr, rela->relocation.addend);
 		}
 	}
 
@@ -739,6 +742,14 @@ static void elf_build(void) {
 
 	hnotice(3, "Allocating sections memory\n");
 
+	// Forget about the file generated by a previous job of this thread
+	memset(&hijacked, 0, sizeof(hijacked));
+	memset(text, 0, sizeof(text));
+	memset(rela_text, 0, sizeof(rela_text));
+	shstrtab = strtab = symtab = rodata = NULL;
+	rela_rodata = rela_data = rela_init_array = rela_fini_array = NULL;
+	data = bss = tbss = tdata = init_array = fini_array = NULL;
+
 	// Allocate in-memory space for the hijacked ELF's header
 	hijacked.ehdr = calloc(ehdr_size(), 1);
 
@@ -1084,6 +1095,235 @@ static void elf_update_symbol_list(symbol *first) {
 }
 
 
+/**
+ * Tells whether an instruction lies within the code of a function, as it
+ * is laid out in the current version.
+ */
+static bool elf_function_contains(function *func, insn_info *instr) {
+	unsigned long long begin;
+
+	begin = func->begin_insn->new_addr;
+
+	return instr->new_addr >= begin && instr->new_addr < begin + func->symbol->size;
+}
+
+
+/**
+ * Tells whether the code of a function may stand for the one of another
+ * function. Only the function symbol may lead into its code: no other symbol
+ * must share its address, no relocation must point within its code and no
+ * jump must enter or leave it without a relocation, since these would depend
+ * on where the function is placed.
+ *
+ * @param func Pointer to the function descriptor
+ * @param functions Function symbols of the version, by offset
+ */
+static bool elf_function_shareable(function *func, hash_table *functions) {
+	insn_info *instr, *source;
+	ht_node *node;
+	symbol *sym;
+	unsigned int idx;
+
+	if (func->begin_insn == NULL || !ll_empty(&func->alias)) {
+		return false;
+	}
+
+	ht_foreach(functions, func->symbol->offset, node) {
+		sym = node->elem;
+
+		if (sym != func->symbol && sym->sec == func->symbol->sec && sym->offset == func->symbol->offset) {
+			return false;
+		}
+	}
+
+	for (instr = func->begin_insn; instr; instr = instr->next) {
+		if (!sv_empty(&instr->pointedby) || instr->jumptable.size > 0) {
+			return false;
+		}
+
+		if (instr->jumpto && sv_empty(&instr->reference) && !elf_function_contains(func, instr->jumpto)) {
+			return false;
+		}
+
+		sv_foreach(&instr->targetof, idx, source) {
+			if (sv_empty(&source->reference) && !elf_function_contains(func, source)) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+
+/**
+ * Returns the next relocation of a function, walking its instructions in
+ * order, or NULL once they are over.
+ */
+static symbol *elf_next_reloc(insn_info **instr, unsigned int *idx) {
+	while (*instr && *idx >= sv_size(&(*instr)->reference)) {
+		*instr = (*instr)->next;
+		*idx = 0;
+	}
+
+	return *instr ? sv_at(&(*instr)->reference, (*idx)++) : NULL;
+}
+
+
+/**
+ * Hashes the code of a function along with its relocations, whose offsets
+ * are taken from the beginning of the function. Functions are hashed as
+ * flat sequences of bytes, since the same code may be split into different
+ * instructions (e.g. an opaque function and its decoded copy).
+ */
+static unsigned long long elf_function_hash(function *func) {
+	unsigned long long hash, offset;
+	insn_info *instr;
+	symbol *rela;
+	unsigned int idx;
+
+	hash = HASH_FNV_OFFSET;
+
+	for (instr = func->begin_insn; instr; instr = instr->next) {
+		hash = hash_bytes(instr->opaque ? instr->opaque : instr->i.x86.insn, instr->size, hash);
+	}
+
+	instr = func->begin_insn;
+	idx = 0;
+
+	while ((rela = elf_next_reloc(&instr, &idx)) != NULL) {
+		offset = rela->relocation.offset - func->begin_insn->new_addr;
+
+		hash = hash_bytes(&rela->index, sizeof(rela->index), hash);
+		hash = hash_bytes(&rela->relocation.type, sizeof(rela->relocation.type), hash);
+		hash = hash_bytes(&rela->relocation.addend, sizeof(rela->relocation.addend), hash);
+		hash = hash_bytes(&offset, sizeof(offset), hash);
+	}
+
+	return hash;
+}
+
+
+/**
+ * Tells whether two functions would be emitted with the same code and the
+ * same relocations, i.e. whether they are interchangeable.
+ */
+static bool elf_function_equal(function *a, function *b) {
+	insn_info *x, *y;
+	symbol *rx, *ry;
+	unsigned char *bx, *by;
+	unsigned int ox, oy, size, ix, iy;
+
+	x = a->begin_insn;
+	y = b->begin_insn;
+	ox = oy = 0;
+
+	while (true) {
+		for (; x && ox == x->size; x = x->next, ox = 0);
+		for (; y && oy == y->size; y = y->next, oy = 0);
+
+		if (x == NULL || y == NULL) {
+			break;
+		}
+
+		bx = x->opaque ? x->opaque : x->i.x86.insn;
+		by = y->opaque ? y->opaque : y->i.x86.insn;
+		size = x->size - ox < y->size - oy ? x->size - ox : y->size - oy;
+
+		if (memcmp(bx + ox, by + oy, size)) {
+			return false;
+		}
+
+		ox += size;
+		oy += size;
+	}
+
+	if (x != NULL || y != NULL) {
+		return false;
+	}
+
+	x = a->begin_insn;
+	y = b->begin_insn;
+	ix = iy = 0;
+
+	while (true) {
+		rx = elf_next_reloc(&x, &ix);
+		ry = elf_next_reloc(&y, &iy);
+
+		if (rx == NULL || ry == NULL) {
+			return rx == ry;
+		}
+
+		if (rx->index != ry->index || rx->relocation.type != ry->relocation.type
+		    || rx->relocation.addend != ry->relocation.addend
+		    || rx->relocation.offset - a->begin_insn->new_addr != ry->relocation.offset - b->begin_insn->new_addr) {
+			return false;
+		}
+	}
+}
+
+
+/**
+ * Drops from a version the functions whose code has already been written by
+ * a previous version, typically those that the version's rules have left
+ * untouched. The symbol of each dropped function is moved to the code it
+ * shares, so the relocations towards it are redirected as well.
+ *
+ * @param version The version whose functions are looked up
+ * @param bodies Functions written so far, by the hash of their code
+ *
+ * @return True if any function has been dropped, hence the code of the
+ * version has to be laid out again
+ */
+static bool elf_share_functions(int version, hash_table *bodies) {
+	hash_table functions = {0};
+	function *func, **link, *twin;
+	ht_node *node;
+	symbol *sym;
+	bool shared;
+
+	for (sym = PROGRAM(symbols); sym; sym = sym->next) {
+		if (sym->authentic && sym->type == SYMBOL_FUNCTION && sym->version == version) {
+			ht_insert(&functions, sym->offset, sym);
+		}
+	}
+
+	shared = false;
+	link = &PROGRAM(v_code)[version];
+
+	while ((func = *link) != NULL) {
+		twin = NULL;
+
+		if (elf_function_shareable(func, &functions)) {
+			ht_foreach(bodies, elf_function_hash(func), node) {
+				if (elf_function_equal(node->elem, func)) {
+					twin = node->elem;
+					break;
+				}
+			}
+		}
+
+		if (twin == NULL) {
+			link = &func->next;
+			continue;
+		}
+
+		hnotice(3, "Function '%s' shares the code of '%s'\n", func->name, twin->name);
+
+		func->symbol->version = twin->symbol->version;
+		func->symbol->offset = twin->symbol->offset;
+		func->symbol->size = twin->symbol->size;
+
+		*link = func->next;
+		shared = true;
+	}
+
+	ht_clear(&functions);
+
+	return shared;
+}
+
+
 static void elf_fill_sections(void) {
 	size_t ver;
 
@@ -1091,6 +1331,8 @@ static void elf_fill_sections(void) {
 	function *func, *prev_func;
 	section *sec;
 
+	hash_table bodies = {0};
+
 	unsigned long long offset;
 	size_t size;
 
@@ -1110,9 +1352,16 @@ static void elf_fill_sections(void) {
 		update_instruction_addresses(ver);
 		update_jump_displacements(ver);
 
+		// Functions which come out the same as in a previous version are
+		// written once, and the remaining ones are packed again
+		if (ver > 0 && elf_share_functions(ver, &bodies)) {
+			update_instruction_addresses(ver);
+			update_jump_displacements(ver);
+		}
+
 		// Even if functions belong to different '.text' original sections,
 		// they are all actually written into the same output text section
-		for (func = PROGRAM(v_code)[PROGRAM(version)]; func; func = func->next) {
+		for (func = PROGRAM(v_code)[CURRENT(id)]; func; func = func->next) {
 			hnotice(3, "Writing function '%s' (%d bytes) on section '%s' (version %d)\n",
 				func->name, func->symbol->size, text[func->symbol->version]->name, func->symbol->version);
 
@@ -1132,9 +1381,13 @@ static void elf_fill_sections(void) {
 				alias->offset = offset;
 				alias->size = func->symbol->size;
 			}
+
+			ht_insert(&bodies, elf_function_hash(func), func);
 		}
 	}
 
+	ht_clear(&bodies);
+
 	// ------------------------------------------------------
 	// META SECTIONS
 	// ------------------------------------------------------
@@ -1284,49 +1537,25 @@ static void elf_fill_sections(void) {
 
 
 /**
- * Generates the new object file.
+ * Builds the sections of the new object file from the intermediate
+ * representation, so that their final size is known.
  */
-void elf_generate_file(char *path) {
-	FILE *file;
+static void elf_prepare_file(void) {
 	section *sec;
 
-	size_t shnum;
-	unsigned long offset;
-
 	hnotice(1, "Initializing the new ELF file...\n");
 
 	elf_build();
 	elf_build_eheader();
 
-	// Open the output file and write the content
-	hnotice(1, "Creating a new output file...\n");
-
-	// If the output path is not valid, the standard one is used
-	if (!path) {
-		path = malloc(strlen(DEFAULT_OUT_NAME) + 1);
-		strcpy(path, DEFAULT_OUT_NAME);
-	}
-
-	file = fopen(path, "w+");
-	if (!file) {
-		herror("Unable to write output ELF file '%s'!\n", path);
-	}
-
-	hijacked.path = malloc(strlen(path) + 1);
-	strcpy(hijacked.path, path);
-
-	// Reserve space for the ELF's header (written later)
-	fseek(file, ehdr_size(), SEEK_SET);
-
 	// update symbol references and indexes
 	elf_update_symbol_list(PROGRAM(symbols));
 
 	// Fill output sections with their respective contents
 	elf_fill_sections();
 
-	// Write all sections to file
-	hnotice(2, "Writing sections content...\n");
-	shnum = 0;
+	// Symbols have been purged and renumbered for the output
+	symbol_index_reset();
 
 	for (sec = hijacked.sections; sec; sec = sec->next) {
 		// We shrink the size of each section to the appropriate size
@@ -1340,7 +1569,29 @@ void elf_generate_file(char *path) {
 		// else if (sec->type != SECTION_TLS) {
 		// 	set_hdr_info(sec->header, sh_addralign, 1);
 		// }
+	}
+}
+
+
+/**
+ * Writes the prepared object file into the given stream.
+ *
+ * @param file Output stream, positioned at its beginning
+ */
+static void elf_write_file(FILE *file) {
+	section *sec;
+
+	size_t shnum;
+	unsigned long offset;
+
+	// Reserve space for the ELF's header (written later)
+	fseek(file, ehdr_size(), SEEK_SET);
+
+	// Write all sections to file
+	hnotice(2, "Writing sections content...\n");
+	shnum = 0;
 
+	for (sec = hijacked.sections; sec; sec = sec->next) {
 		offset = elf_write_section(file, sec);
 		set_hdr_info(sec->header, sh_offset, offset);
 
@@ -1369,5 +1620,72 @@ void elf_generate_file(char *path) {
 
 	rewind(file);
 	fwrite(hijacked.ehdr, ehdr_size(), 1, file);
+}
+
+
+/**
+ * Generates the new object file.
+ */
+void elf_generate_file(char *path) {
+	FILE *file;
+
+	elf_prepare_file();
+
+	// Open the output file and write the content
+	hnotice(1, "Creating a new output file...\n");
+
+	// If the output path is not valid, the standard one is used
+	if (!path) {
+		path = malloc(strlen(DEFAULT_OUT_NAME) + 1);
+		strcpy(path, DEFAULT_OUT_NAME);
+	}
+
+	file = fopen(path, "w+");
+	if (!file) {
+		herror(true, "Unable to write output ELF file '%s'!\n", path);
+	}
+
+	hijacked.path = malloc(strlen(path) + 1);
+	strcpy(hijacked.path, path);
+
+	elf_write_file(file);
+	fclose(file);
+}
+
+
+/**
+ * Generates the new object file in memory, so that it can be further
+ * processed (e.g. linked) before being written to disk.
+ */
+void elf_generate_image(unsigned char **image, size_t *size) {
+	FILE *file;
+	section *sec;
+	unsigned char *buffer;
+	size_t length;
+
+	elf_prepare_file();
+
+	hnotice(1, "Creating a new in-memory object...\n");
+
+	length = ehdr_size();
+	for (sec = hijacked.sections; sec; sec = sec->next) {
+		length += header_info((Section_Hdr *)sec->header, sh_size) + (shdr_size());
+	}
+
+	// The stream needs a spare byte for its string terminator
+	buffer = malloc(length + 1);
+	if (buffer == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	file = fmemopen(buffer, length + 1, "w+");
+	if (!file) {
+		herror(true, "Unable to create the in-memory object!\n");
+	}
+
+	elf_write_file(file);
 	fclose(file);
+
+	*image = buffer;
+	*size = length;
 }
@@ -96,6 +96,14 @@ typedef struct _hijacked_elf {
  * Generates the new object file.
  */
 void elf_generate_file(char *path);
+
+/**
+ * Generates the new object file in memory.
+ *
+ * @param image Pointer to a variable which will hold the newly allocated image
+ * @param size Pointer to a variable which will hold the size of the image
+ */
+void elf_generate_image(unsigned char **image, size_t *size);
 long elf_write_reloc(section *sec, symbol *sym, unsigned long long addr, long addend);
 
 
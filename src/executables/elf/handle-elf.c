@@ -34,6 +34,7 @@
 
 #include <elf/parse-elf.h>
 #include <elf/handle-elf.h>
+#include <apply-rules.h>
 
 
 static void clone_text_sections(int version, char *suffix) {
@@ -93,9 +94,9 @@ static void clone_text_sections(int version, char *suffix) {
  */
 static void clone_relocations(int version, char *suffix) {
 	function *func;
-	insn_info *instr;
+	insn_info *instr, *source, *last;
 
-	ll_node *rela_node;
+	unsigned int idx;
 
 	symbol *rela, *clone, *sym;
 
@@ -104,112 +105,129 @@ static void clone_relocations(int version, char *suffix) {
 	for (func = PROGRAM(v_code)[version]; func; func = func->next) {
 		for (instr = func->begin_insn; instr; instr = instr->next) {
 
-			// --------------------------------------------------------
-			// From CODE to *
-			// --------------------------------------------------------
+			// An opaque clone of a decoded function stands for all of its
+			// instructions, hence it gathers the relocations of each of them
+			last = (instr->opaque && !instr->parent->opaque) ? NULL : instr->parent->next;
 
-			for (rela_node = instr->parent->reference.first; rela_node;
-			     rela_node = rela_node->next) {
-				rela = rela_node->elem;
+			for (source = instr->parent; source != last; source = source->next) {
 
-				if (rela->type == SYMBOL_SECTION && rela->sec->type == SECTION_CODE) {
-					hinternal();
-				}
+				// --------------------------------------------------------
+				// From CODE to *
+				// --------------------------------------------------------
 
-				else if (rela->type != SYMBOL_FUNCTION) {
-					clone = symbol_rela_clone(rela);
-				}
+				sv_foreach(&source->reference, idx, rela) {
 
-				else {
-					// If it is a relocation toward a function, we must make
-					// sure that the function from the new version is referred,
-					// not the original one
-
-					// name = malloc(strlen(rela->name) + strlen(suffix) + 2);
-					// bzero(name, sizeof(name));
-					// sprintf(name, "%s_%s", rela->name, suffix);
-					name = add_suffix(rela->name, "_", suffix);
+					if (rela->type == SYMBOL_SECTION && rela->sec->type == SECTION_CODE) {
+						hinternal();
+					}
 
-					// We seek the correct function by its name
-					// (this should work, provided that cloning of functions
-					// and instructions occurs before cloning relocations)
-					sym = find_symbol_by_name(name);
+					else if (rela->type != SYMBOL_FUNCTION) {
+						clone = symbol_rela_clone(rela);
+					}
 
-					if (sym == NULL) {
-						// TODO: This is a gigantic hack to clone function aliases
-						// which is not duplicated by `switch_executable_version`,
-						// since there is no concrete function's descriptor associated
-						herror(true, "Cannot find symbol '%s'\n", name);
-
-					// 	sym = find_symbol_by_name(rela->name);
-					// 	if (sym == NULL) {
-					// 		hinternal();
-					// 	}
-
-					// 	// It is reasonable that this is a function alias which is not in
-					// 	// the function list because it was not be cloned in the clone
-					// 	// function list step. Here we create a new symbol on-the-fly, to
-					// 	// represent it.
-					// 	clone = symbol_create(name, sym->type, sym->bind, sym->sec, sym->size);
-					// 	clone->func = sym->func;
-					// 	clone->offset = sym->offset;
-					// 	ll_push(&sym->func->alias, clone);
-					// 	sym = clone;
-					// 	herror(false, "Created a new function alias '%s'\n", sym->name);
+					else {
+						// If it is a relocation toward a function, we must make
+						// sure that the function from the new version is referred,
+						// not the original one
+
+						// name = malloc(strlen(rela->name) + strlen(suffix) + 2);
+						// bzero(name, sizeof(name));
+						// sprintf(name, "%s_%s", rela->name, suffix);
+						name = add_suffix(rela->name, "_", suffix);
+
+						// We seek the correct function by its name
+						// (this should work, provided that cloning of functions
+						// and instructions occurs before cloning relocations)
+						sym = find_symbol_by_name(name);
+
+						if (sym == NULL) {
+							// TODO: This is a gigantic hack to clone function aliases
+							// which is not duplicated by `switch_executable_version`,
+							// since there is no concrete function's descriptor associated
+							herror(true, "Cannot find symbol '%s'\n", name);
+
+						// 	sym = find_symbol_by_name(rela->name);
+						// 	if (sym == NULL) {
+						// 		hinternal();
+						// 	}
+
+						// 	// It is reasonable that this is a function alias which is not in
+						// 	// the function list because it was not be cloned in the clone
+						// 	// function list step. Here we create a new symbol on-the-fly, to
+						// 	// represent it.
+						// 	clone = symbol_create(name, sym->type, sym->bind, sym->sec, sym->size);
+						// 	clone->func = sym->func;
+						// 	clone->offset = sym->offset;
+						// 	ll_push(&sym->func->alias, clone);
+						// 	sym = clone;
+						// 	herror(false, "Created a new function alias '%s'\n", sym->name);
+						}
+
+						clone = symbol_rela_clone(sym);
+						// We need to copy everything since we're cloning an
+						// authentic symbol which has no relocation information
+						clone->relocation.type = rela->relocation.type;
+						clone->relocation.offset = rela->relocation.offset;
+						clone->relocation.addend = rela->relocation.addend;
 					}
 
-					clone = symbol_rela_clone(sym);
-					// We need to copy everything since we're cloning an
-					// authentic symbol which has no relocation information
-					clone->relocation.type = rela->relocation.type;
-					clone->relocation.offset = rela->relocation.offset;
-					clone->relocation.addend = rela->relocation.addend;
+					// We need to update the section information
+					clone->relocation.sec = func->symbol->sec;
+
+					clone->relocation.target_insn = instr;
+					sv_push(&instr->reference, clone);
 				}
 
-				// We need to update the section information
-				clone->relocation.sec = func->symbol->sec;
+				// --------------------------------------------------------
+				// From * to CODE
+				// --------------------------------------------------------
 
-				clone->relocation.target_insn = instr;
-				ll_push(&instr->reference, clone);
-			}
+				sv_foreach(&source->pointedby, idx, rela) {
 
-			// --------------------------------------------------------
-			// From * to CODE
-			// --------------------------------------------------------
+					if (rela->type == SYMBOL_SECTION && rela->sec->type == SECTION_CODE) {
+						// hinternal();
+					}
 
-			for (rela_node = instr->parent->pointedby.first; rela_node;
-			     rela_node = rela_node->next) {
-				rela = rela_node->elem;
+					// We seek the symbol associated to the parent section of
+					// the current function
+					sym = func->symbol->sec->sym;
 
-				if (rela->type == SYMBOL_SECTION && rela->sec->type == SECTION_CODE) {
-					// hinternal();
-				}
+					if (sym == NULL) {
+						hinternal();
+					}
 
-				// We seek the symbol associated to the parent section of
-				// the current function
-				sym = func->symbol->sec->sym;
+					clone = symbol_rela_clone(sym);
+					clone->relocation.type = rela->relocation.type;
+					clone->relocation.sec = rela->relocation.sec;
+					// WARNING: This offset *must* be updated in `adjust_relocations`!
+					// If this is not the case, abandon the ship.
+					clone->relocation.offset = rela->relocation.offset;
+					clone->relocation.addend = rela->relocation.addend;
 
-				if (sym == NULL) {
-					hinternal();
+					clone->relocation.target_insn = instr;
+					sv_push(&instr->pointedby, clone);
 				}
 
-				clone = symbol_rela_clone(sym);
-				clone->relocation.type = rela->relocation.type;
-				clone->relocation.sec = rela->relocation.sec;
-				// WARNING: This offset *must* be updated in `adjust_relocations`!
-				// If this is not the case, abandon the ship.
-				clone->relocation.offset = rela->relocation.offset;
-				clone->relocation.addend = rela->relocation.addend;
-
-				clone->relocation.target_insn = instr;
-				ll_push(&instr->pointedby, clone);
 			}
-
 		}
 	}
 }
 
 
+/**
+ * Tells whether the rules of the version being created may write to a
+ * function. Functions which are never written are not decoded again in
+ * the new version, which shares their bytes as they are.
+ *
+ * @param func Pointer to the function descriptor in the plain version
+ *
+ * @return True if the function must be cloned instruction by instruction
+ */
+static bool version_writes_function(function *func) {
+	return rules_reach_function_in(func, CURRENT(id));
+}
+
+
 static void adjust_relocations(symbol *symbols, int version, section *text) {
 	symbol *rela, *rela2;
 	section *sec;
@@ -303,11 +321,15 @@ int switch_executable_version(int version) {
 		hinternal();
 	}
 
-	// Updates the current working version of the binary representation.
+	// Binds the calling thread to the version of the binary representation.
 	// NOTE: We must perform this assignment now because all *_clone
 	// functions rely on the increased version number.
 	// NOTE: I believe it is better not to do that here
-	PROGRAM(version) = version;
+	current_version = &PROGRAM(v_context)[version];
+	CURRENT(id) = version;
+
+	// Nodes of the lists are carved out of the version's arena as well
+	ll_use_arena(&PROGRAM(arenas)[version]);
 
 	// Checks whether the version is already present in the list
 	// otherwise it creates a new one by cloning code and relocations,
@@ -324,7 +346,7 @@ int switch_executable_version(int version) {
 		// Once cloned, instructions are no more linked together in the call/jump graph;
 		// this task belongs to the parsing stage, nevertheless/ we have to re-execute it
 		// in order to realign the representation's semantics.
-		PROGRAM(v_code)[version] = clone_function_list(PROGRAM(v_code)[0], suffix);
+		PROGRAM(v_code)[version] = clone_function_list(PROGRAM(v_code)[0], suffix, version_writes_function);
 
 		// Duplicates all sections containing code and updates the section pointer
 		// in the respective function symbols, so that the new functions (which
@@ -335,31 +357,48 @@ int switch_executable_version(int version) {
 		// adjust them if needed. This is a quite naive copy of relocations which
 		// only takes care of adjusting the `relocation.sec` field so as to make
 		// it point to the cloned text section.
+		// Relocations are symbols, which are shared with the other versions.
+		pthread_mutex_lock(&PROGRAM(lock));
 		clone_relocations(version, suffix);
+		pthread_mutex_unlock(&PROGRAM(lock));
 
 		// For each text section T in the new version, we adjust relocations
 		// from X->T in order to create room for new data in X. This should
 		// hopefully covers cases such as branch tables and other pointers.
+		// Since the room is taken at the end of X, versions which are cloned
+		// concurrently take turns in order, so that the layout of X does not
+		// depend on which one comes first.
+		pthread_mutex_lock(&PROGRAM(lock));
+
+		while (PROGRAM(versions_inflated) + 1 < (unsigned int) version) {
+			pthread_cond_wait(&PROGRAM(turn), &PROGRAM(lock));
+		}
+
 		for (text = PROGRAM(sections)[version]; text; text = text->next) {
 			adjust_relocations(PROGRAM(symbols), version, text);
 		}
 
+		PROGRAM(versions_inflated) = version;
+		pthread_cond_broadcast(&PROGRAM(turn));
+
+		pthread_mutex_unlock(&PROGRAM(lock));
+
 		// Re-linking jump instructions
 		link_jump_instructions();
 
 		// Re-creating a CFG
 		PROGRAM(blocks)[version] = block_graph_create();
-
-		// Update the executable versions array
-		PROGRAM(code) = PROGRAM(v_code)[version];
+		liveness_compute(PROGRAM(blocks)[version]);
 
 		// The overall number of handled versions has to be increased
+		pthread_mutex_lock(&PROGRAM(lock));
 		PROGRAM(versions)++;
+		pthread_mutex_unlock(&PROGRAM(lock));
 
 		hnotice(4, "Version %d of the executable's binary representation created\n", version);
 	}
 
 	hnotice(3, "Switched to version %d\n\n", version);
 
-	return PROGRAM(version);
+	return CURRENT(id);
 }
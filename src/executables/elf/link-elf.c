@@ -0,0 +1,1154 @@
+/**
+*                       Copyright (C) 2008-2015 HPDCS Group
+*                       http://www.dis.uniroma1.it/~hpdcs
+*
+*
+* This file is part of the Hijacker static binary instrumentation tool.
+*
+* Hijacker is free software; you can redistribute it and/or modify it under the
+* terms of the GNU General Public License as published by the Free Software
+* Foundation; either version 3 of the License, or (at your option) any later
+* version.
+*
+* Hijacker is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+* A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* hijacker; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*
+* @file link-elf.c
+* @brief In-process relocatable linking of ELF objects (the equivalent of 'ld -r')
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <elf.h>
+
+#include <hijacker.h>
+#include <prints.h>
+#include <utils.h>
+
+#include <executables/archive.h>
+#include <elf/link-elf.h>
+
+
+/// Number of buckets of the global symbols table
+#define LINK_BUCKETS		1024
+
+/// Prefix of the relocation sections' names
+#define LINK_RELA_PREFIX	".rela"
+
+
+/// Role of an input section in the link
+typedef enum {
+	LINK_SKIP,          // Rebuilt from scratch (symbols and string tables)
+	LINK_CONTENT,       // Concatenated to the homonymous output section
+	LINK_RELA,          // Rebased and attached to the output section
+	LINK_UNSUPPORTED    // Requires the external linker
+} link_kind;
+
+
+/// Output section, made of the concatenation of input sections
+typedef struct {
+	char *name;
+	Elf64_Word type;
+	Elf64_Xword flags;
+	Elf64_Xword align;
+	Elf64_Xword entsize;
+	unsigned int ninputs;         // Number of contributing input sections
+
+	unsigned char *data;          // Contents, NULL for SHT_NOBITS
+	size_t size;
+	size_t capacity;
+
+	Elf64_Rela *relas;            // Relocation entries targeting the section
+	size_t nrelas;
+	size_t maxrelas;
+
+	unsigned int index;           // Index in the section header table
+	unsigned int rela_index;      // Index of the relocation section, if any
+	unsigned int symbol;          // Index of the section symbol
+} link_section;
+
+
+struct _link_input;
+
+/// Global symbol, resolved across all the objects
+typedef struct _link_global {
+	char *name;
+	unsigned long long hash;
+
+	struct _link_input *def;      // Object providing the definition, NULL if undefined
+	Elf64_Sym sym;                // Definition or, if undefined, first reference
+	bool common;                  // The definition is a common symbol
+	bool strong;                  // Referenced by at least a non-weak undefined symbol
+
+	unsigned int index;           // Index in the output symbol table
+
+	struct _link_global *chain;   // Next symbol in the same bucket
+	struct _link_global *next;    // Next symbol in definition order
+} link_global;
+
+
+/// Input object, along with its mapping onto the output
+typedef struct _link_input {
+	link_object *obj;
+	bool included;
+
+	Elf64_Ehdr *ehdr;
+	Elf64_Shdr *shdr;
+	unsigned int shnum;
+	char *shstrtab;
+
+	Elf64_Sym *syms;
+	unsigned int nsyms;
+	unsigned int symtab;          // Index of the symbol table, 0 if none
+	char *strtab;
+	size_t strsize;
+
+	int *sec_out;                 // Output section of each input section, -1 if none
+	Elf64_Xword *sec_off;         // Offset of each input section in its output section
+	unsigned int *sym_out;        // Output index of each local symbol
+	link_global **sym_global;     // Resolution of each global symbol
+} link_input;
+
+
+/// State of a single link
+typedef struct {
+	link_input *inputs;
+	unsigned int ninputs;
+
+	link_section *sections;
+	unsigned int nsections;
+
+	Elf64_Sym *locals;
+	size_t nlocals;
+	size_t maxlocals;
+
+	link_global *buckets[LINK_BUCKETS];
+	link_global *first;
+	link_global *last;
+	unsigned int nglobals;
+
+	char *strtab;
+	size_t strsize;
+	size_t strcapacity;
+} link_context;
+
+
+/**
+ * Makes room for at least 'need' elements in a growable array.
+ */
+static void *link_grow(void *array, size_t *capacity, size_t need, size_t elem) {
+	if (need <= *capacity) {
+		return array;
+	}
+
+	*capacity = *capacity ? *capacity * 2 : 64;
+	if (*capacity < need) {
+		*capacity = need;
+	}
+
+	array = realloc(array, *capacity * elem);
+	if (array == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	return array;
+}
+
+
+/**
+ * Appends a string to a growable string table.
+ *
+ * @return Offset of the string within the table
+ */
+static unsigned int link_add_string(char **table, size_t *size, size_t *capacity, const char *str) {
+	size_t len, pos;
+
+	len = strlen(str) + 1;
+	*table = link_grow(*table, capacity, *size + len, 1);
+
+	pos = *size;
+	memcpy(*table + pos, str, len);
+	*size += len;
+
+	return pos;
+}
+
+
+static inline Elf64_Xword link_align(Elf64_Xword value, Elf64_Xword align) {
+	return align > 1 ? (value + align - 1) & ~(align - 1) : value;
+}
+
+
+// ---------------------------------------------------------------------------
+// Input objects
+// ---------------------------------------------------------------------------
+
+static link_object *link_new_object(char *name, unsigned char *data, size_t size, bool lazy) {
+	link_object *obj;
+
+	obj = calloc(sizeof(link_object), 1);
+	if (obj == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	obj->name = strdup(name);
+	obj->data = data;
+	obj->size = size;
+	obj->lazy = lazy;
+
+	if (obj->name == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	return obj;
+}
+
+
+static unsigned char *link_read_file(char *path, size_t *size) {
+	FILE *fp;
+	long fsize;
+	unsigned char *data;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return NULL;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	fsize = ftell(fp);
+	rewind(fp);
+
+	data = malloc(fsize + 1);
+	if (data == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	if (fread(data, 1, fsize, fp) != (size_t) fsize) {
+		herror(true, "Unable to read the file '%s'!\n", path);
+	}
+
+	fclose(fp);
+
+	*size = fsize;
+	return data;
+}
+
+
+link_object *elf_link_new_object(char *name, unsigned char *data, size_t size) {
+	return link_new_object(name, data, size, false);
+}
+
+
+link_object *elf_link_load_object(char *path) {
+	unsigned char *data;
+	size_t size;
+
+	data = link_read_file(path, &size);
+	if (data == NULL) {
+		return NULL;
+	}
+
+	return link_new_object(path, data, size, false);
+}
+
+
+link_object *elf_link_load_archive(char *path) {
+	archive_member *members, *member;
+	link_object *first, *last, *obj;
+	char fullname[512];
+
+	members = archive_load(path);
+	if (members == NULL) {
+		return NULL;
+	}
+
+	first = last = NULL;
+
+	// Members are moved into lazy objects, named after the archive
+	for (member = members; member; member = member->next) {
+		snprintf(fullname, sizeof(fullname), "%s(%s)", path, member->name);
+
+		obj = link_new_object(fullname, member->data, member->size, true);
+		member->data = NULL;
+
+		if (last) {
+			last->next = obj;
+		} else {
+			first = obj;
+		}
+		last = obj;
+	}
+
+	archive_free(members);
+
+	return first;
+}
+
+
+void elf_link_free_objects(link_object *objects) {
+	link_object *next;
+
+	while (objects) {
+		next = objects->next;
+		free(objects->name);
+		free(objects->data);
+		free(objects);
+		objects = next;
+	}
+}
+
+
+static link_kind link_section_kind(Elf64_Shdr *shdr, char *name) {
+	if (shdr->sh_flags & (SHF_GROUP | SHF_LINK_ORDER | SHF_COMPRESSED)) {
+		return LINK_UNSUPPORTED;
+	}
+
+	switch (shdr->sh_type) {
+		case SHT_NULL:
+		case SHT_SYMTAB:
+		case SHT_STRTAB:
+			return LINK_SKIP;
+
+		case SHT_RELA:
+			return LINK_RELA;
+
+		case SHT_NOTE:
+			// GNU properties must be combined rather than concatenated
+			if (!strcmp(name, ".note.gnu.property")) {
+				return LINK_UNSUPPORTED;
+			}
+			return LINK_CONTENT;
+
+		case SHT_PROGBITS:
+		case SHT_NOBITS:
+		case SHT_INIT_ARRAY:
+		case SHT_FINI_ARRAY:
+		case SHT_PREINIT_ARRAY:
+		case SHT_X86_64_UNWIND:
+			return LINK_CONTENT;
+
+		default:
+			return LINK_UNSUPPORTED;
+	}
+}
+
+
+/**
+ * Checks that an object is a relocatable x86-64 ELF which can be linked
+ * in-process, and retrieves its section and symbol tables.
+ */
+static bool link_parse_input(link_input *in) {
+	link_object *obj = in->obj;
+	Elf64_Shdr *shdr;
+	unsigned int i;
+
+	if (obj->size < sizeof(Elf64_Ehdr)) {
+		return false;
+	}
+
+	in->ehdr = (Elf64_Ehdr *) obj->data;
+
+	if (memcmp(in->ehdr->e_ident, ELFMAG, SELFMAG)
+	    || in->ehdr->e_ident[EI_CLASS] != ELFCLASS64
+	    || in->ehdr->e_ident[EI_DATA] != ELFDATA2LSB
+	    || in->ehdr->e_type != ET_REL
+	    || in->ehdr->e_machine != EM_X86_64
+	    || in->ehdr->e_shentsize != sizeof(Elf64_Shdr)
+	    || in->ehdr->e_shnum == 0
+	    || in->ehdr->e_shstrndx >= in->ehdr->e_shnum
+	    || in->ehdr->e_shoff + in->ehdr->e_shnum * sizeof(Elf64_Shdr) > obj->size) {
+		hnotice(2, "Object '%s' is not a supported relocatable file\n", obj->name);
+		return false;
+	}
+
+	in->shdr = (Elf64_Shdr *) (obj->data + in->ehdr->e_shoff);
+	in->shnum = in->ehdr->e_shnum;
+	in->shstrtab = (char *) obj->data + in->shdr[in->ehdr->e_shstrndx].sh_offset;
+
+	for (i = 0; i < in->shnum; i++) {
+		shdr = &in->shdr[i];
+
+		if (shdr->sh_type != SHT_NOBITS && shdr->sh_offset + shdr->sh_size > obj->size) {
+			return false;
+		}
+
+		if (link_section_kind(shdr, in->shstrtab + shdr->sh_name) == LINK_UNSUPPORTED) {
+			hnotice(2, "Section '%s' of '%s' is not supported by the internal linker\n",
+				in->shstrtab + shdr->sh_name, obj->name);
+			return false;
+		}
+
+		if (shdr->sh_type == SHT_SYMTAB) {
+			if (in->symtab || shdr->sh_link >= in->shnum || shdr->sh_entsize != sizeof(Elf64_Sym)) {
+				return false;
+			}
+
+			in->symtab = i;
+			in->syms = (Elf64_Sym *) (obj->data + shdr->sh_offset);
+			in->nsyms = shdr->sh_size / sizeof(Elf64_Sym);
+			in->strtab = (char *) obj->data + in->shdr[shdr->sh_link].sh_offset;
+			in->strsize = in->shdr[shdr->sh_link].sh_size;
+		}
+	}
+
+	for (i = 0; i < in->nsyms; i++) {
+		if (in->syms[i].st_name >= in->strsize) {
+			return false;
+		}
+
+		if (in->syms[i].st_shndx == SHN_XINDEX) {
+			return false;
+		}
+
+		if (ELF64_ST_BIND(in->syms[i].st_info) != STB_LOCAL
+		    && ELF64_ST_BIND(in->syms[i].st_info) != STB_GLOBAL
+		    && ELF64_ST_BIND(in->syms[i].st_info) != STB_WEAK) {
+			return false;
+		}
+	}
+
+	in->sec_out = malloc(sizeof(int) * in->shnum);
+	in->sec_off = calloc(sizeof(Elf64_Xword), in->shnum);
+	in->sym_out = calloc(sizeof(unsigned int), in->nsyms + 1);
+	in->sym_global = calloc(sizeof(link_global *), in->nsyms + 1);
+
+	if (in->sec_out == NULL || in->sec_off == NULL || in->sym_out == NULL || in->sym_global == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	for (i = 0; i < in->shnum; i++) {
+		in->sec_out[i] = -1;
+	}
+
+	return true;
+}
+
+
+// ---------------------------------------------------------------------------
+// Symbol resolution
+// ---------------------------------------------------------------------------
+
+static link_global *link_find_global(link_context *ctx, char *name, bool create) {
+	link_global *global;
+	unsigned long long hash;
+
+	hash = hash_bytes(name, strlen(name), HASH_FNV_OFFSET);
+
+	for (global = ctx->buckets[hash % LINK_BUCKETS]; global; global = global->chain) {
+		if (global->hash == hash && str_equal(global->name, name)) {
+			return global;
+		}
+	}
+
+	if (!create) {
+		return NULL;
+	}
+
+	global = calloc(sizeof(link_global), 1);
+	if (global == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	global->name = name;
+	global->hash = hash;
+	global->chain = ctx->buckets[hash % LINK_BUCKETS];
+	ctx->buckets[hash % LINK_BUCKETS] = global;
+
+	if (ctx->last) {
+		ctx->last->next = global;
+	} else {
+		ctx->first = global;
+	}
+	ctx->last = global;
+	ctx->nglobals++;
+
+	return global;
+}
+
+
+/**
+ * Adds the global symbols of an object to the link, applying the usual
+ * resolution rules: strong definitions win over weak and common ones,
+ * common symbols are merged taking the largest size and alignment.
+ */
+static void link_add_globals(link_context *ctx, link_input *in) {
+	link_global *global;
+	Elf64_Sym *sym;
+	unsigned int i;
+	bool weak;
+
+	in->included = true;
+
+	for (i = 1; i < in->nsyms; i++) {
+		sym = &in->syms[i];
+
+		if (ELF64_ST_BIND(sym->st_info) == STB_LOCAL) {
+			continue;
+		}
+
+		global = link_find_global(ctx, in->strtab + sym->st_name, true);
+		in->sym_global[i] = global;
+		weak = ELF64_ST_BIND(sym->st_info) == STB_WEAK;
+
+		if (sym->st_shndx == SHN_UNDEF) {
+			if (!weak) {
+				global->strong = true;
+			}
+			if (global->def == NULL && global->sym.st_info == 0) {
+				global->sym = *sym;
+			}
+			continue;
+		}
+
+		if (sym->st_shndx == SHN_COMMON) {
+			if (global->def == NULL) {
+				global->def = in;
+				global->sym = *sym;
+				global->common = true;
+			} else if (global->common) {
+				if (sym->st_size > global->sym.st_size) {
+					global->sym.st_size = sym->st_size;
+				}
+				if (sym->st_value > global->sym.st_value) {
+					global->sym.st_value = sym->st_value;
+				}
+			}
+			continue;
+		}
+
+		if (global->def == NULL || global->common
+		    || (ELF64_ST_BIND(global->sym.st_info) == STB_WEAK && !weak)) {
+			global->def = in;
+			global->sym = *sym;
+			global->common = false;
+		} else if (ELF64_ST_BIND(global->sym.st_info) != STB_WEAK && !weak) {
+			herror(true, "Multiple definition of symbol '%s' in '%s' and '%s'\n",
+				global->name, global->def->obj->name, in->obj->name);
+		}
+	}
+}
+
+
+/**
+ * Tells whether a lazy object defines any symbol which is still needed.
+ */
+static bool link_is_needed(link_context *ctx, link_input *in) {
+	link_global *global;
+	Elf64_Sym *sym;
+	unsigned int i;
+
+	for (i = 1; i < in->nsyms; i++) {
+		sym = &in->syms[i];
+
+		if (ELF64_ST_BIND(sym->st_info) == STB_LOCAL || sym->st_shndx == SHN_UNDEF
+		    || sym->st_shndx == SHN_COMMON) {
+			continue;
+		}
+
+		global = link_find_global(ctx, in->strtab + sym->st_name, false);
+		if (global && global->def == NULL && global->strong) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+// ---------------------------------------------------------------------------
+// Layout
+// ---------------------------------------------------------------------------
+
+static int link_output_section(link_context *ctx, Elf64_Shdr *shdr, char *name) {
+	link_section *out;
+	unsigned int i;
+
+	for (i = 0; i < ctx->nsections; i++) {
+		if (str_equal(ctx->sections[i].name, name)) {
+			out = &ctx->sections[i];
+
+			// Homonymous sections must agree on their nature, except for
+			// uninitialized data which is merged into the initialized one
+			if (out->type == SHT_NOBITS && shdr->sh_type == SHT_PROGBITS) {
+				out->type = SHT_PROGBITS;
+				out->data = link_grow(out->data, &out->capacity, out->size, 1);
+				bzero(out->data, out->size);
+			} else if (out->type != shdr->sh_type && !(out->type == SHT_PROGBITS && shdr->sh_type == SHT_NOBITS)) {
+				return -1;
+			}
+
+			if (out->entsize != shdr->sh_entsize) {
+				out->flags &= ~(SHF_MERGE | SHF_STRINGS);
+				out->entsize = 0;
+			}
+
+			out->flags |= shdr->sh_flags & ~(SHF_MERGE | SHF_STRINGS);
+			return i;
+		}
+	}
+
+	ctx->sections = realloc(ctx->sections, sizeof(link_section) * (ctx->nsections + 1));
+	if (ctx->sections == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	out = &ctx->sections[ctx->nsections];
+	bzero(out, sizeof(link_section));
+
+	out->name = name;
+	out->type = shdr->sh_type;
+	out->flags = shdr->sh_flags;
+	out->entsize = shdr->sh_entsize;
+	out->align = 1;
+
+	return ctx->nsections++;
+}
+
+
+/**
+ * Concatenates the contents of each input section to its output section.
+ */
+static bool link_layout(link_context *ctx, link_input *in) {
+	link_section *out;
+	Elf64_Shdr *shdr;
+	Elf64_Xword align, offset;
+	unsigned int i;
+	char *name;
+	int idx;
+
+	for (i = 0; i < in->shnum; i++) {
+		shdr = &in->shdr[i];
+		name = in->shstrtab + shdr->sh_name;
+
+		if (link_section_kind(shdr, name) != LINK_CONTENT) {
+			continue;
+		}
+
+		idx = link_output_section(ctx, shdr, name);
+		if (idx < 0) {
+			hnotice(2, "Section '%s' of '%s' has a conflicting type\n", name, in->obj->name);
+			return false;
+		}
+
+		out = &ctx->sections[idx];
+		align = shdr->sh_addralign ? shdr->sh_addralign : 1;
+		if (align > out->align) {
+			out->align = align;
+		}
+
+		offset = link_align(out->size, align);
+
+		// A section becomes SHT_PROGBITS as soon as it receives actual contents
+		if (shdr->sh_type != SHT_NOBITS || out->type != SHT_NOBITS) {
+			out->data = link_grow(out->data, &out->capacity, offset + shdr->sh_size, 1);
+			bzero(out->data + out->size, offset - out->size);
+
+			if (shdr->sh_type == SHT_NOBITS) {
+				bzero(out->data + offset, shdr->sh_size);
+			} else {
+				memcpy(out->data + offset, in->obj->data + shdr->sh_offset, shdr->sh_size);
+			}
+		}
+
+		in->sec_out[i] = idx;
+		in->sec_off[i] = offset;
+
+		out->size = offset + shdr->sh_size;
+		out->ninputs++;
+	}
+
+	return true;
+}
+
+
+/**
+ * Translates the value and the section index of a symbol defined
+ * in an input object into the output ones.
+ */
+static bool link_rebase_symbol(link_context *ctx, link_input *in, Elf64_Sym *sym) {
+	Elf64_Section shndx = sym->st_shndx;
+
+	if (shndx == SHN_UNDEF || shndx == SHN_ABS || shndx == SHN_COMMON) {
+		return true;
+	}
+
+	if (shndx >= in->shnum || in->sec_out[shndx] < 0) {
+		return false;
+	}
+
+	sym->st_value += in->sec_off[shndx];
+	sym->st_shndx = ctx->sections[in->sec_out[shndx]].index;
+
+	return true;
+}
+
+
+static bool link_add_locals(link_context *ctx, link_input *in) {
+	Elf64_Sym sym;
+	unsigned int i;
+
+	for (i = 1; i < in->nsyms; i++) {
+		sym = in->syms[i];
+
+		if (ELF64_ST_BIND(sym.st_info) != STB_LOCAL) {
+			continue;
+		}
+
+		// Section symbols are replaced by the ones of the output sections
+		if (ELF64_ST_TYPE(sym.st_info) == STT_SECTION) {
+			if (sym.st_shndx >= in->shnum || in->sec_out[sym.st_shndx] < 0) {
+				in->sym_out[i] = 0;
+			} else {
+				in->sym_out[i] = ctx->sections[in->sec_out[sym.st_shndx]].symbol;
+			}
+			continue;
+		}
+
+		if (!link_rebase_symbol(ctx, in, &sym)) {
+			hnotice(2, "Symbol '%s' of '%s' lays in an unsupported section\n",
+				in->strtab + in->syms[i].st_name, in->obj->name);
+			return false;
+		}
+
+		sym.st_name = link_add_string(&ctx->strtab, &ctx->strsize, &ctx->strcapacity, in->strtab + in->syms[i].st_name);
+
+		ctx->locals = link_grow(ctx->locals, &ctx->maxlocals, ctx->nlocals + 1, sizeof(Elf64_Sym));
+		ctx->locals[ctx->nlocals] = sym;
+
+		// Local symbols follow the null symbol and the section ones
+		in->sym_out[i] = 1 + ctx->nsections + ctx->nlocals++;
+	}
+
+	return true;
+}
+
+
+static bool link_add_relocations(link_context *ctx, link_input *in) {
+	link_section *out;
+	link_global *global;
+	Elf64_Shdr *shdr;
+	Elf64_Rela *rela, *entry;
+	Elf64_Sym *sym;
+	unsigned int i, target, symidx, outsym;
+	size_t j, count;
+
+	for (i = 0; i < in->shnum; i++) {
+		shdr = &in->shdr[i];
+
+		if (shdr->sh_type != SHT_RELA) {
+			continue;
+		}
+
+		target = shdr->sh_info;
+
+		if (shdr->sh_link != in->symtab || shdr->sh_entsize != sizeof(Elf64_Rela)
+		    || target >= in->shnum || in->sec_out[target] < 0) {
+			hnotice(2, "Relocation section '%s' of '%s' is not supported\n",
+				in->shstrtab + shdr->sh_name, in->obj->name);
+			return false;
+		}
+
+		out = &ctx->sections[in->sec_out[target]];
+		rela = (Elf64_Rela *) (in->obj->data + shdr->sh_offset);
+		count = shdr->sh_size / sizeof(Elf64_Rela);
+
+		out->relas = link_grow(out->relas, &out->maxrelas, out->nrelas + count, sizeof(Elf64_Rela));
+
+		for (j = 0; j < count; j++) {
+			entry = &out->relas[out->nrelas++];
+			*entry = rela[j];
+			entry->r_offset += in->sec_off[target];
+
+			symidx = ELF64_R_SYM(rela[j].r_info);
+
+			if (symidx >= in->nsyms && symidx != 0) {
+				return false;
+			}
+
+			sym = &in->syms[symidx];
+
+			if (symidx == 0) {
+				outsym = 0;
+			} else if (ELF64_ST_BIND(sym->st_info) != STB_LOCAL) {
+				global = in->sym_global[symidx];
+				outsym = global->index;
+			} else if (ELF64_ST_TYPE(sym->st_info) == STT_SECTION) {
+				// The section now starts somewhere within the output one
+				if (in->sym_out[symidx] == 0) {
+					return false;
+				}
+				outsym = in->sym_out[symidx];
+				entry->r_addend += in->sec_off[sym->st_shndx];
+			} else {
+				outsym = in->sym_out[symidx];
+			}
+
+			entry->r_info = ELF64_R_INFO(outsym, ELF64_R_TYPE(rela[j].r_info));
+		}
+	}
+
+	return true;
+}
+
+
+// ---------------------------------------------------------------------------
+// Output
+// ---------------------------------------------------------------------------
+
+static void link_write(FILE *file, const void *data, size_t size, size_t *pos) {
+	if (size && fwrite(data, size, 1, file) != 1) {
+		herror(true, "Unable to write the linked object!\n");
+	}
+
+	*pos += size;
+}
+
+
+static void link_pad(FILE *file, Elf64_Xword align, size_t *pos) {
+	static const unsigned char zeros[64];
+	size_t padding;
+
+	padding = link_align(*pos, align) - *pos;
+
+	while (padding) {
+		link_write(file, zeros, padding < sizeof(zeros) ? padding : sizeof(zeros), pos);
+		padding = link_align(*pos, align) - *pos;
+	}
+}
+
+
+/**
+ * Writes the output object: the ELF header, the contents of the sections,
+ * the relocation sections, the symbol and string tables and eventually the
+ * section header table.
+ */
+static void link_write_object(link_context *ctx, char *output, Elf64_Ehdr *model,
+		unsigned int nrelasecs, unsigned int firstglobal) {
+	FILE *file;
+	Elf64_Ehdr ehdr;
+	Elf64_Shdr *shdrs, *shdr;
+	Elf64_Sym null;
+	link_section *out;
+	link_global *global;
+	Elf64_Sym sym;
+	char *shstrtab, *name;
+	size_t shstrsize, shstrcap, pos;
+	unsigned int i, shnum, symtab, strtab, shstrndx;
+
+	shnum = 1 + ctx->nsections + nrelasecs + 3;
+	symtab = 1 + ctx->nsections + nrelasecs;
+	strtab = symtab + 1;
+	shstrndx = strtab + 1;
+
+	shdrs = calloc(sizeof(Elf64_Shdr), shnum);
+	if (shdrs == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	// Section names
+	shstrtab = NULL;
+	shstrsize = shstrcap = 0;
+
+	link_add_string(&shstrtab, &shstrsize, &shstrcap, "");
+
+	file = fopen(output, "w");
+	if (file == NULL) {
+		herror(true, "Unable to write output ELF file '%s'!\n", output);
+	}
+
+	pos = 0;
+	bzero(&ehdr, sizeof(ehdr));
+	link_write(file, &ehdr, sizeof(ehdr), &pos);
+
+	for (i = 0; i < ctx->nsections; i++) {
+		out = &ctx->sections[i];
+		shdr = &shdrs[out->index];
+
+		shdr->sh_name = link_add_string(&shstrtab, &shstrsize, &shstrcap, out->name);
+		shdr->sh_type = out->type;
+		shdr->sh_flags = out->flags;
+		shdr->sh_size = out->size;
+		shdr->sh_addralign = out->align;
+		shdr->sh_entsize = out->entsize;
+
+		if (out->type != SHT_NOBITS) {
+			link_pad(file, out->align, &pos);
+			shdr->sh_offset = pos;
+			link_write(file, out->data, out->size, &pos);
+		} else {
+			shdr->sh_offset = pos;
+		}
+	}
+
+	for (i = 0; i < ctx->nsections; i++) {
+		out = &ctx->sections[i];
+
+		if (out->nrelas == 0) {
+			continue;
+		}
+
+		shdr = &shdrs[out->rela_index];
+
+		name = malloc(strlen(LINK_RELA_PREFIX) + strlen(out->name) + 1);
+		if (name == NULL) {
+			herror(true, "Out of memory!\n");
+		}
+		sprintf(name, LINK_RELA_PREFIX "%s", out->name);
+
+		shdr->sh_name = link_add_string(&shstrtab, &shstrsize, &shstrcap, name);
+		shdr->sh_type = SHT_RELA;
+		shdr->sh_flags = SHF_INFO_LINK;
+		shdr->sh_link = symtab;
+		shdr->sh_info = out->index;
+		shdr->sh_addralign = 8;
+		shdr->sh_entsize = sizeof(Elf64_Rela);
+		shdr->sh_size = out->nrelas * sizeof(Elf64_Rela);
+
+		free(name);
+
+		link_pad(file, 8, &pos);
+		shdr->sh_offset = pos;
+		link_write(file, out->relas, shdr->sh_size, &pos);
+	}
+
+	// Symbol table: null symbol, section symbols, locals and globals
+	link_pad(file, 8, &pos);
+
+	shdr = &shdrs[symtab];
+	shdr->sh_name = link_add_string(&shstrtab, &shstrsize, &shstrcap, ".symtab");
+	shdr->sh_type = SHT_SYMTAB;
+	shdr->sh_link = strtab;
+	shdr->sh_info = firstglobal;
+	shdr->sh_addralign = 8;
+	shdr->sh_entsize = sizeof(Elf64_Sym);
+	shdr->sh_offset = pos;
+
+	bzero(&null, sizeof(null));
+	link_write(file, &null, sizeof(null), &pos);
+
+	for (i = 0; i < ctx->nsections; i++) {
+		bzero(&sym, sizeof(sym));
+		sym.st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+		sym.st_shndx = ctx->sections[i].index;
+		link_write(file, &sym, sizeof(sym), &pos);
+	}
+
+	link_write(file, ctx->locals, ctx->nlocals * sizeof(Elf64_Sym), &pos);
+
+	for (global = ctx->first; global; global = global->next) {
+		sym = global->sym;
+		sym.st_name = link_add_string(&ctx->strtab, &ctx->strsize, &ctx->strcapacity, global->name);
+
+		if (global->def == NULL) {
+			// Unresolved references stay undefined, and are weak only
+			// if no object requires them strongly
+			sym.st_info = ELF64_ST_INFO(global->strong ? STB_GLOBAL : STB_WEAK, ELF64_ST_TYPE(sym.st_info));
+			sym.st_shndx = SHN_UNDEF;
+			sym.st_value = 0;
+			sym.st_size = 0;
+		} else {
+			link_rebase_symbol(ctx, global->def, &sym);
+		}
+
+		link_write(file, &sym, sizeof(sym), &pos);
+	}
+
+	shdr->sh_size = pos - shdr->sh_offset;
+
+	// String tables
+	shdr = &shdrs[strtab];
+	shdr->sh_name = link_add_string(&shstrtab, &shstrsize, &shstrcap, ".strtab");
+	shdr->sh_type = SHT_STRTAB;
+	shdr->sh_addralign = 1;
+	shdr->sh_offset = pos;
+	shdr->sh_size = ctx->strsize;
+	link_write(file, ctx->strtab, ctx->strsize, &pos);
+
+	shdr = &shdrs[shstrndx];
+	shdr->sh_name = link_add_string(&shstrtab, &shstrsize, &shstrcap, ".shstrtab");
+	shdr->sh_type = SHT_STRTAB;
+	shdr->sh_addralign = 1;
+	shdr->sh_offset = pos;
+	shdr->sh_size = shstrsize;
+	link_write(file, shstrtab, shstrsize, &pos);
+
+	// Section header table
+	link_pad(file, 8, &pos);
+
+	memcpy(ehdr.e_ident, model->e_ident, EI_NIDENT);
+	ehdr.e_type = ET_REL;
+	ehdr.e_machine = model->e_machine;
+	ehdr.e_version = EV_CURRENT;
+	ehdr.e_flags = model->e_flags;
+	ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+	ehdr.e_shentsize = sizeof(Elf64_Shdr);
+	ehdr.e_shnum = shnum;
+	ehdr.e_shstrndx = shstrndx;
+	ehdr.e_shoff = pos;
+
+	link_write(file, shdrs, shnum * sizeof(Elf64_Shdr), &pos);
+
+	rewind(file);
+	fwrite(&ehdr, sizeof(ehdr), 1, file);
+	fclose(file);
+
+	free(shstrtab);
+	free(shdrs);
+}
+
+
+static void link_release(link_context *ctx) {
+	link_global *global, *next;
+	unsigned int i;
+
+	for (i = 0; i < ctx->ninputs; i++) {
+		free(ctx->inputs[i].sec_out);
+		free(ctx->inputs[i].sec_off);
+		free(ctx->inputs[i].sym_out);
+		free(ctx->inputs[i].sym_global);
+	}
+
+	for (i = 0; i < ctx->nsections; i++) {
+		free(ctx->sections[i].data);
+		free(ctx->sections[i].relas);
+	}
+
+	for (global = ctx->first; global; global = next) {
+		next = global->next;
+		free(global);
+	}
+
+	free(ctx->inputs);
+	free(ctx->sections);
+	free(ctx->locals);
+	free(ctx->strtab);
+	free(ctx);
+}
+
+
+bool elf_link_objects(char *output, link_object *objects) {
+	link_context *ctx;
+	link_input *in;
+	link_global *global;
+	link_object *obj;
+	Elf64_Sym sym;
+	unsigned int i, index, nrelasecs, firstglobal;
+	bool changed, done;
+
+	ctx = calloc(sizeof(link_context), 1);
+	if (ctx == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	for (obj = objects; obj; obj = obj->next) {
+		ctx->ninputs++;
+	}
+
+	ctx->inputs = calloc(sizeof(link_input), ctx->ninputs);
+	if (ctx->inputs == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	link_add_string(&ctx->strtab, &ctx->strsize, &ctx->strcapacity, "");
+
+	// Parse all the objects first, so that a fallback to the external linker
+	// is decided before any work has been done
+	for (i = 0, obj = objects; obj; obj = obj->next, i++) {
+		in = &ctx->inputs[i];
+		in->obj = obj;
+
+		if (!link_parse_input(in)) {
+			link_release(ctx);
+			return false;
+		}
+	}
+
+	// Resolve the symbols of the explicit objects, then pull in the members
+	// of the archives which define any symbol still undefined
+	for (i = 0; i < ctx->ninputs; i++) {
+		if (!ctx->inputs[i].obj->lazy) {
+			link_add_globals(ctx, &ctx->inputs[i]);
+		}
+	}
+
+	do {
+		changed = false;
+
+		for (i = 0; i < ctx->ninputs; i++) {
+			in = &ctx->inputs[i];
+
+			if (!in->included && link_is_needed(ctx, in)) {
+				hnotice(3, "Linking archive member '%s'\n", in->obj->name);
+				link_add_globals(ctx, in);
+				changed = true;
+			}
+		}
+	} while (changed);
+
+	// Concatenate the sections, in the same order as the objects
+	done = true;
+	for (i = 0; i < ctx->ninputs && done; i++) {
+		if (ctx->inputs[i].included) {
+			done = link_layout(ctx, &ctx->inputs[i]);
+		}
+	}
+
+	// Content sections come first in the section header table, followed by
+	// the relocation ones; each section has its own section symbol
+	nrelasecs = 0;
+	for (i = 0; i < ctx->nsections; i++) {
+		ctx->sections[i].index = 1 + i;
+		ctx->sections[i].symbol = 1 + i;
+	}
+
+	for (i = 0; i < ctx->ninputs && done; i++) {
+		if (ctx->inputs[i].included) {
+			done = link_add_locals(ctx, &ctx->inputs[i]);
+		}
+	}
+
+	firstglobal = 1 + ctx->nsections + ctx->nlocals;
+	index = firstglobal;
+	for (global = ctx->first; global; global = global->next) {
+		global->index = index++;
+	}
+
+	for (i = 0; i < ctx->ninputs && done; i++) {
+		if (ctx->inputs[i].included) {
+			done = link_add_relocations(ctx, &ctx->inputs[i]);
+		}
+	}
+
+	for (global = ctx->first; global && done; global = global->next) {
+		if (global->def) {
+			sym = global->sym;
+			done = link_rebase_symbol(ctx, global->def, &sym);
+		}
+	}
+
+	if (!done) {
+		link_release(ctx);
+		return false;
+	}
+
+	for (i = 0; i < ctx->nsections; i++) {
+		if (ctx->sections[i].nrelas) {
+			ctx->sections[i].rela_index = 1 + ctx->nsections + nrelasecs++;
+		}
+	}
+
+	hnotice(2, "Writing linked object '%s': %u sections, %zu local and %u global symbols\n",
+		output, ctx->nsections, ctx->nlocals, ctx->nglobals);
+
+	link_write_object(ctx, output, ctx->inputs[0].ehdr, nrelasecs, firstglobal);
+
+	link_release(ctx);
+
+	return true;
+}
@@ -0,0 +1,100 @@
+/**
+*                       Copyright (C) 2008-2015 HPDCS Group
+*                       http://www.dis.uniroma1.it/~hpdcs
+*
+*
+* This file is part of the Hijacker static binary instrumentation tool.
+*
+* Hijacker is free software; you can redistribute it and/or modify it under the
+* terms of the GNU General Public License as published by the Free Software
+* Foundation; either version 3 of the License, or (at your option) any later
+* version.
+*
+* Hijacker is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+* A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* hijacker; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*
+* @file link-elf.h
+* @brief In-process relocatable linking of ELF objects (the equivalent of 'ld -r')
+*/
+
+#pragma once
+#ifndef _LINK_ELF_H
+#define _LINK_ELF_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+
+/**
+ * An object taking part to the link. Objects coming from an archive are
+ * <em>lazy</em>: they are only linked if they define a symbol which is
+ * still undefined in the other objects, as a linker would do.
+ */
+typedef struct _link_object {
+	char *name;                   // Name used in the messages
+	unsigned char *data;          // Content of the object file
+	size_t size;
+	bool lazy;                    // Archive member, linked only on demand
+
+	struct _link_object *next;
+} link_object;
+
+
+/**
+ * Creates an object from an in-memory image.
+ *
+ * @param name Name of the object, used in the messages
+ * @param data Content of the object file, which is owned by the new object
+ * @param size Size of the content
+ *
+ * @return Pointer to the new object descriptor
+ */
+link_object *elf_link_new_object(char *name, unsigned char *data, size_t size);
+
+/**
+ * Loads an object file from disk.
+ *
+ * @param path Path of the object file
+ *
+ * @return Pointer to the new object descriptor, or NULL if the file cannot be read
+ */
+link_object *elf_link_load_object(char *path);
+
+/**
+ * Loads the members of a static archive, which are marked as lazy.
+ *
+ * @param path Path of the archive
+ *
+ * @return Pointer to the list of members, or NULL if the file cannot be read
+ * or is not an archive
+ */
+link_object *elf_link_load_archive(char *path);
+
+/**
+ * Releases a list of objects, along with their contents.
+ *
+ * @param objects List of the objects
+ */
+void elf_link_free_objects(link_object *objects);
+
+/**
+ * Merges a list of relocatable ELF objects into a single relocatable object,
+ * which is written to disk. Sections with the same name are concatenated,
+ * global symbols are resolved across objects and relocation entries are
+ * rebased accordingly. Whenever an input makes use of a feature which is not
+ * supported (e.g. section groups or REL entries), nothing is written and the
+ * caller is expected to fall back to an external linker.
+ *
+ * @param output Path of the output file
+ * @param objects List of the objects to link, in order
+ *
+ * @return True if the output has been written, false if the link is not supported
+ */
+bool elf_link_objects(char *output, link_object *objects);
+
+#endif /* _LINK_ELF_H */
@@ -31,10 +31,12 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <endian.h>
 #include <string.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include <hijacker.h>
 #include <prints.h>
@@ -45,6 +47,7 @@
 #include <elf/elf-defs.h>
 #include <elf/handle-elf.h>
 #include <x86/x86.h>
+#include <apply-rules.h>
 
 
 
@@ -53,14 +56,13 @@ unsigned char *strtab(unsigned int byte) {
 
 	// This will give immediate access to the symbol table's string table,
 	// and will be populated upon the first execution of this function.
-	static unsigned int sym_strtab = UINT_MAX;
-
+	// Index 0 is the null section, so it never refers to a string table.
 	register unsigned int i;
 
-	if(sym_strtab == UINT_MAX) { // First invocation: must lookup the table!
+	if(ELF(sym_strtab) == 0) { // First invocation: must lookup the table!
 		for(i = 0; i < ELF(secnum); i++) {
 			if(sec_type(i) == SHT_STRTAB && shstrtab_idx() != i) {
-				sym_strtab = i;
+				ELF(sym_strtab) = i;
 				break;
 			}
 		}
@@ -73,7 +75,7 @@ unsigned char *strtab(unsigned int byte) {
 
 
 	// Now get displace in the section and return
-	return (unsigned char *)(sec_content(sym_strtab) + byte);
+	return (unsigned char *)(sec_content(ELF(sym_strtab)) + byte);
 }
 
 
@@ -101,8 +103,30 @@ static void elf_raw_section(int secndx) {
 
 
 
-static void elf_code_section(int secndx) {
-	section *sec;
+/**
+ * Shared state of the threads decoding the code sections.
+ */
+typedef struct {
+	job_context *job;            // Job owning the sections
+	unsigned int *sections;      // Indexes of the code sections
+	insn_info **chains;          // Decoded instructions of each section
+	unsigned int count;
+	unsigned int next;           // Next section to be decoded
+	pthread_mutex_t lock;
+} decode_pool;
+
+
+/**
+ * Decodes a code section into a chain of instruction descriptors.
+ * It only reads the mapped file, so it may run concurrently on
+ * different sections.
+ *
+ * @param secndx Index of the section
+ * @param pool Arena of the calling thread
+ *
+ * @return First instruction of the chain
+ */
+static insn_info *elf_decode_section(int secndx, arena *pool) {
 	insn_info *first, *instr, *prev;
 
 	size_t pos, size;
@@ -136,7 +160,7 @@ static void elf_code_section(int secndx) {
 	first = instr = prev = NULL;
 
 	while(pos < size) {
-		instr = (insn_info *) calloc(sizeof(insn_info), 1);
+		instr = arena_alloc(pool, sizeof(insn_info));
 
 		switch(PROGRAM(insn_set)) {
 
@@ -156,13 +180,6 @@ static void elf_code_section(int secndx) {
 
 				instr->secname = sec_name(secndx);
 
-				//hprint("%s, %s works on stack\n", instr->i.x86.mnemonic, instr->i.x86.flags & I_STACK ? "" : "not");
-				// hprint("ISTRUZIONE:: '%s' -> opcode = %hhx%hhx, opsize = %d, insn_size = %d; breg = %x, "
-				// 		"ireg = %x; disp_offset = %lx, jump_dest = %lx, scale = %lx, span = %lx\n",
-				// 		instr->i.x86.mnemonic, instr->i.x86.opcode[1], instr->i.x86.opcode[0], instr->i.x86.opcode_size, instr->i.x86.insn_size,
-				// 		instr->i.x86.breg, instr->i.x86.ireg, instr->i.x86.disp_offset, instr->i.x86.jump_dest,
-				// 		instr->i.x86.scale, instr->i.x86.span);
-
 				break;
 
 			default:
@@ -179,6 +196,111 @@ static void elf_code_section(int secndx) {
 		prev = instr;
 	}
 
+	return first;
+}
+
+
+static void *elf_decode_worker(void *arg) {
+	decode_pool *pool = (decode_pool *) arg;
+	arena decoded = { NULL };
+	unsigned int i;
+
+	// Decoders only read the job's state, but for handing their arenas over
+	job = pool->job;
+
+	while (true) {
+		pthread_mutex_lock(&pool->lock);
+		i = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (i >= pool->count) {
+			break;
+		}
+
+		pool->chains[i] = elf_decode_section(pool->sections[i], &decoded);
+	}
+
+	// Each thread decodes into an arena of its own, so that the decoders
+	// do not contend on the allocator; the arenas are handed to version 0
+	pthread_mutex_lock(&pool->lock);
+	arena_merge(&PROGRAM(arenas)[0], &decoded);
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+
+/**
+ * Decodes all the code sections of the ELF, on as many threads as
+ * the job is given. Sections are independent from each other, so each
+ * thread picks the next one which is still to be decoded; the chains
+ * are attached to the representation afterwards, in section order.
+ *
+ * @return Array with the first instruction of each section, indexed
+ * by section number
+ */
+static insn_info **elf_decode_code_sections(void) {
+	decode_pool pool;
+	pthread_t *threads;
+	insn_info **decoded;
+	unsigned int secndx, nthreads, i;
+
+	decoded = calloc(sizeof(insn_info *), ELF(secnum));
+	pool.sections = malloc(sizeof(unsigned int) * ELF(secnum));
+	pool.chains = malloc(sizeof(insn_info *) * ELF(secnum));
+	if (decoded == NULL || pool.sections == NULL || pool.chains == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	pool.job = job;
+	pool.count = pool.next = 0;
+	pthread_mutex_init(&pool.lock, NULL);
+
+	for (secndx = 0; secndx < ELF(secnum); secndx++) {
+		if (sec_type(secndx) == SHT_PROGBITS && sec_test_flag(secndx, SHF_EXECINSTR)) {
+			pool.sections[pool.count++] = secndx;
+		}
+	}
+
+	nthreads = job->threads < pool.count ? job->threads : pool.count;
+
+	hnotice(1, "Decoding %u code sections on %u threads\n", pool.count, nthreads ? nthreads : 1);
+
+	threads = malloc(sizeof(pthread_t) * (nthreads + 1));
+	if (threads == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	// The calling thread is a decoder as well
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, elf_decode_worker, &pool) != 0) {
+			herror(true, "Unable to create the decoding threads\n");
+		}
+	}
+
+	elf_decode_worker(&pool);
+
+	for (i = 1; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	for (i = 0; i < pool.count; i++) {
+		decoded[pool.sections[i]] = pool.chains[i];
+	}
+
+	pthread_mutex_destroy(&pool.lock);
+	free(threads);
+	free(pool.sections);
+	free(pool.chains);
+
+	return decoded;
+}
+
+
+
+static void elf_code_section(int secndx, insn_info *first) {
+	section *sec;
+
 	sec = section_create_from_ELF(secndx, SECTION_CODE);
 	sec->payload = first;
 
@@ -329,20 +451,19 @@ static void elf_string_section(int secndx) {
 	pos = 0;
 	size = sec_size(secndx);
 
-	stringtab = malloc(sizeof(char) * size);
+	// Strings are never rewritten, so the table is used in place
+	stringtab = sec_content(secndx);
 
-	while(pos < size){
-		name = (sec_content(secndx) + pos);
-		strcpy(stringtab + pos, (char *)name);
+	while(pos < size && config.verbose >= 2){
+		name = (stringtab + pos);
 
-		hnotice(2, "%#08x: '%s'\n", pos, stringtab + pos);
+		hnotice(2, "%#08x: '%s'\n", pos, name);
 
 		pos += (strlen((const char *) name) + 1);
 	}
 
 	// TODO: is this needed?
 	sec = section_create_from_ELF(secndx, SECTION_NAMES);
-	sec->payload = stringtab;
 
 	hsuccess();
 }
@@ -434,7 +555,7 @@ static void resolve_variable_symbol(symbol *sym) {
 static void resolve_section_symbol(symbol *sym) {
 	section *sec;
 
-	sym->name = (unsigned char *) sec_name(sym->secnum);
+	symbol_rename(sym, sec_name(sym->secnum));
 	sym->size = sec_size(sym->secnum);
 
 	hnotice(2, "Section symbol %s (%d bytes long) pointing to section %d (%s)\n",
@@ -480,6 +601,10 @@ static void resolve_symbols(void) {
 
 	first = NULL;
 
+	// Functions are looked up in the chains of instructions of each section,
+	// which are only split afterwards
+	insn_index_begin();
+
 	for (sym = sec->payload; sym; sym = sym->next) {
 
 		switch(sym->type) {
@@ -560,6 +685,8 @@ static void resolve_symbols(void) {
 		}
 	}
 
+	insn_index_end();
+
 	// Now, we must find function ends. This task ends up being more complex
 	// than needed, since it is not possible to just seek RET instructions.
 	// Indeed, they can be used in the middle of a function for optimization
@@ -624,6 +751,7 @@ static void resolve_symbols(void) {
 	// }
 
 	PROGRAM(symbols) = sec->payload;
+	symbol_index_reset();
 	PROGRAM(code) = first;
 	PROGRAM(v_code)[0] = first;
 
@@ -728,7 +856,7 @@ static void resolve_relocation(void) {
 				// the specific emitter in the emit phase.
 				// Note: we use a list since there may be more relocations that applies to
 				// the same instruction.
-				ll_push(&instr->reference, rela);
+				sv_push(&instr->reference, rela);
 
 				// hnotice(2, "Added symbol reference to '%s' + <%#08llx> + %d\n\n",
 				// 	sym->relocation.sec->name, rel->offset, rel->addend);
@@ -770,7 +898,7 @@ static void resolve_relocation(void) {
 				// by a relocation.
 				// Note: we use list because one instruction can be referenced by more than
 				// one relocation entry
-				ll_push(&instr->pointedby, rela);
+				sv_push(&instr->pointedby, rela);
 
 				// hnotice(2, "Added symbol reference to '%s' + <%#08llx> + %d\n\n",
 				// 	sym->relocation.sec->name, rel->offset, rel->addend);
@@ -796,8 +924,55 @@ static void resolve_jumps(void) {
 
 
 
+/**
+ * Collapses into opaque instructions the functions which no rule can reach,
+ * so that they are carried through the instrumentation as plain byte ranges
+ * along with their relocations: the control flow graph, the cloning of the
+ * versions and the emission of the code then cost a single instruction for
+ * each of them.
+ */
+static void resolve_opaque(void) {
+	function *func;
+	insn_info *instr;
+	unsigned int idx, count, total;
+
+	count = total = 0;
+
+	for (func = PROGRAM(v_code)[0]; func; func = func->next) {
+		total++;
+
+		if (!rules_reach_function(func)) {
+			function_make_opaque(func);
+			count++;
+		}
+	}
+
+	if (count == 0) {
+		return;
+	}
+
+	// Jump tables of the remaining functions may still point to
+	// instructions which have been replaced
+	for (func = PROGRAM(v_code)[0]; func; func = func->next) {
+		for (instr = func->begin_insn; instr; instr = instr->next) {
+			for (idx = 0; idx < instr->jumptable.size; idx++) {
+				if (instr->jumptable.entry[idx] && instr->jumptable.entry[idx]->virtual) {
+					instr->jumptable.entry[idx] = instr->jumptable.entry[idx]->virtual;
+				}
+			}
+		}
+	}
+
+	hnotice(1, "%u of %u functions are not reached by the rules and are kept opaque\n", count, total);
+
+	hsuccess();
+}
+
+
+
 static void resolve_blocks(void) {
 	PROGRAM(blocks)[0] = block_graph_create();
+	liveness_compute(PROGRAM(blocks)[0]);
 
 	hsuccess();
 }
@@ -805,19 +980,22 @@ static void resolve_blocks(void) {
 
 
 void elf_create_map(void) {
-	unsigned int size;
+	struct stat info;
 	unsigned int secndx;
+	insn_info **decoded;
 
-	// Reserve space and load ELF in memory
-	fseek(ELF(pointer), 0L, SEEK_END);
-	size = ftell(ELF(pointer));
-	rewind(ELF(pointer));
-
-	ELF(data) = malloc(size * sizeof(unsigned char));
-	if (fread(ELF(data), 1, size, ELF(pointer)) != size) {
+	// Map the ELF in memory. The mapping is read-only: the parsed sections
+	// point into it as long as they are not rewritten, while anything which
+	// is modified by the instrumentation gets its own copy
+	if (fstat(fileno(ELF(pointer)), &info) == -1) {
 		herror(true, "Unable to correctly load the ELF file\n");
 	}
-	rewind(ELF(pointer));
+
+	ELF(size) = info.st_size;
+	ELF(data) = mmap(NULL, ELF(size), PROT_READ, MAP_PRIVATE, fileno(ELF(pointer)), 0);
+	if (ELF(data) == MAP_FAILED) {
+		herror(true, "Unable to map the ELF file in memory\n");
+	}
 
 	// Keep track of the header
 	ELF(hdr) = (Elf_Hdr *)ELF(data);
@@ -836,6 +1014,10 @@ void elf_create_map(void) {
 		ELF(secnum) = ELF(hdr)->header32.e_shnum;
 	}
 
+	// Code sections are independent from each other, so they are
+	// decoded in parallel before being attached to the representation
+	decoded = elf_decode_code_sections();
+
 	// Scan ELF Sections and convert/parse them (if any to be)
 	for(secndx = 0; secndx < ELF(secnum); secndx++) {
 		hnotice(1, "Parsing section %u of %u: '%s' (%d bytes long, offset %#08lx)\n",
@@ -849,7 +1031,7 @@ void elf_create_map(void) {
 					// trova dei simboli di sezione senza la rispettiva
 					// sezione...
 					// if (str_prefix(sec_name(secndx), ".text")) {
-						elf_code_section(secndx);
+						elf_code_section(secndx, decoded[secndx]);
 					// }
 				} else {
 					// It must be a data section
@@ -911,14 +1093,22 @@ void elf_create_map(void) {
 		}
 	}
 
+	free(decoded);
+
 	// Ultimates the binary representation
 	resolve_symbols();
+
+	function_index_build();
+	insn_index_begin();
 	resolve_relocation();
+	insn_index_end();
+	function_index_drop();
 
 	// update_instruction_addresses(0);
 	// update_jump_displacements(0);
 
 	resolve_jumps();
+	resolve_opaque();
 	resolve_blocks();
 
 	PROGRAM(versions)++;
@@ -929,6 +1119,26 @@ void elf_create_map(void) {
 
 
 
+/**
+ * Releases what the map of the input keeps from the file once the job is
+ * over, so that a worker does not run out of descriptors or address space
+ * over many inputs.
+ */
+void elf_destroy_map(void) {
+	if (ELF(data) != NULL) {
+		munmap(ELF(data), ELF(size));
+		ELF(data) = NULL;
+		ELF(size) = 0;
+	}
+
+	if (ELF(pointer) != NULL) {
+		fclose(ELF(pointer));
+		ELF(pointer) = NULL;
+	}
+}
+
+
+
 int elf_instruction_set(void) {
 	Elf32_Ehdr hdr; // Headers are same sized. Assuming its 32 bits...
 	int insn_set = UNRECOG_INSN;
@@ -969,7 +1179,7 @@ bool is_elf(char *path) {
 	hnotice(1, "Checking whether '%s' is an ELF executable...", path);
 
 	// Try to oper the file
-	ELF(pointer) = fopen(path, "r+");
+	ELF(pointer) = fopen(path, "r");
 	if(ELF(pointer) == NULL) {
 		herror(true, "Unable to open '%s' for reading\n", path);
 	}
@@ -33,6 +33,7 @@
 //parsed_elf parsed;
 
 extern void elf_create_map(void);
+extern void elf_destroy_map(void);
 extern int elf_instruction_set(void);
 extern bool is_elf(char *path);
 extern unsigned char *strtab(unsigned int byte);
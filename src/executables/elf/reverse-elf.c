@@ -77,7 +77,7 @@ static void get_memwrite_info (insn_info *insn, insn_entry *entry) {
 }*/
 
 
-void trampoline_prepare (insn_info *target, unsigned char *func, int where) {
+void trampoline_prepare (insn_info *target, unsigned char *func, int where, trampoline_mode mode) {
 	/*insn_entry entry;
 	symbol *sym;
 
@@ -115,7 +115,7 @@ void trampoline_prepare (insn_info *target, unsigned char *func, int where) {
 	// according to the executable file type
 	switch (PROGRAM(insn_set)) {
 		case X86_INSN:
-			x86_trampoline_prepare(target, func, where);
+			x86_trampoline_prepare(target, func, where, mode);
 		break;
 	}
 }
@@ -54,6 +54,16 @@
 
 void prepare_trampoline_call (insn_info *target, symbol *reference);
 
-void trampoline_prepare (insn_info *target, unsigned char *func, int where);
+/**
+ * Instruments a memory access with a call to the trampoline, which hands the
+ * address and the size of the access to a function.
+ *
+ * @param target Pointer to the descriptor of the memory access
+ * @param func Name of the function to call
+ * @param where Whether the call goes before or after the access
+ * @param mode Whether the accesses are handed to the function one at a time,
+ * buffered and handed in batches, or made into ranges
+ */
+void trampoline_prepare (insn_info *target, unsigned char *func, int where, trampoline_mode mode);
 
 #endif /* REVERSE_ELF_H_ */
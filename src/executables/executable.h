@@ -29,6 +29,8 @@
 #ifndef _EXECUTABLE_H
 #define _EXECUTABLE_H
 
+#include <pthread.h>
+
 #include <ibr.h>
 #include <elf/elf-defs.h>
 
@@ -37,6 +39,34 @@
 
 #define MAX_VERSIONS	256
 
+
+/**
+ * State of a version which is only used by the thread building it. Versions
+ * are built concurrently, one per thread, so each thread works on the
+ * version bound to its thread-local 'current_version' handle (see hijacker.h).
+ */
+typedef struct _version_context {
+	unsigned int id;		/// Number of the version
+	unsigned int last_block_id;	// Counters used to number the IR elements of the version
+	unsigned int last_insn_index;
+	unsigned int last_batch_site;
+	unsigned int last_range_site;
+	size_t next_symbol_id;		// Identifiers of the symbols created while building the version,
+	size_t symbol_id_step;		// which are interleaved with the other versions' ones (if step > 0)
+	hash_table functions_by_insn;	// Functions by their first instruction (a cache)
+	function_index functions_by_addr;	// Functions by address, only while it is built
+	hash_table insns_by_head;	// Indexes of the instruction chains, by their head
+	insn_index *insn_indexes;	// List of the indexes built so far
+	bool insn_index_active;	// Whether instruction chains are being indexed
+	insn_columns columns;		// Columnar copy of the instructions, see insn_columns_build
+	unsigned long insn_changes;	// Insertions and substitutions made to the chains so far
+	bool insn_batch_active;	// Whether a batch of insertions is open
+	hash_table insn_batch_code;	// Code decoded since the batch has been opened
+	hash_table insn_batch_funcs;	// Functions of the instructions looked up meanwhile
+	block_index blocks_by_insn;	// Blocks by their first instruction, frozen once the graph is built
+	bool liveness_valid;		// Whether the dead registers of the instructions can be trusted
+} version_context;
+
 typedef struct _executable {
 	int type;
 	int insn_set;
@@ -45,7 +75,7 @@ typedef struct _executable {
 	} e;
 	symbol		*orig_syms;
 	function	*v_code[MAX_VERSIONS];
-	unsigned int	version;	/// Current instrumenting version
+	version_context	v_context[MAX_VERSIONS];	/// State of each version while it is built
 	unsigned int	versions;	/// Number of total versions
 	void 		*metadata;
 	unsigned int	symnum;
@@ -55,12 +85,26 @@ typedef struct _executable {
 	function	*code;		// [DC] Added this field to handle the parsed functions
 	void 	*rawdata;		// [DC] Added this filed to handle preallocated raw data
 	block *blocks[MAX_VERSIONS];		// [SE] Basic block overlay
+	size_t last_symbol_id;		// Counters used to number the IR elements
+	size_t last_section_id;
+	hash_table symbols_by_name;	// Indexes of the symbols, kept up to date along with the list
+	hash_table symbols_by_index;
+	symbol *symbols_last_local;	// Where the next local and global symbols are appended (hints)
+	symbol *symbols_tail;
+	hash_table sections_by_name[MAX_VERSIONS];	// Indexes of the sections of each version
+	hash_table sections_by_index[MAX_VERSIONS];
+	arena arenas[MAX_VERSIONS];	// Memory of the descriptors of each version, released at once
+	pthread_mutex_t lock;		// Serializes the updates of the state shared by the versions (recursive)
+	pthread_cond_t turn;		// Signaled whenever a version has inflated the data sections
+	unsigned int versions_inflated;	// Last version which has inflated the data sections
 } executable_info;
 
 
 
 extern void load_program(char *path);
+extern void unload_program(void);
 extern void output_object_file(char *pathname);
+extern void output_object_image(unsigned char **image, size_t *size);
 
 #endif /* _EXECUTABLE_H */
 
@@ -99,6 +99,23 @@ static void create_map(void) {
 
 
 
+void unload_program(void) {
+
+	// Switch on file type
+	switch(PROGRAM(type)) {
+
+		case EXECUTABLE_ELF:
+
+			elf_destroy_map();
+			break;
+
+		default:
+			hinternal();
+	}
+}
+
+
+
 void load_program(char *path) {
 
 	hprint("Loading '%s'...\n", path);
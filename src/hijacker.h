@@ -29,6 +29,8 @@
 
 #include <stdbool.h>
 
+#include <utils.h>
+
 #include <presets/presets.h>
 #include <rules/load-rules.h>
 #include <executables/executable.h>
@@ -41,21 +43,46 @@ typedef struct _configuration {
 	char	  	*input;
 	char		*output;
 	char		*inject_path;
-	executable_info	program;
+	char		*cache_path;
+	bool		external_linker;
+	char		*batch;		/// List file or directory of the inputs in batch mode
+	unsigned int	workers;	/// Number of worker threads in batch mode
   preset *presets;
 } configuration;
 
 
+/**
+ * State of the instrumentation of a single input object. In batch mode
+ * every input is a separate job, processed by one of the worker threads,
+ * which binds the job to the thread-local 'job' pointer while working on it.
+ */
+typedef struct _job_context {
+	unsigned int	id;		/// Unique identifier, used to name temporary files
+	char		*input;
+	char		*output;
+	executable_info	program;
+	linked_list	modules;	/// Object files compiled from the Inject tags
+	bool		member;		/// Archive member, written without linking the modules
+	unsigned int	threads;	/// Threads the job may use for its own parallel phases
+} job_context;
+
+
 /// Easily access program flags
-#define PROGRAM(field) (config.program.field)
+#define PROGRAM(field) (job->program.field)
 
-#define SYMBOLS PROGRAM(v_symbols)[PROGRAM(version)]
-#define CODE PROGRAM(v_code)[PROGRAM(version)]
+/// Easily access the state of the version being built by the calling thread
+#define CURRENT(field) (current_version->field)
+
+#define SYMBOLS PROGRAM(v_symbols)[CURRENT(id)]
+#define CODE PROGRAM(v_code)[CURRENT(id)]
 
 
 /// Default output name
 #define DEFAULT_OUT_NAME	"hijacked.o"
 
+/// Suffix replacing the extension of the inputs in batch mode, if no output directory is set
+#define DEFAULT_BATCH_SUFFIX	".hijacked.o"
+
 
 // This is an OS-dependent way to check if a file exists
 #if defined(WIN32) || defined(WIN64)
@@ -75,6 +102,8 @@ typedef struct _configuration {
 #endif
 
 extern configuration config;
+extern __thread job_context *job;
+extern __thread version_context *current_version;
 
 #endif /* _HIJACKER_H */
 
@@ -24,193 +24,135 @@
 * @date June 18, 2015
 */
 
+#include <string.h>
+
 #include <prints.h>
 #include <ibr.h>
 
 #include <elf/handle-elf.h>
 
-static block *root[MAX_VERSIONS];
-
 block *block_create(void) {
 	block *blk;
-	static int id;
-
-	blk = calloc(sizeof(block), 1);
-	blk->id = ++id;
 
-	// This is a bit of an ugly hack, but is functional to
-	// avoiding polluting the namespace with a global symbol
-	// or having to pass a variable to all visible functions
-	// of this module
-	// TODO: Devise a better mechanism which is unit-test friendly
-	if (!root[PROGRAM(version)]) {
-		root[PROGRAM(version)] = blk;
-	}
+	blk = ibr_alloc(sizeof(block));
+	blk->id = ++CURRENT(last_block_id);
 
 	return blk;
 }
 
-static void block_tree_balance_update(block *blk) {
-	unsigned int left_height, right_height;
 
-	left_height = right_height = 0;
+/**
+ * Returns the position of the last block which begins at or before an
+ * instruction, or the number of blocks if there is none. The search has no
+ * data-dependent branches, so its cost does not depend on the outcome of
+ * the comparisons.
+ *
+ * @param index Index of the blocks
+ * @param key Index of the instruction
+ */
+static size_t block_index_search(block_index *index, unsigned int key) {
+	unsigned int *base;
+	size_t size, half;
 
-	if (blk->left) {
-		left_height = blk->left->height;
-	}
-	if (blk->right) {
-		right_height = blk->right->height;
+	if (index->size == 0 || key < index->begin[0]) {
+		return index->size;
 	}
 
-	blk->height = (left_height > right_height ? left_height : right_height) + 1;
-	blk->balance = left_height - right_height;
-}
-
-static void block_tree_parent_update(block *replaced, block *replacement) {
-	replacement->parent = replaced->parent;
+	base = index->begin;
+	size = index->size;
 
-	if (!replaced->parent) {
-		root[PROGRAM(version)] = replacement;
-	}
-	else if (replaced->parent->left == replaced) {
-		replaced->parent->left = replacement;
-	}
-	else {
-		replaced->parent->right = replacement;
+	while (size > 1) {
+		half = size / 2;
+		base = (base[half] <= key) ? base + half : base;
+		size -= half;
 	}
-}
-
-static void block_tree_rotate_left(block **parent, block **child) {
-	block *temp;
 
-	// 'parent' becomes the left block of the one denoted 'child'
+	return base - index->begin;
+}
 
-	block_tree_parent_update(*parent, *child);
 
-	(*parent)->parent = (*child);
-	(*parent)->right = (*child)->left;
+/**
+ * Puts a block in the index of the current version, at a given position.
+ */
+static void block_index_insert(block *blk, size_t position) {
+	block_index *index;
 
-	if ((*parent)->right) {
-		(*parent)->right->parent = (*parent);
+	// The split past the last instruction leaves an empty block behind
+	if (blk->begin == NULL) {
+		return;
 	}
 
-	(*child)->left = (*parent);
-
-	block_tree_balance_update(*parent);
-	block_tree_balance_update(*child);
-
-	temp = *parent, *parent = *child, *child = temp;
-}
-
-static void block_tree_rotate_right(block **parent, block **child) {
-	block *temp;
-
-	// 'parent' becomes the right block of the one denoted 'child'
-
-	block_tree_parent_update(*parent, *child);
+	index = &CURRENT(blocks_by_insn);
 
-	(*parent)->parent = (*child);
-	(*parent)->left = (*child)->right;
+	if (index->size == index->capacity) {
+		index->capacity = index->capacity ? index->capacity * 2 : 256;
+		index->begin = realloc(index->begin, sizeof(unsigned int) * index->capacity);
+		index->entry = realloc(index->entry, sizeof(block *) * index->capacity);
 
-	if ((*parent)->left) {
-		(*parent)->left->parent = (*parent);
+		if (index->begin == NULL || index->entry == NULL) {
+			herror(true, "Out of memory!\n");
+		}
 	}
 
-	(*child)->right = (*parent);
-
-	block_tree_balance_update(*parent);
-	block_tree_balance_update(*child);
+	memmove(&index->begin[position + 1], &index->begin[position], sizeof(unsigned int) * (index->size - position));
+	memmove(&index->entry[position + 1], &index->entry[position], sizeof(block *) * (index->size - position));
 
-	temp = *parent, *parent = *child, *child = temp;
+	index->begin[position] = blk->begin->index;
+	index->entry[position] = blk;
+	index->size++;
 }
 
-static void block_tree_rebalance(block *orig, block *new) {
-	block *parent, *first, *second;
 
-	// Node insertion: the right-most block replaces the original
-	// and the latter becomes the left child of the former
-	new->parent = orig;
-	new->right = orig->right;
-	orig->right = new;
+/**
+ * Moves the index of the blocks of the current version into its arena, once
+ * the graph is built, since the blocks are no longer split afterwards.
+ */
+static void block_index_freeze(void) {
+	block_index *index;
+	unsigned int *begin;
+	block **entry;
 
-	if (new->right) {
-		new->right->parent = new;
-	}
+	index = &CURRENT(blocks_by_insn);
 
-	// We now check if there's need to re-balance the tree
-	// and at the same time we recompute all balance factors
-	// that have changed since the latest insertion
-	parent = new;
-	first = new->right;
+	begin = ibr_alloc(sizeof(unsigned int) * (index->size + 1));
+	entry = ibr_alloc(sizeof(block *) * (index->size + 1));
 
-	while (parent) {
-		block_tree_balance_update(parent);
-		hnotice(6, "Checking whether block #%u needs re-balancing (balance %d)\n", parent->id, parent->balance);
+	memcpy(begin, index->begin, sizeof(unsigned int) * index->size);
+	memcpy(entry, index->entry, sizeof(block *) * index->size);
 
-		if (parent->balance >= 2) {
-			// LEFT RIGHT case
-			if (first->balance <= -1) {
-				second = first->right;
-				hnotice(5, "Re-balancing block #%u, LEFT RIGHT case\n", parent->id);
-				block_tree_rotate_left(&first, &second);
-			}
-			// LEFT LEFT case
-			hnotice(5, "Re-balancing block #%u, LEFT LEFT case\n", parent->id);
-			block_tree_rotate_right(&parent, &first);
-		}
+	free(index->begin);
+	free(index->entry);
 
-		else if (parent->balance <= -2) {
-			// RIGHT LEFT case
-			if (first->balance >= 1) {
-				second = first->left;
-				hnotice(5, "Re-balancing block #%u, RIGHT LEFT case\n", parent->id);
-				block_tree_rotate_right(&first, &second);
-			}
-			// RIGHT RIGHT case
-			hnotice(5, "Re-balancing block #%u, RIGHT RIGHT case\n", parent->id);
-			block_tree_rotate_left(&parent, &first);
-		}
-
-		second = first;
-		first = parent;
-		parent = parent->parent;
-	}
+	index->begin = begin;
+	index->entry = entry;
+	index->capacity = index->size;
 }
 
+
 block *block_find(insn_info *instr) {
+	block_index *index;
 	block *blk;
+	size_t position;
 
 	if (!instr) {
 		hinternal();
 	}
 
-	for (blk = PROGRAM(blocks[PROGRAM(version)]); blk; blk = blk->next) {
-		if (blk->begin->index <= instr->index & blk->end->index >= instr->index) {
-			return blk;
-		}
-	}
-
-	return NULL;
+	index = &CURRENT(blocks_by_insn);
+	position = block_index_search(index, instr->index);
 
-	// blk = root[PROGRAM(version)];
+	if (position == index->size) {
+		return NULL;
+	}
 
-	// while(blk) {
-	// 	if (blk->begin->index > instr->index) {
-	// 		blk = blk->left;
-	// 	}
-	// 	else if (blk->end->index < instr->index) {
-	// 		blk = blk->right;
-	// 	}
-	// 	else {
-	// 		break;
-	// 	}
-	// }
+	blk = index->entry[position];
 
-	// return blk;
+	return blk->end->index >= instr->index ? blk : NULL;
 }
 
 block *block_split(block *blk, insn_info *breakpoint, block_split_mode mode) {
 	block *new_blk;
+	size_t position;
 
 	// If the block is already split at the desired breakpoint
 	// just return it
@@ -221,6 +163,17 @@ block *block_split(block *blk, insn_info *breakpoint, block_split_mode mode) {
 		return blk;
 	}
 
+	// The breakpoint must belong to the block being split
+	if (breakpoint->index < blk->begin->index || breakpoint->index > blk->end->index) {
+		hinternal();
+	}
+
+	position = block_index_search(&CURRENT(blocks_by_insn), blk->begin->index);
+
+	if (position == CURRENT(blocks_by_insn).size || CURRENT(blocks_by_insn).entry[position] != blk) {
+		hinternal();
+	}
+
 	// Allocate the new blocks, update the ordered list
 	// and appropriately mark their boundaries
 	new_blk = block_create();
@@ -243,17 +196,13 @@ block *block_split(block *blk, insn_info *breakpoint, block_split_mode mode) {
 
 	// The new block gets all the outgoing connections of the old one
 	// The outgoing blocks get their incoming connections updated too
-	ll_move(&(blk->out), &(new_blk->out));
+	sv_move(&(blk->out), &(new_blk->out));
 
-	ll_node *outgoing, *incoming;
+	unsigned int out_idx, in_idx;
 	block_edge *outgoing_edge, *incoming_edge;
 
-	for (outgoing = new_blk->out.first; outgoing; outgoing = outgoing->next) {
-		outgoing_edge = outgoing->elem;
-
-		for (incoming = outgoing_edge->to->in.first; incoming; incoming = incoming->next) {
-			incoming_edge = incoming->elem;
-
+	sv_foreach(&new_blk->out, out_idx, outgoing_edge) {
+		sv_foreach(&outgoing_edge->to->in, in_idx, incoming_edge) {
 			if (incoming_edge->from == blk) {
 				incoming_edge->from = new_blk;
 			}
@@ -265,14 +214,14 @@ block *block_split(block *blk, insn_info *breakpoint, block_split_mode mode) {
 		blk->id, blk->begin->orig_addr, blk->end->orig_addr,
 		new_blk->id, new_blk->begin->orig_addr, new_blk->end->orig_addr);
 
-	// We maintain a balanced tree of blocks for fast lookup
-	// block_tree_rebalance(blk, new_blk);
+	// The new block comes right after the old one in the index as well
+	block_index_insert(new_blk, position + 1);
 
 	return new_blk;
 }
 
 void block_link(block *from, block *to, block_edge_type type) {
-	linked_list *out, *in;
+	small_vector *out, *in;
 	block_edge *edge;
 
 	if (from == NULL || to == NULL) {
@@ -293,25 +242,18 @@ void block_link(block *from, block *to, block_edge_type type) {
 	in = &(to->in);
 
 	// Connect source to destination
-	ll_push(out, edge);
+	sv_push(out, edge);
 
 	// Connect destination to source
-	ll_push(in, edge);
+	sv_push(in, edge);
 
 	hnotice(4, "Linking block #%u with block #%u\n", from->id, to->id);
 }
 
-void block_tree_dump(char *filename, char *mode) {
+void block_index_dump(char *filename, char *mode) {
 	FILE *f;
 	block *blk;
-	linked_list *queue, *queue_temp;
-
-	// FIXME: Disabled for now
-	return;
-
-	if (!root[PROGRAM(version)]) {
-		return;
-	}
+	size_t position;
 
 	if (!mode) {
 		hinternal();
@@ -323,43 +265,16 @@ void block_tree_dump(char *filename, char *mode) {
 		f = stdout;
 	}
 
-	queue = calloc(sizeof(linked_list), 1);
-	queue_temp = calloc(sizeof(linked_list), 1);
-
-	ll_push(queue, root[PROGRAM(version)]);
-
-	while(true) {
-
-		while(!ll_empty(queue)) {
-			blk = ll_pop_first(queue);
-
-			fprintf(f, "Block #%u from <%#08llx> to <%#08llx> has balance %d, "
-				"left #%u, right #%u and parent #%u\n",
-				blk->id, blk->begin->orig_addr, blk->end->orig_addr, blk->balance,
-				(blk->left ? blk->left->id : 0),
-				(blk->right ? blk->right->id : 0),
-				(blk->parent ? blk->parent->id : 0));
+	for (position = 0; position < CURRENT(blocks_by_insn).size; position++) {
+		blk = CURRENT(blocks_by_insn).entry[position];
 
-			if (blk->left) {
-				ll_push(queue_temp, blk->left);
-			}
-			if (blk->right) {
-				ll_push(queue_temp, blk->right);
-			}
-		}
-
-		if (ll_empty(queue_temp)) {
-			break;
-		}
-
-		ll_move(queue_temp, queue);
+		fprintf(f, "Block #%u from <%#08llx> to <%#08llx> (instructions %u to %u)\n",
+			blk->id, blk->begin->orig_addr, blk->end->orig_addr,
+			blk->begin->index, blk->end->index);
 	}
 
 	fprintf(f, "\n");
 
-	free(queue);
-	free(queue_temp);
-
 	if (filename) {
 		fclose(f);
 	}
@@ -370,7 +285,7 @@ static bool block_graph_dump_pre(void *elem, void *data) {
 	block *blk;
 	FILE *f;
 
-	ll_node *to_node, *from_node;
+	unsigned int idx;
 
 	edge = elem;
 	blk = edge->to;
@@ -380,34 +295,24 @@ static bool block_graph_dump_pre(void *elem, void *data) {
 		return false;
 	}
 
-	to_node = blk->out.first;
-	from_node = blk->in.first;
-
 	fprintf(f, "Block #%u", edge->to->id);
 
-	if (to_node) {
+	if (!sv_empty(&blk->out)) {
 		fprintf(f, " links to");
 
-		while(to_node) {
-			edge = to_node->elem;
+		sv_foreach(&blk->out, idx, edge) {
 			fprintf(f, " #%u%s", edge->to->id, edge->dir == EDGE_NEXT ? "" : "(B)");
-
-			to_node = to_node->next;
 		}
 
 	}
 
-	if (from_node && ((block_edge *)from_node->elem)->type != EDGE_INIT) {
+	if (!sv_empty(&blk->in) && ((block_edge *)sv_first(&blk->in))->type != EDGE_INIT) {
 		fprintf(f, " reached from");
 
-		while(from_node) {
-			edge = from_node->elem;
-
+		sv_foreach(&blk->in, idx, edge) {
 			if (edge->from) {
 				fprintf(f, " #%u%s", edge->from->id, edge->dir == EDGE_NEXT ? "" : "(B)");
 			}
-
-			from_node = from_node->next;
 		}
 
 	}
@@ -446,7 +351,7 @@ void block_graph_dump(function *functions, char *filename, char *mode) {
 			.post_func = NULL
 		};
 
-		block_graph_visit(func->source->in.first->elem, &dump_visit);
+		block_graph_visit(sv_first(&func->source->in), &dump_visit);
 	}
 
 	if (filename) {
@@ -457,14 +362,15 @@ void block_graph_dump(function *functions, char *filename, char *mode) {
 static void block_graph_visit_next(block_edge *edge, graph_visit *visit) {
 	block *blk;
 	block_edge *current;
-	ll_node *tosched;
+	small_vector *tosched;
+	unsigned int idx;
 
 	if (visit->dir == VISIT_FORWARD) {
 		blk = edge->to;
-		tosched = blk->out.first;
+		tosched = &blk->out;
 	} else {
 		blk = edge->from;
-		tosched = blk->in.first;
+		tosched = &blk->in;
 	}
 
 	if (visit->pre_func != NULL) {
@@ -483,8 +389,8 @@ static void block_graph_visit_next(block_edge *edge, graph_visit *visit) {
 		ll_push(&(visit->visited), blk);
 	}
 
-	while (tosched) {
-		ll_push(&(visit->scheduled), tosched->elem);
+	sv_foreach(tosched, idx, current) {
+		ll_push(&(visit->scheduled), current);
 
 		if (visit->policy == VISIT_DEPTH) {
 			current = ll_pop(&(visit->scheduled));
@@ -493,8 +399,6 @@ static void block_graph_visit_next(block_edge *edge, graph_visit *visit) {
 		}
 
 		block_graph_visit_next(current, visit);
-
-		tosched = tosched->next;
 	}
 
 	if (visit->post_func != NULL) {
@@ -584,7 +488,7 @@ block *block_graph_create(void) {
 
 	hnotice(1, "Resolving CFG...\n");
 
-	first = PROGRAM(v_code)[PROGRAM(version)];
+	first = PROGRAM(v_code)[CURRENT(id)];
 
 	// The first block comprises the entire program, then it will be
 	// progressively split until we obtain basic blocks
@@ -595,7 +499,10 @@ block *block_graph_create(void) {
 	hnotice(4, "Program block #%u created from <%#08llx> to <%#08llx>\n",
 		current_blk->id, current_blk->begin->orig_addr, current_blk->end->orig_addr);
 
-	blocks = PROGRAM(blocks)[PROGRAM(version)] = current_blk;
+	blocks = PROGRAM(blocks)[CURRENT(id)] = current_blk;
+
+	CURRENT(blocks_by_insn) = (block_index) {0};
+	block_index_insert(current_blk, 0);
 
 	// For each instruction in each function, we begin iteratively
 	// splitting current blocks into smaller and smaller chunks
@@ -624,16 +531,11 @@ block *block_graph_create(void) {
 		current_blk = block_split(current_blk, func->begin_insn, SPLIT_FIRST);
 		func->begin_blk = current_blk;
 
-		for (instr = func->begin_insn->next; instr->next; instr = instr->next) {
-
-			// Beginning of function body
-			if (instr->prev && !instr->prev->prev) {
-				hnotice(3, "Function %s body breakpoint at <%#08llx>\n", func->name, instr->orig_addr);
+		// Opaque functions are made of a single instruction, which has
+		// nothing to split
+		instr = func->begin_insn->next ? func->begin_insn->next : func->begin_insn;
 
-				current_blk = block_split(current_blk, instr, SPLIT_LAST);
-
-				block_link(func->begin_blk, current_blk, EDGE_FORCED);
-			}
+		for (; instr->next; instr = instr->next) {
 
 			// We've moved to a block which was already created during
 			// a previous iteration
@@ -646,6 +548,17 @@ block *block_graph_create(void) {
 				}
 			}
 
+			// Beginning of function body. The current block still holds the
+			// breakpoint, which may be a breakpoint of its own below in
+			// functions of a couple of instructions
+			if (instr->prev && !instr->prev->prev) {
+				hnotice(3, "Function %s body breakpoint at <%#08llx>\n", func->name, instr->orig_addr);
+
+				new_blk = block_split(current_blk, instr, SPLIT_LAST);
+
+				block_link(current_blk, new_blk, EDGE_FORCED);
+			}
+
 			// Function exit point
 			if (instr->next && IS_RET(instr->next)) {
 				hnotice(3, "Function %s return breakpoint at <%#08llx>\n",
@@ -839,6 +752,14 @@ block *block_graph_create(void) {
 		hnotice(3, "Function %s end breakpoint at <%#08llx>\n",
 			func->name, instr->orig_addr);
 
+		if (instr->index > current_blk->end->index) {
+			current_blk = current_blk->next;
+
+			if (!current_blk) {
+				hinternal();
+			}
+		}
+
 		func->end_blk = current_blk;
 
 		// Hackish way to make the splitting work as expected: we fast-forward
@@ -865,7 +786,7 @@ block *block_graph_create(void) {
 		// Now let's compute block lengths, as well as the source block
 		for (current_blk = func->begin_blk; current_blk != func->end_blk->next; current_blk = current_blk->next) {
 
-			if (ll_empty(&current_blk->in)) {
+			if (sv_empty(&current_blk->in)) {
 				block_edge *edge;
 
 				edge = malloc(sizeof(block_edge));
@@ -874,7 +795,7 @@ block *block_graph_create(void) {
 				edge->from = NULL;
 				edge->to = current_blk;
 
-				ll_push(&(current_blk->in), edge);
+				sv_push(&(current_blk->in), edge);
 
 				func->source = current_blk;
 			}
@@ -899,12 +820,14 @@ block *block_graph_create(void) {
 			.post_func = block_graph_complete_post
 		};
 
-		block_graph_visit(func->source->in.first->elem, &loop_visit);
+		block_graph_visit(sv_first(&func->source->in), &loop_visit);
 	}
 
+	block_index_freeze();
+
 	if (config.verbose > 6) {
-		block_tree_dump("treedump.txt", "a+");
-		block_graph_dump(PROGRAM(v_code)[PROGRAM(version)], "graphdump.txt", "a+");
+		block_index_dump("treedump.txt", "a+");
+		block_graph_dump(PROGRAM(v_code)[CURRENT(id)], "graphdump.txt", "a+");
 	}
 
 	return blocks;
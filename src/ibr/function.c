@@ -27,6 +27,7 @@
 
 #include <string.h>
 #include <strings.h>
+#include <stdint.h>
 
 #include <hijacker.h>
 #include <prints.h>
@@ -45,24 +46,283 @@
  */
 function *find_func_from_instr(insn_info *target, insn_address_type type) {
 	function *func;
-	insn_info *instr;
+	insn_info *instr, *head;
+	ht_node *node;
+
+	// Instructions of a function are chained from its first one, so the
+	// chain is walked back to its head, which is looked up in the cache.
+	// While a batch of insertions is open, the functions of the instructions
+	// looked up are remembered as well and the walk stops at the first one
+	for (head = target; head; head = head->prev) {
+		if (CURRENT(insn_batch_active)) {
+			ht_foreach(&CURRENT(insn_batch_funcs), hash_pointer(head), node) {
+				func = node->elem;
+
+				if (head != target) {
+					ht_insert(&CURRENT(insn_batch_funcs), hash_pointer(target), func);
+				}
 
-	for (func = PROGRAM(v_code)[PROGRAM(version)]; func; func = func->next) {
-		for (instr = func->begin_insn; instr; instr = instr->next) {
-			if (instr == target) {
 				return func;
 			}
 		}
+
+		if (head->prev == NULL) {
+			break;
+		}
 	}
 
-	return NULL;
+	func = NULL;
+
+	if (head != NULL) {
+		ht_foreach(&CURRENT(functions_by_insn), hash_pointer(head), node) {
+			if (((function *) node->elem)->begin_insn == head
+			    && ((function *) node->elem)->symbol->version == (int) CURRENT(id)) {
+				func = node->elem;
+				break;
+			}
+		}
+	}
+
+	if (func == NULL) {
+		for (func = PROGRAM(v_code)[CURRENT(id)]; func; func = func->next) {
+			for (instr = func->begin_insn; instr; instr = instr->next) {
+				if (instr == target) {
+					break;
+				}
+			}
+
+			if (instr != NULL) {
+				ht_insert(&CURRENT(functions_by_insn), hash_pointer(func->begin_insn), func);
+				break;
+			}
+		}
+	}
+
+	// Only instructions which belong to the chain of their function
+	// are remembered, i.e. not the ones preceding its first instruction
+	if (func != NULL && CURRENT(insn_batch_active) && func->begin_insn == head) {
+		ht_insert(&CURRENT(insn_batch_funcs), hash_pointer(target), func);
+	}
+
+	return func;
+}
+
+
+typedef struct {
+	function *func;
+	size_t position;
+} function_index_entry;
+
+
+static int function_index_compare(const void *a, const void *b) {
+	const function_index_entry *x = a, *y = b;
+
+	if (x->func->symbol->sec != y->func->symbol->sec) {
+		return (uintptr_t) x->func->symbol->sec < (uintptr_t) y->func->symbol->sec ? -1 : 1;
+	}
+
+	if (x->func->begin_insn->orig_addr != y->func->begin_insn->orig_addr) {
+		return x->func->begin_insn->orig_addr < y->func->begin_insn->orig_addr ? -1 : 1;
+	}
+
+	return x->position < y->position ? -1 : (x->position > y->position);
+}
+
+
+/**
+ * Builds the index by address of the functions in the current version.
+ * The index is a snapshot: it must be dropped before functions are added
+ * or resized, and it is meant to speed up phases which look up many
+ * addresses without changing the code, such as the resolution of the
+ * relocations and of the jumps.
+ */
+void function_index_build(void) {
+	function_index *index;
+	function_index_entry *entries;
+	function *func;
+	unsigned long long end;
+	size_t i, count;
+
+	function_index_drop();
+
+	index = &CURRENT(functions_by_addr);
+
+	for (count = 0, func = PROGRAM(v_code)[CURRENT(id)]; func; func = func->next) {
+		count++;
+	}
+
+	entries = malloc(sizeof(function_index_entry) * (count + 1));
+	index->entry = malloc(sizeof(function *) * (count + 1));
+	index->reach = malloc(sizeof(unsigned long long) * (count + 1));
+	index->position = malloc(sizeof(size_t) * (count + 1));
+	if (!entries || !index->entry || !index->reach || !index->position) {
+		herror(true, "Out of memory!\n");
+	}
+
+	for (i = 0, func = PROGRAM(v_code)[CURRENT(id)]; func; i++, func = func->next) {
+		entries[i].func = func;
+		entries[i].position = i;
+	}
+
+	qsort(entries, count, sizeof(function_index_entry), function_index_compare);
+
+	for (i = 0; i < count; i++) {
+		func = entries[i].func;
+		end = func->begin_insn->orig_addr + func->symbol->size;
+
+		index->entry[i] = func;
+		index->position[i] = entries[i].position;
+
+		// Functions may overlap, so each entry keeps track of the farthest
+		// address reached by the functions before it in the same section
+		if (i > 0 && index->entry[i - 1]->symbol->sec == func->symbol->sec && index->reach[i - 1] > end) {
+			end = index->reach[i - 1];
+		}
+		index->reach[i] = end;
+	}
+
+	free(entries);
+
+	index->size = count;
+	index->version = CURRENT(id);
+}
+
+
+void function_index_drop(void) {
+	function_index *index;
+
+	index = &CURRENT(functions_by_addr);
+
+	free(index->entry);
+	free(index->reach);
+	free(index->position);
+
+	index->entry = NULL;
+	index->reach = NULL;
+	index->position = NULL;
+	index->size = 0;
+	index->version = -1;
+}
+
+
+/**
+ * Looks for the functions of a section containing an address in the index.
+ *
+ * @param lo First entry of the section
+ * @param hi Entry past the last one of the section
+ * @param addr Address to look for
+ *
+ * @return Entry of the function which comes first in the list of functions,
+ * or <em>hi</em> if none contains the address
+ */
+static size_t function_index_seek(size_t lo, size_t hi, unsigned long long addr) {
+	function_index *index;
+	size_t first, last, mid, i, best;
+
+	index = &CURRENT(functions_by_addr);
+
+	// Functions beginning after the address are not candidates
+	first = lo;
+	last = hi;
+	while (first < last) {
+		mid = first + (last - first) / 2;
+		if (index->entry[mid]->begin_insn->orig_addr <= addr) {
+			first = mid + 1;
+		} else {
+			last = mid;
+		}
+	}
+	hi = first;
+
+	// The first candidate is where the reach goes past the address
+	first = lo;
+	last = hi;
+	while (first < last) {
+		mid = first + (last - first) / 2;
+		if (index->reach[mid] <= addr) {
+			first = mid + 1;
+		} else {
+			last = mid;
+		}
+	}
+
+	best = hi;
+
+	for (i = first; i < hi; i++) {
+		if (index->entry[i]->begin_insn->orig_addr + index->entry[i]->symbol->size > addr
+		    && (best == hi || index->position[i] < index->position[best])) {
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+
+/**
+ * Finds the range of the index holding the functions of a section.
+ *
+ * @param sec Pointer to the section descriptor
+ * @param lo Set to the first entry of the section
+ * @param hi Set to the entry past the last one of the section
+ */
+static void function_index_section(section *sec, size_t *lo, size_t *hi) {
+	function_index *index;
+	size_t first, last, mid;
+
+	index = &CURRENT(functions_by_addr);
+
+	first = 0;
+	last = index->size;
+	while (first < last) {
+		mid = first + (last - first) / 2;
+		if ((uintptr_t) index->entry[mid]->symbol->sec < (uintptr_t) sec) {
+			first = mid + 1;
+		} else {
+			last = mid;
+		}
+	}
+	*lo = first;
+
+	last = index->size;
+	while (first < last) {
+		mid = first + (last - first) / 2;
+		if ((uintptr_t) index->entry[mid]->symbol->sec <= (uintptr_t) sec) {
+			first = mid + 1;
+		} else {
+			last = mid;
+		}
+	}
+	*hi = first;
 }
 
 
 function *find_func_from_addr(unsigned long long addr) {
 	function *func;
+	function_index *index;
+	size_t lo, hi, i, best;
+
+	index = &CURRENT(functions_by_addr);
+
+	if (index->entry != NULL && index->version == (int) CURRENT(id)) {
+		// Each section is searched, the function coming first in the list wins
+		func = NULL;
+		best = 0;
+
+		for (lo = 0; lo < index->size; lo = hi) {
+			function_index_section(index->entry[lo]->symbol->sec, &lo, &hi);
+
+			i = function_index_seek(lo, hi, addr);
+			if (i < hi && (func == NULL || index->position[i] < best)) {
+				func = index->entry[i];
+				best = index->position[i];
+			}
+		}
 
-	for (func = PROGRAM(v_code)[PROGRAM(version)]; func; func = func->next) {
+		return func;
+	}
+
+	for (func = PROGRAM(v_code)[CURRENT(id)]; func; func = func->next) {
 		if (func->begin_insn->orig_addr <= addr
 		 && func->begin_insn->orig_addr + func->symbol->size > addr) {
 			return func;
@@ -75,8 +335,20 @@ function *find_func_from_addr(unsigned long long addr) {
 
 function *find_func_cool(section *sec, unsigned long long addr) {
 	function *func;
+	function_index *index;
+	size_t lo, hi, i;
+
+	index = &CURRENT(functions_by_addr);
+
+	if (index->entry != NULL && index->version == (int) CURRENT(id)) {
+		function_index_section(sec, &lo, &hi);
+
+		i = function_index_seek(lo, hi, addr);
 
-	for (func = PROGRAM(v_code)[PROGRAM(version)]; func; func = func->next) {
+		return i < hi ? index->entry[i] : NULL;
+	}
+
+	for (func = PROGRAM(v_code)[CURRENT(id)]; func; func = func->next) {
 		if (func->symbol->sec == sec && func->begin_insn->orig_addr <= addr
 		 && func->begin_insn->orig_addr + func->symbol->size > addr) {
 			return func;
@@ -127,7 +399,7 @@ function *function_create_from_insn(char *name, insn_info *code, section *sec) {
 
 	// sec->sym->size += size;
 
-	for (prev = NULL, curr = PROGRAM(v_code)[PROGRAM(version)]; curr;
+	for (prev = NULL, curr = PROGRAM(v_code)[CURRENT(id)]; curr;
 		prev = curr, curr = curr->next) {
 		// if (prev && prev->symbol->sec == sec && curr->symbol->sec != sec) {
 		// 	break;
@@ -155,7 +427,7 @@ function *function_create_from_bytes(char *name, unsigned char *code, size_t siz
 	function *func;
 	unsigned long pos;
 
-	first = calloc(sizeof(insn_info), 1);
+	first = ibr_alloc(sizeof(insn_info));
 	insn = first;
 	pos = 0;
 
@@ -167,7 +439,7 @@ function *function_create_from_bytes(char *name, unsigned char *code, size_t siz
 		insn->orig_addr += pos;
 		insn->new_addr += pos;
 
-		insn->next = calloc(sizeof(insn_info), 1);
+		insn->next = ibr_alloc(sizeof(insn_info));
 
 		insn->next->new_addr = insn->new_addr;
 		insn->next->orig_addr = insn->orig_addr;
@@ -187,10 +459,12 @@ function *function_create_from_bytes(char *name, unsigned char *code, size_t siz
  *
  * @param func Pointer to the function descriptor to clone.
  * @param suffix Buffer pointing to the suffix.
+ * @param opaque Whether the function is cloned as a single opaque instruction
+ * carrying the bytes of all its instructions, rather than one by one.
  *
  * @return Pointer to the clone function descriptor.
  */
-function * clone_function (function *func, char *suffix) {
+function * clone_function (function *func, char *suffix, bool opaque) {
 	function *clone;
 	char *name;
 
@@ -205,13 +479,19 @@ function * clone_function (function *func, char *suffix) {
 	memcpy(clone, func, sizeof(function));
 
 	// Updates the pointer to instruction list
-	clone->begin_insn = clone_instruction_list(func->begin_insn);
+	if (opaque && !func->begin_insn->opaque) {
+		clone->begin_insn = clone_instruction_opaque(func->begin_insn);
+		clone->end_insn = clone->begin_insn;
+	} else {
+		clone->begin_insn = clone_instruction_list(func->begin_insn);
+	}
 
 	// Reset some fields
 	clone->begin_blk = clone->end_blk = clone->source = NULL;
 	clone->calledfrom.first = clone->calledfrom.last = NULL;
 	clone->callto.first = clone->callto.last = NULL;
 	clone->alias.first = clone->alias.last = NULL;
+	clone->red_zone = RED_ZONE_UNKNOWN;
 
 	// Compose the function name
 	name = add_suffix(func->name, "_", suffix);
@@ -250,24 +530,180 @@ function * clone_function (function *func, char *suffix) {
 /**
  * Clone the whole function list of the internal representation. This is done
  * in order to support multi-versioning of executable and object files.
- * Cloning the function means to clone their instructions as well.
+ * Cloning the function means to clone their instructions as well, except for
+ * the functions that the new version will never write to: they are cloned as
+ * opaque instructions, which carry their bytes and relocations as they are.
+ *
+ * @param func Pointer to the first function descriptor of the list
+ * @param suffix Buffer pointing to the suffix
+ * @param written Tells whether the new version may write to a function
  *
  * @return Pointer to the first function descriptor of the clone list.
  */
-function *clone_function_list(function *func, char *suffix) {
+function *clone_function_list(function *func, char *suffix, bool (*written)(function *func)) {
 	function *clone, *head;
 
 	if(func == NULL)
 		return NULL;
 
-	head = clone = clone_function(func, suffix);
+	head = clone = clone_function(func, suffix, !written(func));
 	func = func->next;
 
 	while(func != NULL) {
-		clone->next = clone_function(func, suffix);
+		clone->next = clone_function(func, suffix, !written(func));
 		clone = clone->next;
 		func = func->next;
 	}
 
 	return head;
 }
+
+
+/**
+ * Turns an instruction into an opaque one, standing for a whole function.
+ *
+ * @param opaque Pointer to the first instruction of the function
+ * @param bytes Bytes of all the instructions of the function
+ * @param size Number of bytes
+ */
+static void instruction_set_opaque(insn_info *opaque, unsigned char *bytes, size_t size) {
+	opaque->jumpto = NULL;
+	opaque->jumptable.size = 0;
+	opaque->jumptable.entry = NULL;
+
+	opaque->flags = opaque->i.x86.flags = 0;
+	opaque->size = opaque->i.x86.insn_size = size;
+	opaque->opcode_size = opaque->i.x86.opcode_size = 0;
+	strcpy(opaque->i.x86.mnemonic, "(opaque)");
+	opaque->opaque = bytes;
+
+	opaque->next = NULL;
+}
+
+
+/**
+ * Clones the instructions of a function into a single opaque instruction,
+ * which carries their bytes verbatim. Its parent is the first instruction
+ * of the function, whereas the relocations of all of them are left to be
+ * cloned by the caller.
+ *
+ * @param begin Pointer to the first instruction of the function
+ *
+ * @return Pointer to the opaque instruction
+ */
+insn_info *clone_instruction_opaque(insn_info *begin) {
+	insn_info *clone, *instr;
+	unsigned char *bytes;
+	size_t size;
+
+	size = 0;
+	for (instr = begin; instr; instr = instr->next) {
+		size += instr->size;
+	}
+
+	bytes = malloc(size);
+	if (bytes == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	size = 0;
+	for (instr = begin; instr; instr = instr->next) {
+		memcpy(bytes + size, instr->opaque ? instr->opaque : instr->i.x86.insn, instr->size);
+		size += instr->size;
+	}
+
+	clone = clone_instruction(begin);
+	clone->prev = NULL;
+
+	instruction_set_opaque(clone, bytes, size);
+
+	return clone;
+}
+
+
+/**
+ * Collapses the instructions of a function into a single opaque instruction,
+ * which carries their bytes verbatim. Relocations at or towards any of the
+ * instructions are moved to the opaque one, so that they keep on following
+ * the function when addresses are updated, and calls from other functions
+ * are relinked to it. Jumps never cross function boundaries, therefore the
+ * bytes need no fix when the rest of the code is moved around.
+ * The replaced instructions are marked by making the opaque instruction
+ * their virtual reference.
+ *
+ * @param func Pointer to the function descriptor
+ */
+void function_make_opaque(function *func) {
+	insn_info *opaque, *instr, *jump;
+	unsigned char *bytes;
+	size_t size;
+
+	small_vector targetof;
+	unsigned int idx;
+	symbol *rela;
+
+	opaque = func->begin_insn;
+
+	if (opaque->opaque || opaque->next == NULL) {
+		return;
+	}
+
+	size = 0;
+	for (instr = opaque; instr; instr = instr->next) {
+		size += instr->size;
+
+		if (instr != opaque) {
+			instr->virtual = opaque;
+		}
+	}
+
+	bytes = malloc(size);
+	if (bytes == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	size = 0;
+	bzero(&targetof, sizeof(targetof));
+
+	for (instr = opaque; instr; instr = instr->next) {
+		memcpy(bytes + size, instr->i.x86.insn, instr->size);
+		size += instr->size;
+
+		// Calls towards other functions are dropped from their targets
+		if (instr->jumpto && instr->jumpto != opaque && instr->jumpto->virtual != opaque) {
+			sv_remove(&instr->jumpto->targetof, instr);
+		}
+
+		// Calls from other functions are relinked to the opaque instruction
+		sv_foreach(&instr->targetof, idx, jump) {
+
+			if (jump != opaque && jump->virtual != opaque) {
+				jump->jumpto = opaque;
+				sv_push(&targetof, jump);
+			}
+		}
+
+		if (instr == opaque) {
+			continue;
+		}
+
+		while (!sv_empty(&instr->reference)) {
+			rela = sv_pop_first(&instr->reference);
+			rela->relocation.target_insn = opaque;
+			sv_push(&opaque->reference, rela);
+		}
+
+		while (!sv_empty(&instr->pointedby)) {
+			rela = sv_pop_first(&instr->pointedby);
+			rela->relocation.target_insn = opaque;
+			sv_push(&opaque->pointedby, rela);
+		}
+	}
+
+	sv_move(&targetof, &opaque->targetof);
+	instruction_set_opaque(opaque, bytes, size);
+
+	func->end_insn = opaque;
+
+	hnotice(4, "Function '%s' collapsed into an opaque instruction of %zu bytes\n", func->name, size);
+}
@@ -42,6 +42,10 @@ typedef struct _symbol symbol;
 typedef struct _reloc reloc;
 typedef struct _section section;
 
+// Instructions, blocks and symbols are carved out of the arena of the
+// version being instrumented, which is released along with the program
+#define ibr_alloc(size) arena_alloc(&PROGRAM(arenas)[CURRENT(id)], (size))
+
 /* Instructions */
 
 typedef enum {
@@ -57,7 +61,7 @@ typedef enum {
 
 
 #define instr_reference_weak(instr) \
-  ((instr)->reference.first ? (instr)->reference.first->elem : NULL)
+  sv_first(&(instr)->reference)
 
 
 struct _instruction {
@@ -82,14 +86,18 @@ struct _instruction {
 	} jumptable;
 
 	// [SE] Which instructions can reach the current one?
-	linked_list targetof;
+	small_vector targetof;
 
 	// [SE] The instruction that 'virtually' represents the current one
 	// as the target of a jump instruction.
 	struct _instruction *virtual;
 
-	linked_list reference;
-	linked_list pointedby;
+	// Raw bytes of an opaque instruction, which stands for a whole function
+	// that is not decoded any further (NULL for regular instructions)
+	unsigned char *opaque;
+
+	small_vector reference;
+	small_vector pointedby;
 
 	// struct _symbol *reference;
 	// struct _symbol *pointedby;
@@ -98,6 +106,11 @@ struct _instruction {
 	// Parent instruction in the previous IBR version
 	struct _instruction *parent;
 
+	// Registers holding a dead value before and after the instruction,
+	// which probes can clobber (see liveness.c)
+	unsigned long long dead_before;
+	unsigned long long dead_after;
+
 	struct _instruction *prev;  // Instructions are organized in a chain
 	struct _instruction *next;
 };
@@ -164,19 +177,24 @@ struct _block {
 
 	// Flowgraph-related fields
 	block_type type;          // The type of a block wrt control flow structures
-	linked_list out;          // Double-linked list of next blocks
-	linked_list in;           // Double-linked list of previous blocks
+	small_vector out;         // Edges to the next blocks
+	small_vector in;          // Edges from the previous blocks
 	bool visited;             // True if the block was already met in the current visit
 	bool active;              // True if the block is in the current path (only for DFS!)
-
-	// Tree-related fields
-	int balance;              // The balance factor of the AVL tree rooted at this block
-	unsigned int height;      // The height of the AVL tree rooted at this block
-	struct _block *left;      // Left child in the AVL tree
-	struct _block *right;     // Right child in the AVL tree
-	struct _block *parent;    // Parent block in the AVL tree
 };
 
+/**
+ * Blocks of a version sorted by the index of their first instruction. A split
+ * only puts the new block right after the old one, and the blocks are split
+ * in program order, so few entries are moved while the graph is built.
+ */
+typedef struct {
+	unsigned int *begin;          // Index of the first instruction of each block
+	block **entry;
+	size_t size;
+	size_t capacity;
+} block_index;
+
 
 /* Symbols */
 
@@ -239,6 +257,7 @@ struct _symbol {
 	} relocation;
 
 	int version;       /// Integer indicating to which instrumenting version it belongs
+	int builder;       /// Version which was being built when the symbol was created
 	bool duplicate;    /// Flag that tells if symbol is a duplicate
 	bool referenced;   /// Flag indicating the symbol has been referenced
 	bool authentic;
@@ -264,6 +283,17 @@ struct _reloc {
 
 /* Functions */
 
+/**
+ * How a function uses the red zone, i.e. the 128 bytes below the stack pointer
+ * which the System V ABI lets it use without moving the stack pointer.
+ */
+typedef enum {
+	RED_ZONE_UNKNOWN,        // Not analyzed yet
+	RED_ZONE_UNUSED,         // The stack below the stack pointer is never used
+	RED_ZONE_PROTECTED,      // Used through the frame pointer, but the stack pointer is now moved past it
+	RED_ZONE_USED            // Possibly used, so the inserted code must skip it
+} red_zone_usage;
+
 struct _function {
 	char   *name;
 
@@ -279,6 +309,8 @@ struct _function {
 	bool overload;
 	linked_list alias;		// A list of possible aliases of this function
 
+	red_zone_usage red_zone;	// Computed upon the first instrumentation of the function
+
 	insn_info   *begin_insn;
 	insn_info   *end_insn;
 	symbol      *symbol;  // [DC] Added reference to the relative symbol
@@ -286,6 +318,68 @@ struct _function {
 	struct _function *next;
 };
 
+/**
+ * Index of a chain of instructions, sorted by address. Indexes are built
+ * lazily upon the first lookup in a chain, and are only kept while the
+ * instructions neither move nor change.
+ */
+typedef struct _insn_index {
+	insn_info *head;              // First instruction of the chain
+	size_t count;
+	insn_info **by_orig;          // Instructions sorted by original address
+	unsigned long long *reach;    // Highest end address up to each entry
+	size_t *position;             // Position of each entry in the chain
+	insn_info **by_new;           // Instructions sorted by new address, built lazily
+
+	struct _insn_index *next;
+} insn_index;
+
+/**
+ * Summary of the memory operand of an instruction, packed so that the passes
+ * filtering accesses by their addressing mode do not touch the descriptors.
+ */
+typedef struct {
+	unsigned char base;           // Base register, or INSN_NO_REGISTER
+	unsigned char index;          // Index register, or INSN_NO_REGISTER
+	unsigned char scale;
+	unsigned short span;          // Bytes read or written, saturated
+} insn_operand;
+
+#define INSN_NO_REGISTER	0xff
+
+/**
+ * Columnar copy of the fields of the instructions of a version which the
+ * filtering passes read, so that they scan contiguous arrays rather than
+ * following the chains. Entries are laid out in the order of the chains,
+ * function after function, and the copy is stale as soon as an instruction
+ * is inserted or substituted.
+ */
+typedef struct {
+	insn_info **insn;             // Descriptor of each entry
+	unsigned long *flags;
+	unsigned int *size;
+	unsigned long long *orig_addr;
+	unsigned long long *new_addr;
+	insn_operand *operand;
+	size_t count;
+	size_t *function_begin;       // First entry of each function, then the count of the entries
+	bool indexed;                 // Whether each instruction sits at the entry of its index
+	unsigned long changes;        // Changes to the chains when the copy was made
+} insn_columns;
+
+/**
+ * Snapshot of the functions of a version, sorted by section and address,
+ * which speeds up the lookups by address as long as neither the functions
+ * nor their sizes change.
+ */
+typedef struct {
+	function **entry;             // Functions sorted by section and original address
+	unsigned long long *reach;    // Highest end address up to each entry, within its section
+	size_t *position;             // Position of each entry in the list of functions
+	size_t size;
+	int version;                  // Version the functions belong to, -1 if not built
+} function_index;
+
 #define functions_overlap(a, b)\
 	(a && b && a->symbol->sec == b->symbol->sec\
 		&& a->begin_insn->new_addr == b->begin_insn->new_addr)
@@ -328,11 +422,20 @@ struct _section {
 
 insn_info *find_insn(function *func, unsigned long long addr, insn_address_type type);
 insn_info *find_insn_cool(insn_info *head, unsigned long long addr);
+void insn_index_begin(void);
+void insn_index_end(void);
+insn_columns *insn_columns_build(void);
+insn_columns *insn_columns_get(void);
+void insn_columns_drop(void);
+void insn_batch_begin(void);
+void insn_batch_commit(void);
 insn_info *find_last_insn(function *functions);
 void parse_instruction_bytes(unsigned char *bytes, unsigned long int *pos, insn_info **final);
 int insert_instructions_at(insn_info *target, unsigned char *binary, size_t size,
 	insn_insert_mode mode, insn_info **last);
 int substitute_instruction_with(insn_info *target, unsigned char *binary, size_t size);
+int insert_instruction_clones_at(insn_info *target, insn_info *model,
+	insn_insert_mode mode, insn_info **last);
 insn_info *clone_instruction(insn_info *insn);
 insn_info *clone_instruction_list(insn_info *insn);
 void add_call_instruction(insn_info *target, char *func, insn_insert_mode mode, insn_info **instr);
@@ -349,6 +452,9 @@ void set_call_displacement(insn_info *jump, insn_info *target);
 
 symbol *find_symbol(size_t index);
 symbol *find_symbol_by_name(char *name);
+void symbol_index_reset(void);
+void symbol_rename(symbol *sym, char *name);
+void symbol_remove(symbol *sym);
 symbol *create_symbol_node(char *name, symbol_type type, symbol_bind bind, int size);
 symbol *symbol_create(char *name, symbol_type type, symbol_bind bind,
 	section *sec, size_t size);
@@ -361,6 +467,8 @@ symbol *symbol_rela_create(symbol *sym, reloc_type type,
 	unsigned long long offset, long addend, section *sec);
 symbol *symbol_rela_create_from_ELF(reloc *rel);
 symbol *symbol_instr_rela_create(symbol *sym, insn_info *insn, reloc_type type);
+void symbol_versions_begin(unsigned int first, unsigned int count);
+void symbol_versions_end(unsigned int first, unsigned int count);
 symbol *symbol_rela_clone(symbol *sym);
 
 /* function.c */
@@ -368,10 +476,14 @@ symbol *symbol_rela_clone(symbol *sym);
 function *find_func_cool(section *sec, unsigned long long addr);
 function *find_func_from_instr(insn_info *instr, insn_address_type type);
 function *find_func_from_addr(unsigned long long addr);
+void function_index_build(void);
+void function_index_drop(void);
 function *function_create_from_insn(char *name, insn_info *code, section *sec);
 function *function_create_from_bytes(char *name, unsigned char *code, size_t size, section *sec);
-function *clone_function(function *func, char *suffix);
-function *clone_function_list(function *func, char *suffix);
+function *clone_function(function *func, char *suffix, bool opaque);
+function *clone_function_list(function *func, char *suffix, bool (*written)(function *func));
+insn_info *clone_instruction_opaque(insn_info *begin);
+void function_make_opaque(function *func);
 // function *clone_function_descriptor(function *original, char *name);
 
 /* section.c */
@@ -390,10 +502,15 @@ block *block_create(void);
 block *block_split(block *node, insn_info *breakpoint, block_split_mode mode);
 block *block_find(insn_info *instr);
 void block_link(block *from, block *to, block_edge_type type);
-void block_tree_dump(char *filename, char *mode);
+void block_index_dump(char *filename, char *mode);
 void block_graph_dump(function *func, char *filename, char *mode);
 block *block_graph_create(void);
 void block_graph_visit(block_edge *edge, graph_visit *visit);
 
+/* liveness.c */
+
+void liveness_compute(block *blocks);
+unsigned long long insn_dead_registers(insn_info *instr, insn_insert_mode mode);
+
 
 #endif /* _IBR_H */
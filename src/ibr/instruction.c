@@ -30,6 +30,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <limits.h>
 
 #include <hijacker.h>
 #include <prints.h>
@@ -41,8 +42,382 @@
 
 
 #define MAX_LOOKBEHIND		10 // [SE] Used while reverse-parsing instruction to resolve jump tables
+#define INSN_INDEX_MIN_CHAIN	16 // Chains shorter than this are scanned rather than indexed
 
 
+typedef struct {
+	insn_info *instr;
+	unsigned long long addr;
+	size_t position;
+} insn_index_entry;
+
+
+static int insn_index_compare(const void *a, const void *b) {
+	const insn_index_entry *x = a, *y = b;
+
+	if (x->addr != y->addr) {
+		return x->addr < y->addr ? -1 : 1;
+	}
+
+	return x->position < y->position ? -1 : (x->position > y->position);
+}
+
+
+/**
+ * Sorts the instructions of an indexed chain by either address, breaking
+ * ties with their position in the chain.
+ *
+ * @param index Pointer to the index of the chain
+ * @param type Which address the instructions are sorted by
+ * @param position If not NULL, filled with the positions of the sorted entries
+ *
+ * @return Array of the sorted instructions
+ */
+static insn_info **insn_index_sort(insn_index *index, insn_address_type type, size_t *position) {
+	insn_index_entry *entries;
+	insn_info **sorted;
+	insn_info *instr;
+	size_t i;
+
+	entries = malloc(sizeof(insn_index_entry) * index->count);
+	sorted = malloc(sizeof(insn_info *) * index->count);
+	if (!entries || !sorted) {
+		herror(true, "Out of memory!\n");
+	}
+
+	for (i = 0, instr = index->head; instr; i++, instr = instr->next) {
+		entries[i].instr = instr;
+		entries[i].addr = type == ORIG_ADDR ? instr->orig_addr : instr->new_addr;
+		entries[i].position = i;
+	}
+
+	qsort(entries, index->count, sizeof(insn_index_entry), insn_index_compare);
+
+	for (i = 0; i < index->count; i++) {
+		sorted[i] = entries[i].instr;
+
+		if (position) {
+			position[i] = entries[i].position;
+		}
+	}
+
+	free(entries);
+
+	return sorted;
+}
+
+
+/**
+ * Retrieves the index of a chain of instructions, building it if needed.
+ *
+ * @param head First instruction of the chain
+ *
+ * @return Pointer to the index, or NULL if the chain should rather be scanned
+ */
+static insn_index *insn_index_get(insn_info *head) {
+	insn_index *index;
+	insn_info *instr;
+	ht_node *node;
+	size_t count, i;
+
+	if (!CURRENT(insn_index_active) || head == NULL || head->prev != NULL) {
+		return NULL;
+	}
+
+	ht_foreach(&CURRENT(insns_by_head), hash_pointer(head), node) {
+		return node->elem;
+	}
+
+	for (count = 0, instr = head; instr; instr = instr->next) {
+		count++;
+	}
+
+	if (count < INSN_INDEX_MIN_CHAIN) {
+		return NULL;
+	}
+
+	index = calloc(sizeof(insn_index), 1);
+	if (!index) {
+		herror(true, "Out of memory!\n");
+	}
+
+	index->head = head;
+	index->count = count;
+
+	index->reach = malloc(sizeof(unsigned long long) * count);
+	index->position = malloc(sizeof(size_t) * count);
+	if (!index->reach || !index->position) {
+		herror(true, "Out of memory!\n");
+	}
+
+	index->by_orig = insn_index_sort(index, ORIG_ADDR, index->position);
+
+	// Instructions may overlap in the original layout (e.g. the ones added
+	// by the instrumentation), so each entry keeps track of the farthest
+	// address reached by the instructions before it
+	for (i = 0; i < count; i++) {
+		index->reach[i] = index->by_orig[i]->orig_addr + index->by_orig[i]->size;
+
+		if (i > 0 && index->reach[i - 1] > index->reach[i]) {
+			index->reach[i] = index->reach[i - 1];
+		}
+	}
+
+	ht_insert(&CURRENT(insns_by_head), hash_pointer(head), index);
+
+	index->next = CURRENT(insn_indexes);
+	CURRENT(insn_indexes) = index;
+
+	return index;
+}
+
+
+/**
+ * Looks for the first instruction in a chain which lies at an address.
+ *
+ * @param index Pointer to the index of the chain
+ * @param addr Address of the instruction
+ * @param type Which address the instruction is looked up by
+ *
+ * @return Pointer to the instruction, or NULL if there is none
+ */
+static insn_info *insn_index_exact(insn_index *index, unsigned long long addr, insn_address_type type) {
+	insn_info **entry;
+	size_t first, last, mid;
+
+	if (type == ORIG_ADDR) {
+		entry = index->by_orig;
+	} else {
+		if (index->by_new == NULL) {
+			index->by_new = insn_index_sort(index, NEW_ADDR, NULL);
+		}
+		entry = index->by_new;
+	}
+
+	first = 0;
+	last = index->count;
+	while (first < last) {
+		mid = first + (last - first) / 2;
+		if ((type == ORIG_ADDR ? entry[mid]->orig_addr : entry[mid]->new_addr) < addr) {
+			first = mid + 1;
+		} else {
+			last = mid;
+		}
+	}
+
+	if (first < index->count
+	    && (type == ORIG_ADDR ? entry[first]->orig_addr : entry[first]->new_addr) == addr) {
+		return entry[first];
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Looks for the first instruction in a chain whose original bytes span
+ * an address.
+ *
+ * @param index Pointer to the index of the chain
+ * @param addr Address to look for
+ *
+ * @return Pointer to the instruction, or NULL if there is none
+ */
+static insn_info *insn_index_span(insn_index *index, unsigned long long addr) {
+	size_t first, last, mid, hi, i, best;
+
+	// Instructions beginning after the address are not candidates
+	first = 0;
+	last = index->count;
+	while (first < last) {
+		mid = first + (last - first) / 2;
+		if (index->by_orig[mid]->orig_addr <= addr) {
+			first = mid + 1;
+		} else {
+			last = mid;
+		}
+	}
+	hi = first;
+
+	// The first candidate is where the reach goes past the address
+	first = 0;
+	last = hi;
+	while (first < last) {
+		mid = first + (last - first) / 2;
+		if (index->reach[mid] <= addr) {
+			first = mid + 1;
+		} else {
+			last = mid;
+		}
+	}
+
+	best = hi;
+
+	for (i = first; i < hi; i++) {
+		if (index->by_orig[i]->orig_addr + index->by_orig[i]->size > addr
+		    && (best == hi || index->position[i] < index->position[best])) {
+			best = i;
+		}
+	}
+
+	return best < hi ? index->by_orig[best] : NULL;
+}
+
+
+/**
+ * Starts indexing the chains of instructions upon lookup. This speeds up
+ * the phases which look up many instructions by address, as long as no
+ * instruction is added, removed or moved until <em>insn_index_end</em>.
+ */
+void insn_index_begin(void) {
+	insn_index_end();
+
+	CURRENT(insn_index_active) = true;
+}
+
+
+/**
+ * Stops indexing the chains of instructions and releases the indexes.
+ */
+void insn_index_end(void) {
+	insn_index *index;
+
+	while (CURRENT(insn_indexes)) {
+		index = CURRENT(insn_indexes);
+		CURRENT(insn_indexes) = index->next;
+
+		free(index->by_orig);
+		free(index->by_new);
+		free(index->reach);
+		free(index->position);
+		free(index);
+	}
+
+	ht_clear(&CURRENT(insns_by_head));
+
+	CURRENT(insn_index_active) = false;
+}
+
+
+/**
+ * Makes a columnar copy of the instructions of the current version, which
+ * replaces the previous one. Passes which filter many instructions by their
+ * flags or operands scan the copy, and only follow the pointers to the
+ * descriptors of the instructions they select.
+ *
+ * @return Pointer to the copy, which stays valid until an instruction is
+ * inserted or substituted (see <em>insn_columns_get</em>)
+ */
+insn_columns *insn_columns_build(void) {
+	insn_columns *table;
+	insn_operand *operand;
+	insn_info_x86 *x86;
+	insn_info *instr;
+	function *func;
+	size_t count, functions;
+
+	insn_columns_drop();
+
+	table = &CURRENT(columns);
+
+	for (count = 0, functions = 0, func = CODE; func; func = func->next, functions++) {
+		for (instr = func->begin_insn; instr; instr = instr->next) {
+			count++;
+		}
+	}
+
+	table->insn = malloc(sizeof(insn_info *) * (count + 1));
+	table->flags = malloc(sizeof(unsigned long) * (count + 1));
+	table->size = malloc(sizeof(unsigned int) * (count + 1));
+	table->orig_addr = malloc(sizeof(unsigned long long) * (count + 1));
+	table->new_addr = malloc(sizeof(unsigned long long) * (count + 1));
+	table->operand = calloc(sizeof(insn_operand), count + 1);
+	table->function_begin = malloc(sizeof(size_t) * (functions + 1));
+	if (!table->insn || !table->flags || !table->size || !table->orig_addr
+	    || !table->new_addr || !table->operand || !table->function_begin) {
+		herror(true, "Out of memory!\n");
+	}
+
+	table->indexed = true;
+
+	for (count = 0, functions = 0, func = CODE; func; func = func->next, functions++) {
+		table->function_begin[functions] = count;
+
+		for (instr = func->begin_insn; instr; instr = instr->next, count++) {
+			table->insn[count] = instr;
+			table->flags[count] = instr->flags;
+			table->size[count] = instr->size;
+			table->orig_addr[count] = instr->orig_addr;
+			table->new_addr[count] = instr->new_addr;
+
+			// Instructions added after the jumps were linked are not numbered
+			if (instr->index != count) {
+				table->indexed = false;
+			}
+
+			operand = &table->operand[count];
+
+			switch (PROGRAM(insn_set)) {
+				case X86_INSN:
+					x86 = &instr->i.x86;
+					operand->base = x86->has_base_register ? x86->breg : INSN_NO_REGISTER;
+					operand->index = x86->has_index_register ? x86->ireg : INSN_NO_REGISTER;
+					operand->scale = x86->has_scale ? x86->scale : 1;
+					operand->span = x86->span < USHRT_MAX ? x86->span : USHRT_MAX;
+					break;
+			}
+		}
+	}
+
+	table->function_begin[functions] = count;
+	table->count = count;
+	table->changes = CURRENT(insn_changes);
+
+	hnotice(4, "Columnar copy of %zu instructions made (%s)\n",
+		count, table->indexed ? "indexed" : "not indexed");
+
+	return table;
+}
+
+
+/**
+ * Retrieves the columnar copy of the instructions of the current version.
+ *
+ * @return Pointer to the copy, or <em>NULL</em> if it has not been made or
+ * the chains have changed since then
+ */
+insn_columns *insn_columns_get(void) {
+	insn_columns *table;
+
+	table = &CURRENT(columns);
+
+	if (table->insn == NULL || table->changes != CURRENT(insn_changes)) {
+		return NULL;
+	}
+
+	return table;
+}
+
+
+/**
+ * Releases the columnar copy of the instructions of the current version.
+ */
+void insn_columns_drop(void) {
+	insn_columns *table;
+
+	table = &CURRENT(columns);
+
+	free(table->insn);
+	free(table->flags);
+	free(table->size);
+	free(table->orig_addr);
+	free(table->new_addr);
+	free(table->operand);
+	free(table->function_begin);
+
+	bzero(table, sizeof(insn_columns));
+}
+
 
 /**
  * Seeks the instruction descriptor associated with a given instruction address
@@ -61,9 +436,10 @@
 // [SE] This should be name `find_insn_from_func`
 insn_info *find_insn(function *func, unsigned long long addr, insn_address_type type) {
 	insn_info *instr;
+	insn_index *index;
 
 	if (!func) {
-		func = PROGRAM(code);
+		func = CODE;
 	}
 
 	while (func) {
@@ -79,6 +455,19 @@ insn_info *find_insn(function *func, unsigned long long addr, insn_address_type
 			}
 		}
 
+		index = insn_index_get(func->begin_insn);
+
+		if (index) {
+			instr = insn_index_exact(index, addr, type);
+
+			if (instr) {
+				return instr;
+			}
+
+			func = func->next;
+			continue;
+		}
+
 		instr = func->begin_insn;
 		while(instr) {
 			if (instr->orig_addr == addr && type == ORIG_ADDR) {
@@ -100,6 +489,13 @@ insn_info *find_insn(function *func, unsigned long long addr, insn_address_type
 // [SE] This should be named `find_insn`
 insn_info *find_insn_cool(insn_info *head, unsigned long long addr) {
 	insn_info *instr;
+	insn_index *index;
+
+	index = insn_index_get(head);
+
+	if (index) {
+		return insn_index_span(index, addr);
+	}
 
 	for (instr = head; instr; instr = instr->next) {
 		if (instr->orig_addr <= addr
@@ -188,6 +584,137 @@ void parse_instruction_bytes(unsigned char *bytes, unsigned long int *pos, insn_
 }
 
 
+/**
+ * A piece of code decoded while a batch of insertions is open.
+ */
+typedef struct {
+	unsigned char *binary;
+	size_t size;
+	insn_info *model;             // Chain of the decoded instructions
+} insn_batch_entry;
+
+
+/**
+ * Returns the chain of instructions decoded from a buffer of bytes, which
+ * is decoded only the first time the same bytes are inserted in a batch.
+ *
+ * @param binary Pointer to the buffer of bytes
+ * @param size Length of the buffer
+ *
+ * @return Pointer to the first descriptor of the decoded chain
+ */
+static insn_info *insn_batch_decode(unsigned char *binary, size_t size) {
+	insn_batch_entry *entry;
+	insn_info *instr, *prev;
+	unsigned long int pos;
+	unsigned long long key;
+	ht_node *node;
+
+	key = hash_bytes(binary, size, HASH_FNV_OFFSET);
+
+	ht_foreach(&CURRENT(insn_batch_code), key, node) {
+		entry = node->elem;
+
+		if (entry->size == size && memcmp(entry->binary, binary, size) == 0) {
+			return entry->model;
+		}
+	}
+
+	entry = calloc(sizeof(insn_batch_entry), 1);
+	if (entry == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	entry->binary = malloc(size);
+	if (entry->binary == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	memcpy(entry->binary, binary, size);
+	entry->size = size;
+
+	pos = 0;
+	prev = NULL;
+
+	while (pos < size) {
+		instr = calloc(sizeof(insn_info), 1);
+		if (instr == NULL) {
+			herror(true, "Out of memory!\n");
+		}
+
+		parse_instruction_bytes(binary, &pos, &instr);
+
+		if (prev == NULL) {
+			entry->model = instr;
+		} else {
+			prev->next = instr;
+			instr->prev = prev;
+		}
+
+		prev = instr;
+	}
+
+	ht_insert(&CURRENT(insn_batch_code), key, entry);
+
+	return entry->model;
+}
+
+
+/**
+ * Opens a batch of insertions. Until the batch is committed, the code which
+ * is inserted more than once is decoded only once, and the functions of the
+ * instructions are remembered, so that the many insertions of the rules and
+ * the presets do not cost a walk of the program each.
+ * Instructions must not be removed from the chains while the batch is open.
+ */
+void insn_batch_begin(void) {
+	insn_batch_commit();
+
+	CURRENT(insn_batch_active) = true;
+}
+
+
+/**
+ * Commits the insertions of the open batch, if any: the addresses of the
+ * instructions of the current version are laid out once, along with the
+ * offsets of their relocations and the sizes of the function symbols.
+ */
+void insn_batch_commit(void) {
+	insn_batch_entry *entry;
+	insn_info *instr;
+	ht_node *node;
+	size_t i;
+
+	if (!CURRENT(insn_batch_active)) {
+		return;
+	}
+
+	// Only clones of the decoded code have been inserted, hence the
+	// decoded instructions are released along with the batch
+	for (i = 0; i < CURRENT(insn_batch_code).size; i++) {
+		for (node = CURRENT(insn_batch_code).buckets[i]; node; node = node->next) {
+			entry = node->elem;
+
+			while (entry->model) {
+				instr = entry->model;
+				entry->model = instr->next;
+				free(instr);
+			}
+
+			free(entry->binary);
+			free(entry);
+		}
+	}
+
+	ht_clear(&CURRENT(insn_batch_code));
+	ht_clear(&CURRENT(insn_batch_funcs));
+
+	CURRENT(insn_batch_active) = false;
+
+	update_instruction_addresses(CURRENT(id));
+}
+
+
 /**
  * Links a newly created instruction descriptor to the intermediate representation,
  * before or after another descriptor.
@@ -200,6 +727,8 @@ void parse_instruction_bytes(unsigned char *bytes, unsigned long int *pos, insn_
  */
 static inline void insert_insn_at(insn_info *target, insn_info *instr, insn_insert_mode mode) {
 
+	CURRENT(insn_changes)++;
+
 	if (mode == INSERT_BEFORE) {
 		instr->next = target;
 		instr->prev = target->prev;
@@ -250,6 +779,11 @@ int insert_instructions_at(insn_info *target, unsigned char *binary, size_t size
 		size, mode == INSERT_BEFORE ? "before" : "after", target->orig_addr);
 	hdump(5, "Binary", binary, size);
 
+	// Within a batch, the same code is decoded only once and then cloned
+	if (CURRENT(insn_batch_active)) {
+		return insert_instruction_clones_at(target, insn_batch_decode(binary, size), mode, last);
+	}
+
 	// Pointer 'binary' may contains more than one instruction:
 	// in this case, the behavior is to convert the whole binary
 	// and add the relative instructions to the representation
@@ -258,7 +792,7 @@ int insert_instructions_at(insn_info *target, unsigned char *binary, size_t size
 
 	while(pos < size) {
 		// Packs the next instruction
-		instr = calloc(sizeof(insn_info), 1);
+		instr = ibr_alloc(sizeof(insn_info));
 
 		// Calls the disassembly procedure in order to correctly parse
 		// the instruction bytes passed as argument.
@@ -318,6 +852,8 @@ int substitute_instruction_with(insn_info *target, unsigned char *binary, size_t
 	instr = target;
 
 	parse_instruction_bytes(binary, &pos, &instr);
+	CURRENT(insn_changes)++;
+	CURRENT(liveness_valid) = false;
 
 	hnotice(4, "Target instruction substituted with %d instructions\n", count);
 
@@ -325,6 +861,78 @@ int substitute_instruction_with(insn_info *target, unsigned char *binary, size_t
 }
 
 
+/**
+ * Clones an already decoded chain of instruction descriptors and adds the
+ * clones to the intermediate representation. This is the counterpart of
+ * <em>insert_instructions_at</em> and <em>substitute_instruction_with</em>
+ * for code which has been parsed once and is injected many times.
+ *
+ * @param target Pointer to the instruction descriptor relative to which the
+ * insertion will be performed.
+ * @param model Pointer to the first descriptor of the chain to be cloned.
+ * @param mode Integer constant representing whether the instructions are inserted
+ * before, after or in place of the target one. When substituting, only the first
+ * instruction of the chain replaces the target one.
+ * @param last Pointer to a variable which will hold the pointer to the descriptor
+ * of the last newly inserted instruction.
+ *
+ * @return Number of newly inserted instructions.
+ */
+int insert_instruction_clones_at(insn_info *target, insn_info *model, insn_insert_mode mode, insn_info **last) {
+	insn_info *instr;
+	int count;
+
+	if (model == NULL) {
+		return 0;
+	}
+
+	if (mode == SUBSTITUTE) {
+		hnotice(4, "Substituting target instruction at %#08llx with a cached instruction\n", target->new_addr);
+
+		// Only the architecture-dependent descriptor changes,
+		// the position in the chain and the references are kept
+		memcpy(&target->i, &model->i, sizeof(target->i));
+		target->flags = model->flags;
+		target->size = model->size;
+		target->opcode_size = model->opcode_size;
+		CURRENT(insn_changes)++;
+		CURRENT(liveness_valid) = false;
+
+		if (last) {
+			*last = target;
+		}
+
+		return 1;
+	}
+
+	count = 0;
+
+	while(model) {
+		instr = clone_instruction(model);
+
+		// The clone does not derive from any instruction of the previous version
+		instr->parent = NULL;
+		instr->prev = instr->next = NULL;
+		instr->orig_addr = instr->new_addr = target->new_addr;
+
+		insert_insn_at(target, instr, mode);
+
+		target = instr;
+		model = model->next;
+		count++;
+	}
+
+	if (last) {
+		*last = target;
+	}
+
+	hnotice(4, "Inserted %d cloned instructions %s the target <%#08llx>\n",
+		count, mode == INSERT_BEFORE ? "before" : "after", target->new_addr);
+
+	return count;
+}
+
+
 /**
  * Given a symbol, this function will create a new CALL instruction and returns it.
  * The instruction can be passed to the insertion function to add it to the
@@ -349,7 +957,7 @@ void add_call_instruction(insn_info *target, char *name, insn_insert_mode mode,
 		break;
 	}
 
-	for (sec = PROGRAM(sections)[PROGRAM(version)]; sec; sec = sec->next) {
+	for (sec = PROGRAM(sections)[CURRENT(id)]; sec; sec = sec->next) {
 		if (sec->type == SECTION_CODE) {
 			break;
 		}
@@ -391,7 +999,7 @@ void add_jump_instruction(insn_info *target, char *name, insn_insert_mode mode,
 		break;
 	}
 
-	for (sec = PROGRAM(sections)[PROGRAM(version)]; sec; sec = sec->next) {
+	for (sec = PROGRAM(sections)[CURRENT(id)]; sec; sec = sec->next) {
 		if (sec->type == SECTION_CODE) {
 			break;
 		}
@@ -428,21 +1036,18 @@ void add_jump_instruction(insn_info *target, char *name, insn_insert_mode mode,
 insn_info * clone_instruction (insn_info *instr) {
 	insn_info *clone;
 
-	clone = (insn_info *) calloc(sizeof(insn_info), 1);
-	if(!clone) {
-		herror(true, "Out of memory!\n");
-	}
+	clone = (insn_info *) ibr_alloc(sizeof(insn_info));
 
 	memcpy(clone, instr, sizeof(insn_info));
 
 	// Reset the meta-data of new instruction clone
 	clone->jumpto = NULL;
-	clone->targetof.first = clone->targetof.last = NULL;
+	bzero(&clone->targetof, sizeof(clone->targetof));
 	clone->jumptable.size = 0;
 	clone->jumptable.entry = NULL;
 	clone->virtual = NULL;
-	clone->reference.first = clone->reference.last = NULL;
-	clone->pointedby.first = clone->pointedby.last = NULL;
+	bzero(&clone->reference, sizeof(clone->reference));
+	bzero(&clone->pointedby, sizeof(clone->pointedby));
 
 	clone->parent = instr;
 
@@ -491,7 +1096,7 @@ insn_info * clone_instruction_list (insn_info *instr) {
 inline void set_jumpto_reference(insn_info *jump, insn_info *target) {
 	jump->jumpto = target;
 
-	ll_push(&target->targetof, jump);
+	sv_push(&target->targetof, jump);
 
 	hnotice(3, "%s instruction at <%#08llx> (<%#08llx>) linked to instruction <%#08llx> at address <%#08llx> (<%#08llx>)\n",
 		IS_JUMP(jump) ? "Jump" : "Call",
@@ -540,10 +1145,10 @@ void set_virtual_reference(insn_info *target, insn_info *virtual) {
 
 	unsigned int idx;
 
-	while( !ll_empty(&target->targetof) ) {
-		jump = ll_pop_first(&target->targetof);
+	while( !sv_empty(&target->targetof) ) {
+		jump = sv_pop_first(&target->targetof);
 
-		ll_push(&virtual->targetof, jump);
+		sv_push(&virtual->targetof, jump);
 
 		if (jump->jumpto) {
 			jump->jumpto = virtual;
@@ -570,12 +1175,12 @@ void set_virtual_reference(insn_info *target, insn_info *virtual) {
 
 	// Update relocations that originally pointed target to refer
 	// its virtual replacement
-	while (!ll_empty(&target->pointedby)) {
-		rela = ll_pop(&target->pointedby);
+	while (!sv_empty(&target->pointedby)) {
+		rela = sv_pop(&target->pointedby);
 
 		rela->relocation.target_insn = virtual;
 
-		ll_push(&virtual->pointedby, rela);
+		sv_push(&virtual->pointedby, rela);
 	}
 }
 
@@ -803,7 +1408,6 @@ void link_jump_instructions(void) {
 	function *func, *prev;
 	insn_info *instr, *dest;
 
-	static unsigned int index = 0;
 	unsigned long long jmp_addr;
 
 	function *callee;
@@ -811,7 +1415,11 @@ void link_jump_instructions(void) {
 
 	hnotice(1, "Resolving jump and call instructions...\n");
 
-	for (prev = NULL, func = PROGRAM(v_code)[PROGRAM(version)]; func;
+	// Neither function boundaries nor instructions change while resolving the jumps
+	function_index_build();
+	insn_index_begin();
+
+	for (prev = NULL, func = PROGRAM(v_code)[CURRENT(id)]; func;
 	     prev = func, func = func->next) {
 		// if (functions_overlap(prev, func)) {
 		// 	continue;
@@ -821,7 +1429,7 @@ void link_jump_instructions(void) {
 
 		for (instr = func->begin_insn; instr; instr = instr->next) {
 
-			instr->index = index++;
+			instr->index = CURRENT(last_insn_index)++;
 
 			hnotice(6, "Inspecting instruction %s at %#08llx\n",
 				instr->i.x86.mnemonic, instr->orig_addr);
@@ -843,7 +1451,7 @@ void link_jump_instructions(void) {
 					resolve_jump_table(func, instr);
 				}
 
-				else if (!ll_empty(&instr->reference)) {
+				else if (!sv_empty(&instr->reference)) {
 					// If the jump instruction has a relocation, simply skip the instruction;
 					// the linker will be in charge to correctly handle it
 					continue;
@@ -894,10 +1502,10 @@ void link_jump_instructions(void) {
 					continue;
 				}
 
-				else if (!ll_empty(&instr->reference)) {
+				else if (!sv_empty(&instr->reference)) {
 					// NOTE: Not likely, but a call instruction may have multiple
 					// associated relocations
-					sym = instr->reference.first->elem;
+					sym = sv_first(&instr->reference);
 
 					// We must check whether it is a CALL to a local function or not,
 					// and act accordingly.
@@ -946,15 +1554,9 @@ void link_jump_instructions(void) {
 							hinternal();
 						}
 
-						for (rela = PROGRAM(symbols); rela->next; rela = rela->next) {
-							if (rela->next == sym) {
-								rela->next = sym->next;
-								break;
-							}
-						}
+						symbol_remove(sym);
 
-						ll_pop_first(&instr->reference);
-						free(sym);
+						sv_pop_first(&instr->reference);
 
 						symbol_instr_rela_create(callee->symbol, instr, RELOC_PCREL_32);
 					} else {
@@ -1016,7 +1618,52 @@ void link_jump_instructions(void) {
 		}
 	}
 
+	insn_index_end();
+	function_index_drop();
+}
+
+
+/**
+ * Key of a function symbol in the index of the aliases, built from the
+ * section and the offset of the symbol.
+ */
+static unsigned long long alias_key(section *sec, unsigned long long offset) {
+	unsigned long long key;
+
+	key = hash_bytes(&sec, sizeof(sec), HASH_FNV_OFFSET);
+
+	return hash_bytes(&offset, sizeof(offset), key);
+}
+
+
+/**
+ * Moves a symbol to a new offset, keeping the index of the aliases in sync.
+ *
+ * @param aliases Index of the function symbols by section and offset
+ * @param sym Pointer to the symbol descriptor
+ * @param offset New offset of the symbol
+ * @param size New size of the symbol
+ */
+static void alias_update(hash_table *aliases, symbol *sym, unsigned long long offset, unsigned long long size) {
+	if (ht_remove(aliases, alias_key(sym->sec, sym->offset), sym)) {
+		ht_insert(aliases, alias_key(sym->sec, offset), sym);
+	}
+
+	sym->offset = offset;
+	sym->size = size;
+}
+
 
+/**
+ * Returns the position of a symbol in the list of symbols, plus one, or zero
+ * if the symbol is not a function symbol of the list.
+ */
+static size_t alias_position(hash_table *positions, symbol *sym) {
+	ht_node *node;
+
+	node = ht_first(positions, hash_pointer(sym));
+
+	return node ? (size_t)(uintptr_t) node->elem : 0;
 }
 
 
@@ -1044,11 +1691,32 @@ void update_instruction_addresses(int version) {
 	unsigned long long foo_offset;
 	unsigned long long foo_size;
 
-	ll_node *rela_node;
+	unsigned int idx;
 	symbol *rela, *alias;
 
 	long long rela_offset;
 
+	hash_table aliases = {0};
+	hash_table positions = {0};
+	linked_list matches = {0};
+	ht_node *node;
+	section *sec;
+	unsigned long long cur_offset;
+	size_t foo_pos, pos;
+
+	// Function symbols are indexed by section and offset, along with their
+	// position in the list, so that the aliases of each function are found
+	// without scanning all the symbols. Other versions may be appending
+	// their own symbols meanwhile, which are not looked at
+	pthread_mutex_lock(&PROGRAM(lock));
+	for (pos = 1, alias = PROGRAM(symbols); alias != NULL; pos++, alias = alias->next) {
+		if (alias->type == SYMBOL_FUNCTION && alias->version == version) {
+			ht_insert(&aliases, alias_key(alias->sec, alias->offset), alias);
+			ht_insert(&positions, hash_pointer(alias), (void *)(uintptr_t) pos);
+		}
+	}
+	pthread_mutex_unlock(&PROGRAM(lock));
+
 	// Instruction addresses are recomputed from scratch starting from
 	// the very beginning of the code section.
 	offset = 0;
@@ -1070,8 +1738,7 @@ void update_instruction_addresses(int version) {
 				instr->i.x86.mnemonic, (unsigned long long) instr, old_offset, instr->size, instr->new_addr);
 
 			// Updates the relocation entry to reflect the address update
-			for (rela_node = instr->reference.first; rela_node; rela_node = rela_node->next) {
-				rela = rela_node->elem;
+			sv_foreach(&instr->reference, idx, rela) {
 				rela_offset = rela->relocation.offset;
 
 				// rela->relocation.offset = instr->new_addr + instr->opcode_size;
@@ -1082,8 +1749,7 @@ void update_instruction_addresses(int version) {
 			}
 
 			// FIXME: Hackish way to check for relocation from .text to .rodata, find better one
-			for (rela_node = instr->pointedby.first; rela_node; rela_node = rela_node->next) {
-				rela = rela_node->elem;
+			sv_foreach(&instr->pointedby, idx, rela) {
 				rela_offset = rela->relocation.addend;
 
 				rela->relocation.addend += instr->new_addr - old_offset;
@@ -1094,35 +1760,60 @@ void update_instruction_addresses(int version) {
 		}
 
 
-		for (alias = PROGRAM(symbols); alias != NULL; alias = alias->next) {
-			if (alias->type != SYMBOL_FUNCTION || alias->sec != foo->symbol->sec)
+		// Function symbols sharing the offset of this function are its aliases.
+		// Once the symbol of the function itself is met in the list, the symbols
+		// after it are compared against its updated offset instead.
+		sec = foo->symbol->sec;
+		cur_offset = foo->symbol->offset;
+		foo_pos = alias_position(&positions, foo->symbol);
+
+		ht_foreach(&aliases, alias_key(sec, cur_offset), node) {
+			alias = node->elem;
+
+			if (alias->sec != sec || alias->offset != cur_offset) {
 				continue;
+			}
 
-			if (alias->offset == foo->symbol->offset) {
-				alias->offset = foo_offset;
-				alias->size = foo_size;
+			if (foo_pos && cur_offset != foo_offset && alias_position(&positions, alias) > foo_pos) {
+				continue;
 			}
+
+			ll_push(&matches, alias);
 		}
 
-		foo->symbol->offset = foo_offset;
-		foo->symbol->size = foo_size;
-		foo->symbol->offset = foo_offset;
+		if (foo_pos && cur_offset != foo_offset) {
+			ht_foreach(&aliases, alias_key(sec, foo_offset), node) {
+				alias = node->elem;
+
+				if (alias->sec == sec && alias->offset == foo_offset
+				    && alias_position(&positions, alias) > foo_pos) {
+					ll_push(&matches, alias);
+				}
+			}
+		}
+
+		while (!ll_empty(&matches)) {
+			alias_update(&aliases, ll_pop_first(&matches), foo_offset, foo_size);
+		}
+
+		alias_update(&aliases, foo->symbol, foo_offset, foo_size);
 
 		// If this function has any alias will update them as well
 		ll_node *alias_node;
-		symbol *alias;
 
 		for (alias_node = foo->alias.first; alias_node; alias_node = alias_node->next) {
 			alias = alias_node->elem;
 
-			alias->offset = foo_offset;
-			alias->size = foo_size;
+			alias_update(&aliases, alias, foo_offset, foo_size);
 		}
 
 		hnotice(4, "Function '%s' updated to <%#08llx> (%d bytes)\n",
 			foo->symbol->name, foo->begin_insn->new_addr, foo->symbol->size);
 	}
 
+	ht_clear(&aliases);
+	ht_clear(&positions);
+
 }
 
 static void set_jump_displacement(insn_info *jump, insn_info *target) {
@@ -1161,187 +1852,225 @@ static void set_jump_displacement(insn_info *jump, insn_info *target) {
 		jump->orig_addr, jump->new_addr, displacement);
 }
 
+/// Entry of a relaxation which does not jump to an instruction of the version
+#define RELAX_NO_TARGET ((size_t) -1)
+
+/**
+ * Entry of the relaxation of the jumps of a version, one per instruction,
+ * in the order in which instructions are laid out.
+ */
+typedef struct {
+	insn_info *instr;
+	unsigned long long addr;      // Address in the layout being relaxed
+	unsigned int size;            // Size in the layout being relaxed
+	size_t target;                // Entry of the jump target
+	bool promoted;                // Short jump to be turned into a long one
+} relax_entry;
+
+
+static inline bool is_short_jump(insn_info *instr) {
+	return (instr->i.x86.opcode[0] & 0xf0) == 0x70 || instr->i.x86.opcode[0] == 0xeb;
+}
+
+
 /**
- * Starting from the target instruction, the function will perform an update
- * of all the addresses of the instructions that follow.
+ * Updates jump displacements in accordance with the new addresses of instructions.
+ * It is advisable to call this function only after addresses have already been
+ * recomputed (i.e. after calling <em>update_instruction_addresses</em>), otherwise
+ * displacements will be wrong and the control flow correctness of the instrumented
+ * logic cannot be preserved.
  *
- * @param target Pointer to the target instruction descriptor, starting from
- * which shifting is performed.
- * @param shift (Signed) number of bytes by which to shift all the addresses.
+ * Short jumps whose displacement does not fit 8 bits anymore are promoted
+ * to long jumps, which in turn moves the instructions that follow them.
+ * Promotions are first decided on a compact array of the whole layout,
+ * as an assembler would do: every pass lays the instructions out again
+ * and promotes the short jumps which do not reach their target, until
+ * none is left. Instructions, relocations and displacements are then
+ * updated once, in a single walk.
  *
  * @author Davide Cingolani
  * @author Simone Economo
  */
-static void shift_instruction_addresses(insn_info *pivot, int shift) {
-	function *func, *prev;
+void update_jump_displacements(int version) {
+	function *foo;
 	insn_info *instr;
 
-	ll_node *rela_node;
+	relax_entry *entry, *jump;
+	size_t *jumps;
+	size_t count, njumps, promoted, i;
+
+	hash_table positions = {0};
+	ht_node *node;
+
+	unsigned long long addr, target;
+	unsigned int passes;
+	size_t old_size;
+	bool changed;
+
+	long shift, displacement;
+
+	unsigned int idx;
 	symbol *rela;
 
-	ll_node *jump_node;
-	insn_info *jump;
+	unsigned char bytes[8];
 
-	hnotice(4, "Shifting the addresses of instructions beyond <%#08llx> by %+d bytes\n",
-		pivot->new_addr, shift);
+	insn_info_x86 *x86;
 
-	// Skip functions that are before the pivot instruction
-	for (prev = NULL, func = PROGRAM(code); func; prev = func, func = func->next) {
-		if (func->begin_insn->new_addr > pivot->new_addr) {
-			break;
-		}
+	if (PROGRAM(insn_set) != X86_INSN) {
+		hinternal();
 	}
 
-	if (prev != NULL) {
-		// Update the size of the function that contains the pivot instruction
-		prev->symbol->size += shift;
+	for (count = 0, foo = PROGRAM(v_code)[version]; foo; foo = foo->next) {
+		for (instr = foo->begin_insn; instr; instr = instr->next) {
+			count++;
+		}
 	}
 
-	for (func = prev; func; func = func->next) {
-		for (instr = func->begin_insn; instr; instr = instr->next) {
+	entry = malloc(sizeof(relax_entry) * (count + 1));
+	jumps = malloc(sizeof(size_t) * (count + 1));
+	if (!entry || !jumps) {
+		herror(true, "Out of memory!\n");
+	}
 
-			// Skip instructions that come before 'pivot'
-			if (instr->new_addr <= pivot->new_addr) {
-				continue;
-			}
+	for (i = 0, foo = PROGRAM(v_code)[version]; foo; foo = foo->next) {
+		for (instr = foo->begin_insn; instr; instr = instr->next, i++) {
+			entry[i].instr = instr;
+			entry[i].addr = instr->new_addr;
+			entry[i].size = instr->size;
+			entry[i].target = RELAX_NO_TARGET;
+			entry[i].promoted = false;
 
-			// Shift instruction address
-			instr->new_addr += shift;
+			ht_insert(&positions, hash_pointer(instr), (void *)(uintptr_t) i);
+		}
+	}
 
-			// Shift relocation offsets/addends
-			for (rela_node = instr->reference.first; rela_node; rela_node = rela_node->next) {
-				rela = rela_node->elem;
+	// Only short jumps may need to be promoted
+	for (njumps = 0, i = 0; i < count; i++) {
+		instr = entry[i].instr;
 
-				rela->relocation.offset += shift;
-			}
+		if (!IS_JUMP(instr) || instr->jumpto == NULL) {
+			continue;
+		}
 
-			for (rela_node = instr->reference.first; rela_node; rela_node = rela_node->next) {
-				rela = rela_node->elem;
+		node = ht_first(&positions, hash_pointer(instr->jumpto));
+		if (node != NULL) {
+			entry[i].target = (size_t)(uintptr_t) node->elem;
+		}
 
-				if (str_prefix(rela->name, ".text")) {
-					rela->relocation.addend += shift;
-				}
-			}
+		if (is_short_jump(instr)) {
+			jumps[njumps++] = i;
+		}
+	}
 
-			// Rewrite displacements of jumps that come before the pivot
-			for (jump_node = instr->targetof.first; jump_node; jump_node = jump_node->next) {
-				jump = jump_node->elem;
+	// Promotions only ever make displacements grow, so the passes
+	// converge to the smallest set of promotions which fits
+	passes = promoted = 0;
 
-				// No need to insert an embedded displacement in CALLs,
-				// let's leave it for the linker...
-				if (!IS_CALL(jump) && jump->new_addr < pivot->new_addr) {
-					set_jump_displacement(jump, instr);
-				}
-			}
+	do {
+		changed = false;
+		passes++;
 
-			hnotice(6, "Instruction '%s' at address <%#08llx> (size %u) shifted to new address <%#08llx>\n",
-				instr->i.x86.mnemonic, instr->new_addr - shift, instr->size, instr->new_addr);
+		addr = count ? entry[0].instr->new_addr : 0;
+		for (i = 0; i < count; i++) {
+			entry[i].addr = addr;
+			addr += entry[i].size;
 		}
 
-		hnotice(4, "Function '%s' updated to <%#08llx> (%d bytes)\n",
-			func->symbol->name, func->begin_insn->new_addr, func->symbol->size);
-	}
-}
+		for (i = 0; i < njumps; i++) {
+			jump = &entry[jumps[i]];
 
-/**
- * Updates jump displacements in accordance with the new addresses of instructions.
- * It is advisable to call this function only after addresses have already been
- * recomputed (i.e. after calling <em>update_instruction_addresses</em>), otherwise
- * displacements will be wrong and the control flow correctness of the instrumented
- * logic cannot be preserved.
- *
- * @author Davide Cingolani
- * @author Simone Economo
- */
-void update_jump_displacements(int version) {
-	function *foo;
-	insn_info *instr;
+			if (jump->promoted) {
+				continue;
+			}
 
-	size_t old_size;
+			target = jump->target != RELAX_NO_TARGET ? entry[jump->target].addr : jump->instr->jumpto->new_addr;
 
-	long delta, displacement;
+			// The expression `addr + size` gives the value of %rip. By subtracting
+			// it from the address of the target instruction, we obtain the displacement
+			displacement = target - (jump->addr + jump->size);
 
-	unsigned char bytes[8];
+			if (displacement < (char) 0x80 || displacement > 0x7f) {
+				hnotice(4, "Short jump at <%#08llx> (originally <%#08llx>) will be converted to a long jump because %ld > %ld or < %d\n",
+					jump->addr, jump->instr->orig_addr, displacement, 0x7f, (char) 0x80);
 
-	insn_info_x86 *x86;
+				// Unconditional jumps become 'e9 rel32', conditional ones '0f 8x rel32'
+				jump->size = jump->instr->i.x86.opcode[0] == 0xeb ? 5 : 6;
+				jump->promoted = true;
 
-	if (PROGRAM(insn_set) != X86_INSN) {
-		hinternal();
-	}
+				changed = true;
+				promoted++;
+			}
+		}
+	} while (changed);
 
-	for (foo = PROGRAM(v_code)[version]; foo; foo = foo->next) {
+	hnotice(3, "%lu short jumps promoted in %u passes\n", (unsigned long) promoted, passes);
+
+	// Lay the instructions out for real
+	for (i = 0, foo = PROGRAM(v_code)[version]; foo; foo = foo->next) {
 		hnotice(3, "Update jump displacements in function '%s'\n", foo->name);
 
-		for (instr = foo->begin_insn; instr; instr = instr->next) {
-			if (IS_JUMP(instr) && instr->jumpto != NULL) {
-				old_size = instr->size;
+		for (instr = foo->begin_insn; instr; instr = instr->next, i++) {
+			shift = entry[i].addr - instr->new_addr;
 
-				// The expression `insn->new_addr + insn->size` gives
-				// the value of %rip. By subtracting it from the address
-				// of the target instruction, we obtain the displacement
-				displacement = instr->jumpto->new_addr - (instr->new_addr + instr->size);
+			if (shift != 0) {
+				instr->new_addr = entry[i].addr;
 
-				hnotice(4, "Jump instruction at <%#08llx> (originally <%#08llx>) +%#0llx "
-					"points to instruction '%s' at <%#08llx> (originally <%#08llx>)\n",
-					instr->new_addr, instr->orig_addr, (unsigned long long) displacement,
-					instr->jumpto->i.x86.mnemonic, instr->jumpto->new_addr, instr->jumpto->orig_addr);
+				// Shift relocation offsets/addends
+				sv_foreach(&instr->reference, idx, rela) {
 
-				x86 = &(instr->i.x86);
+					rela->relocation.offset += shift;
 
-				// There are two kind of jumps: near and far jumps.
-				// Near (relative) jumps use a relative offset, whereas
-				// far (absolute) jumps use an absolute one.
-				// Another taxonomy entails the bit width of the jump
-				// displacement fields. If the jump instruction is a
-				// short jump, we must check whether the single 8-bit
-				// displacement is big enough to hold the new value for
-				// the jump displacement. In the negative case, we must
-				// replace the short jump with a long jump.
-
-				if ((x86->opcode[0] & 0xf0) == 0x70 || x86->opcode[0] == 0xeb) {
-					// It is a short jump instruction
-					hnotice(4, "It is a short instruction\n");
-
-					if (displacement < (char) 0x80 || displacement > 0x7f) {
-						// We need to substitute the short jump with a long one
-						memset(bytes, '\0', sizeof(bytes));
-
-						// TODO: embeddare l'update del displacement in questo modo non è sicuro
-						if (x86->opcode[0] == 0xeb) {
-							// Unconditional jump
-							bytes[0] = 0xe9;
-						} else {
-							// Conditional jump
-							bytes[0] = 0x0f;
-							bytes[1] = 0x80 | (x86->opcode[0] & 0xf);
-						}
+					if (str_prefix(rela->name, ".text")) {
+						rela->relocation.addend += shift;
+					}
+				}
+			}
 
-						hnotice(4, "Short jump at <%#08llx> (originally <%#08llx>) will be converted to a long jump because %ld > %ld or < %d:\n",
-							instr->new_addr, instr->orig_addr, displacement, 0x7f, (char) 0x80);
-						hdump(6, "FROM", instr->i.x86.insn, instr->size);
-						hdump(6, "TO", bytes, sizeof(bytes));
+			if (entry[i].promoted) {
+				x86 = &(instr->i.x86);
+				old_size = instr->size;
 
-						substitute_instruction_with(instr, bytes, sizeof(bytes));
+				memset(bytes, '\0', sizeof(bytes));
 
-						delta = (instr->size - old_size);
+				if (x86->opcode[0] == 0xeb) {
+					// Unconditional jump
+					bytes[0] = 0xe9;
+				} else {
+					// Conditional jump
+					bytes[0] = 0x0f;
+					bytes[1] = 0x80 | (x86->opcode[0] & 0xf);
+				}
 
-						// Updating the jump instruction will also change the
-						// instruction size, thus the address of subsequent
-						// instructions has to be updated again in order to
-						// take into account the size increment.
+				hdump(6, "FROM", instr->i.x86.insn, instr->size);
+				hdump(6, "TO", bytes, sizeof(bytes));
 
-						// The new jump displacement gets inserted into the
-						// instruction by the end of the iteration.
-						shift_instruction_addresses(instr, delta);
+				substitute_instruction_with(instr, bytes, sizeof(bytes));
 
-						// if (instr->new_addr < instr->jumpto->new_addr) {
-						// 	displacement += delta;
-						// }
-					}
+				if (instr->size != entry[i].size) {
+					hinternal();
 				}
 
-				set_jump_displacement(instr, instr->jumpto);
+				// The function grows along with its jump
+				foo->symbol->size += instr->size - old_size;
 			}
 		}
 	}
+
+	// Every displacement is now written against the final layout
+	for (i = 0; i < count; i++) {
+		instr = entry[i].instr;
+
+		if (IS_JUMP(instr) && instr->jumpto != NULL) {
+			hnotice(4, "Jump instruction at <%#08llx> (originally <%#08llx>) "
+				"points to instruction '%s' at <%#08llx> (originally <%#08llx>)\n",
+				instr->new_addr, instr->orig_addr,
+				instr->jumpto->i.x86.mnemonic, instr->jumpto->new_addr, instr->jumpto->orig_addr);
+
+			set_jump_displacement(instr, instr->jumpto);
+		}
+	}
+
+	ht_clear(&positions);
+	free(jumps);
+	free(entry);
 }
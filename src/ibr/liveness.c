@@ -0,0 +1,265 @@
+/**
+*                       Copyright (C) 2008-2015 HPDCS Group
+*                       http://www.dis.uniroma1.it/~hpdcs
+*
+*
+* This file is part of the Hijacker static binary instrumentation tool.
+*
+* Hijacker is free software; you can redistribute it and/or modify it under the
+* terms of the GNU General Public License as published by the Free Software
+* Foundation; either version 3 of the License, or (at your option) any later
+* version.
+*
+* Hijacker is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+* A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* hijacker; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*
+* @file liveness.c
+* @brief Registers whose value is dead across the instructions of a version
+*/
+
+#include <stdlib.h>
+
+#include <hijacker.h>
+#include <prints.h>
+#include <ibr.h>
+
+#include <executable.h>
+#include <x86/liveness-x86.h>
+
+
+static unsigned long long registers_all(void) {
+	switch (PROGRAM(insn_set)) {
+		case X86_INSN:
+			return X86_ALL;
+	}
+
+	hinternal();
+	return 0;
+}
+
+static void register_usage(insn_info *instr, unsigned long long *use, unsigned long long *def) {
+	switch (PROGRAM(insn_set)) {
+		case X86_INSN:
+			x86_register_usage(instr, use, def);
+			return;
+	}
+
+	hinternal();
+}
+
+
+static unsigned long long return_usage(unsigned long long written) {
+	switch (PROGRAM(insn_set)) {
+		case X86_INSN:
+			return x86_return_usage(written);
+	}
+
+	hinternal();
+	return 0;
+}
+
+
+// Instructions the analysis has not reached keep no dead registers at all
+static unsigned long long live_at(insn_info *instr, unsigned long long all) {
+	if (instr == NULL) {
+		return all;
+	}
+
+	return all & ~instr->dead_before;
+}
+
+/**
+ * Registers live right after an instruction. The successors are taken from
+ * the instruction rather than from the edges of the graph, which miss the
+ * self loops and the jumps closing a function; control leaving the program
+ * (unresolved jumps, falling off the chain) keeps every register alive.
+ */
+static unsigned long long live_out(insn_info *instr, unsigned long long all) {
+	unsigned long long live;
+	unsigned long long idx;
+
+	if (IS_CALL(instr)) {
+		return live_at(instr->next, all);
+	}
+
+	if (IS_RET(instr)) {
+		return 0;
+	}
+
+	if (IS_JUMPIND(instr)) {
+		if (instr->jumptable.size == 0) {
+			return all;
+		}
+
+		live = 0;
+		for (idx = 0; idx < instr->jumptable.size; idx++) {
+			live |= live_at(instr->jumptable.entry[idx], all);
+		}
+
+		return live;
+	}
+
+	if (IS_JUMP(instr)) {
+		live = live_at(instr->jumpto, all);
+
+		if (IS_CONDITIONAL(instr)) {
+			live |= live_at(instr->next, all);
+		}
+
+		return live;
+	}
+
+	return live_at(instr->next, all);
+}
+
+
+/**
+ * Computes which registers hold a dead value before and after each instruction
+ * of the current version, i.e. a value that every path overwrites before
+ * reading it again. Probes can then clobber those registers without saving
+ * them. It must run on the code as parsed, before any rule is applied: calls
+ * inserted by the rules preserve the registers, unlike the original ones.
+ *
+ * The blocks are visited backward until a fixpoint is reached, starting
+ * from no live register at all, so that loops only need a few passes.
+ *
+ * @param blocks List of the blocks of the current version
+ */
+void liveness_compute(block *blocks) {
+	block *blk;
+	block **order;
+	function *func;
+	insn_info *instr;
+	size_t count, idx;
+	unsigned long long all, live, dead, written;
+	unsigned long long *use, *def;
+	unsigned int passes;
+	bool changed;
+
+	hnotice(1, "Computing the liveness of the registers...\n");
+
+	all = registers_all();
+
+	use = calloc(CURRENT(last_insn_index) + 1, sizeof(unsigned long long));
+	def = calloc(CURRENT(last_insn_index) + 1, sizeof(unsigned long long));
+	if (use == NULL || def == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	count = 0;
+	for (blk = blocks; blk; blk = blk->next) {
+		count++;
+	}
+
+	order = malloc(sizeof(block *) * (count + 1));
+	if (order == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	count = 0;
+	for (blk = blocks; blk; blk = blk->next) {
+		if (blk->begin == NULL || blk->end == NULL) {
+			continue;
+		}
+
+		order[count++] = blk;
+
+		for (instr = blk->end; instr; instr = instr->prev) {
+			if (instr->index > CURRENT(last_insn_index)) {
+				hinternal();
+			}
+
+			register_usage(instr, &use[instr->index], &def[instr->index]);
+			instr->dead_before = instr->dead_after = all;
+
+			if (instr == blk->begin) {
+				break;
+			}
+		}
+	}
+
+	// What a return reads depends on the registers the whole function
+	// overwrites: those which are not are left to the callers
+	for (func = PROGRAM(v_code)[CURRENT(id)]; func; func = func->next) {
+		written = 0;
+		for (instr = func->begin_insn; instr; instr = instr->next) {
+			if (instr->index <= CURRENT(last_insn_index)) {
+				written |= def[instr->index];
+			}
+		}
+
+		for (instr = func->begin_insn; instr; instr = instr->next) {
+			if (IS_RET(instr) && instr->index <= CURRENT(last_insn_index)) {
+				use[instr->index] = return_usage(written);
+			}
+		}
+	}
+
+	passes = 0;
+	do {
+		changed = false;
+		passes++;
+
+		for (idx = count; idx > 0; idx--) {
+			blk = order[idx - 1];
+
+			for (instr = blk->end; instr; instr = instr->prev) {
+				live = live_out(instr, all);
+				instr->dead_after = all & ~live;
+
+				live = (live & ~def[instr->index]) | use[instr->index];
+				dead = all & ~live;
+
+				if (dead != instr->dead_before) {
+					instr->dead_before = dead;
+					changed = true;
+				}
+
+				if (instr == blk->begin) {
+					break;
+				}
+			}
+		}
+	} while (changed);
+
+	hnotice(2, "Liveness of %zu blocks settled in %u passes\n", count, passes);
+
+	free(order);
+	free(use);
+	free(def);
+
+	CURRENT(liveness_valid) = true;
+}
+
+
+/**
+ * Tells which registers a probe can clobber without saving them. Nothing is
+ * available once an instruction has been replaced, as the replacement may
+ * read registers that were dead in the original code.
+ *
+ * @param instr Instruction descriptor next to which the probe is placed
+ * @param mode Whether the probe runs before or after the instruction
+ *
+ * @return Mask of the registers available, in the encoding of the architecture
+ */
+unsigned long long insn_dead_registers(insn_info *instr, insn_insert_mode mode) {
+	if (!CURRENT(liveness_valid)) {
+		return 0;
+	}
+
+	switch (mode) {
+		case INSERT_BEFORE:
+			return instr->dead_before;
+
+		case INSERT_AFTER:
+			return instr->dead_after;
+
+		default:
+			return 0;
+	}
+}
@@ -39,13 +39,19 @@ const char *section_type_str[] = {
 
 
 size_t section_id(size_t nextid, bool update) {
-	static size_t id = 0;
+	size_t id;
 
-	if (nextid > id && update == true) {
-		id = nextid;
+	pthread_mutex_lock(&PROGRAM(lock));
+
+	if (nextid > PROGRAM(last_section_id) && update == true) {
+		PROGRAM(last_section_id) = nextid;
 	}
 
-	return (update == true ? id : id++);
+	id = (update == true ? PROGRAM(last_section_id) : PROGRAM(last_section_id)++);
+
+	pthread_mutex_unlock(&PROGRAM(lock));
+
+	return id;
 }
 
 
@@ -63,7 +69,7 @@ section *section_create(char *name, section_type type, void *payload) {
 
 	sec->sym = symbol_create(name, SYMBOL_SECTION, SYMBOL_LOCAL, sec, 0);
 
-	section_append(sec, &PROGRAM(sections)[PROGRAM(version)]);
+	section_append(sec, &PROGRAM(sections)[CURRENT(id)]);
 
 	hnotice(3, "New %s section '%s' (%d) has been created from scratch\n",
 		section_type_str[sec->type], sec->name, sec->index);
@@ -84,12 +90,19 @@ section *section_create_from_ELF(size_t index, section_type type) {
 	sec->index = section_id(index, true);
 
 	sec->offset = sec_field(index, sh_offset);
-	sec->header = sec_header(index);
+
+	// The header may be updated (e.g. when a section grows), while the
+	// mapped file is read-only, so it is the only part which is copied
+	sec->header = malloc(sizeof(Section_Hdr));
+	if (sec->header == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+	memcpy(sec->header, sec_header(index), ELF(is64) ? sizeof(Elf64_Shdr) : sizeof(Elf32_Shdr));
 
 	// NOTE: We don't create any symbol, since we expect it to be
 	// done in a separate step
 
-	section_append(sec, &PROGRAM(sections)[PROGRAM(version)]);
+	section_append(sec, &PROGRAM(sections)[CURRENT(id)]);
 
 	hnotice(3, "New %s section '%s' (%d) has been created from ELF\n",
 		section_type_str[sec->type], sec->name, sec->index);
@@ -108,11 +121,21 @@ section *section_create_from_ELF(size_t index, section_type type) {
  */
 void section_append(section *sec, section **head) {
 	section *curr;
+	int version;
 
 	if (head == NULL) {
 		hinternal();
 	}
 
+	// Sections appended to the list of a version are indexed as well;
+	// sections are never unlinked, so the indexes follow the list order
+	if (head >= &PROGRAM(sections)[0] && head < &PROGRAM(sections)[MAX_VERSIONS]) {
+		version = head - &PROGRAM(sections)[0];
+
+		ht_insert(&PROGRAM(sections_by_name)[version], hash_string(sec->name), sec);
+		ht_insert(&PROGRAM(sections_by_index)[version], sec->index, sec);
+	}
+
 	if (*head == NULL) {
 		*head = sec;
 	} else {
@@ -136,8 +159,11 @@ void section_append(section *sec, section **head) {
  */
 inline section *find_section(unsigned int index) {
 	section *sec;
+	ht_node *node;
+
+	ht_foreach(&PROGRAM(sections_by_index)[CURRENT(id)], index, node) {
+		sec = node->elem;
 
-	for (sec = PROGRAM(sections)[PROGRAM(version)]; sec; sec = sec->next) {
 		if (sec->index == index) {
 			return sec;
 		}
@@ -149,8 +175,11 @@ inline section *find_section(unsigned int index) {
 
 section *find_section_by_name(char *name, int version) {
 	section *sec;
+	ht_node *node;
+
+	ht_foreach(&PROGRAM(sections_by_name)[version], hash_string(name), node) {
+		sec = node->elem;
 
-	for (sec = PROGRAM(sections)[version]; sec; sec = sec->next) {
 		if (str_equal(sec->name, name)) {
 			return sec;
 		}
@@ -47,26 +47,134 @@ const char *reloc_type_str[] = {
 
 
 size_t symbol_id(size_t nextid, bool update) {
-	static size_t id = 0;
+	size_t id;
 
-	if (nextid > id && update == true) {
-		id = nextid;
+	// Versions built concurrently take the identifiers of their symbols
+	// from sequences of their own (see symbol_versions_begin)
+	if (update == false && CURRENT(symbol_id_step) > 0) {
+		id = CURRENT(next_symbol_id);
+		CURRENT(next_symbol_id) += CURRENT(symbol_id_step);
+
+		return id;
+	}
+
+	pthread_mutex_lock(&PROGRAM(lock));
+
+	if (nextid > PROGRAM(last_symbol_id) && update == true) {
+		PROGRAM(last_symbol_id) = nextid;
 	}
 
-	return (update == true ? id : id++);
+	id = (update == true ? PROGRAM(last_symbol_id) : PROGRAM(last_symbol_id)++);
+
+	pthread_mutex_unlock(&PROGRAM(lock));
+
+	return id;
 }
 
 
-symbol *find_symbol(size_t index) {
+/**
+ * Tells whether a symbol can be seen by the version being built. The
+ * symbols created while building a version are only seen by that version,
+ * so that versions built concurrently never depend on each other's progress
+ * (e.g. when looking up an external symbol before creating it).
+ *
+ * @param sym Pointer to the symbol descriptor
+ *
+ * @return True if the symbol belongs to the plain program or has been
+ * created by the version being built
+ */
+static inline bool symbol_visible(symbol *sym) {
+	return sym->builder == 0 || current_version == NULL || sym->builder == (int) CURRENT(id);
+}
+
+
+/**
+ * Adds a symbol to the indexes of the program's symbols, by name and by
+ * index. Every symbol which is linked in the list must be indexed, so
+ * that lookups never need to walk the list. Only authentic symbols are
+ * looked up by index, hence relocation symbols, which share the index
+ * of their target by the thousands, are left out of that index.
+ *
+ * @param sym Pointer to the symbol descriptor
+ */
+static void symbol_index_add(symbol *sym) {
+	ht_insert(&PROGRAM(symbols_by_name), hash_string(sym->name), sym);
+
+	if (sym->authentic) {
+		ht_insert(&PROGRAM(symbols_by_index), sym->index, sym);
+	}
+}
+
+
+static void symbol_index_del(symbol *sym) {
+	ht_remove(&PROGRAM(symbols_by_name), hash_string(sym->name), sym);
+
+	if (sym->authentic) {
+		ht_remove(&PROGRAM(symbols_by_index), sym->index, sym);
+	}
+}
+
+
+/**
+ * Rebuilds the indexes of the program's symbols from scratch. This must
+ * be called whenever the list is rewritten as a whole (e.g. when symbols
+ * are renumbered or purged before being emitted).
+ */
+void symbol_index_reset(void) {
 	symbol *sym;
 
+	pthread_mutex_lock(&PROGRAM(lock));
+
+	ht_clear(&PROGRAM(symbols_by_name));
+	ht_clear(&PROGRAM(symbols_by_index));
+
+	PROGRAM(symbols_last_local) = PROGRAM(symbols_tail) = NULL;
+
 	for (sym = PROGRAM(symbols); sym; sym = sym->next) {
-		if (sym->index == index && sym->authentic) {
-			return sym;
+		symbol_index_add(sym);
+	}
+
+	pthread_mutex_unlock(&PROGRAM(lock));
+}
+
+
+symbol *find_symbol(size_t index) {
+	symbol *sym, *found;
+	ht_node *node;
+	bool unique;
+
+	found = NULL;
+	unique = true;
+
+	pthread_mutex_lock(&PROGRAM(lock));
+
+	ht_foreach(&PROGRAM(symbols_by_index), index, node) {
+		sym = node->elem;
+
+		if (sym->index != index || !sym->authentic || !symbol_visible(sym)) {
+			continue;
+		}
+
+		if (found != NULL) {
+			unique = false;
+			break;
+		}
+
+		found = sym;
+	}
+
+	if (!unique) {
+		// More than one candidate, the first one in the list wins
+		for (found = PROGRAM(symbols); found; found = found->next) {
+			if (found->index == index && found->authentic && symbol_visible(found)) {
+				break;
+			}
 		}
 	}
 
-	return NULL;
+	pthread_mutex_unlock(&PROGRAM(lock));
+
+	return found;
 }
 
 
@@ -78,15 +186,86 @@ symbol *find_symbol(size_t index) {
  * @return Pointer to the symbol descriptor found, if any, or <em>NULL</em>.
  */
 symbol *find_symbol_by_name(char *name) {
-	symbol *sym;
+	symbol *sym, *found;
+	ht_node *node;
+	bool unique;
+
+	found = NULL;
+	unique = true;
+
+	pthread_mutex_lock(&PROGRAM(lock));
 
 	// FIXME: Multiple symbols with the same name can exist!
-	for (sym = PROGRAM(symbols); sym; sym = sym->next) {
-		if (str_equal(sym->name, name) && sym->authentic)
-			return sym;
+	ht_foreach(&PROGRAM(symbols_by_name), hash_string(name), node) {
+		sym = node->elem;
+
+		if (!str_equal(sym->name, name) || !sym->authentic || !symbol_visible(sym)) {
+			continue;
+		}
+
+		if (found != NULL) {
+			unique = false;
+			break;
+		}
+
+		found = sym;
+	}
+
+	if (!unique) {
+		// More than one candidate, the first one in the list wins
+		for (found = PROGRAM(symbols); found; found = found->next) {
+			if (str_equal(found->name, name) && found->authentic && symbol_visible(found)) {
+				break;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&PROGRAM(lock));
+
+	return found;
+}
+
+
+/**
+ * Changes the name of a symbol, keeping the index by name up to date.
+ *
+ * @param sym Pointer to the symbol descriptor
+ * @param name The new name, which is not copied
+ */
+void symbol_rename(symbol *sym, char *name) {
+	pthread_mutex_lock(&PROGRAM(lock));
+
+	ht_remove(&PROGRAM(symbols_by_name), hash_string(sym->name), sym);
+	sym->name = name;
+	ht_insert(&PROGRAM(symbols_by_name), hash_string(sym->name), sym);
+
+	pthread_mutex_unlock(&PROGRAM(lock));
+}
+
+
+/**
+ * Unlinks a symbol from the program's list of symbols.
+ *
+ * @param sym Pointer to the symbol descriptor
+ */
+void symbol_remove(symbol *sym) {
+	symbol *prev;
+
+	pthread_mutex_lock(&PROGRAM(lock));
+
+	for (prev = PROGRAM(symbols); prev && prev->next; prev = prev->next) {
+		if (prev->next == sym) {
+			prev->next = sym->next;
+			symbol_index_del(sym);
+
+			if (sym == PROGRAM(symbols_last_local) || sym == PROGRAM(symbols_tail)) {
+				PROGRAM(symbols_last_local) = PROGRAM(symbols_tail) = NULL;
+			}
+			break;
+		}
 	}
 
-	return NULL;
+	pthread_mutex_unlock(&PROGRAM(lock));
 }
 
 
@@ -94,7 +273,7 @@ symbol *symbol_create(char *name, symbol_type type, symbol_bind bind,
 	section *sec, size_t size) {
 	symbol *sym;
 
-	sym = (symbol *) calloc(sizeof(symbol), 1);
+	sym = (symbol *) ibr_alloc(sizeof(symbol));
 
 	sym->name = malloc(strlen((const char *) name) + 1);
 	strcpy(sym->name, name);
@@ -110,7 +289,7 @@ symbol *symbol_create(char *name, symbol_type type, symbol_bind bind,
 	sym->size = size;
 
 	sym->index = symbol_id(0, false);
-	sym->version = PROGRAM(version);
+	sym->version = sym->builder = CURRENT(id);
 	sym->authentic = true;
 
 	// We now append the symbol to the global list of symbols
@@ -127,7 +306,7 @@ symbol *symbol_create_from_ELF(Elf_Sym *elfsym) {
 	symbol *sym;
 	unsigned int symtype, symbind;
 
-	sym = (symbol *) calloc(sizeof(symbol), 1);
+	sym = (symbol *) ibr_alloc(sizeof(symbol));
 
 	sym->name = (char *) strtab(symbol_info(elfsym, st_name));
 
@@ -199,7 +378,7 @@ symbol *symbol_create_from_ELF(Elf_Sym *elfsym) {
 	// This was breaking the generation of references in case of local calls.
 	// I don't know if it is safe to remove the "initial" field anyhow
 
-	sym->version = PROGRAM(version);
+	sym->version = sym->builder = CURRENT(id);
 	sym->authentic = true;
 
 	// We now append the symbol to the global list of symbols
@@ -215,6 +394,7 @@ symbol *symbol_create_from_ELF(Elf_Sym *elfsym) {
 void symbol_append(symbol *sym, symbol **head) {
 	symbol *curr, *prev;
 	symbol *duplicate;
+	ht_node *node;
 
 	// We append the symbol to an input list of symbols, at a position
 	// which depends on the symbol binding:
@@ -225,17 +405,22 @@ void symbol_append(symbol *sym, symbol **head) {
 		hinternal();
 	}
 
+	pthread_mutex_lock(&PROGRAM(lock));
+
 	if (*head == NULL) {
 		*head = sym;
 	} else {
 		curr = *head;
 		prev = NULL;
 
-		for (duplicate = *head; duplicate != NULL; duplicate = duplicate->next) {
-			if (duplicate->name[0] == '\0')
-				continue;
+		// Symbols with the same name are looked up through the index
+		node = sym->name[0] != '\0' ? ht_first(&PROGRAM(symbols_by_name), hash_string(sym->name)) : NULL;
+
+		while (node != NULL) {
+			duplicate = node->elem;
+			node = ht_next(node, node->key);
 
-			if (str_equal(duplicate->name, sym->name)) {
+			if (str_equal(duplicate->name, sym->name) && symbol_visible(duplicate)) {
 				// NOTE: In the future it would be posible to collapse two function symbols
 				// in the case they have the same byte footprint
 				// 6: '_' + 4 digits + '\0'
@@ -244,7 +429,7 @@ void symbol_append(symbol *sym, symbol **head) {
 				bzero(new_name, name_length);
 
 				sprintf(new_name, "%s_%d", sym->name, duplicate->index);
-				duplicate->name = new_name;
+				symbol_rename(duplicate, new_name);
 
 				herror(false, "Two symbol with same names are found ('%s'); change into '%s'\n",
 					sym->name, new_name);
@@ -252,6 +437,19 @@ void symbol_append(symbol *sym, symbol **head) {
 		}
 
 
+		// The insertion points of the program's list are remembered, so
+		// that the walk resumes from there instead of the head of the list
+		if (head == &PROGRAM(symbols)) {
+			if (sym->bind == SYMBOL_LOCAL && PROGRAM(symbols_last_local) != NULL
+			    && PROGRAM(symbols_last_local)->bind == SYMBOL_LOCAL) {
+				prev = PROGRAM(symbols_last_local);
+				curr = prev->next;
+			} else if (sym->bind != SYMBOL_LOCAL && PROGRAM(symbols_tail) != NULL) {
+				prev = PROGRAM(symbols_tail);
+				curr = prev->next;
+			}
+		}
+
 		while (curr) {
 			if (sym->bind == SYMBOL_LOCAL && curr->bind != SYMBOL_LOCAL) {
 				break;
@@ -270,6 +468,19 @@ void symbol_append(symbol *sym, symbol **head) {
 		}
 	}
 
+	if (head == &PROGRAM(symbols)) {
+		if (sym->bind == SYMBOL_LOCAL) {
+			PROGRAM(symbols_last_local) = sym;
+		}
+
+		if (sym->next == NULL) {
+			PROGRAM(symbols_tail) = sym;
+		}
+	}
+
+	symbol_index_add(sym);
+
+	pthread_mutex_unlock(&PROGRAM(lock));
 }
 
 /**
@@ -290,10 +501,17 @@ symbol *symbol_check_shared(symbol *sym) {
 	symbol *clone, *prev, *curr;
 
 	// Duplicate the last symbol copy and mark it, too, as a copy
-	clone = (symbol *) malloc(sizeof(symbol));
+	clone = (symbol *) ibr_alloc(sizeof(symbol));
 	memcpy(clone, sym, sizeof(symbol));
 
 	clone->duplicate = true;
+	clone->builder = CURRENT(id);
+
+	// Copies are relocation symbols, unless they are turned into a
+	// clone of the symbol by symbol_clone
+	clone->authentic = false;
+
+	pthread_mutex_lock(&PROGRAM(lock));
 
 	// Seek the end of the symbol list, starting from the input symbol
 	prev = curr = sym;
@@ -306,6 +524,10 @@ symbol *symbol_check_shared(symbol *sym) {
 	clone->next = prev->next;
 	prev->next = clone;
 
+	symbol_index_add(clone);
+
+	pthread_mutex_unlock(&PROGRAM(lock));
+
 	return clone;
 }
 
@@ -320,6 +542,8 @@ void find_relocations(symbol *symbols, section *in, symbol *to, linked_list *lis
 		hinternal();
 	}
 
+	pthread_mutex_lock(&PROGRAM(lock));
+
 	for (sym = symbols; sym; sym = sym->next) {
 
 		// Skip all non-relocation symbols
@@ -365,6 +589,8 @@ void find_relocations(symbol *symbols, section *in, symbol *to, linked_list *lis
 		}
 
 	}
+
+	pthread_mutex_unlock(&PROGRAM(lock));
 }
 
 
@@ -372,6 +598,10 @@ symbol *symbol_rela_create(symbol *sym, reloc_type type,
 	unsigned long long offset, long addend, section *sec) {
 	symbol *rela;
 
+	// The copy is linked in the shared list before being initialized,
+	// hence the lock is held until it is complete
+	pthread_mutex_lock(&PROGRAM(lock));
+
 	rela = symbol_check_shared(sym);
 
 	sym->referenced = true;
@@ -416,6 +646,8 @@ symbol *symbol_rela_create(symbol *sym, reloc_type type,
 		reloc_type_str[type], rela->relocation.sec->name, rela->relocation.offset,
 			rela->name, rela->relocation.addend);
 
+	pthread_mutex_unlock(&PROGRAM(lock));
+
 	return rela;
 }
 
@@ -423,6 +655,8 @@ symbol *symbol_rela_create(symbol *sym, reloc_type type,
 symbol *symbol_rela_create_from_ELF(reloc *rel) {
 	symbol *rela;
 
+	pthread_mutex_lock(&PROGRAM(lock));
+
 	rela = symbol_check_shared(rel->sym);
 
 	rel->sym->referenced = true;
@@ -438,6 +672,8 @@ symbol *symbol_rela_create_from_ELF(reloc *rel) {
 		rela->relocation.type, rela->relocation.sec->name, rela->relocation.offset,
 			rela->name, rela->relocation.addend);
 
+	pthread_mutex_unlock(&PROGRAM(lock));
+
 	return rela;
 }
 
@@ -455,6 +691,8 @@ symbol *symbol_instr_rela_create(symbol *sym, insn_info *insn, reloc_type type)
 
 	func = find_func_from_instr(insn, NEW_ADDR);
 
+	pthread_mutex_lock(&PROGRAM(lock));
+
 	rela = symbol_check_shared(sym);
 
 	sym->referenced = true;
@@ -463,7 +701,7 @@ symbol *symbol_instr_rela_create(symbol *sym, insn_info *insn, reloc_type type)
 	rela->relocation.offset = insn->new_addr + insn->opcode_size;
 	rela->relocation.sec = func->symbol->sec;
 
-	ll_push(&insn->reference, rela);
+	sv_push(&insn->reference, rela);
 	rela->relocation.target_insn = insn;
 
 	rela->authentic = false;
@@ -516,6 +754,8 @@ symbol *symbol_instr_rela_create(symbol *sym, insn_info *insn, reloc_type type)
 	hnotice(3, "New RELA node [%s] has been created at instruction <%#08llx> to symbol '%s' + %ld\n",
 		reloc_type_str[type], insn->new_addr, rela->name, rela->relocation.addend);
 
+	pthread_mutex_unlock(&PROGRAM(lock));
+
 	return rela;
 }
 
@@ -527,11 +767,15 @@ symbol *symbol_rela_clone(symbol *sym) {
 		return NULL;
 	}
 
+	pthread_mutex_lock(&PROGRAM(lock));
+
 	clone = symbol_check_shared(sym);
-	clone->version = PROGRAM(version);
+	clone->version = CURRENT(id);
 
 	clone->authentic = false;
 
+	pthread_mutex_unlock(&PROGRAM(lock));
+
 	return clone;
 }
 
@@ -543,8 +787,10 @@ symbol *symbol_clone(symbol *sym, char *suffix) {
 		return NULL;
 	}
 
+	pthread_mutex_lock(&PROGRAM(lock));
+
 	clone = symbol_check_shared(sym);
-	clone->version = PROGRAM(version);
+	clone->version = CURRENT(id);
 
 	clone->relocation.offset = sym->relocation.offset;
 	clone->relocation.addend = sym->relocation.addend;
@@ -554,7 +800,168 @@ symbol *symbol_clone(symbol *sym, char *suffix) {
 	// Compose the symbol name
 	name = add_suffix(sym->name, "_", suffix);
 
-	clone->name = name;
+	symbol_rename(clone, name);
+
+	clone->authentic = sym->authentic;
+	if (clone->authentic) {
+		ht_insert(&PROGRAM(symbols_by_index), clone->index, clone);
+	}
+
+	pthread_mutex_unlock(&PROGRAM(lock));
 
 	return clone;
 }
+
+
+/**
+ * Prepares the numbering of the symbols for a range of versions which are
+ * built concurrently. Each version takes the identifiers of its symbols from
+ * a sequence of its own, and the sequences are interleaved: identifiers do not
+ * depend on the order in which the versions run and, whenever a single version
+ * is built, they are the same as the ones of the global counter.
+ *
+ * @param first First version of the range
+ * @param count Number of versions in the range
+ */
+void symbol_versions_begin(unsigned int first, unsigned int count) {
+	unsigned int version;
+
+	for (version = first; version < first + count; version++) {
+		PROGRAM(v_context)[version].next_symbol_id = PROGRAM(last_symbol_id) + (version - first);
+		PROGRAM(v_context)[version].symbol_id_step = count;
+	}
+}
+
+
+typedef struct {
+	symbol *sym;
+	size_t position;
+} symbol_entry;
+
+
+typedef struct {
+	size_t first;                 // First entry of the run
+	size_t count;
+	int builder;                  // Version which has created the run
+	bool local;
+	size_t position;
+} symbol_run;
+
+
+static int symbol_entry_compare(const void *a, const void *b) {
+	const symbol_entry *x = a, *y = b;
+
+	if (x->sym->builder != y->sym->builder) {
+		return x->sym->builder < y->sym->builder ? -1 : 1;
+	}
+
+	return x->position < y->position ? -1 : (x->position > y->position);
+}
+
+
+static int symbol_run_compare(const void *a, const void *b) {
+	const symbol_run *x = a, *y = b;
+
+	if (x->local != y->local) {
+		return x->local ? -1 : 1;
+	}
+
+	if (x->builder != y->builder) {
+		return x->builder < y->builder ? -1 : 1;
+	}
+
+	return x->position < y->position ? -1 : (x->position > y->position);
+}
+
+
+/**
+ * Closes the numbering of the symbols started by symbol_versions_begin, and
+ * puts the symbols created meanwhile in the order they would have if the
+ * versions had been built one after the other.
+ * The list is made of runs, i.e. a symbol followed by its copies, which share
+ * its identifier. A copy always lands at the end of the run of its symbol, a
+ * new symbol at the end of either the local or the global ones, hence the
+ * versions only interleave their symbols within a run or among the new runs.
+ * Both are sorted by the version which has created them.
+ *
+ * @param first First version of the range
+ * @param count Number of versions in the range
+ */
+void symbol_versions_end(unsigned int first, unsigned int count) {
+	symbol_entry *entries, *entry;
+	symbol_run *runs;
+	symbol *sym;
+	version_context *context;
+	unsigned int version;
+	size_t i, j, size, nruns;
+
+	for (version = first; version < first + count; version++) {
+		context = &PROGRAM(v_context)[version];
+
+		if (context->next_symbol_id > PROGRAM(last_symbol_id)) {
+			PROGRAM(last_symbol_id) = context->next_symbol_id;
+		}
+		context->symbol_id_step = 0;
+	}
+
+	for (size = 0, sym = PROGRAM(symbols); sym; sym = sym->next) {
+		size++;
+	}
+
+	if (size == 0) {
+		return;
+	}
+
+	entries = malloc(sizeof(symbol_entry) * size);
+	runs = malloc(sizeof(symbol_run) * size);
+	if (entries == NULL || runs == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	for (i = 0, sym = PROGRAM(symbols); sym; i++, sym = sym->next) {
+		entries[i].sym = sym;
+		entries[i].position = i;
+	}
+
+	// Copies of a symbol are sorted within its run
+	for (i = 0, nruns = 0; i < size; i = j, nruns++) {
+		for (j = i + 1; j < size && entries[j].sym->index == entries[i].sym->index; j++);
+
+		qsort(&entries[i], j - i, sizeof(symbol_entry), symbol_entry_compare);
+
+		runs[nruns].first = i;
+		runs[nruns].count = j - i;
+		runs[nruns].builder = entries[i].sym->builder;
+		runs[nruns].local = entries[i].sym->bind == SYMBOL_LOCAL;
+		runs[nruns].position = nruns;
+	}
+
+	// New runs are sorted wherever they follow each other
+	for (i = 0; i < nruns; i = j + 1) {
+		for (; i < nruns && runs[i].builder == 0; i++);
+		for (j = i; j < nruns && runs[j].builder != 0; j++);
+
+		if (j > i + 1) {
+			qsort(&runs[i], j - i, sizeof(symbol_run), symbol_run_compare);
+		}
+	}
+
+	for (i = 0, sym = NULL; i < nruns; i++) {
+		for (j = 0; j < runs[i].count; j++) {
+			entry = &entries[runs[i].first + j];
+
+			if (sym == NULL) {
+				PROGRAM(symbols) = entry->sym;
+			} else {
+				sym->next = entry->sym;
+			}
+			sym = entry->sym;
+		}
+	}
+	sym->next = NULL;
+
+	PROGRAM(symbols_last_local) = PROGRAM(symbols_tail) = NULL;
+
+	free(entries);
+	free(runs);
+}
@@ -0,0 +1,1550 @@
+/**
+*                       Copyright (C) 2008-2015 HPDCS Group
+*                       http://www.dis.uniroma1.it/~hpdcs
+*
+*
+* This file is part of the Hijacker static binary instrumentation tool.
+*
+* Hijacker is free software; you can redistribute it and/or modify it under the
+* terms of the GNU General Public License as published by the Free Software
+* Foundation; either version 3 of the License, or (at your option) any later
+* version.
+*
+* Hijacker is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+* A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* hijacker; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*
+* @file assemble-x86.c
+* @brief Minimal in-process x86-64 assembler for the Assembly rule tags
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+
+#include <hijacker.h>
+#include <prints.h>
+
+#include <x86/assemble-x86.h>
+
+
+/// Maximum length of a single statement
+#define X86_ASM_MAX_LINE	256
+
+/// Maximum number of labels and label references in a single source
+#define X86_ASM_MAX_LABELS	64
+
+/// Operands of an instruction
+#define X86_ASM_MAX_OPERANDS	2
+
+
+typedef enum {
+	OPD_NONE,
+	OPD_REG,
+	OPD_IMM,
+	OPD_MEM
+} x86_operand_type;
+
+
+typedef struct {
+	x86_operand_type type;
+	unsigned int size;            // Size in bytes, 0 if not specified
+
+	int reg;                      // Register number (OPD_REG)
+	bool rex;                     // Byte register only reachable through REX (spl, bpl, sil, dil)
+	bool high;                    // Legacy high byte register (ah, ch, dh, bh)
+
+	long long imm;                // Immediate value or displacement
+	char sym[X86_ASM_MAX_NAME];   // Referenced symbol, empty if none
+	bool tpoff;                   // Symbol is a TLS offset (sym@tpoff)
+
+	int base;                     // Base register, -1 if none
+	int index;                    // Index register, -1 if none
+	int scale;                    // Index scale (1, 2, 4 or 8)
+	bool rip;                     // RIP-relative addressing
+	unsigned char seg;            // Segment override prefix, 0 if none
+	bool bare;                    // Plain expression, i.e. no base, index nor brackets
+	bool indirect;                // AT&T '*' marker on call/jmp targets
+} x86_operand;
+
+
+typedef struct {
+	char name[X86_ASM_MAX_NAME];
+	unsigned int stmt;            // Statement which defines the label
+	size_t offset;                // Offset of the label in the code buffer
+} x86_label;
+
+
+typedef struct {
+	char name[X86_ASM_MAX_NAME];
+	unsigned int stmt;            // Statement which references the label
+	size_t start;                 // Offset of the referencing instruction
+	size_t at;                    // Offset of the 32-bit displacement to patch
+} x86_label_ref;
+
+
+typedef struct {
+	char *line;                   // Statement being assembled
+	unsigned int stmt;            // Index of the statement
+
+	unsigned char *code;
+	size_t size;
+	size_t pos;                   // Current offset in the code buffer
+	size_t start;                 // Offset of the instruction being assembled
+
+	x86_fixup *fixups;
+	unsigned int nfixups;
+	bool fixed;                   // The current instruction has already a fixup
+
+	x86_label labels[X86_ASM_MAX_LABELS];
+	unsigned int nlabels;
+	x86_label_ref refs[X86_ASM_MAX_LABELS];
+	unsigned int nrefs;
+} x86_asm_state;
+
+
+/**
+ * Description of a single encoding: legacy prefixes and REX are derived
+ * from the operands, the ModR/M byte from either 'digit' or 'reg'.
+ */
+typedef struct {
+	unsigned int size;            // Operand size, drives the 0x66 prefix and REX.W
+	bool wide;                    // 64-bit operand size needs REX.W
+	unsigned char opcode[3];
+	int nopcode;
+	int digit;                    // Opcode extension in the ModR/M reg field, -1 if 'reg' is used
+	x86_operand *reg;             // Register operand in the ModR/M reg field
+	x86_operand *rm;              // Operand in the ModR/M rm field, NULL if no ModR/M
+	x86_operand *plusr;           // Register added to the last opcode byte
+	x86_operand *imm;             // Immediate operand, NULL if none
+	unsigned int immsize;
+} x86_encoding;
+
+
+typedef struct {
+	const char *name;
+	int num;
+	unsigned int size;
+	bool rex;
+	bool high;
+} x86_register;
+
+static const x86_register registers[] = {
+	{ "rax", 0, 8, false, false }, { "rcx", 1, 8, false, false },
+	{ "rdx", 2, 8, false, false }, { "rbx", 3, 8, false, false },
+	{ "rsp", 4, 8, false, false }, { "rbp", 5, 8, false, false },
+	{ "rsi", 6, 8, false, false }, { "rdi", 7, 8, false, false },
+	{ "r8", 8, 8, false, false }, { "r9", 9, 8, false, false },
+	{ "r10", 10, 8, false, false }, { "r11", 11, 8, false, false },
+	{ "r12", 12, 8, false, false }, { "r13", 13, 8, false, false },
+	{ "r14", 14, 8, false, false }, { "r15", 15, 8, false, false },
+
+	{ "eax", 0, 4, false, false }, { "ecx", 1, 4, false, false },
+	{ "edx", 2, 4, false, false }, { "ebx", 3, 4, false, false },
+	{ "esp", 4, 4, false, false }, { "ebp", 5, 4, false, false },
+	{ "esi", 6, 4, false, false }, { "edi", 7, 4, false, false },
+	{ "r8d", 8, 4, false, false }, { "r9d", 9, 4, false, false },
+	{ "r10d", 10, 4, false, false }, { "r11d", 11, 4, false, false },
+	{ "r12d", 12, 4, false, false }, { "r13d", 13, 4, false, false },
+	{ "r14d", 14, 4, false, false }, { "r15d", 15, 4, false, false },
+
+	{ "ax", 0, 2, false, false }, { "cx", 1, 2, false, false },
+	{ "dx", 2, 2, false, false }, { "bx", 3, 2, false, false },
+	{ "sp", 4, 2, false, false }, { "bp", 5, 2, false, false },
+	{ "si", 6, 2, false, false }, { "di", 7, 2, false, false },
+	{ "r8w", 8, 2, false, false }, { "r9w", 9, 2, false, false },
+	{ "r10w", 10, 2, false, false }, { "r11w", 11, 2, false, false },
+	{ "r12w", 12, 2, false, false }, { "r13w", 13, 2, false, false },
+	{ "r14w", 14, 2, false, false }, { "r15w", 15, 2, false, false },
+
+	{ "al", 0, 1, false, false }, { "cl", 1, 1, false, false },
+	{ "dl", 2, 1, false, false }, { "bl", 3, 1, false, false },
+	{ "spl", 4, 1, true, false }, { "bpl", 5, 1, true, false },
+	{ "sil", 6, 1, true, false }, { "dil", 7, 1, true, false },
+	{ "ah", 4, 1, false, true }, { "ch", 5, 1, false, true },
+	{ "dh", 6, 1, false, true }, { "bh", 7, 1, false, true },
+	{ "r8b", 8, 1, false, false }, { "r9b", 9, 1, false, false },
+	{ "r10b", 10, 1, false, false }, { "r11b", 11, 1, false, false },
+	{ "r12b", 12, 1, false, false }, { "r13b", 13, 1, false, false },
+	{ "r14b", 14, 1, false, false }, { "r15b", 15, 1, false, false },
+	{ "r8l", 8, 1, false, false }, { "r9l", 9, 1, false, false },
+	{ "r10l", 10, 1, false, false }, { "r11l", 11, 1, false, false },
+	{ "r12l", 12, 1, false, false }, { "r13l", 13, 1, false, false },
+	{ "r14l", 14, 1, false, false }, { "r15l", 15, 1, false, false },
+
+	{ NULL, 0, 0, false, false }
+};
+
+static const struct {
+	const char *name;
+	unsigned char prefix;
+} segments[] = {
+	{ "es", 0x26 }, { "cs", 0x2e }, { "ss", 0x36 },
+	{ "ds", 0x3e }, { "fs", 0x64 }, { "gs", 0x65 },
+	{ NULL, 0 }
+};
+
+static const struct {
+	const char *name;
+	unsigned char cc;
+} conditions[] = {
+	{ "o", 0x0 }, { "no", 0x1 }, { "b", 0x2 }, { "c", 0x2 }, { "nae", 0x2 },
+	{ "ae", 0x3 }, { "nb", 0x3 }, { "nc", 0x3 }, { "e", 0x4 }, { "z", 0x4 },
+	{ "ne", 0x5 }, { "nz", 0x5 }, { "be", 0x6 }, { "na", 0x6 }, { "a", 0x7 },
+	{ "nbe", 0x7 }, { "s", 0x8 }, { "ns", 0x9 }, { "p", 0xa }, { "pe", 0xa },
+	{ "np", 0xb }, { "po", 0xb }, { "l", 0xc }, { "nge", 0xc }, { "ge", 0xd },
+	{ "nl", 0xd }, { "le", 0xe }, { "ng", 0xe }, { "g", 0xf }, { "nle", 0xf },
+	{ NULL }
+};
+
+
+#define asm_error(st, ...) do {\
+		herror(false, __VA_ARGS__);\
+		herror(true, "Unable to assemble '%s'\n", (st)->line);\
+	} while(0)
+
+
+static inline bool fits_int8(long long value) {
+	return value >= INT8_MIN && value <= INT8_MAX;
+}
+
+static inline bool fits_int32(long long value) {
+	return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+static inline bool is_ident_char(char c) {
+	return isalnum((unsigned char) c) || c == '_' || c == '.' || c == '$';
+}
+
+static char *skip_spaces(char *p) {
+	while (*p && isspace((unsigned char) *p)) {
+		p++;
+	}
+
+	return p;
+}
+
+static void trim(char *str) {
+	size_t len;
+	char *p;
+
+	p = skip_spaces(str);
+	memmove(str, p, strlen(p) + 1);
+
+	len = strlen(str);
+	while (len > 0 && isspace((unsigned char) str[len - 1])) {
+		str[--len] = '\0';
+	}
+}
+
+static const x86_register *find_register(const char *name, size_t len) {
+	int i;
+
+	for (i = 0; registers[i].name; i++) {
+		if (strlen(registers[i].name) == len && !strncasecmp(registers[i].name, name, len)) {
+			return &registers[i];
+		}
+	}
+
+	return NULL;
+}
+
+static unsigned char find_segment(const char *name, size_t len) {
+	int i;
+
+	for (i = 0; segments[i].name; i++) {
+		if (strlen(segments[i].name) == len && !strncasecmp(segments[i].name, name, len)) {
+			return segments[i].prefix;
+		}
+	}
+
+	return 0;
+}
+
+static size_t ident_length(const char *p) {
+	size_t len;
+
+	for (len = 0; is_ident_char(p[len]); len++);
+
+	return len;
+}
+
+
+// ---------------------------------------------------------------------------
+// Operand parsing
+// ---------------------------------------------------------------------------
+
+/**
+ * Parses a single term of an expression, either a number or a symbol
+ * (optionally followed by '@tpoff'), and accumulates it into the operand.
+ */
+static char *parse_term(x86_asm_state *st, char *p, x86_operand *opd, bool negative) {
+	long long value;
+	size_t len;
+	char *end;
+
+	p = skip_spaces(p);
+
+	// Numeric label references ('1f', '1b') are handled as symbols
+	for (len = 0; isdigit((unsigned char) p[len]); len++);
+
+	if (len && (tolower((unsigned char) p[len]) == 'f' || tolower((unsigned char) p[len]) == 'b')
+	    && !is_ident_char(p[len + 1])) {
+		len++;
+	} else if (len) {
+		value = strtoll(p, &end, 0);
+		opd->imm += negative ? -value : value;
+		return end;
+	} else {
+		len = ident_length(p);
+	}
+
+	if (len == 0 || len >= X86_ASM_MAX_NAME) {
+		asm_error(st, "Invalid expression near '%s'\n", p);
+	}
+
+	if (opd->sym[0] || negative) {
+		asm_error(st, "Only a single, positive symbol may appear in an expression\n");
+	}
+
+	memcpy(opd->sym, p, len);
+	opd->sym[len] = '\0';
+	p += len;
+
+	if (*p == '@') {
+		len = ident_length(p + 1);
+
+		if (len == 5 && !strncasecmp(p + 1, "tpoff", 5)) {
+			opd->tpoff = true;
+		} else {
+			asm_error(st, "Unsupported symbol modifier '%s'\n", p);
+		}
+
+		p += len + 1;
+	}
+
+	return p;
+}
+
+/**
+ * Parses a sequence of terms joined by '+' and '-', until one of the
+ * characters in 'stop' (or the end of the string) is met.
+ */
+static char *parse_expression(x86_asm_state *st, char *p, x86_operand *opd, const char *stop) {
+	bool negative;
+
+	p = skip_spaces(p);
+
+	while (*p && !strchr(stop, *p)) {
+		negative = false;
+
+		while (*p == '+' || *p == '-' || isspace((unsigned char) *p)) {
+			if (*p == '-') {
+				negative = !negative;
+			}
+			p++;
+		}
+
+		p = parse_term(st, p, opd, negative);
+		p = skip_spaces(p);
+
+		if (*p && !strchr(stop, *p) && *p != '+' && *p != '-') {
+			asm_error(st, "Unexpected character '%c' in expression\n", *p);
+		}
+	}
+
+	return p;
+}
+
+static void set_base_register(x86_asm_state *st, x86_operand *opd, const x86_register *reg, char *name) {
+	if (!strncasecmp(name, "rip", 3) && !is_ident_char(name[3])) {
+		opd->rip = true;
+		return;
+	}
+
+	if (reg == NULL || reg->size != 8) {
+		asm_error(st, "Only 64-bit registers can be used for addressing\n");
+	}
+
+	opd->base = reg->num;
+}
+
+static void set_index_register(x86_asm_state *st, x86_operand *opd, const x86_register *reg, int scale) {
+	if (reg == NULL || reg->size != 8) {
+		asm_error(st, "Only 64-bit registers can be used for addressing\n");
+	}
+
+	if (reg->num == 4) {
+		asm_error(st, "The stack pointer cannot be used as index register\n");
+	}
+
+	if (scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+		asm_error(st, "Invalid scale factor %d\n", scale);
+	}
+
+	opd->index = reg->num;
+	opd->scale = scale;
+}
+
+static void set_register(x86_asm_state *st, x86_operand *opd, const x86_register *reg) {
+	if (reg == NULL) {
+		asm_error(st, "Unknown register\n");
+	}
+
+	opd->type = OPD_REG;
+	opd->reg = reg->num;
+	opd->size = reg->size;
+	opd->rex = reg->rex;
+	opd->high = reg->high;
+}
+
+
+/**
+ * Parses an AT&T operand: '$expr', '%reg', '*target', or a memory
+ * reference in the form '[%seg:][expr][(base[,index[,scale]])]'.
+ */
+static void parse_att_operand(x86_asm_state *st, char *str, x86_operand *opd) {
+	const x86_register *reg;
+	size_t len;
+	char *p, *name;
+
+	p = skip_spaces(str);
+
+	if (*p == '*') {
+		opd->indirect = true;
+		p = skip_spaces(p + 1);
+	}
+
+	if (*p == '$') {
+		opd->type = OPD_IMM;
+		parse_expression(st, p + 1, opd, "");
+		return;
+	}
+
+	opd->type = OPD_MEM;
+
+	if (*p == '%') {
+		name = p + 1;
+		len = ident_length(name);
+		p = skip_spaces(name + len);
+
+		if (*p == ':') {
+			opd->seg = find_segment(name, len);
+			if (opd->seg == 0) {
+				asm_error(st, "Unknown segment register\n");
+			}
+			p = skip_spaces(p + 1);
+		} else if (*p == '\0') {
+			set_register(st, opd, find_register(name, len));
+			return;
+		} else {
+			asm_error(st, "Unexpected character '%c' after register\n", *p);
+		}
+	}
+
+	p = parse_expression(st, p, opd, "(");
+
+	if (*p != '(') {
+		opd->bare = (opd->seg == 0);
+		return;
+	}
+
+	// Base register
+	p = skip_spaces(p + 1);
+	if (*p == '%') {
+		len = ident_length(p + 1);
+		set_base_register(st, opd, find_register(p + 1, len), p + 1);
+		p = skip_spaces(p + 1 + len);
+	}
+
+	// Index register and scale
+	if (*p == ',') {
+		p = skip_spaces(p + 1);
+
+		if (*p != '%') {
+			asm_error(st, "Index register expected\n");
+		}
+
+		len = ident_length(p + 1);
+		reg = find_register(p + 1, len);
+		p = skip_spaces(p + 1 + len);
+
+		if (*p == ',') {
+			set_index_register(st, opd, reg, (int) strtol(p + 1, &p, 0));
+			p = skip_spaces(p);
+		} else {
+			set_index_register(st, opd, reg, 1);
+		}
+	}
+
+	if (*p != ')' || *skip_spaces(p + 1) != '\0') {
+		asm_error(st, "Malformed memory operand\n");
+	}
+
+	if (opd->rip && opd->index != -1) {
+		asm_error(st, "RIP-relative operands cannot have an index register\n");
+	}
+}
+
+
+/**
+ * Parses the content of an Intel memory reference, between brackets.
+ */
+static void parse_intel_memory(x86_asm_state *st, char *p, x86_operand *opd) {
+	const x86_register *reg;
+	bool negative;
+	size_t len;
+	long scale;
+	char *q;
+
+	p = skip_spaces(p);
+
+	while (*p && *p != ']') {
+		negative = false;
+
+		while (*p == '+' || *p == '-' || isspace((unsigned char) *p)) {
+			if (*p == '-') {
+				negative = !negative;
+			}
+			p++;
+		}
+
+		len = ident_length(p);
+		reg = isdigit((unsigned char) *p) ? NULL : find_register(p, len);
+
+		if (reg || (!strncasecmp(p, "rip", 3) && len == 3)) {
+			if (negative) {
+				asm_error(st, "Registers cannot be subtracted\n");
+			}
+
+			q = skip_spaces(p + len);
+
+			if (*q == '*') {
+				set_index_register(st, opd, reg, (int) strtol(q + 1, &p, 0));
+			} else if (opd->base == -1 && !opd->rip) {
+				set_base_register(st, opd, reg, p);
+				p = q;
+			} else {
+				set_index_register(st, opd, reg, 1);
+				p = q;
+			}
+		}
+
+		else if (isdigit((unsigned char) *p) && *skip_spaces(p + ident_length(p)) == '*') {
+			// Scale written before the index register
+			scale = strtol(p, &q, 0);
+			q = skip_spaces(skip_spaces(q) + 1);
+			len = ident_length(q);
+			set_index_register(st, opd, find_register(q, len), (int) scale);
+			p = q + len;
+		}
+
+		else {
+			p = parse_term(st, p, opd, negative);
+		}
+
+		p = skip_spaces(p);
+	}
+
+	if (*p != ']' || *skip_spaces(p + 1) != '\0') {
+		asm_error(st, "Malformed memory operand\n");
+	}
+
+	if (opd->rip && opd->index != -1) {
+		asm_error(st, "RIP-relative operands cannot have an index register\n");
+	}
+}
+
+
+/**
+ * Parses an Intel operand: a register, an immediate value, 'offset symbol',
+ * or a memory reference optionally qualified by '<size> ptr' and 'seg:'.
+ */
+static void parse_intel_operand(x86_asm_state *st, char *str, x86_operand *opd) {
+	static const struct {
+		const char *name;
+		unsigned int size;
+	} sizes[] = {
+		{ "byte", 1 }, { "word", 2 }, { "dword", 4 }, { "qword", 8 }, { NULL }
+	};
+
+	const x86_register *reg;
+	size_t len;
+	char *p, *q;
+	int i;
+
+	p = skip_spaces(str);
+
+	// Size qualifier
+	for (i = 0; sizes[i].name; i++) {
+		len = strlen(sizes[i].name);
+
+		if (!strncasecmp(p, sizes[i].name, len) && !is_ident_char(p[len])) {
+			q = skip_spaces(p + len);
+
+			if (!strncasecmp(q, "ptr", 3) && !is_ident_char(q[3])) {
+				opd->size = sizes[i].size;
+				p = skip_spaces(q + 3);
+			}
+			break;
+		}
+	}
+
+	if (!strncasecmp(p, "offset", 6) && isspace((unsigned char) p[6])) {
+		opd->type = OPD_IMM;
+		parse_expression(st, p + 6, opd, "");
+		return;
+	}
+
+	len = ident_length(p);
+	q = skip_spaces(p + len);
+
+	// Segment override
+	if (*q == ':' && (opd->seg = find_segment(p, len)) != 0) {
+		p = skip_spaces(q + 1);
+		len = ident_length(p);
+		q = skip_spaces(p + len);
+	}
+
+	if (*p == '[') {
+		opd->type = OPD_MEM;
+		parse_intel_memory(st, p + 1, opd);
+		return;
+	}
+
+	if (*q == '\0' && !opd->seg && !opd->size && (reg = find_register(p, len)) != NULL) {
+		set_register(st, opd, reg);
+		return;
+	}
+
+	if ((isdigit((unsigned char) *p) || *p == '-' || *p == '+') && !opd->seg && !opd->size) {
+		opd->type = OPD_IMM;
+		parse_expression(st, p, opd, "");
+		return;
+	}
+
+	// Anything else is a direct memory reference, or a label for branches
+	opd->type = OPD_MEM;
+	parse_expression(st, p, opd, "");
+	opd->bare = (opd->seg == 0);
+}
+
+
+/**
+ * Splits the operands of a statement on top-level commas.
+ *
+ * @return The number of operands found
+ */
+static int split_operands(x86_asm_state *st, char *p, char **operands) {
+	int count, depth;
+
+	p = skip_spaces(p);
+	if (*p == '\0') {
+		return 0;
+	}
+
+	count = 0;
+	depth = 0;
+	operands[count++] = p;
+
+	for (; *p; p++) {
+		if (*p == '(' || *p == '[') {
+			depth++;
+		} else if (*p == ')' || *p == ']') {
+			depth--;
+		} else if (*p == ',' && depth == 0) {
+			if (count == X86_ASM_MAX_OPERANDS) {
+				asm_error(st, "Too many operands\n");
+			}
+
+			*p = '\0';
+			operands[count++] = p + 1;
+		}
+	}
+
+	return count;
+}
+
+
+// ---------------------------------------------------------------------------
+// Encoding
+// ---------------------------------------------------------------------------
+
+static void emit_byte(x86_asm_state *st, unsigned char byte) {
+	if (st->pos >= st->size) {
+		asm_error(st, "Assembled code exceeds the buffer size (%zu bytes)\n", st->size);
+	}
+
+	st->code[st->pos++] = byte;
+}
+
+static void emit_value(x86_asm_state *st, long long value, unsigned int size) {
+	unsigned int i;
+
+	for (i = 0; i < size; i++) {
+		emit_byte(st, (unsigned char) (value >> (8 * i)));
+	}
+}
+
+static void add_fixup(x86_asm_state *st, x86_operand *opd, reloc_type type, long addend) {
+	x86_fixup *fixup;
+
+	if (st->fixed) {
+		asm_error(st, "Only one symbolic reference per instruction is supported\n");
+	}
+
+	if (st->nfixups == X86_ASM_MAX_FIXUPS) {
+		asm_error(st, "Too many symbolic references\n");
+	}
+
+	fixup = &st->fixups[st->nfixups++];
+	fixup->offset = st->start;
+	fixup->type = type;
+	fixup->addend = addend;
+	strcpy(fixup->name, opd->sym);
+
+	st->fixed = true;
+}
+
+/**
+ * Emits the ModR/M byte, and the SIB byte and displacement if needed.
+ * Symbolic displacements are always 32-bit wide.
+ */
+static void emit_modrm(x86_asm_state *st, int regfield, x86_operand *rm) {
+	unsigned char mod, modrm, sib;
+	bool symbolic;
+	int base, index, scale;
+
+	regfield = (regfield & 0x7) << 3;
+
+	if (rm->type == OPD_REG) {
+		emit_byte(st, 0xc0 | regfield | (rm->reg & 0x7));
+		return;
+	}
+
+	symbolic = rm->sym[0] != '\0';
+
+	if (rm->rip) {
+		emit_byte(st, 0x05 | regfield);
+
+		if (symbolic) {
+			add_fixup(st, rm, RELOC_PCREL_32, rm->imm);
+			emit_value(st, 0, 4);
+		} else {
+			emit_value(st, rm->imm, 4);
+		}
+		return;
+	}
+
+	base = rm->base;
+	index = rm->index;
+
+	if (base == -1) {
+		// Absolute address (or index only): SIB with no base and disp32
+		mod = 0x00;
+	} else if (symbolic || !fits_int8(rm->imm)) {
+		mod = 0x80;
+	} else if (rm->imm == 0 && (base & 0x7) != 5) {
+		mod = 0x00;
+	} else {
+		mod = 0x40;
+	}
+
+	if (index == -1 && base != -1 && (base & 0x7) != 4) {
+		modrm = mod | regfield | (base & 0x7);
+		emit_byte(st, modrm);
+	} else {
+		for (scale = 0; index != -1 && (1 << scale) != rm->scale; scale++);
+
+		modrm = mod | regfield | 0x04;
+		sib = (scale << 6) | ((index == -1 ? 4 : index) & 0x7) << 3 | (base == -1 ? 5 : base & 0x7);
+		emit_byte(st, modrm);
+		emit_byte(st, sib);
+	}
+
+	if (symbolic) {
+		add_fixup(st, rm, rm->tpoff ? RELOC_TLSREL_32 : RELOC_ABS_32S, rm->imm);
+		emit_value(st, 0, 4);
+	} else if (mod == 0x40) {
+		emit_value(st, rm->imm, 1);
+	} else if (mod == 0x80 || base == -1) {
+		if (!fits_int32(rm->imm)) {
+			asm_error(st, "Displacement out of range\n");
+		}
+		emit_value(st, rm->imm, 4);
+	}
+}
+
+static void emit_immediate(x86_asm_state *st, x86_operand *imm, unsigned int size, unsigned int opsize) {
+	if (imm->sym[0]) {
+		if (size != 4 || imm->tpoff) {
+			asm_error(st, "Unsupported symbolic immediate\n");
+		}
+
+		add_fixup(st, imm, opsize == 8 ? RELOC_ABS_32S : RELOC_ABS_32, imm->imm);
+		emit_value(st, 0, size);
+		return;
+	}
+
+	switch (size) {
+		case 1:
+			if (imm->imm < INT8_MIN || imm->imm > UINT8_MAX) {
+				asm_error(st, "Immediate value out of range\n");
+			}
+			break;
+
+		case 2:
+			if (imm->imm < INT16_MIN || imm->imm > UINT16_MAX) {
+				asm_error(st, "Immediate value out of range\n");
+			}
+			break;
+
+		case 4:
+			if (imm->imm < INT32_MIN || imm->imm > (opsize == 8 ? INT32_MAX : UINT32_MAX)) {
+				asm_error(st, "Immediate value out of range\n");
+			}
+			break;
+	}
+
+	emit_value(st, imm->imm, size);
+}
+
+static void encode(x86_asm_state *st, x86_encoding *enc) {
+	unsigned char rex;
+	bool high;
+	int i;
+
+	// The relocation is expected just after the opcode: a symbolic immediate
+	// following a memory displacement could not be told apart from the latter
+	if (enc->imm && enc->imm->sym[0] && enc->rm && enc->rm->type == OPD_MEM) {
+		asm_error(st, "Symbolic immediates cannot be used with memory operands\n");
+	}
+
+	// Legacy prefixes
+	if (enc->rm && enc->rm->type == OPD_MEM && enc->rm->seg) {
+		emit_byte(st, enc->rm->seg);
+	}
+
+	if (enc->size == 2) {
+		emit_byte(st, 0x66);
+	}
+
+	// REX prefix
+	rex = 0;
+	high = false;
+
+	if (enc->wide && enc->size == 8) {
+		rex |= 0x08;
+	}
+
+	if (enc->reg) {
+		rex |= (enc->reg->reg & 0x8) ? 0x04 : 0;
+		rex |= enc->reg->rex ? 0x40 : 0;
+		high |= enc->reg->high;
+	}
+
+	if (enc->rm && enc->rm->type == OPD_REG) {
+		rex |= (enc->rm->reg & 0x8) ? 0x01 : 0;
+		rex |= enc->rm->rex ? 0x40 : 0;
+		high |= enc->rm->high;
+	} else if (enc->rm && enc->rm->type == OPD_MEM) {
+		rex |= (enc->rm->index != -1 && (enc->rm->index & 0x8)) ? 0x02 : 0;
+		rex |= (enc->rm->base != -1 && (enc->rm->base & 0x8)) ? 0x01 : 0;
+	}
+
+	if (enc->plusr) {
+		rex |= (enc->plusr->reg & 0x8) ? 0x01 : 0;
+		rex |= enc->plusr->rex ? 0x40 : 0;
+		high |= enc->plusr->high;
+	}
+
+	if (rex) {
+		if (high) {
+			asm_error(st, "High byte registers cannot be used with a REX prefix\n");
+		}
+
+		emit_byte(st, 0x40 | rex);
+	}
+
+	// Opcode
+	for (i = 0; i < enc->nopcode - 1; i++) {
+		emit_byte(st, enc->opcode[i]);
+	}
+
+	emit_byte(st, enc->opcode[i] + (enc->plusr ? (enc->plusr->reg & 0x7) : 0));
+
+	// ModR/M, SIB and displacement
+	if (enc->rm) {
+		emit_modrm(st, enc->reg ? enc->reg->reg : enc->digit, enc->rm);
+	}
+
+	// Immediate
+	if (enc->imm) {
+		emit_immediate(st, enc->imm, enc->immsize, enc->size);
+	}
+}
+
+/**
+ * Emits a relative branch with a 32-bit displacement towards a local label
+ * or an external symbol, which are resolved once the whole source is read.
+ */
+static void encode_branch(x86_asm_state *st, const unsigned char *opcode, int nopcode, x86_operand *target) {
+	x86_label_ref *ref;
+	int i;
+
+	if (!target->bare || !target->sym[0] || target->imm || target->tpoff) {
+		asm_error(st, "Branch target must be a label or a symbol\n");
+	}
+
+	if (st->nrefs == X86_ASM_MAX_LABELS) {
+		asm_error(st, "Too many label references\n");
+	}
+
+	for (i = 0; i < nopcode; i++) {
+		emit_byte(st, opcode[i]);
+	}
+
+	ref = &st->refs[st->nrefs++];
+	strcpy(ref->name, target->sym);
+	ref->stmt = st->stmt;
+	ref->start = st->start;
+	ref->at = st->pos;
+
+	emit_value(st, 0, 4);
+}
+
+
+// ---------------------------------------------------------------------------
+// Mnemonics
+// ---------------------------------------------------------------------------
+
+typedef void (*x86_asm_handler)(x86_asm_state *st, int arg, unsigned int suffix,
+	x86_operand *ops, int nops);
+
+static unsigned int operand_size(x86_asm_state *st, unsigned int suffix, x86_operand *ops, int nops) {
+	unsigned int size;
+	int i;
+
+	size = suffix;
+
+	for (i = 0; i < nops; i++) {
+		if (ops[i].type == OPD_IMM || ops[i].size == 0) {
+			continue;
+		}
+
+		if (size && size != ops[i].size) {
+			asm_error(st, "Operand size mismatch\n");
+		}
+
+		size = ops[i].size;
+	}
+
+	if (size == 0) {
+		asm_error(st, "Unable to infer the operand size\n");
+	}
+
+	return size;
+}
+
+static void check_operands(x86_asm_state *st, int nops, int expected) {
+	if (nops != expected) {
+		asm_error(st, "Wrong number of operands (%d, expected %d)\n", nops, expected);
+	}
+}
+
+static void check_rm(x86_asm_state *st, x86_operand *opd) {
+	if (opd->type != OPD_REG && opd->type != OPD_MEM) {
+		asm_error(st, "Register or memory operand expected\n");
+	}
+}
+
+/// add, or, adc, sbb, and, sub, xor, cmp: 'arg' is the opcode extension
+static void asm_alu(x86_asm_state *st, int arg, unsigned int suffix, x86_operand *ops, int nops) {
+	x86_encoding enc = { .digit = -1, .wide = true, .nopcode = 1 };
+	unsigned int size;
+
+	check_operands(st, nops, 2);
+	check_rm(st, &ops[0]);
+
+	size = operand_size(st, suffix, ops, nops);
+	enc.size = size;
+
+	if (ops[1].type == OPD_IMM) {
+		enc.imm = &ops[1];
+
+		if (size == 1) {
+			enc.immsize = 1;
+
+			if (ops[0].type == OPD_REG && ops[0].reg == 0 && !ops[0].high) {
+				enc.opcode[0] = arg * 8 + 4;
+			} else {
+				enc.opcode[0] = 0x80;
+				enc.digit = arg;
+				enc.rm = &ops[0];
+			}
+		} else if (!ops[1].sym[0] && fits_int8(ops[1].imm)) {
+			enc.opcode[0] = 0x83;
+			enc.digit = arg;
+			enc.rm = &ops[0];
+			enc.immsize = 1;
+		} else {
+			enc.immsize = (size == 2) ? 2 : 4;
+
+			if (ops[0].type == OPD_REG && ops[0].reg == 0) {
+				enc.opcode[0] = arg * 8 + 5;
+			} else {
+				enc.opcode[0] = 0x81;
+				enc.digit = arg;
+				enc.rm = &ops[0];
+			}
+		}
+	} else if (ops[1].type == OPD_REG) {
+		enc.opcode[0] = arg * 8 + (size == 1 ? 0 : 1);
+		enc.reg = &ops[1];
+		enc.rm = &ops[0];
+	} else if (ops[0].type == OPD_REG) {
+		enc.opcode[0] = arg * 8 + (size == 1 ? 2 : 3);
+		enc.reg = &ops[0];
+		enc.rm = &ops[1];
+	} else {
+		asm_error(st, "Invalid combination of operands\n");
+	}
+
+	encode(st, &enc);
+}
+
+static void asm_test(x86_asm_state *st, int arg, unsigned int suffix, x86_operand *ops, int nops) {
+	x86_encoding enc = { .digit = -1, .wide = true, .nopcode = 1 };
+	unsigned int size;
+
+	(void) arg;
+
+	check_operands(st, nops, 2);
+	check_rm(st, &ops[0]);
+
+	size = operand_size(st, suffix, ops, nops);
+	enc.size = size;
+
+	if (ops[1].type == OPD_IMM) {
+		enc.imm = &ops[1];
+		enc.immsize = (size == 8) ? 4 : size;
+
+		if (ops[0].type == OPD_REG && ops[0].reg == 0 && !ops[0].high) {
+			enc.opcode[0] = (size == 1) ? 0xa8 : 0xa9;
+		} else {
+			enc.opcode[0] = (size == 1) ? 0xf6 : 0xf7;
+			enc.digit = 0;
+			enc.rm = &ops[0];
+		}
+	} else if (ops[1].type == OPD_REG) {
+		enc.opcode[0] = (size == 1) ? 0x84 : 0x85;
+		enc.reg = &ops[1];
+		enc.rm = &ops[0];
+	} else if (ops[0].type == OPD_REG) {
+		enc.opcode[0] = (size == 1) ? 0x84 : 0x85;
+		enc.reg = &ops[0];
+		enc.rm = &ops[1];
+	} else {
+		asm_error(st, "Invalid combination of operands\n");
+	}
+
+	encode(st, &enc);
+}
+
+static void asm_mov(x86_asm_state *st, int arg, unsigned int suffix, x86_operand *ops, int nops) {
+	x86_encoding enc = { .digit = -1, .wide = true, .nopcode = 1 };
+	unsigned int size;
+
+	check_operands(st, nops, 2);
+	check_rm(st, &ops[0]);
+
+	size = operand_size(st, suffix, ops, nops);
+	enc.size = size;
+
+	if (ops[1].type == OPD_IMM) {
+		enc.imm = &ops[1];
+
+		if (ops[0].type == OPD_REG && (arg || (size == 8 && !ops[1].sym[0] && !fits_int32(ops[1].imm)))) {
+			// movabs $imm64, %reg
+			if (size != 8 || ops[1].sym[0]) {
+				asm_error(st, "movabs requires a numeric 64-bit immediate\n");
+			}
+
+			enc.opcode[0] = 0xb8;
+			enc.plusr = &ops[0];
+			enc.immsize = 8;
+		} else if (ops[0].type == OPD_REG && size != 8) {
+			enc.opcode[0] = (size == 1) ? 0xb0 : 0xb8;
+			enc.plusr = &ops[0];
+			enc.immsize = size;
+		} else {
+			enc.opcode[0] = (size == 1) ? 0xc6 : 0xc7;
+			enc.digit = 0;
+			enc.rm = &ops[0];
+			enc.immsize = (size == 8) ? 4 : size;
+		}
+	} else if (arg) {
+		asm_error(st, "movabs requires an immediate operand\n");
+	} else if (ops[1].type == OPD_REG) {
+		enc.opcode[0] = (size == 1) ? 0x88 : 0x89;
+		enc.reg = &ops[1];
+		enc.rm = &ops[0];
+	} else if (ops[0].type == OPD_REG) {
+		enc.opcode[0] = (size == 1) ? 0x8a : 0x8b;
+		enc.reg = &ops[0];
+		enc.rm = &ops[1];
+	} else {
+		asm_error(st, "Invalid combination of operands\n");
+	}
+
+	encode(st, &enc);
+}
+
+static void asm_lea(x86_asm_state *st, int arg, unsigned int suffix, x86_operand *ops, int nops) {
+	x86_encoding enc = { .digit = -1, .wide = true, .nopcode = 1, .opcode = { 0x8d } };
+
+	(void) arg;
+
+	check_operands(st, nops, 2);
+
+	if (ops[0].type != OPD_REG || ops[1].type != OPD_MEM || ops[0].size == 1) {
+		asm_error(st, "lea requires a memory source and a register destination\n");
+	}
+
+	if (suffix && suffix != ops[0].size) {
+		asm_error(st, "Operand size mismatch\n");
+	}
+
+	enc.size = ops[0].size;
+	enc.reg = &ops[0];
+	enc.rm = &ops[1];
+
+	encode(st, &enc);
+}
+
+/// push and pop: 'arg' is 1 for push, 0 for pop
+static void asm_pushpop(x86_asm_state *st, int arg, unsigned int suffix, x86_operand *ops, int nops) {
+	x86_encoding enc = { .digit = -1, .wide = false, .nopcode = 1 };
+	unsigned int size;
+
+	check_operands(st, nops, 1);
+
+	size = (ops[0].type == OPD_REG || ops[0].size) ? operand_size(st, suffix, ops, nops) : (suffix ? suffix : 8);
+	if (size != 8 && size != 2) {
+		asm_error(st, "Only 16-bit and 64-bit operands can be pushed or popped\n");
+	}
+
+	enc.size = size;
+
+	if (ops[0].type == OPD_REG) {
+		enc.opcode[0] = arg ? 0x50 : 0x58;
+		enc.plusr = &ops[0];
+	} else if (ops[0].type == OPD_MEM) {
+		enc.opcode[0] = arg ? 0xff : 0x8f;
+		enc.digit = arg ? 6 : 0;
+		enc.rm = &ops[0];
+	} else if (arg) {
+		enc.imm = &ops[0];
+
+		if (!ops[0].sym[0] && fits_int8(ops[0].imm)) {
+			enc.opcode[0] = 0x6a;
+			enc.immsize = 1;
+		} else {
+			enc.opcode[0] = 0x68;
+			enc.immsize = (size == 2) ? 2 : 4;
+		}
+	} else {
+		asm_error(st, "Cannot pop into an immediate\n");
+	}
+
+	encode(st, &enc);
+}
+
+/// inc and dec: 'arg' is the opcode extension
+static void asm_incdec(x86_asm_state *st, int arg, unsigned int suffix, x86_operand *ops, int nops) {
+	x86_encoding enc = { .wide = true, .nopcode = 1 };
+
+	check_operands(st, nops, 1);
+	check_rm(st, &ops[0]);
+
+	enc.size = operand_size(st, suffix, ops, nops);
+	enc.opcode[0] = (enc.size == 1) ? 0xfe : 0xff;
+	enc.digit = arg;
+	enc.rm = &ops[0];
+
+	encode(st, &enc);
+}
+
+/// call and jmp: 'arg' is the relative opcode, the extension for indirect
+/// branches is derived from it
+static void asm_branch(x86_asm_state *st, int arg, unsigned int suffix, x86_operand *ops, int nops) {
+	x86_encoding enc = { .wide = false, .nopcode = 1, .opcode = { 0xff }, .size = 8 };
+	unsigned char opcode;
+
+	check_operands(st, nops, 1);
+
+	if (suffix && suffix != 8) {
+		asm_error(st, "Only 64-bit branch targets are supported\n");
+	}
+
+	if (ops[0].indirect || ops[0].type == OPD_REG || !ops[0].bare) {
+		check_rm(st, &ops[0]);
+
+		if (ops[0].type == OPD_REG && ops[0].size != 8) {
+			asm_error(st, "Only 64-bit branch targets are supported\n");
+		}
+
+		enc.digit = (arg == 0xe8) ? 2 : 4;
+		enc.rm = &ops[0];
+		encode(st, &enc);
+		return;
+	}
+
+	opcode = arg;
+	encode_branch(st, &opcode, 1, &ops[0]);
+}
+
+/// Conditional jumps: 'arg' is the condition code
+static void asm_jcc(x86_asm_state *st, int arg, unsigned int suffix, x86_operand *ops, int nops) {
+	unsigned char opcode[2];
+
+	(void) suffix;
+
+	check_operands(st, nops, 1);
+
+	opcode[0] = 0x0f;
+	opcode[1] = 0x80 | arg;
+	encode_branch(st, opcode, 2, &ops[0]);
+}
+
+/// Instructions without operands: 'arg' is the opcode
+static void asm_simple(x86_asm_state *st, int arg, unsigned int suffix, x86_operand *ops, int nops) {
+	(void) ops;
+
+	check_operands(st, nops, 0);
+
+	// pushf/popf are the only ones accepting a 16-bit form
+	if (suffix == 2 && (arg == 0x9c || arg == 0x9d)) {
+		emit_byte(st, 0x66);
+	} else if (suffix && suffix != 8) {
+		asm_error(st, "Invalid operand size suffix\n");
+	}
+
+	emit_byte(st, arg);
+}
+
+
+static const struct {
+	const char *name;
+	x86_asm_handler handler;
+	int arg;
+} mnemonics[] = {
+	{ "add", asm_alu, 0 }, { "or", asm_alu, 1 }, { "adc", asm_alu, 2 }, { "sbb", asm_alu, 3 },
+	{ "and", asm_alu, 4 }, { "sub", asm_alu, 5 }, { "xor", asm_alu, 6 }, { "cmp", asm_alu, 7 },
+	{ "test", asm_test, 0 },
+	{ "mov", asm_mov, 0 }, { "movabs", asm_mov, 1 },
+	{ "lea", asm_lea, 0 },
+	{ "push", asm_pushpop, 1 }, { "pop", asm_pushpop, 0 },
+	{ "inc", asm_incdec, 0 }, { "dec", asm_incdec, 1 },
+	{ "call", asm_branch, 0xe8 }, { "jmp", asm_branch, 0xe9 },
+	{ "ret", asm_simple, 0xc3 }, { "nop", asm_simple, 0x90 },
+	{ "pushf", asm_simple, 0x9c }, { "popf", asm_simple, 0x9d },
+	{ NULL }
+};
+
+
+/**
+ * Looks up a mnemonic, possibly followed by an AT&T size suffix.
+ */
+static bool find_mnemonic(const char *name, x86_asm_handler *handler, int *arg, unsigned int *suffix) {
+	char base[X86_ASM_MAX_NAME];
+	size_t len;
+	int i;
+
+	*suffix = 0;
+
+	if (name[0] == 'j' || name[0] == 'J') {
+		for (i = 0; conditions[i].name; i++) {
+			if (!strcasecmp(name + 1, conditions[i].name)) {
+				*handler = asm_jcc;
+				*arg = conditions[i].cc;
+				return true;
+			}
+		}
+	}
+
+	for (i = 0; mnemonics[i].name; i++) {
+		if (!strcasecmp(name, mnemonics[i].name)) {
+			*handler = mnemonics[i].handler;
+			*arg = mnemonics[i].arg;
+			return true;
+		}
+	}
+
+	len = strlen(name);
+	if (len < 2 || len >= sizeof(base)) {
+		return false;
+	}
+
+	switch (tolower((unsigned char) name[len - 1])) {
+		case 'b': *suffix = 1; break;
+		case 'w': *suffix = 2; break;
+		case 'l': *suffix = 4; break;
+		case 'q': *suffix = 8; break;
+		default: return false;
+	}
+
+	memcpy(base, name, len - 1);
+	base[len - 1] = '\0';
+
+	for (i = 0; mnemonics[i].name; i++) {
+		if (!strcasecmp(base, mnemonics[i].name)) {
+			*handler = mnemonics[i].handler;
+			*arg = mnemonics[i].arg;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+// ---------------------------------------------------------------------------
+// Statements and labels
+// ---------------------------------------------------------------------------
+
+static void define_label(x86_asm_state *st, char *name) {
+	x86_label *label;
+	unsigned int i;
+
+	if (strlen(name) == 0 || strlen(name) >= X86_ASM_MAX_NAME) {
+		asm_error(st, "Invalid label name\n");
+	}
+
+	if (!isdigit((unsigned char) name[0])) {
+		for (i = 0; i < st->nlabels; i++) {
+			if (str_equal(st->labels[i].name, name)) {
+				asm_error(st, "Label '%s' defined twice\n", name);
+			}
+		}
+	}
+
+	if (st->nlabels == X86_ASM_MAX_LABELS) {
+		asm_error(st, "Too many labels\n");
+	}
+
+	label = &st->labels[st->nlabels++];
+	strcpy(label->name, name);
+	label->stmt = st->stmt;
+	label->offset = st->pos;
+}
+
+static void assemble_statement(x86_asm_state *st, char *stmt, bool intel) {
+	x86_operand ops[X86_ASM_MAX_OPERANDS];
+	char *operands[X86_ASM_MAX_OPERANDS];
+	char mnemonic[X86_ASM_MAX_NAME];
+	x86_asm_handler handler;
+	unsigned int suffix;
+	size_t len;
+	int nops, arg, i;
+	char *p;
+
+	st->line = stmt;
+
+	// Strip comments
+	if ((p = strchr(stmt, '#')) != NULL) {
+		*p = '\0';
+	}
+
+	trim(stmt);
+
+	// Labels
+	while ((len = ident_length(stmt)) > 0 && *skip_spaces(stmt + len) == ':') {
+		stmt[len] = '\0';
+		define_label(st, stmt);
+		memmove(stmt, skip_spaces(stmt + len + 1) , strlen(skip_spaces(stmt + len + 1)) + 1);
+	}
+
+	if (*stmt == '\0') {
+		return;
+	}
+
+	len = ident_length(stmt);
+	if (len == 0 || len >= sizeof(mnemonic)) {
+		asm_error(st, "Invalid mnemonic\n");
+	}
+
+	memcpy(mnemonic, stmt, len);
+	mnemonic[len] = '\0';
+
+	if (!find_mnemonic(mnemonic, &handler, &arg, &suffix)) {
+		asm_error(st, "Unsupported instruction '%s'\n", mnemonic);
+	}
+
+	nops = split_operands(st, stmt + len, operands);
+
+	for (i = 0; i < nops; i++) {
+		memset(&ops[i], 0, sizeof(x86_operand));
+		ops[i].base = ops[i].index = -1;
+		ops[i].scale = 1;
+
+		trim(operands[i]);
+
+		if (intel) {
+			parse_intel_operand(st, operands[i], &ops[i]);
+		} else {
+			parse_att_operand(st, operands[i], &ops[i]);
+		}
+
+		if (ops[i].indirect && intel) {
+			asm_error(st, "Unexpected '*' in Intel syntax\n");
+		}
+	}
+
+	// Internally operands are always kept in Intel order (destination first)
+	if (!intel && nops == 2) {
+		x86_operand swap = ops[0];
+		ops[0] = ops[1];
+		ops[1] = swap;
+	}
+
+	st->start = st->pos;
+	st->fixed = false;
+
+	handler(st, arg, suffix, ops, nops);
+
+	hnotice(6, "Assembled '%s' (%zu bytes)\n", st->line, st->pos - st->start);
+}
+
+/**
+ * Resolves a label reference: numeric labels use the 'Nf'/'Nb' notation
+ * to refer to the next or the previous definition of 'N'.
+ */
+static x86_label *resolve_label(x86_asm_state *st, x86_label_ref *ref) {
+	x86_label *found;
+	size_t len;
+	unsigned int i;
+	char dir;
+
+	len = strlen(ref->name);
+	found = NULL;
+
+	if (isdigit((unsigned char) ref->name[0])) {
+		dir = tolower((unsigned char) ref->name[len - 1]);
+
+		if (dir != 'f' && dir != 'b') {
+			return NULL;
+		}
+
+		for (i = 0; i < st->nlabels; i++) {
+			if (strlen(st->labels[i].name) != len - 1 || strncmp(st->labels[i].name, ref->name, len - 1)) {
+				continue;
+			}
+
+			if (dir == 'b' && st->labels[i].stmt <= ref->stmt) {
+				found = &st->labels[i];
+			} else if (dir == 'f' && st->labels[i].stmt > ref->stmt) {
+				return &st->labels[i];
+			}
+		}
+
+		return found;
+	}
+
+	for (i = 0; i < st->nlabels; i++) {
+		if (str_equal(st->labels[i].name, ref->name)) {
+			return &st->labels[i];
+		}
+	}
+
+	return NULL;
+}
+
+
+size_t x86_assemble(char *source, bool intel, unsigned char *code, size_t size,
+		x86_fixup *fixups, unsigned int *nfixups) {
+	x86_asm_state *st;
+	x86_label *label;
+	x86_label_ref *ref;
+	x86_fixup *fixup;
+	char line[X86_ASM_MAX_LINE];
+	int32_t displacement;
+	size_t len, written;
+	unsigned int i;
+	char *p;
+
+	st = calloc(sizeof(x86_asm_state), 1);
+	if (st == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	st->code = code;
+	st->size = size;
+	st->fixups = fixups;
+
+	hnotice(4, "Assembling '%s' (%s syntax)\n", source, intel ? "Intel" : "AT&T");
+
+	// Statements are separated either by newlines or semicolons
+	for (p = source; *p; st->stmt++) {
+		len = strcspn(p, ";\n");
+
+		if (len >= sizeof(line)) {
+			herror(true, "Assembly statement too long: '%.*s'\n", (int) len, p);
+		}
+
+		memcpy(line, p, len);
+		line[len] = '\0';
+
+		assemble_statement(st, line, intel);
+
+		p += len;
+		if (*p) {
+			p++;
+		}
+	}
+
+	// Resolve the branch targets
+	for (i = 0; i < st->nrefs; i++) {
+		ref = &st->refs[i];
+		st->line = ref->name;
+
+		label = resolve_label(st, ref);
+
+		if (label) {
+			displacement = (int32_t) ((long) label->offset - (long) (ref->at + 4));
+			memcpy(code + ref->at, &displacement, sizeof(displacement));
+			continue;
+		}
+
+		if (isdigit((unsigned char) ref->name[0])) {
+			herror(true, "Undefined local label '%s'\n", ref->name);
+		}
+
+		// Not a local label: the branch targets an external symbol
+		if (st->nfixups == X86_ASM_MAX_FIXUPS) {
+			herror(true, "Too many symbolic references\n");
+		}
+
+		fixup = &fixups[st->nfixups++];
+		fixup->offset = ref->start;
+		fixup->type = RELOC_PCREL_32;
+		fixup->addend = 0;
+		strcpy(fixup->name, ref->name);
+	}
+
+	*nfixups = st->nfixups;
+	written = st->pos;
+
+	free(st);
+
+	hnotice(4, "Assembled %zu bytes with %u symbolic references\n", written, *nfixups);
+
+	return written;
+}
@@ -0,0 +1,76 @@
+/**
+*                       Copyright (C) 2008-2015 HPDCS Group
+*                       http://www.dis.uniroma1.it/~hpdcs
+*
+*
+* This file is part of the Hijacker static binary instrumentation tool.
+*
+* Hijacker is free software; you can redistribute it and/or modify it under the
+* terms of the GNU General Public License as published by the Free Software
+* Foundation; either version 3 of the License, or (at your option) any later
+* version.
+*
+* Hijacker is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+* A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* hijacker; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*
+* @file assemble-x86.h
+* @brief Minimal in-process x86-64 assembler for the Assembly rule tags
+*/
+
+#pragma once
+#ifndef ASSEMBLE_X86_H_
+#define ASSEMBLE_X86_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <ibr.h>
+
+/// Maximum length of a symbol or label name
+#define X86_ASM_MAX_NAME	128
+
+/// Maximum number of symbolic references in a single source
+#define X86_ASM_MAX_FIXUPS	64
+
+
+/**
+ * Symbolic reference emitted by the assembler which has to be turned
+ * into a relocation entry once the code is placed in the representation.
+ * The referenced field is always the one found at the instruction's
+ * opcode size, as expected by <em>symbol_instr_rela_create</em>.
+ */
+typedef struct {
+	unsigned int offset;            // Offset of the referencing instruction
+	char name[X86_ASM_MAX_NAME];    // Referenced symbol
+	reloc_type type;                // Kind of relocation
+	long addend;                    // Constant added to the symbol's value
+} x86_fixup;
+
+
+/**
+ * Assembles a sequence of x86-64 instructions, separated by newlines or
+ * semicolons. The supported subset covers mov, movabs, lea, push, pop,
+ * pushf, popf, the ALU group (add, or, adc, sbb, and, sub, xor, cmp),
+ * test, inc, dec, call, jmp, jcc, ret and nop, with register, immediate
+ * and memory operands (including RIP-relative and %fs/%gs-relative ones).
+ * Local labels, either named or numeric ('1:' referenced as '1f'/'1b'),
+ * are resolved in place; any other name becomes a fixup.
+ *
+ * @param source String containing the instructions
+ * @param intel True if the source uses the Intel syntax, false for AT&T
+ * @param code Buffer that will hold the machine code
+ * @param size Size of the buffer
+ * @param fixups Array that will hold the symbolic references
+ * @param nfixups Pointer to a variable which will hold the number of fixups
+ *
+ * @return Number of bytes written into <em>code</em>
+ */
+size_t x86_assemble(char *source, bool intel, unsigned char *code, size_t size,
+	x86_fixup *fixups, unsigned int *nfixups);
+
+#endif /* ASSEMBLE_X86_H_ */
@@ -0,0 +1,358 @@
+/**
+*                       Copyright (C) 2008-2015 HPDCS Group
+*                       http://www.dis.uniroma1.it/~hpdcs
+*
+*
+* This file is part of the Hijacker static binary instrumentation tool.
+*
+* Hijacker is free software; you can redistribute it and/or modify it under the
+* terms of the GNU General Public License as published by the Free Software
+* Foundation; either version 3 of the License, or (at your option) any later
+* version.
+*
+* Hijacker is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+* A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* hijacker; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*
+* @file induction-x86.c
+* @brief Addresses of the x86-64 accesses which move by a stride across the
+* 	 iterations of a loop
+*/
+
+#include <hijacker.h>
+#include <prints.h>
+
+#include <executable.h>
+#include <instruction.h>
+
+#include <x86/x86.h>
+#include <x86/liveness-x86.h>
+#include <x86/induction-x86.h>
+
+
+/**
+ * Returns the opcode of an instruction, past its REX, along with the bytes
+ * which follow it, or NULL if it has any other prefix or belongs to the
+ * two-byte map.
+ */
+static unsigned char *plain_opcode(insn_info *instr, unsigned char *rex, size_t *left) {
+	insn_info_x86 *x86;
+	unsigned long pos;
+
+	x86 = &instr->i.x86;
+	*rex = 0;
+	pos = 0;
+
+	if (instr->opaque != NULL || x86->insn_size == 0 || is_prefix(x86->insn[0])) {
+		return NULL;
+	}
+
+	if (is_rex_prefix(x86->insn[pos], true)) {
+		*rex = x86->insn[pos++];
+	}
+
+	if (pos + 1 >= x86->insn_size || x86->insn[pos] == 0x0f) {
+		return NULL;
+	}
+
+	*left = x86->insn_size - pos;
+	return x86->insn + pos;
+}
+
+
+// Instructions writing a 32-bit register zero-extend the lower half of the
+// result, whichever half of their operands they read. A 64-bit operation
+// on such a value would add the whole of it instead, and is not modeled.
+static bool affine_offset(x86_affine *value, long long disp, bool wide, x86_affine *result) {
+	if (value->reg == X86_NOREG || (wide && value->narrow)) {
+		return false;
+	}
+
+	*result = *value;
+	result->disp += disp;
+	result->narrow = !wide;
+
+	return true;
+}
+
+static bool affine_add(x86_affine *value, x86_affine *other, long long disp, bool wide, x86_affine *result) {
+	if (value->reg == X86_NOREG || other->reg == X86_NOREG || value->reg == other->reg
+	    || value->addend != X86_NOREG || other->addend != X86_NOREG
+	    || (wide && (value->narrow || other->narrow))) {
+		return false;
+	}
+
+	result->reg = value->reg;
+	result->addend = other->reg;
+	result->disp = value->disp + other->disp + disp;
+	result->narrow = !wide;
+
+	return true;
+}
+
+
+/**
+ * Computes the value an instruction writes in a register, if it is either a
+ * copy of another one or the sum of other ones and a constant.
+ *
+ * @param instr Instruction descriptor
+ * @param value Values of the registers before the instruction
+ * @param dest Pointer to the register written
+ * @param result Pointer to the value written
+ *
+ * @return False if the value is not modeled
+ */
+static bool affine_transfer(insn_info *instr, x86_affine *value, unsigned char *dest, x86_affine *result) {
+	insn_info_x86 *x86;
+	unsigned char *opc, rex, reg, rm, sub;
+	long long imm;
+	size_t left;
+	bool wide;
+
+	opc = plain_opcode(instr, &rex, &left);
+	if (opc == NULL) {
+		return false;
+	}
+
+	x86 = &instr->i.x86;
+	wide = REXW(rex);
+	reg = ((opc[1] >> 3) & 0x7) | (REXR(rex) << 3);
+	rm = (opc[1] & 0x7) | (REXB(rex) << 3);
+	sub = (opc[1] >> 3) & 0x7;
+
+	// Only the lea has a memory operand
+	if ((opc[0] == 0x8d) == ((opc[1] & 0xc0) == 0xc0)) {
+		return false;
+	}
+
+	switch (opc[0]) {
+		case 0x89: case 0x8b:  // mov
+			*dest = opc[0] == 0x89 ? rm : reg;
+			*result = value[opc[0] == 0x89 ? reg : rm];
+			if (result->reg == X86_NOREG)
+				return false;
+			result->narrow |= !wide;
+			return true;
+
+		case 0x01: case 0x03:  // add
+			*dest = opc[0] == 0x01 ? rm : reg;
+			return affine_add(&value[*dest], &value[opc[0] == 0x01 ? reg : rm], 0, wide, result);
+
+		case 0x81: case 0x83:  // add and sub
+			if (sub != 0 && sub != 5)
+				return false;
+			imm = opc[0] == 0x83 ? (signed char) opc[2] : (long long) *(int *) (opc + 2);
+			*dest = rm;
+			return affine_offset(&value[rm], sub == 0 ? imm : -imm, wide, result);
+
+		case 0xff:             // inc and dec
+			if (sub != 0 && sub != 1)
+				return false;
+			*dest = rm;
+			return affine_offset(&value[rm], sub == 0 ? 1 : -1, wide, result);
+
+		case 0x8d:             // lea, unless its displacement is relocated
+			if (x86->uses_rip || !x86->has_base_register || !sv_empty(&instr->reference))
+				return false;
+			*dest = reg;
+			if (!x86->has_index_register)
+				return affine_offset(&value[x86->breg], x86->disp, wide, result);
+			if (x86->has_scale && x86->scale != 1)
+				return false;
+			return affine_add(&value[x86->breg], &value[x86->ireg], x86->disp, wide, result);
+	}
+
+	return false;
+}
+
+
+/**
+ * Tells how much the value of a register changes from an iteration to the
+ * next one, given the value it has at the end of the iteration.
+ */
+static bool affine_delta(x86_affine *last, unsigned char reg, long long *stride, signed char *step, bool *narrow) {
+	x86_affine *value, *added;
+
+	value = &last[reg];
+	*stride = 0;
+	*step = X86_NOREG;
+	*narrow = value->narrow;
+
+	if (value->reg != reg) {
+		return false;
+	}
+
+	if (value->addend == X86_NOREG) {
+		// Invariant registers must not be truncated either
+		if (value->disp == 0 && value->narrow)
+			return false;
+
+		*stride = value->narrow ? (int) value->disp : value->disp;
+		return true;
+	}
+
+	added = &last[(unsigned char) value->addend];
+	if (value->disp != 0 || added->reg != value->addend || added->addend != X86_NOREG
+	    || added->disp != 0 || added->narrow) {
+		return false;
+	}
+
+	*step = value->addend;
+	return true;
+}
+
+// Adds what a register contributes to the stride of the address
+static bool stride_add(x86_affine *last, signed char reg, unsigned char scale, x86_induction *ind) {
+	long long stride;
+	signed char step;
+	bool narrow;
+
+	if (reg == X86_NOREG) {
+		return true;
+	}
+
+	if (!affine_delta(last, reg, &stride, &step, &narrow)) {
+		return false;
+	}
+
+	ind->stride += stride * scale;
+
+	if (step != X86_NOREG) {
+		if (ind->step != X86_NOREG)
+			return false;
+
+		ind->step = step;
+		ind->step_scale = scale;
+		ind->step_narrow = narrow;
+	}
+
+	return true;
+}
+
+
+bool x86_induction_analyze(insn_info *access, x86_induction *ind) {
+	insn_info_x86 *x86;
+	insn_info *instr;
+	function *func;
+	block *blk, *prev;
+
+	x86_affine value[16], result;
+	unsigned long long written;
+	unsigned char reg, dest;
+	bool found;
+
+	x86 = &access->i.x86;
+
+	if (x86->uses_rip || (!x86->has_base_register && !x86->has_index_register)) {
+		return false;
+	}
+
+	blk = block_find(access);
+	if (blk == NULL || blk->begin == NULL || blk->end == NULL) {
+		return false;
+	}
+
+	// The only way out of the loop is the jump closing it, whose target must
+	// be the block itself, even if code has been placed before it meanwhile
+	ind->loop = blk;
+	ind->latch = blk->end;
+
+	if (!IS_JUMP(ind->latch) || IS_JUMPIND(ind->latch) || !IS_CONDITIONAL(ind->latch)
+	    || (ind->latch->jumpto != blk->begin
+	    && (blk->begin->virtual == NULL || ind->latch->jumpto != blk->begin->virtual))) {
+		return false;
+	}
+
+	func = find_func_from_instr(access, NEW_ADDR);
+	if (func == NULL || func->begin_blk == NULL || func->begin_blk == blk) {
+		return false;
+	}
+
+	for (prev = func->begin_blk; prev && prev->next != blk; prev = prev->next);
+	if (prev == NULL) {
+		return false;
+	}
+
+	ind->fallthrough = prev->end;
+	if (IS_RET(prev->end) || (IS_JUMP(prev->end) && !IS_CONDITIONAL(prev->end))) {
+		ind->fallthrough = NULL;
+	}
+
+	for (reg = 0; reg < 16; reg++) {
+		value[reg].reg = reg;
+		value[reg].addend = X86_NOREG;
+		value[reg].disp = 0;
+		value[reg].narrow = false;
+	}
+
+	found = false;
+
+	for (instr = blk->begin; instr; instr = instr->next) {
+		if (instr == access) {
+			ind->base = x86->has_base_register ? value[x86->breg] : (x86_affine) {X86_NOREG, X86_NOREG, 0, false};
+			ind->index = x86->has_index_register ? value[x86->ireg] : (x86_affine) {X86_NOREG, X86_NOREG, 0, false};
+			found = true;
+		}
+
+		if (IS_CALL(instr) || (instr != ind->latch && (IS_JUMP(instr) || IS_RET(instr)))) {
+			return false;
+		}
+
+		written = x86_register_writes(instr);
+
+		if (!affine_transfer(instr, value, &dest, &result)) {
+			dest = X86_RSP;
+		}
+
+		for (reg = 0; reg < 16; reg++) {
+			if (written & X86_REG(reg)) {
+				value[reg].reg = X86_NOREG;
+			}
+		}
+
+		if (dest != X86_RSP) {
+			value[dest] = result;
+		}
+
+		if (instr == ind->latch) {
+			break;
+		}
+	}
+
+	if (!found || instr == NULL) {
+		return false;
+	}
+
+	// Both the base and the index must be known where the access is made
+	if ((x86->has_base_register && (ind->base.reg == X86_NOREG || ind->base.reg == X86_RSP))
+	    || (x86->has_index_register && ind->index.reg == X86_NOREG)) {
+		return false;
+	}
+
+	ind->scale = x86->has_scale ? x86->scale : 1;
+	ind->stride = 0;
+	ind->step = X86_NOREG;
+	ind->step_scale = 0;
+	ind->step_narrow = false;
+
+	if (!stride_add(value, ind->base.reg, 1, ind) || !stride_add(value, ind->base.addend, 1, ind)
+	    || !stride_add(value, ind->index.reg, ind->scale, ind)
+	    || !stride_add(value, ind->index.addend, ind->scale, ind)) {
+		return false;
+	}
+
+	if (ind->step != X86_NOREG && ind->step_scale != 1 && ind->step_scale != 2
+	    && ind->step_scale != 4 && ind->step_scale != 8) {
+		return false;
+	}
+
+	hnotice(4, "Access at <%#08llx> moves by %lld bytes%s%s per iteration of the loop at <%#08llx>\n",
+		access->orig_addr, ind->stride, ind->step != X86_NOREG ? " plus a register" : "",
+		ind->step_narrow ? " (32 bits)" : "", blk->begin->orig_addr);
+
+	return true;
+}
@@ -0,0 +1,88 @@
+/**
+*                       Copyright (C) 2008-2015 HPDCS Group
+*                       http://www.dis.uniroma1.it/~hpdcs
+*
+*
+* This file is part of the Hijacker static binary instrumentation tool.
+*
+* Hijacker is free software; you can redistribute it and/or modify it under the
+* terms of the GNU General Public License as published by the Free Software
+* Foundation; either version 3 of the License, or (at your option) any later
+* version.
+*
+* Hijacker is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+* A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* hijacker; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*
+* @file induction-x86.h
+* @brief Addresses of the x86-64 accesses which move by a stride across the
+* 	 iterations of a loop
+*/
+
+#pragma once
+#ifndef INDUCTION_X86_H_
+#define INDUCTION_X86_H_
+
+#include <ibr.h>
+
+/// Register missing, or whose value is not known
+#define X86_NOREG	-1
+
+
+/**
+ * Value of a general purpose register at some point of an iteration, in terms
+ * of the values the registers had at the beginning of the iteration:
+ * <code>reg + addend + disp</code>, whose lower 32 bits are zero-extended if
+ * the value is narrow.
+ */
+typedef struct {
+	signed char reg;          // X86_NOREG if the value is not known
+	signed char addend;       // X86_NOREG if nothing is added
+	long long disp;
+	bool narrow;
+} x86_affine;
+
+/**
+ * Address of an access made once by every iteration of a loop, which moves
+ * by the same stride from one iteration to the next:
+ * <pre>
+ *	address = base + index * scale + displacement of the access
+ *	stride  = stride + step * step_scale
+ * </pre>
+ * where the registers are the ones at the beginning of the iteration.
+ */
+typedef struct {
+	block *loop;              // Block which makes up the whole loop
+	insn_info *latch;         // Conditional jump closing the loop
+	insn_info *fallthrough;   // Last instruction before the loop, if the control flows from it
+	x86_affine base;          // Value of the base of the access (reg is X86_NOREG if missing)
+	x86_affine index;         // Value of the index of the access (reg is X86_NOREG if missing)
+	unsigned char scale;
+	long long stride;         // Constant part of the stride
+	signed char step;         // Register whose value adds to the stride, or X86_NOREG
+	unsigned char step_scale;
+	bool step_narrow;         // Whether only the lower 32 bits of the step count, sign-extended
+} x86_induction;
+
+
+/**
+ * Tells whether an access is made once per iteration of a loop by a stride
+ * known at the entry of the loop. Only the loops made of a single block, with
+ * no call, are considered, in which the registers of the address are either
+ * invariant or induction variables, i.e. registers which are incremented by a
+ * constant or by an invariant register. Registers computed on 32 bits are
+ * assumed not to wrap around while the loop runs.
+ *
+ * @param access Instruction descriptor of the memory access
+ * @param ind Pointer to the description of the address, filled in if the
+ * access is made by a stride
+ *
+ * @return True if the access is made by a stride
+ */
+bool x86_induction_analyze(insn_info *access, x86_induction *ind);
+
+#endif /* INDUCTION_X86_H_ */
@@ -0,0 +1,715 @@
+/**
+*                       Copyright (C) 2008-2015 HPDCS Group
+*                       http://www.dis.uniroma1.it/~hpdcs
+*
+*
+* This file is part of the Hijacker static binary instrumentation tool.
+*
+* Hijacker is free software; you can redistribute it and/or modify it under the
+* terms of the GNU General Public License as published by the Free Software
+* Foundation; either version 3 of the License, or (at your option) any later
+* version.
+*
+* Hijacker is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+* A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* hijacker; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*
+* @file liveness-x86.c
+* @brief Registers read and written by the x86-64 instructions
+*/
+
+#include <string.h>
+
+#include <hijacker.h>
+#include <prints.h>
+
+#include <executable.h>
+#include <instruction.h>
+
+#include <x86/x86.h>
+#include <x86/liveness-x86.h>
+
+
+// Registers which may carry the arguments of a call, %al included as it
+// holds the number of vector arguments of variadic functions
+#define ABI_ARGUMENTS	(X86_REG(X86_RDI) | X86_REG(X86_RSI) | X86_REG(X86_RDX) \
+	| X86_REG(X86_RCX) | X86_REG(8) | X86_REG(9) | X86_REG(X86_RAX) | (0xffULL << 16))
+
+// Registers which a function called through the System V ABI may clobber
+// (RETURN_SCRATCH leaves out the ones carrying the return values)
+#define ABI_CLOBBERED	(X86_REG(X86_RAX) | X86_REG(X86_RCX) | X86_REG(X86_RDX) \
+	| X86_REG(X86_RSI) | X86_REG(X86_RDI) | X86_REG(8) | X86_REG(9) | X86_REG(10) \
+	| X86_REG(11) | X86_XMMS_ALL | X86_FLAGS)
+
+#define RETURN_SCRATCH	(ABI_CLOBBERED & ~(X86_REG(X86_RAX) | X86_REG(X86_RDX) \
+	| X86_XMM(0) | X86_XMM(1) | X86_FLAGS))
+
+// Partial or conditional writes of general purpose registers count as reads,
+// but are noted above the flags as well for x86_register_writes
+#define PARTIAL(reg)	((reg) << 33)
+
+
+/**
+ * Fields of an instruction which tell its operands apart.
+ */
+typedef struct {
+	unsigned char rex;        // REX prefix, or 0x00
+	bool opsize;              // Whether the operand size override (0x66) is there
+	unsigned char mandatory;  // Prefix selecting an SSE instruction (0x66, 0xf2 or 0xf3), or 0x00
+	bool escape;              // Whether the opcode belongs to the two-byte map (0x0f)
+	unsigned char opcode;
+	unsigned char modrm;      // Bytes following the opcode, meaningful only if
+	unsigned char sib;        // the instruction actually has them
+	int size;                 // Size of the general purpose operands
+} x86_operands;
+
+
+static bool decode_operands(insn_info_x86 *x86, x86_operands *op) {
+	unsigned long pos;
+
+	bzero(op, sizeof(x86_operands));
+
+	for (pos = 0; pos < x86->insn_size && is_prefix(x86->insn[pos]); pos++) {
+		if (x86->insn[pos] == 0x66) {
+			op->opsize = true;
+			if (!op->mandatory)
+				op->mandatory = 0x66;
+		}
+		else if (x86->insn[pos] == 0xf2 || x86->insn[pos] == 0xf3) {
+			op->mandatory = x86->insn[pos];
+		}
+	}
+
+	if (pos < x86->insn_size && is_rex_prefix(x86->insn[pos], true)) {
+		op->rex = x86->insn[pos++];
+	}
+
+	if (pos < x86->insn_size && x86->insn[pos] == 0x0f) {
+		op->escape = true;
+		pos++;
+	}
+
+	if (pos >= x86->insn_size) {
+		return false;
+	}
+
+	op->opcode = x86->insn[pos++];
+
+	// The three-byte maps are not modeled
+	if (op->escape && (op->opcode == 0x38 || op->opcode == 0x3a)) {
+		return false;
+	}
+
+	op->modrm = pos < x86->insn_size ? x86->insn[pos] : 0;
+	op->sib = pos + 1 < x86->insn_size ? x86->insn[pos + 1] : 0;
+	op->size = REXW(op->rex) ? 8 : (op->opsize ? 2 : 4);
+
+	return true;
+}
+
+
+/**
+ * Maps the number of a register operand to the register it belongs to:
+ * without REX, the byte registers 4 to 7 are %ah, %ch, %dh and %bh.
+ */
+static unsigned long long gpr(x86_operands *op, unsigned char num, int size) {
+	if (size == 1 && !op->rex && num >= 4 && num < 8) {
+		num -= 4;
+	}
+
+	return X86_REG(num);
+}
+
+static unsigned char reg_field(x86_operands *op) {
+	return ((op->modrm >> 3) & 0x7) | (REXR(op->rex) << 3);
+}
+
+static unsigned char rm_field(x86_operands *op) {
+	return (op->modrm & 0x7) | (REXB(op->rex) << 3);
+}
+
+static bool rm_is_register(x86_operands *op) {
+	return (op->modrm & 0xc0) == 0xc0;
+}
+
+// Registers which make up the address of the memory operand
+static unsigned long long address_registers(x86_operands *op) {
+	unsigned char base, index;
+	unsigned long long mask;
+
+	if (rm_is_register(op)) {
+		return 0;
+	}
+
+	if ((op->modrm & 0x7) == 0x4) {
+		mask = 0;
+		base = (op->sib & 0x7) | (REXB(op->rex) << 3);
+		index = ((op->sib >> 3) & 0x7) | (REXX(op->rex) << 3);
+
+		if ((op->modrm & 0xc0) != 0 || (op->sib & 0x7) != 0x5) {
+			mask |= X86_REG(base);
+		}
+		if (index != 0x4) {
+			mask |= X86_REG(index);
+		}
+
+		return mask;
+	}
+
+	// RIP-relative
+	if ((op->modrm & 0xc7) == 0x05) {
+		return 0;
+	}
+
+	return X86_REG(rm_field(op));
+}
+
+static unsigned long long rm_read(x86_operands *op, int size) {
+	return rm_is_register(op) ? gpr(op, rm_field(op), size) : address_registers(op);
+}
+
+static unsigned long long rm_xmm(x86_operands *op) {
+	return rm_is_register(op) ? X86_XMM(rm_field(op)) : address_registers(op);
+}
+
+// Writes narrower than 32 bits merge with the previous value of the register
+static void write_register(unsigned long long reg, int size, unsigned long long *use, unsigned long long *def) {
+	if (size >= 4) {
+		*def |= reg;
+	} else {
+		*use |= reg | PARTIAL(reg);
+	}
+}
+
+static void write_rm(x86_operands *op, int size, unsigned long long *use, unsigned long long *def) {
+	if (rm_is_register(op)) {
+		write_register(gpr(op, rm_field(op), size), size, use, def);
+	} else {
+		*use |= address_registers(op);
+	}
+}
+
+
+static bool usage_primary(x86_operands *op, unsigned long long *use, unsigned long long *def) {
+	unsigned char opc, sub, alu;
+	unsigned long long reg;
+	int size;
+
+	opc = op->opcode;
+	sub = (op->modrm >> 3) & 0x7;
+	size = op->size;
+
+	// add, or, adc, sbb, and, sub, xor and cmp
+	if (opc < 0x40 && (opc & 0x7) < 6) {
+		alu = opc >> 3;
+		size = (opc & 0x1) ? size : 1;
+		reg = gpr(op, reg_field(op), size);
+
+		switch (opc & 0x7) {
+			case 0: case 1:
+			case 2: case 3:
+				// Zeroing idiom
+				if ((alu == 5 || alu == 6) && rm_is_register(op) && reg_field(op) == rm_field(op) && size >= 4) {
+					*def |= reg;
+					break;
+				}
+
+				*use |= reg | rm_read(op, size);
+
+				if (alu == 7)
+					break;
+
+				if (opc & 0x2)
+					write_register(reg, size, use, def);
+				else
+					write_rm(op, size, use, def);
+				break;
+
+			default:
+				*use |= X86_REG(X86_RAX);
+				if (alu != 7)
+					write_register(X86_REG(X86_RAX), size, use, def);
+				break;
+		}
+
+		*def |= X86_FLAGS;
+		if (alu == 2 || alu == 3)
+			*use |= X86_FLAGS;
+
+		return true;
+	}
+
+	switch (opc) {
+		case 0x50 ... 0x57:    // push
+			*use |= X86_REG((opc & 0x7) | (REXB(op->rex) << 3));
+			return true;
+
+		case 0x58 ... 0x5f:    // pop
+			write_register(X86_REG((opc & 0x7) | (REXB(op->rex) << 3)), op->opsize ? 2 : 8, use, def);
+			return true;
+
+		case 0x63:             // movsxd
+			*use |= rm_read(op, 4);
+			write_register(gpr(op, reg_field(op), size), size, use, def);
+			return true;
+
+		case 0x68: case 0x6a:  // push imm
+			return true;
+
+		case 0x69: case 0x6b:  // imul reg, r/m, imm
+			*use |= rm_read(op, size);
+			write_register(gpr(op, reg_field(op), size), size, use, def);
+			*def |= X86_FLAGS;
+			return true;
+
+		case 0x70 ... 0x7f:    // jcc
+			*use |= X86_FLAGS;
+			return true;
+
+		case 0x80: case 0x81: case 0x83:
+			size = opc == 0x80 ? 1 : size;
+			*use |= rm_read(op, size);
+			if (sub != 7)
+				write_rm(op, size, use, def);
+			*def |= X86_FLAGS;
+			if (sub == 2 || sub == 3)
+				*use |= X86_FLAGS;
+			return true;
+
+		case 0x84: case 0x85:  // test
+			size = opc == 0x84 ? 1 : size;
+			*use |= gpr(op, reg_field(op), size) | rm_read(op, size);
+			*def |= X86_FLAGS;
+			return true;
+
+		case 0x86: case 0x87:  // xchg
+			size = opc == 0x86 ? 1 : size;
+			reg = gpr(op, reg_field(op), size);
+			*use |= reg | rm_read(op, size);
+			write_register(reg, size, use, def);
+			write_rm(op, size, use, def);
+			return true;
+
+		case 0x88: case 0x89:  // mov r/m, reg
+			size = opc == 0x88 ? 1 : size;
+			*use |= gpr(op, reg_field(op), size);
+			write_rm(op, size, use, def);
+			return true;
+
+		case 0x8a: case 0x8b:  // mov reg, r/m
+			size = opc == 0x8a ? 1 : size;
+			*use |= rm_read(op, size);
+			write_register(gpr(op, reg_field(op), size), size, use, def);
+			return true;
+
+		case 0x8d:             // lea
+			*use |= address_registers(op);
+			write_register(gpr(op, reg_field(op), size), size, use, def);
+			return true;
+
+		case 0x90:             // nop, unless it exchanges %r8 with %rax
+			if (!REXB(op->rex))
+				return true;
+			/* fall through */
+		case 0x91 ... 0x97:    // xchg reg, rax
+			reg = X86_REG((opc & 0x7) | (REXB(op->rex) << 3));
+			*use |= reg | X86_REG(X86_RAX);
+			write_register(reg | X86_REG(X86_RAX), size, use, def);
+			return true;
+
+		case 0x98:             // cbw, cwde, cdqe
+			*use |= X86_REG(X86_RAX);
+			write_register(X86_REG(X86_RAX), size, use, def);
+			return true;
+
+		case 0x99:             // cwd, cdq, cqo
+			*use |= X86_REG(X86_RAX);
+			write_register(X86_REG(X86_RDX), size, use, def);
+			return true;
+
+		case 0xa8: case 0xa9:  // test rax, imm
+			*use |= X86_REG(X86_RAX);
+			*def |= X86_FLAGS;
+			return true;
+
+		case 0xb0 ... 0xb7:    // mov reg8, imm
+			write_register(gpr(op, (opc & 0x7) | (REXB(op->rex) << 3), 1), 1, use, def);
+			return true;
+
+		case 0xb8 ... 0xbf:    // mov reg, imm
+			write_register(X86_REG((opc & 0x7) | (REXB(op->rex) << 3)), size, use, def);
+			return true;
+
+		case 0xc0: case 0xc1:  // Shifts and rotations: a null count leaves the flags
+		case 0xd0: case 0xd1:  // untouched, and rotations only write CF and OF
+		case 0xd2: case 0xd3:
+			if (sub == 6)
+				return false;
+			size = (opc & 0x1) ? size : 1;
+			*use |= rm_read(op, size) | X86_FLAGS;
+			write_rm(op, size, use, def);
+			*def |= X86_FLAGS;
+			if (opc == 0xd2 || opc == 0xd3)
+				*use |= X86_REG(X86_RCX);
+			return true;
+
+		case 0xc6: case 0xc7:  // mov r/m, imm
+			if (sub != 0)
+				return false;
+			write_rm(op, opc == 0xc6 ? 1 : size, use, def);
+			return true;
+
+		case 0xc9:             // leave
+			*use |= X86_REG(X86_RBP);
+			*def |= X86_REG(X86_RBP);
+			return true;
+
+		case 0xe3:             // jrcxz
+			*use |= X86_REG(X86_RCX);
+			return true;
+
+		case 0xe9: case 0xeb:  // jmp
+			return true;
+
+		case 0xf5: case 0xf8: case 0xf9:  // cmc, clc, stc
+			*use |= X86_FLAGS;
+			*def |= X86_FLAGS;
+			return true;
+
+		case 0xfc: case 0xfd:  // cld, std
+			return true;
+
+		case 0xf6: case 0xf7:
+			size = opc == 0xf6 ? 1 : size;
+			*use |= rm_read(op, size);
+
+			switch (sub) {
+				case 0: case 1:    // test
+					break;
+
+				case 2:            // not
+					write_rm(op, size, use, def);
+					return true;
+
+				case 3:            // neg
+					write_rm(op, size, use, def);
+					break;
+
+				default:           // mul, imul, div, idiv
+					*use |= X86_REG(X86_RAX);
+					if (sub >= 6 && size > 1)
+						*use |= X86_REG(X86_RDX);
+
+					write_register(X86_REG(X86_RAX), size, use, def);
+					if (size > 1)
+						write_register(X86_REG(X86_RDX), size, use, def);
+					break;
+			}
+
+			*def |= X86_FLAGS;
+			return true;
+
+		case 0xfe: case 0xff:
+			size = opc == 0xfe ? 1 : size;
+
+			switch (sub) {
+				case 0: case 1:    // inc and dec, which leave CF untouched
+					*use |= rm_read(op, size) | X86_FLAGS;
+					write_rm(op, size, use, def);
+					*def |= X86_FLAGS;
+					return true;
+
+				case 4: case 6:    // jmp and push
+					if (opc == 0xfe)
+						return false;
+					*use |= rm_read(op, 8);
+					return true;
+			}
+			return false;
+	}
+
+	return false;
+}
+
+
+static bool usage_escape(x86_operands *op, unsigned long long *use, unsigned long long *def) {
+	unsigned char opc;
+	unsigned long long reg, xmm;
+	int size;
+
+	opc = op->opcode;
+	size = op->size;
+	reg = gpr(op, reg_field(op), size);
+	xmm = X86_XMM(reg_field(op));
+
+	switch (opc) {
+		case 0x18 ... 0x1f:    // Prefetches, hints and multi-byte nops
+			*use |= rm_read(op, 8);
+			return true;
+
+		case 0x10:             // movups, movupd, movss, movsd
+			*use |= rm_xmm(op);
+			if (op->mandatory == 0xf2 || op->mandatory == 0xf3) {
+				// Only the loads from memory clear the upper part
+				if (rm_is_register(op))
+					*use |= xmm;
+			}
+			*def |= xmm;
+			return true;
+
+		case 0x11:
+			*use |= xmm;
+			if (!rm_is_register(op)) {
+				*use |= address_registers(op);
+			} else if (op->mandatory == 0xf2 || op->mandatory == 0xf3) {
+				*use |= X86_XMM(rm_field(op));
+			} else {
+				*def |= X86_XMM(rm_field(op));
+			}
+			return true;
+
+		case 0x12 ... 0x17:    // Partial moves, unpacks
+		case 0x51 ... 0x5f:    // Arithmetics and conversions
+		case 0x70:             // Shuffles
+		case 0xc2: case 0xc6:  // Comparisons and shuffles
+			if (opc == 0x70 && op->mandatory == 0)
+				return false;
+
+			// Zeroing idiom (xorps, xorpd)
+			if (opc == 0x57 && rm_is_register(op) && reg_field(op) == rm_field(op)) {
+				*def |= xmm;
+				return true;
+			}
+
+			*use |= xmm | rm_xmm(op);
+			return true;
+
+		case 0x28:             // movaps, movapd
+			if (op->mandatory != 0 && op->mandatory != 0x66)
+				return false;
+			*use |= rm_xmm(op);
+			*def |= xmm;
+			return true;
+
+		case 0x29:
+			if (op->mandatory != 0 && op->mandatory != 0x66)
+				return false;
+			*use |= xmm;
+			if (rm_is_register(op))
+				*def |= X86_XMM(rm_field(op));
+			else
+				*use |= address_registers(op);
+			return true;
+
+		case 0x2a:             // cvtsi2ss, cvtsi2sd
+			if (op->mandatory != 0xf2 && op->mandatory != 0xf3)
+				return false;
+			*use |= xmm | rm_read(op, size);
+			return true;
+
+		case 0x2c: case 0x2d:  // cvt(t)ss2si, cvt(t)sd2si
+			if (op->mandatory != 0xf2 && op->mandatory != 0xf3)
+				return false;
+			*use |= rm_xmm(op);
+			write_register(reg, size, use, def);
+			return true;
+
+		case 0x2e: case 0x2f:  // ucomiss, comiss, ucomisd, comisd
+			*use |= xmm | rm_xmm(op);
+			*def |= X86_FLAGS;
+			return true;
+
+		case 0x40 ... 0x4f:    // cmovcc
+			*use |= X86_FLAGS | reg | PARTIAL(reg) | rm_read(op, size);
+			return true;
+
+		case 0x60 ... 0x6d:    // Integer unpacks, packs and comparisons
+		case 0x74 ... 0x76:
+		case 0xd1 ... 0xd5:
+		case 0xd8 ... 0xe6:
+		case 0xe8 ... 0xf6:
+		case 0xf8 ... 0xfe:
+			if (op->mandatory != 0x66)
+				return false;
+
+			// Zeroing idiom (pxor)
+			if (opc == 0xef && rm_is_register(op) && reg_field(op) == rm_field(op)) {
+				*def |= xmm;
+				return true;
+			}
+
+			*use |= xmm | rm_xmm(op);
+			return true;
+
+		case 0x6e:             // movd, movq xmm, r/m
+			if (op->mandatory != 0x66)
+				return false;
+			*use |= rm_read(op, size);
+			*def |= xmm;
+			return true;
+
+		case 0x6f:             // movdqa, movdqu
+			if (op->mandatory != 0x66 && op->mandatory != 0xf3)
+				return false;
+			*use |= rm_xmm(op);
+			*def |= xmm;
+			return true;
+
+		case 0x7e:
+			if (op->mandatory == 0x66) {
+				// movd, movq r/m, xmm
+				*use |= xmm;
+				write_rm(op, REXW(op->rex) ? 8 : 4, use, def);
+				return true;
+			}
+			if (op->mandatory == 0xf3) {
+				// movq xmm, xmm/m64
+				*use |= rm_xmm(op);
+				*def |= xmm;
+				return true;
+			}
+			return false;
+
+		case 0x7f:             // movdqa, movdqu
+		case 0xd6:             // movq xmm/m64, xmm
+		case 0xe7:             // movntdq
+			if ((opc == 0x7f && op->mandatory != 0x66 && op->mandatory != 0xf3)
+			    || (opc != 0x7f && op->mandatory != 0x66))
+				return false;
+			*use |= xmm;
+			if (rm_is_register(op))
+				*def |= X86_XMM(rm_field(op));
+			else
+				*use |= address_registers(op);
+			return true;
+
+		case 0x80 ... 0x8f:    // jcc
+			*use |= X86_FLAGS;
+			return true;
+
+		case 0x90 ... 0x9f:    // setcc
+			*use |= X86_FLAGS;
+			write_rm(op, 1, use, def);
+			return true;
+
+		case 0xaf:             // imul reg, r/m
+			*use |= reg | rm_read(op, size);
+			write_register(reg, size, use, def);
+			*def |= X86_FLAGS;
+			return true;
+
+		case 0xb6: case 0xbe:  // movzx, movsx from a byte
+			*use |= rm_read(op, 1);
+			write_register(reg, size, use, def);
+			return true;
+
+		case 0xb7: case 0xbf:  // movzx, movsx from a word
+			*use |= rm_read(op, 2);
+			write_register(reg, size, use, def);
+			return true;
+
+		case 0xbc: case 0xbd:  // bsf and bsr leave the destination alone on a null source
+			*use |= reg | PARTIAL(reg) | rm_read(op, size);
+			*def |= X86_FLAGS;
+			return true;
+
+		case 0xc8 ... 0xcf:    // bswap
+			reg = X86_REG((opc & 0x7) | (REXB(op->rex) << 3));
+			*use |= reg;
+			write_register(reg, size, use, def);
+			return true;
+	}
+
+	return false;
+}
+
+
+/**
+ * Computes the usage of an instruction, with the partial writes noted in the
+ * mask of the registers read as well.
+ *
+ * @return False if the registers written by the instruction are not known
+ */
+static bool register_usage(insn_info *instr, unsigned long long *use, unsigned long long *def) {
+	x86_operands op;
+	symbol *sym;
+	bool known;
+
+	*use = *def = 0;
+
+	if (instr->opaque != NULL || !decode_operands(&instr->i.x86, &op)) {
+		*use = X86_ALL;
+		return false;
+	}
+
+	known = false;
+
+	// Functions of the program may be compiled so that their callers keep
+	// values in the registers they do not touch (-fipa-ra): these calls
+	// are not assumed to clobber anything, and returns read every register
+	// unless the whole function is known (see x86_return_usage)
+	if (IS_CALL(instr)) {
+		*use = ABI_ARGUMENTS;
+		*def = X86_FLAGS;
+
+		if (IS_CALLIND(instr)) {
+			*use |= rm_read(&op, 8);
+			*def = ABI_CLOBBERED;
+		} else if (instr->jumpto == NULL) {
+			sym = sv_first(&instr->reference);
+			if (sym != NULL && sym->size == 0)
+				*def = ABI_CLOBBERED;
+		}
+	}
+
+	else if (IS_RET(instr)) {
+		*use = X86_REGS_ALL | X86_XMMS_ALL;
+	}
+
+	else if (IS_STRING(instr)) {
+		*use = X86_ALL;
+	}
+
+	else {
+		known = op.escape ? usage_escape(&op, use, def) : usage_primary(&op, use, def);
+
+		if (!known) {
+			hnotice(6, "Registers used by '%s' at <%#08llx> are not known\n",
+				instr->i.x86.mnemonic, instr->orig_addr);
+			*use = X86_ALL;
+			*def = 0;
+		}
+	}
+
+	// The stack pointer is never available
+	*use |= X86_REG(X86_RSP);
+
+	return known;
+}
+
+
+void x86_register_usage(insn_info *instr, unsigned long long *use, unsigned long long *def) {
+	register_usage(instr, use, def);
+	*use &= X86_ALL;
+}
+
+
+unsigned long long x86_register_writes(insn_info *instr) {
+	unsigned long long use, def;
+
+	if (!register_usage(instr, &use, &def)) {
+		return X86_ALL;
+	}
+
+	// Pushes and pops move the stack pointer without telling
+	return def | ((use >> 33) & X86_REGS_ALL) | X86_REG(X86_RSP);
+}
+
+
+unsigned long long x86_return_usage(unsigned long long written) {
+	return ((X86_REGS_ALL | X86_XMMS_ALL) & ~(written & RETURN_SCRATCH)) | X86_REG(X86_RSP);
+}
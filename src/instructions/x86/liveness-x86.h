@@ -0,0 +1,88 @@
+/**
+*                       Copyright (C) 2008-2015 HPDCS Group
+*                       http://www.dis.uniroma1.it/~hpdcs
+*
+*
+* This file is part of the Hijacker static binary instrumentation tool.
+*
+* Hijacker is free software; you can redistribute it and/or modify it under the
+* terms of the GNU General Public License as published by the Free Software
+* Foundation; either version 3 of the License, or (at your option) any later
+* version.
+*
+* Hijacker is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+* A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* hijacker; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*
+* @file liveness-x86.h
+* @brief Registers read and written by the x86-64 instructions
+*/
+
+#pragma once
+#ifndef LIVENESS_X86_H_
+#define LIVENESS_X86_H_
+
+#include <ibr.h>
+
+/// General purpose registers, in the order of their encoding
+#define X86_REG(n)	(1ULL << (n))
+
+/// XMM registers
+#define X86_XMM(n)	(1ULL << (16 + (n)))
+
+/// Arithmetic flags (CF, PF, AF, ZF, SF and OF), tracked as a whole
+#define X86_FLAGS	(1ULL << 32)
+
+#define X86_REGS_ALL	0xffffULL
+#define X86_XMMS_ALL	(0xffffULL << 16)
+#define X86_ALL		(X86_REGS_ALL | X86_XMMS_ALL | X86_FLAGS)
+
+#define X86_RAX	0
+#define X86_RCX	1
+#define X86_RDX	2
+#define X86_RBX	3
+#define X86_RSP	4
+#define X86_RBP	5
+#define X86_RSI	6
+#define X86_RDI	7
+
+
+/**
+ * Tells which registers an instruction reads and which ones it surely
+ * overwrites as a whole. Partial or conditional writes count as reads, and
+ * instructions which are not modeled read every register, so that the
+ * result never makes a live register look dead.
+ *
+ * @param instr Instruction descriptor
+ * @param use Pointer to the mask of the registers read
+ * @param def Pointer to the mask of the registers overwritten
+ */
+void x86_register_usage(insn_info *instr, unsigned long long *use, unsigned long long *def);
+
+/**
+ * Tells which registers an instruction may write, even partially or only
+ * under some condition. Calls, returns, string instructions and instructions
+ * which are not modeled may write any register.
+ *
+ * @param instr Instruction descriptor
+ *
+ * @return Mask of the registers written
+ */
+unsigned long long x86_register_writes(insn_info *instr);
+
+/**
+ * Tells which registers a return reads. Besides the return values and the
+ * registers the System V ABI preserves, callers compiled with -fipa-ra may
+ * keep values in any register the function never overwrites.
+ *
+ * @param written Mask of the registers overwritten by the function
+ *
+ * @return Mask of the registers read
+ */
+unsigned long long x86_return_usage(unsigned long long written);
+
+#endif /* LIVENESS_X86_H_ */
@@ -4561,7 +4561,7 @@ void format_addr_m (struct disassembly_state *state, enum addr_method addr,
 			base = state->sib & 0x07;
 
 			// Gestisce i registri estesi a 64 bit
-			if(state->addr_size == SIZE_64) {
+			if(state->mode64) {
 				// Estensione di idx
 				if(REXX(state->rex))
 					idx |= 0x08;
@@ -4590,7 +4590,8 @@ void format_addr_m (struct disassembly_state *state, enum addr_method addr,
 			}
 
 			// Se c'è un registro indice
-			if(idx != 0x4 && idx != 0xc) {
+			// Con REX.X, 100b indica %r12
+			if(idx != 0x4) {
 
 				// Controlla la scala
 				// [FV] if(!state->read_dest) {
@@ -4630,7 +4631,7 @@ void format_addr_m (struct disassembly_state *state, enum addr_method addr,
 		} else { // Non c'è SIB
 
 			// Gestisce i registri estesi a 64 bit
-			if(state->addr_size == SIZE_64) {
+			if(state->mode64) {
 				// Estensione di base
 				if(REXB(state->rex))
 					rm |= 0x08;
@@ -0,0 +1,335 @@
+/**
+*                       Copyright (C) 2008-2015 HPDCS Group
+*                       http://www.dis.uniroma1.it/~hpdcs
+*
+*
+* This file is part of the Hijacker static binary instrumentation tool.
+*
+* Hijacker is free software; you can redistribute it and/or modify it under the
+* terms of the GNU General Public License as published by the Free Software
+* Foundation; either version 3 of the License, or (at your option) any later
+* version.
+*
+* Hijacker is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+* A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* hijacker; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*
+* @file redzone-x86.c
+* @brief Use of the red zone by the x86-64 functions
+*/
+
+
+#include <string.h>
+
+#include <hijacker.h>
+#include <prints.h>
+
+#include <executable.h>
+#include <instruction.h>
+
+#include <x86/x86.h>
+#include <x86/liveness-x86.h>
+#include <x86/redzone-x86.h>
+
+
+/**
+ * Returns the opcode of an instruction, past its prefixes and REX, along with
+ * the bytes which follow it, or NULL if it belongs to the two-byte map.
+ */
+static unsigned char *primary_opcode(insn_info *instr, unsigned char *rex, size_t *left) {
+	insn_info_x86 *x86;
+	unsigned long pos;
+
+	x86 = &instr->i.x86;
+	*rex = 0;
+
+	for (pos = 0; pos < x86->insn_size && is_prefix(x86->insn[pos]); pos++);
+
+	if (pos < x86->insn_size && is_rex_prefix(x86->insn[pos], true)) {
+		*rex = x86->insn[pos++];
+	}
+
+	if (pos >= x86->insn_size || x86->insn[pos] == 0x0f) {
+		return NULL;
+	}
+
+	*left = x86->insn_size - pos;
+	return x86->insn + pos;
+}
+
+static bool is_instruction(insn_info *instr, unsigned char *bytes, size_t size) {
+	return instr != NULL && instr->opaque == NULL && instr->i.x86.insn_size == size
+		&& !memcmp(instr->i.x86.insn, bytes, size);
+}
+
+// push %rbp; mov %rsp,%rbp
+static bool is_frame_setup(insn_info *instr) {
+	return is_instruction(instr, (unsigned char []) {0x55}, 1)
+		&& (is_instruction(instr->next, (unsigned char []) {0x48, 0x89, 0xe5}, 3)
+		|| is_instruction(instr->next, (unsigned char []) {0x48, 0x8b, 0xec}, 3));
+}
+
+// sub $imm,%rsp, or -1
+static long long frame_allocation(insn_info *instr) {
+	insn_info_x86 *x86;
+
+	if (instr == NULL || instr->opaque != NULL) {
+		return -1;
+	}
+
+	x86 = &instr->i.x86;
+
+	if (x86->insn_size == 4 && !memcmp(x86->insn, (unsigned char []) {0x48, 0x83, 0xec}, 3)) {
+		return (signed char) x86->insn[3];
+	}
+	if (x86->insn_size == 7 && !memcmp(x86->insn, (unsigned char []) {0x48, 0x81, 0xec}, 3)) {
+		return *(unsigned int *) (x86->insn + 3);
+	}
+
+	return -1;
+}
+
+// pop %rbp or leave, right before a return
+static bool is_frame_exit(insn_info *instr) {
+	return (is_instruction(instr, (unsigned char []) {0x5d}, 1)
+		|| is_instruction(instr, (unsigned char []) {0xc9}, 1))
+		&& instr->next != NULL && IS_RET(instr->next);
+}
+
+/**
+ * Tells whether an instruction has a memory operand based on a register, and
+ * the displacement from it, which is unknown if the operand has an index.
+ */
+static bool stack_operand(insn_info *instr, unsigned char reg, long long *disp, bool *known) {
+	insn_info_x86 *x86;
+
+	x86 = &instr->i.x86;
+
+	// The parser reports the register of an indirect jump as a base as well
+	if (!x86->has_base_register || x86->breg != reg || (x86->modrm >> 6) == 0x3) {
+		return false;
+	}
+
+	*disp = x86->disp;
+	*known = !x86->has_index_register;
+
+	return true;
+}
+
+// Whether the instruction moves the stack pointer, either explicitly or not
+static bool moves_stack(insn_info *instr, unsigned long long def) {
+	unsigned char *opc, rex;
+	size_t left;
+
+	if (def & X86_REG(X86_RSP)) {
+		return true;
+	}
+
+	opc = primary_opcode(instr, &rex, &left);
+	if (opc == NULL) {
+		return false;
+	}
+
+	switch (opc[0]) {
+		case 0x50 ... 0x5f:    // push, pop
+		case 0x68: case 0x6a:  // push imm
+		case 0x8f:             // pop r/m
+		case 0x9c: case 0x9d:  // pushf, popf
+		case 0xc8: case 0xc9:  // enter, leave
+			return true;
+
+		case 0xff:             // push r/m
+			return left > 1 && ((opc[1] >> 3) & 0x7) == 6;
+	}
+
+	return false;
+}
+
+// Whether the instruction copies the stack or the frame pointer elsewhere
+static bool copies_stack(insn_info *instr) {
+	unsigned char *opc, rex, src;
+	size_t left;
+
+	opc = primary_opcode(instr, &rex, &left);
+	if (opc == NULL || left < 2 || (opc[1] >> 6) != 0x3) {
+		return false;
+	}
+
+	if (opc[0] == 0x89) {
+		src = ((opc[1] >> 3) & 0x7) | (REXR(rex) << 3);
+	} else if (opc[0] == 0x8b) {
+		src = (opc[1] & 0x7) | (REXB(rex) << 3);
+	} else {
+		return false;
+	}
+
+	return src == X86_RSP || src == X86_RBP;
+}
+
+
+/**
+ * Finds out how a function uses the red zone.
+ *
+ * @param func Function descriptor
+ * @param setup Pointer receiving the last instruction of the prologue, if the
+ * red zone can be protected once for all the function
+ *
+ * @return Usage of the red zone
+ */
+static red_zone_usage red_zone_classify(function *func, insn_info **setup) {
+	insn_info *instr, *prologue;
+	unsigned long long use, def;
+	long long disp, size;
+	bool known, leaf, below_stack, below_frame, moves, copies, epilogue;
+	bool in_prologue;
+
+	*setup = NULL;
+
+	if (func->begin_insn == NULL || func->begin_insn->opaque != NULL) {
+		return RED_ZONE_USED;
+	}
+
+	// Locals of a standard frame lie below %rbp, down to what the prologue
+	// allocates; below that, they are in the red zone
+	prologue = NULL;
+	size = 0;
+
+	if (is_frame_setup(func->begin_insn)) {
+		prologue = func->begin_insn->next;
+
+		size = frame_allocation(prologue->next);
+		if (size >= 0) {
+			prologue = prologue->next;
+		} else {
+			size = 0;
+		}
+	}
+
+	leaf = true;
+	below_stack = below_frame = moves = copies = false;
+	in_prologue = prologue != NULL;
+
+	for (instr = func->begin_insn; instr; instr = instr->next) {
+		if (instr->opaque != NULL) {
+			return RED_ZONE_USED;
+		}
+
+		if (IS_CALL(instr)) {
+			leaf = false;
+			continue;
+		}
+
+		if (stack_operand(instr, X86_RSP, &disp, &known) && (!known || disp < 0)) {
+			below_stack = true;
+		}
+
+		if (prologue != NULL && stack_operand(instr, X86_RBP, &disp, &known) && (!known || disp < -size)) {
+			below_frame = true;
+		}
+
+		if (copies_stack(instr) && !(prologue != NULL && instr == func->begin_insn->next)) {
+			copies = true;
+		}
+
+		// The prologue and the epilogues are the only ones allowed
+		// to move the stack and the frame pointers. An epilogue popping
+		// %rbp needs the stack pointer not to have been moved at all
+		if (in_prologue) {
+			in_prologue = instr != prologue;
+			continue;
+		}
+
+		epilogue = prologue != NULL && (IS_RET(instr) || is_frame_exit(instr));
+
+		if (epilogue && !IS_RET(instr) && instr->i.x86.insn[0] == 0x5d && size > 0) {
+			moves = true;
+		}
+
+		if (epilogue) {
+			continue;
+		}
+
+		x86_register_usage(instr, &use, &def);
+
+		if (use == X86_ALL || moves_stack(instr, def) || (def & X86_REG(X86_RBP))) {
+			moves = true;
+		}
+	}
+
+	// Other functions are not expected to use the red zone, see GCC's
+	// ix86_red_zone_used(), which is only true for leaf functions
+	if (!below_stack && !below_frame && !(leaf && copies)) {
+		return RED_ZONE_UNUSED;
+	}
+
+	if (leaf && prologue != NULL && !below_stack && !copies && !moves) {
+		*setup = prologue;
+		return RED_ZONE_PROTECTED;
+	}
+
+	return RED_ZONE_USED;
+}
+
+
+/**
+ * Moves the stack pointer past the red zone right after the prologue of a
+ * function and back before each of its epilogues, which only need it if they
+ * pop %rbp rather than restoring the stack pointer from it.
+ *
+ * @param func Function descriptor
+ * @param setup Last instruction of the prologue
+ */
+static void red_zone_protect(function *func, insn_info *setup) {
+	insn_info *instr, *restore;
+	bool body;
+
+	unsigned char skip[8] = {0x48, 0x8d, 0xa4, 0x24, 0x80, 0xff, 0xff, 0xff};   // lea -0x80(%rsp),%rsp
+	unsigned char unskip[8] = {0x48, 0x8d, 0xa4, 0x24, 0x80, 0x00, 0x00, 0x00}; // lea 0x80(%rsp),%rsp
+
+	body = false;
+
+	for (instr = func->begin_insn; instr; instr = instr->next) {
+		if (body && is_frame_exit(instr) && instr->i.x86.insn[0] == 0x5d) {
+			insert_instructions_at(instr, unskip, sizeof(unskip), INSERT_BEFORE, &restore);
+
+			if (!instr->virtual) {
+				set_virtual_reference(instr, restore);
+			}
+		}
+
+		body = body || instr == setup;
+	}
+
+	insert_instructions_at(setup, skip, sizeof(skip), INSERT_AFTER, NULL);
+
+	hnotice(3, "Red zone of function '%s' protected after its prologue\n", func->name);
+}
+
+
+bool x86_red_zone_skip(insn_info *instr) {
+	function *func;
+	insn_info *setup;
+
+	func = find_func_from_instr(instr, NEW_ADDR);
+	if (func == NULL) {
+		return true;
+	}
+
+	if (func->red_zone == RED_ZONE_UNKNOWN) {
+		func->red_zone = red_zone_classify(func, &setup);
+
+		if (func->red_zone == RED_ZONE_PROTECTED) {
+			red_zone_protect(func, setup);
+		}
+
+		hnotice(4, "Function '%s' red zone usage: %s\n", func->name,
+			func->red_zone == RED_ZONE_UNUSED ? "none" :
+			func->red_zone == RED_ZONE_PROTECTED ? "frame" : "stack");
+	}
+
+	return func->red_zone == RED_ZONE_USED;
+}
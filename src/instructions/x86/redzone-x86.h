@@ -0,0 +1,57 @@
+/**
+*                       Copyright (C) 2008-2015 HPDCS Group
+*                       http://www.dis.uniroma1.it/~hpdcs
+*
+*
+* This file is part of the Hijacker static binary instrumentation tool.
+*
+* Hijacker is free software; you can redistribute it and/or modify it under the
+* terms of the GNU General Public License as published by the Free Software
+* Foundation; either version 3 of the License, or (at your option) any later
+* version.
+*
+* Hijacker is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+* A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* hijacker; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*
+* @file redzone-x86.h
+* @brief Use of the red zone by the x86-64 functions
+*/
+
+#pragma once
+#ifndef REDZONE_X86_H_
+#define REDZONE_X86_H_
+
+#include <ibr.h>
+
+/// Bytes below the stack pointer which a function may use as scratch space
+#define X86_RED_ZONE	128
+
+
+/**
+ * Tells whether the code placed at an instruction must move the stack pointer
+ * past the red zone before pushing anything. The function of the instruction
+ * is analyzed upon the first call:
+ * <ul>
+ * <li>if it never accesses the stack below the stack pointer, the red zone
+ * needs no protection;</li>
+ * <li>if it is a leaf function which only reaches below the stack pointer
+ * through a standard frame (<code>push %rbp; mov %rsp,%rbp</code>), the
+ * stack pointer is moved past the red zone once, after the prologue, and
+ * restored before the epilogue;</li>
+ * <li>otherwise, every piece of code placed in it must skip the red zone.</li>
+ * </ul>
+ * As GCC only uses the red zone in leaf functions, the other functions are
+ * deemed not to need a protection unless they visibly access it.
+ *
+ * @param instr Instruction the code is placed at
+ *
+ * @return True if the code must skip the red zone by itself
+ */
+bool x86_red_zone_skip(insn_info *instr);
+
+#endif /* REDZONE_X86_H_ */
@@ -25,6 +25,8 @@
 */
 
 #include <string.h>
+#include <limits.h>
+#include <stddef.h>
 
 #include <hijacker.h>
 #include <prints.h>
@@ -36,36 +38,865 @@
 #include <elf/handle-elf.h>
 #include <x86/x86.h>
 #include <x86/reverse-x86.h>
+#include <x86/liveness-x86.h>
+#include <x86/redzone-x86.h>
+#include <x86/induction-x86.h>
 
+// The MOVs which fill the trampoline structure have an 8-bit displacement
+// between their opcode and the immediate being relocated
+#define MOV_IMMEDIATE_SHIFT	1
 
-void x86_trampoline_prepare(insn_info *target, char *function_name, int where) {
+
+// Base of encode_lea() which stands for the instruction pointer
+#define LEA_RIP		-2
+
+
+/**
+ * Encodes a <code>lea disp32(base,index,scale),reg</code>. The displacement is
+ * always encoded on 32 bits, so that it can be relocated whatever its value is.
+ *
+ * @param reg Register written
+ * @param base Base register, X86_NOREG if missing or LEA_RIP
+ * @param index Index register, or X86_NOREG
+ * @param scale Scale of the index
+ * @param disp Displacement to encode
+ * @param wide Whether the whole register is written, rather than its lower
+ * 32 bits only
+ * @param bytes Buffer of at least 8 bytes receiving the instruction
+ *
+ * @return Size of the encoded instruction
+ */
+static size_t encode_lea(unsigned char reg, int base, int index, unsigned char scale, int disp, bool wide, unsigned char *bytes) {
+	unsigned char rex, ss;
+	size_t size;
+
+	rex = 0x40 | (wide ? 0x08 : 0x00) | ((reg & 0x08) ? 0x04 : 0x00);
+	if (index >= 0 && (index & 0x08))
+		rex |= 0x02;
+	if (base >= 0 && (base & 0x08))
+		rex |= 0x01;
+
+	size = 0;
+	if (rex != 0x40) {
+		bytes[size++] = rex;
+	}
+	bytes[size++] = 0x8d;
+
+	if (base == LEA_RIP) {
+		// mod = 00, r/m = 101: RIP-relative
+		bytes[size++] = ((reg & 0x07) << 3) | 0x05;
+	}
+
+	else if (base < 0 || index >= 0 || (base & 0x07) == 0x04) {
+		switch (scale) {
+			case 2: ss = 1; break;
+			case 4: ss = 2; break;
+			case 8: ss = 3; break;
+			default: ss = 0;
+		}
+
+		// mod = 10, r/m = 100: SIB and 32-bit displacement, unless there
+		// is no base, which is encoded as 101 with mod = 00
+		bytes[size++] = (base >= 0 ? 0x80 : 0x00) | ((reg & 0x07) << 3) | 0x04;
+		bytes[size++] = (ss << 6)
+			| ((index >= 0 ? (index & 0x07) : 0x04) << 3)
+			| (base >= 0 ? (base & 0x07) : 0x05);
+	}
+
+	else {
+		// mod = 10, r/m = base: 32-bit displacement
+		bytes[size++] = 0x80 | ((reg & 0x07) << 3) | (base & 0x07);
+	}
+
+	memcpy(bytes + size, &disp, sizeof(int));
+	size += sizeof(int);
+
+	return size;
+}
+
+
+/**
+ * Encodes a <code>lea disp32(...),%rdi</code> which computes the same effective
+ * address of the memory operand of an instruction.
+ *
+ * @param x86 Descriptor of the instruction accessing memory
+ * @param disp Displacement to encode
+ * @param bytes Buffer of at least 8 bytes receiving the instruction
+ *
+ * @return Size of the encoded instruction
+ */
+static size_t encode_access_lea(insn_info_x86 *x86, int disp, unsigned char *bytes) {
+	return encode_lea(X86_RDI,
+		x86->uses_rip ? LEA_RIP : (x86->has_base_register ? x86->breg : X86_NOREG),
+		x86->has_index_register ? x86->ireg : X86_NOREG,
+		x86->has_scale ? x86->scale : 1, disp, true, bytes);
+}
+
+
+/**
+ * Looks for the relocation applied to the displacement of an instruction.
+ *
+ * @param target Instruction descriptor
+ *
+ * @return Pointer to the relocation symbol, or NULL if the displacement is
+ * not relocated
+ */
+static symbol *find_disp_relocation(insn_info *target) {
+	insn_info_x86 *x86;
+	unsigned int rela_idx;
+	unsigned long long field;
+	symbol *sym;
+
+	x86 = &(target->i.x86);
+	field = target->new_addr + (x86->disp_offset - x86->initial);
+
+	sv_foreach(&target->reference, rela_idx, sym) {
+		if(sym->relocation.offset == field)
+			return sym;
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Returns the undefined symbol a call site refers to, which is created only
+ * once for all the call sites.
+ *
+ * @param name Name of the symbol
+ * @param sec Section the symbol is created in
+ */
+static symbol *external_symbol(char *name, section *sec) {
+	symbol *sym;
+
+	sym = find_symbol_by_name(name);
+	if(sym == NULL) {
+		sym = symbol_create(name, SYMBOL_UNDEF, SYMBOL_GLOBAL, sec, 0);
+	}
+
+	return sym;
+}
+
+
+/**
+ * Makes the code placed before the first instruction of a function part of
+ * the function, so that it is both emitted and found when relocating it.
+ *
+ * @param target Instruction before which the code has been placed
+ * @param first First instruction of the code
+ */
+static void include_in_function(insn_info *target, insn_info *first) {
+	function *func;
+
+	if(first->prev != NULL)
+		return;
+
+	func = find_func_from_instr(target, NEW_ADDR);
+	if(func && func->begin_insn == target) {
+		func->begin_insn = first;
+	}
+}
+
+
+/**
+ * Tells whether the effective address of an access can be rebuilt by a LEA
+ * placed elsewhere, which is not the case of string instructions, segment
+ * overrides, operands not described by the ModR/M byte and unsupported
+ * relocated displacements.
+ *
+ * @param target Instruction descriptor of the memory access
+ * @param disp Pointer to the displacement the LEA must encode
+ * @param rela Pointer to the relocation the displacement of the LEA must
+ * receive, or NULL
+ *
+ * @return True if the address can be rebuilt
+ */
+static bool access_address(insn_info *target, long long *disp, symbol **rela) {
 	insn_info_x86 *x86;
+	bool absolute;
+	int idx;
+
+	x86 = &(target->i.x86);
+
+	if(x86->flags & I_STRING)
+		return false;
+
+	// A SIB without base (mod = 00, r/m = 100) only carries a displacement,
+	// which the parser records as the address of the operand
+	absolute = !x86->uses_rip && !x86->has_base_register && (x86->modrm & 0xc7) == 0x04;
+
+	if(!x86->uses_rip && !x86->has_base_register && !absolute)
+		return false;
+
+	// The LEA would not add the segment base, nor truncate the address
+	for(idx = 0; idx < 4; idx++) {
+		if(x86->prefix[idx] == 0x64 || x86->prefix[idx] == 0x65 || x86->prefix[idx] == 0x67)
+			return false;
+	}
+
+	*disp = absolute ? (int) x86->addr : x86->disp;
+	*rela = (x86->disp_size || absolute) ? find_disp_relocation(target) : NULL;
+
+	if(*rela != NULL) {
+		// The field is rewritten by the linker
+		*disp = 0;
+
+		switch((*rela)->relocation.type) {
+			case R_X86_64_PC32:
+			case R_X86_64_PLT32:
+				if(!x86->uses_rip)
+					return false;
+				break;
+
+			case R_X86_64_32:
+			case R_X86_64_32S:
+				if(x86->uses_rip)
+					return false;
+				break;
+
+			default:
+				return false;
+		}
+	}
+
+	// A RIP-relative operand can be rebuilt elsewhere only through its relocation
+	else if(x86->uses_rip)
+		return false;
+
+	return true;
+}
+
+
+/**
+ * Duplicates the relocation of the displacement of an access onto the LEA
+ * rebuilding its address, whose displacement is the last field.
+ *
+ * @param target Instruction descriptor of the memory access
+ * @param rela Relocation of the displacement of the access
+ * @param lea Instruction descriptor of the LEA
+ * @param disp Displacement the LEA would encode, which adds to the relocation
+ */
+static void relocate_lea(insn_info *target, symbol *rela, insn_info *lea, long long disp) {
+	insn_info_x86 *x86;
+	symbol *sym;
+
+	x86 = &(target->i.x86);
+
+	if(x86->uses_rip) {
+		sym = symbol_instr_rela_create(rela, lea, RELOC_PCREL_32);
+
+		// The original addend was computed against the end of the target,
+		// while the displacement is the last field of the LEA
+		sym->relocation.addend = rela->relocation.addend + disp
+			+ (long) (target->size - (x86->disp_offset - x86->initial) - sizeof(int));
+	} else {
+		sym = symbol_instr_rela_create(rela, lea,
+			rela->relocation.type == R_X86_64_32 ? RELOC_ABS_32 : RELOC_ABS_32S);
+		sym->relocation.addend = rela->relocation.addend + disp;
+	}
+}
+
+
+/**
+ * Instruments a memory access with a call site specialized on its addressing
+ * mode. The effective address is computed in place by a single LEA into %rdi,
+ * the size of the access is loaded into %rsi and the user function is reached
+ * through <em>trampoline_access</em>, which only preserves what the System V
+ * ABI allows the function to clobber:
+ *
+ * <pre>
+ *	lea -128(%rsp),%rsp
+ *	push %rdi
+ *	push %rsi
+ *	push %rax
+ *	lea EA,%rdi
+ *	mov $size,%esi
+ *	lea function(%rip),%rax
+ *	call trampoline_access
+ *	pop %rax
+ *	pop %rsi
+ *	pop %rdi
+ *	lea 128(%rsp),%rsp
+ * </pre>
+ *
+ * Neither LEA nor PUSH touch the flags, which are therefore saved by the entry.
+ * The red zone is skipped only if the enclosing function relies on it (see
+ * x86_red_zone_skip()). Registers whose value is dead at the call site are
+ * neither pushed nor popped, and the entry is chosen among the variants which skip the flags
+ * or the XMM registers when those are dead as well.
+ * Accesses whose address cannot be rebuilt this way (string instructions,
+ * segment overrides, operands not described by the ModR/M byte or unsupported
+ * relocated displacements) are left to the generic trampoline.
+ *
+ * Batched accesses reach <em>trampoline_batch</em> instead, and a MOVABS
+ * loads %rsi with the identifier of the call site as well as the size.
+ * Accesses handed as ranges which could not be hoisted out of a loop reach
+ * the <em>trampoline_range</em> variants, which make a range out of them.
+ *
+ * @param target Instruction descriptor of the memory access
+ * @param function_name Name of the function to call
+ * @param where Whether the call site goes before or after the target
+ * @param mode How the access is handed to the function
+ * @param site Identifier of the call site, if the access is batched
+ *
+ * @return True if the call site has been emitted, false if the access must be
+ * instrumented with the generic trampoline
+ */
+static bool x86_trampoline_specialize(insn_info *target, char *function_name, int where, trampoline_mode mode, unsigned int site) {
+	insn_info_x86 *x86;
+	insn_info *instr, *first, *lea;
+	symbol *sym, *rela;
+
+	unsigned char bytes[8];
+	unsigned long long dead;
+	long long disp;
+	bool red_zone;
+	size_t size;
+	int idx, saved, placed;
+
+	// Registers clobbered by the call site, in the order they are pushed
+	static const unsigned char clobbered[3] = {X86_RDI, X86_RSI, X86_RAX};
+
+	static char *entries[2][4] = {
+		{
+			"trampoline_access",
+			"trampoline_access_noflags",
+			"trampoline_access_noxmm",
+			"trampoline_access_noflags_noxmm",
+		}, {
+			"trampoline_range",
+			"trampoline_range_noflags",
+			"trampoline_range_noxmm",
+			"trampoline_range_noflags_noxmm",
+		}
+	};
+
+	unsigned char skip[5] = {0x48, 0x8d, 0x64, 0x24, 0x80};   // lea -0x80(%rsp),%rsp
+	unsigned char save[3];
+	unsigned char size_mov[5] = {0xbe, 0x00, 0x00, 0x00, 0x00};
+	unsigned char info_mov[10] = {0x48, 0xbe, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	unsigned char func_lea[7] = {0x48, 0x8d, 0x05, 0x00, 0x00, 0x00, 0x00};
+	unsigned char call[5] = {0xe8, 0x00, 0x00, 0x00, 0x00};
+	unsigned char leave[11];
+	unsigned char unskip[8] = {0x48, 0x8d, 0xa4, 0x24, 0x80, 0x00, 0x00, 0x00}; // lea 0x80(%rsp),%rsp
+
+	x86 = &(target->i.x86);
+
+	if(!access_address(target, &disp, &rela))
+		return false;
+
+	dead = insn_dead_registers(target, where);
+
+	saved = 0;
+	for(idx = 0; idx < 3; idx++) {
+		if(!(dead & X86_REG(clobbered[idx])))
+			save[saved++] = 0x50 + clobbered[idx];
+	}
+
+	red_zone = x86_red_zone_skip(target);
+
+	if(x86->has_base_register && x86->breg == 0x04)
+		disp += (red_zone ? X86_RED_ZONE : 0) + saved * 8;
+
+	if(disp < INT_MIN || disp > INT_MAX)
+		return false;
+
+	hnotice(4, "Specialize the call to '%s' on the access at <%#08llx>\n", function_name, target->new_addr);
+
+	size = encode_access_lea(x86, (int) disp, bytes);
+
+	// Only the first instruction is placed with respect to 'target': the
+	// others follow it, as a batch inserted before would be reversed
+	if(red_zone) {
+		insert_instructions_at(target, skip, sizeof(skip), where, &first);
+	} else if(saved > 0) {
+		insert_instructions_at(target, save, 1, where, &first);
+	} else {
+		insert_instructions_at(target, bytes, size, where, &first);
+	}
+	include_in_function(target, first);
+
+	// As for the generic trampoline, jumps toward 'target' must now reach the
+	// beginning of the call site
+	if(where == INSERT_BEFORE && !target->virtual) {
+		set_virtual_reference(target, first);
+	}
+
+	instr = first;
+	placed = red_zone ? 0 : 1;
+
+	if(saved > placed) {
+		insert_instructions_at(instr, save + placed, saved - placed, INSERT_AFTER, &instr);
+	}
+
+	if(red_zone || saved > 0) {
+		insert_instructions_at(instr, bytes, size, INSERT_AFTER, &lea);
+	} else {
+		lea = first;
+	}
+	instr = lea;
+
+	if(rela != NULL) {
+		relocate_lea(target, rela, lea, disp);
+	}
+
+	if(mode == TRAMPOLINE_BATCH) {
+		*(unsigned int *)(info_mov + 2) = (unsigned int) x86->span;
+		*(unsigned int *)(info_mov + 6) = site;
+		insert_instructions_at(instr, info_mov, sizeof(info_mov), INSERT_AFTER, &instr);
+	} else {
+		*(unsigned int *)(size_mov + 1) = (unsigned int) x86->span;
+		insert_instructions_at(instr, size_mov, sizeof(size_mov), INSERT_AFTER, &instr);
+	}
+
+	insert_instructions_at(instr, func_lea, sizeof(func_lea), INSERT_AFTER, &instr);
+	sym = external_symbol(function_name, NULL);
+	symbol_instr_rela_create(sym, instr, RELOC_PCREL_32);
+
+	insert_instructions_at(instr, call, sizeof(call), INSERT_AFTER, &instr);
+	if(mode == TRAMPOLINE_BATCH) {
+		sym = external_symbol("trampoline_batch", NULL);
+	} else {
+		idx = ((dead & X86_FLAGS) ? 1 : 0) | ((dead & X86_XMMS_ALL) == X86_XMMS_ALL ? 2 : 0);
+		sym = external_symbol(entries[mode == TRAMPOLINE_RANGE][idx], NULL);
+	}
+	symbol_instr_rela_create(sym, instr, RELOC_PCREL_32);
+
+	// The registers are popped in the reverse order
+	for(idx = 0; idx < saved; idx++) {
+		leave[idx] = 0x08 + save[saved - idx - 1];
+	}
+	size = saved;
+
+	if(red_zone) {
+		memcpy(leave + size, unskip, sizeof(unskip));
+		size += sizeof(unskip);
+	}
+
+	if(size > 0) {
+		insert_instructions_at(instr, leave, size, INSERT_AFTER, &instr);
+	}
+
+	hnotice(2, "Specialized trampoline call installed %s instruction at <%#08llx>\n",
+		where == INSERT_BEFORE ? "before" : "after", target->new_addr);
+
+	return true;
+}
+
+
+// Entries of a loop which the code capturing the start of a range is placed at
+#define HOIST_ENTRIES	16
+
+
+/**
+ * Places an instruction right after the last one placed, or with respect to
+ * 'target' if it is the first one: a batch inserted before would be reversed.
+ */
+static void place_instruction(insn_info *target, int where, unsigned char *bytes, size_t size, insn_info **first, insn_info **last) {
+	if(*first == NULL) {
+		insert_instructions_at(target, bytes, size, where, last);
+		include_in_function(target, *last);
+		*first = *last;
+	} else {
+		insert_instructions_at(*last, bytes, size, INSERT_AFTER, last);
+	}
+}
+
+
+// Whether a register value is not just the value of a register
+static bool affine_complex(x86_affine *value) {
+	return value->reg != X86_NOREG && (value->narrow || value->addend != X86_NOREG);
+}
+
+/**
+ * Encodes the LEAs computing the address of an access which moves by a stride
+ * into a register, from the value the registers have wherever they are placed.
+ * At most one of the base and the index can take a LEA on its own, which the
+ * last one adds to the rest of the address.
+ *
+ * @param ind Description of the address
+ * @param disp Displacement of the access
+ * @param reg Register written
+ * @param bytes Buffers receiving the instructions
+ * @param size Sizes of the instructions
+ * @param last Pointer to the displacement encoded by the last LEA
+ *
+ * @return Number of instructions, or zero if the address cannot be computed
+ */
+static int encode_hoisted_address(x86_induction *ind, long long disp, unsigned char reg,
+		unsigned char bytes[2][8], size_t *size, long long *last) {
+	x86_affine *value;
+	int base, index, count;
+
+	base = ind->base.reg;
+	index = ind->index.reg;
+	count = 0;
+
+	if(affine_complex(&ind->base) && affine_complex(&ind->index))
+		return 0;
+
+	if(ind->index.reg != X86_NOREG && !affine_complex(&ind->index))
+		disp += ind->index.disp * ind->scale;
+	if(ind->base.reg != X86_NOREG && !affine_complex(&ind->base))
+		disp += ind->base.disp;
+
+	value = affine_complex(&ind->index) ? &ind->index : (affine_complex(&ind->base) ? &ind->base : NULL);
+
+	if(value != NULL) {
+		// The rest of the address must not be read from the register
+		if((value == &ind->index && base == reg) || (value == &ind->base && index == reg))
+			return 0;
+
+		if(!value->narrow && (value->disp < INT_MIN || value->disp > INT_MAX))
+			return 0;
+
+		size[count] = encode_lea(reg, value->reg, value->addend, 1, (int) value->disp, !value->narrow, bytes[count]);
+		count++;
+
+		if(value == &ind->index)
+			index = reg;
+		else
+			base = reg;
+	}
+
+	if(disp < INT_MIN || disp > INT_MAX)
+		return 0;
+
+	size[count] = encode_lea(reg, base, index, ind->scale, (int) disp, true, bytes[count]);
+	count++;
+
+	*last = disp;
+	return count;
+}
+
+
+// Registers read within a loop, hence by the code computing any of its ranges
+static unsigned long long loop_registers(x86_induction *ind) {
 	insn_info *instr;
+	unsigned long long use, def, read;
+
+	read = 0;
+	for(instr = ind->loop->begin; instr != NULL; instr = instr->next) {
+		x86_register_usage(instr, &use, &def);
+		read |= use;
+
+		if(instr == ind->latch)
+			break;
+	}
+
+	return read;
+}
+
+
+// Lowest general purpose register which is dead, other than the stack pointer
+static int dead_register(unsigned long long dead) {
+	int reg;
+
+	for(reg = 0; reg < 16; reg++) {
+		if(reg != X86_RSP && (dead & X86_REG(reg)))
+			return reg;
+	}
+
+	return X86_NOREG;
+}
+
+
+/**
+ * Hoists the instrumentation of an access out of the loop it belongs to, if
+ * it moves by a stride across the iterations (see x86_induction_analyze()).
+ * Each entry of the loop stores the address of the first iteration into the
+ * slot of the call site in <em>trampoline_range_start</em>, using a register
+ * which is dead there:
+ *
+ * <pre>
+ *	lea EA,%reg
+ *	mov %reg,%fs:trampoline_range_start@tpoff+8*site
+ * </pre>
+ *
+ * The code is placed before the jumps entering the loop, which are redirected
+ * to it, and before the loop itself, which is only reached that way when the
+ * control falls into it. When the loop is over, the function is handed the
+ * whole range at once:
+ *
+ * <pre>
+ *	lea -128(%rsp),%rsp
+ *	push ...
+ *	lea EA,%rsi
+ *	lea stride(,%step,scale),%rdx
+ *	mov %fs:trampoline_range_start@tpoff+8*site,%rdi
+ *	mov $size,%ecx
+ *	lea function(%rip),%rax
+ *	call trampoline_access
+ *	pop ...
+ *	lea 128(%rsp),%rsp
+ * </pre>
+ *
+ * where EA is computed after the last iteration, hence one stride past the
+ * last address accessed. Registers are pushed only if they are live at the
+ * exit, and the red zone is skipped only if the function relies on it.
+ *
+ * @param target Instruction descriptor of the memory access
+ * @param function_name Name of the function to call
+ *
+ * @return True if the access has been hoisted, false if it must be
+ * instrumented where it is
+ */
+static bool x86_trampoline_hoist(insn_info *target, char *function_name) {
+	x86_induction ind;
+	insn_info *entry, *head, *exit, *jump, *first, *instr;
+	insn_info *points[HOIST_ENTRIES];
+	int scratch[HOIST_ENTRIES];
+	symbol *sym, *rela, *start;
+
+	unsigned char bytes[2][8], stride[2][8], save[5], leave[5];
+	size_t sizes[2], stride_sizes[2];
+	unsigned long long dead;
+	unsigned int site, jump_idx;
+	long long disp, last;
+	int count, stride_count, entries, saved, idx, reg;
+	bool red_zone, stride_first;
+
+	// Registers clobbered by the exit, in the order they are pushed
+	static const unsigned char clobbered[5] = {X86_RDI, X86_RSI, X86_RDX, X86_RCX, X86_RAX};
+
+	static char *trampolines[4] = {
+		"trampoline_access",
+		"trampoline_access_noflags",
+		"trampoline_access_noxmm",
+		"trampoline_access_noflags_noxmm",
+	};
+
+	unsigned char skip[5] = {0x48, 0x8d, 0x64, 0x24, 0x80};   // lea -0x80(%rsp),%rsp
+	unsigned char store[9] = {0x64, 0x48, 0x89, 0x04, 0x25, 0x00, 0x00, 0x00, 0x00}; // mov %reg,%fs:disp32
+	unsigned char load[9] = {0x64, 0x48, 0x8b, 0x3c, 0x25, 0x00, 0x00, 0x00, 0x00}; // mov %fs:disp32,%rdi
+	unsigned char size_mov[5] = {0xb9, 0x00, 0x00, 0x00, 0x00};
+	unsigned char func_lea[7] = {0x48, 0x8d, 0x05, 0x00, 0x00, 0x00, 0x00};
+	unsigned char call[5] = {0xe8, 0x00, 0x00, 0x00, 0x00};
+	unsigned char movslq[3] = {0x48, 0x63, 0xd0};             // movslq %e..,%rdx
+	unsigned char unskip[8] = {0x48, 0x8d, 0xa4, 0x24, 0x80, 0x00, 0x00, 0x00}; // lea 0x80(%rsp),%rsp
+
+	if(CURRENT(last_range_site) >= RANGE_SITES)
+		return false;
+
+	if(!access_address(target, &disp, &rela) || !x86_induction_analyze(target, &ind))
+		return false;
+
+	// Jumps toward the loop have been redirected to the code placed before it
+	head = ind.loop->begin;
+	entry = head->virtual ? head->virtual : head;
+	exit = ind.loop->next ? ind.loop->next->begin : NULL;
+
+	if(exit == NULL || !sv_empty(&head->pointedby) || !sv_empty(&entry->pointedby))
+		return false;
+
+	// Every entry needs a dead register to compute the address
+	entries = 0;
+
+	if(ind.fallthrough != NULL) {
+		points[entries] = entry;
+		scratch[entries++] = dead_register(insn_dead_registers(head, INSERT_BEFORE));
+	}
+
+	sv_foreach(&entry->targetof, jump_idx, jump) {
+		if(jump == ind.latch)
+			continue;
+
+		if(!IS_JUMP(jump) || IS_JUMPIND(jump) || jump->jumpto != entry || entries == HOIST_ENTRIES)
+			return false;
+
+		points[entries] = jump;
+		scratch[entries++] = dead_register(insn_dead_registers(jump, INSERT_BEFORE));
+	}
+
+	if(entry != head && !sv_empty(&head->targetof))
+		return false;
+
+	for(idx = 0; idx < entries; idx++) {
+		if(scratch[idx] == X86_NOREG
+		    || encode_hoisted_address(&ind, disp, scratch[idx], bytes, sizes, &last) == 0)
+			return false;
+	}
+
+	// The exit computes the address into %rsi and the stride into %rdx,
+	// whichever comes first does not overwrite what the other one reads
+	count = encode_hoisted_address(&ind, disp, X86_RSI, bytes, sizes, &last);
+	if(count == 0)
+		return false;
+
+	stride_count = 0;
+	if(ind.step == X86_NOREG) {
+		if(ind.stride < INT_MIN || ind.stride > INT_MAX)
+			return false;
+		stride_sizes[stride_count++] = encode_lea(X86_RDX, X86_NOREG, X86_NOREG, 1, (int) ind.stride, true, stride[0]);
+	} else {
+		if(ind.stride < INT_MIN || ind.stride > INT_MAX)
+			return false;
+
+		reg = ind.step;
+		if(ind.step_narrow) {
+			memcpy(stride[stride_count], movslq, sizeof(movslq));
+			stride[stride_count][0] |= (reg & 0x08) ? 0x01 : 0x00;
+			stride[stride_count][2] |= reg & 0x07;
+			stride_sizes[stride_count++] = sizeof(movslq);
+			reg = X86_RDX;
+		}
+		stride_sizes[stride_count] = encode_lea(X86_RDX, X86_NOREG, reg, ind.step_scale, (int) ind.stride, true, stride[stride_count]);
+		stride_count++;
+	}
+
+	stride_first = ind.step == X86_RSI;
+	if(stride_first && (ind.base.reg == X86_RDX || ind.base.addend == X86_RDX
+	    || ind.index.reg == X86_RDX || ind.index.addend == X86_RDX))
+		return false;
+
+	site = CURRENT(last_range_site)++;
+
+	hnotice(3, "Hoist the call to '%s' on the access at <%#08llx> out of the loop at <%#08llx> (site %u)\n",
+		function_name, target->orig_addr, head->orig_addr, site);
+
+	start = find_symbol_by_name("trampoline_range_start");
+	if(start == NULL) {
+		start = symbol_create("trampoline_range_start", SYMBOL_TLS, SYMBOL_GLOBAL, NULL, 0);
+	}
+
+	// The entries of the loop
+	for(idx = 0; idx < entries; idx++) {
+		count = encode_hoisted_address(&ind, disp, scratch[idx], bytes, sizes, &last);
+
+		first = NULL;
+		for(reg = 0; reg < count; reg++) {
+			place_instruction(points[idx], INSERT_BEFORE, bytes[reg], sizes[reg], &first, &instr);
+		}
+
+		if(rela != NULL) {
+			relocate_lea(target, rela, instr, last);
+		}
+
+		store[1] = 0x48 | ((scratch[idx] & 0x08) ? 0x04 : 0x00);
+		store[3] = 0x04 | ((scratch[idx] & 0x07) << 3);
+		place_instruction(points[idx], INSERT_BEFORE, store, sizeof(store), &first, &instr);
+
+		sym = symbol_instr_rela_create(start, instr, RELOC_TLSREL_32);
+		sym->relocation.addend = site * sizeof(unsigned long long);
+
+		if(points[idx] != entry && !points[idx]->virtual) {
+			set_virtual_reference(points[idx], first);
+		}
+	}
+
+	// The exit of the loop
+	// The exits of other accesses of the loop may follow this one, and read
+	// the registers it overwrites
+	dead = insn_dead_registers(exit, INSERT_BEFORE) & ~loop_registers(&ind);
+	red_zone = x86_red_zone_skip(ind.latch);
+
+	saved = 0;
+	for(idx = 0; idx < 5; idx++) {
+		if(!(dead & X86_REG(clobbered[idx])))
+			save[saved++] = 0x50 + clobbered[idx];
+	}
+
+	first = NULL;
+
+	if(red_zone) {
+		place_instruction(ind.latch, INSERT_AFTER, skip, sizeof(skip), &first, &instr);
+	}
+	for(idx = 0; idx < saved; idx++) {
+		place_instruction(ind.latch, INSERT_AFTER, save + idx, 1, &first, &instr);
+	}
+
+	if(stride_first) {
+		for(idx = 0; idx < stride_count; idx++)
+			place_instruction(ind.latch, INSERT_AFTER, stride[idx], stride_sizes[idx], &first, &instr);
+	}
+
+	count = encode_hoisted_address(&ind, disp, X86_RSI, bytes, sizes, &last);
+	for(idx = 0; idx < count; idx++) {
+		place_instruction(ind.latch, INSERT_AFTER, bytes[idx], sizes[idx], &first, &instr);
+	}
+	if(rela != NULL) {
+		relocate_lea(target, rela, instr, last);
+	}
+
+	if(!stride_first) {
+		for(idx = 0; idx < stride_count; idx++)
+			place_instruction(ind.latch, INSERT_AFTER, stride[idx], stride_sizes[idx], &first, &instr);
+	}
+
+	place_instruction(ind.latch, INSERT_AFTER, load, sizeof(load), &first, &instr);
+	sym = symbol_instr_rela_create(start, instr, RELOC_TLSREL_32);
+	sym->relocation.addend = site * sizeof(unsigned long long);
+
+	*(unsigned int *)(size_mov + 1) = (unsigned int) target->i.x86.span;
+	place_instruction(ind.latch, INSERT_AFTER, size_mov, sizeof(size_mov), &first, &instr);
+
+	place_instruction(ind.latch, INSERT_AFTER, func_lea, sizeof(func_lea), &first, &instr);
+	symbol_instr_rela_create(external_symbol(function_name, NULL), instr, RELOC_PCREL_32);
+
+	place_instruction(ind.latch, INSERT_AFTER, call, sizeof(call), &first, &instr);
+	idx = ((dead & X86_FLAGS) ? 1 : 0) | ((dead & X86_XMMS_ALL) == X86_XMMS_ALL ? 2 : 0);
+	symbol_instr_rela_create(external_symbol(trampolines[idx], NULL), instr, RELOC_PCREL_32);
+
+	// The registers are popped in the reverse order
+	for(idx = 0; idx < saved; idx++) {
+		leave[idx] = 0x08 + save[saved - idx - 1];
+		place_instruction(ind.latch, INSERT_AFTER, leave + idx, 1, &first, &instr);
+	}
+
+	if(red_zone) {
+		place_instruction(ind.latch, INSERT_AFTER, unskip, sizeof(unskip), &first, &instr);
+	}
+
+	hnotice(2, "Range of the access at <%#08llx> handed over after the loop at <%#08llx>\n",
+		target->orig_addr, ind.latch->orig_addr);
+
+	return true;
+}
+
+
+void x86_trampoline_prepare(insn_info *target, char *function_name, int where, trampoline_mode mode) {
+	insn_info_x86 *x86;
+	insn_info *instr, *first;
+	insn_info *movs[sizeof(batch_entry) / 4];
 	insn_entry *entry;
+	batch_entry batched;
 
-	ll_node *rela_node;
-	symbol *sym;
+	unsigned int rela_idx;
+	symbol *sym, *rela;
 
 	// FIXME: da istanziare correttamente per symbol_create!!
 	section *sec = NULL;
 
 	unsigned int size;
+	unsigned int site;
 	int num;
 	int idx;
+	bool red_zone;
 
 	unsigned char flags;
 
+	if(mode == TRAMPOLINE_RANGE && x86_trampoline_hoist(target, function_name)) {
+		return;
+	}
+
+	site = 0;
+	if(mode == TRAMPOLINE_BATCH) {
+		site = CURRENT(last_batch_site)++;
+		hnotice(3, "Batched call site %u to '%s' at <%#08llx>\n", site, function_name, target->orig_addr);
+	}
+
+	if(x86_trampoline_specialize(target, function_name, where, mode, site)) {
+		return;
+	}
+
 	// Retrieve information to fill the structure
 	// from the instruction descriptor get the x86 instrucion one
 	hnotice(4, "Retrieve meta-info about target MOV instruction...\n");
 
 	instr = target;
 	x86 = &(instr->i.x86);
-	entry = malloc(sizeof(insn_entry));
-	if(entry == NULL) {
-		herror(true, "Out of memory!\n");
-	}
-	bzero(entry, sizeof(insn_entry));
+	bzero(&batched, sizeof(batch_entry));
+	entry = &batched.entry;
 
 
 	// fill the structure
@@ -92,16 +923,17 @@ void x86_trampoline_prepare(insn_info *target, char *function_name, int where) {
 	//printf("disp=%llx, disp_size=%d\n", x86->disp, x86->disp_size);
 	//printf("insn '%s' at <%#08llx>\n", x86->mnemonic, instr->new_addr);
 
+	// The entry of a batched access carries the call site as well
+	batched.site = site;
+
 	hnotice(4, "Push trampoline structure into stack before the target MOV...\n");
-	size = sizeof(insn_entry);	// size of the structure
+	size = mode != TRAMPOLINE_TARGET ? sizeof(batch_entry) : sizeof(insn_entry);	// size of the structure
 	num = size / 4;				// number of the mov instructions needed to copy all the struture fields
 
-	// [SE] This is a guard added to make sure that Hijacker never writes on the Red Zone,
-	// a safe area on the stack on which leaf functions can operate without explicitly
-	// allocating space (i.e., without moving the top of the stack).
-	// The guard makes sure that the displacement from the current stack pointer is of at least
-	// 128 bytes, which is the maximum size of the Red Zone as mandated by the System V X86-64 ABI.
-	size = (size < 128) ? 128 : size;
+	// Padding the structure up to the size of the red zone would not keep the
+	// EFLAGS pushed before it out of the red zone, which is thus skipped as
+	// a whole, and only when the function relies on it
+	red_zone = x86_red_zone_skip(target);
 
 	// Creates bytes array of the main instructions needed to manage
 	// the stack in order to save trampoline's structure
@@ -113,12 +945,23 @@ void x86_trampoline_prepare(insn_info *target, char *function_name, int where) {
 	unsigned char mov[8] = {0xc7, 0x44, 0x24, 0x00, 0x00, 0x00, 0x00, 0x00};
 	unsigned char pushfw[2] = {0x66, 0x9c};
 	unsigned char popfw[2] = {0x66, 0x9d};
+	unsigned char skip[5] = {0x48, 0x8d, 0x64, 0x24, 0x80};   // lea -0x80(%rsp),%rsp
+	unsigned char unskip[8] = {0x48, 0x8d, 0xa4, 0x24, 0x80, 0x00, 0x00, 0x00}; // lea 0x80(%rsp),%rsp
 
 	*(unsigned int *)(sub + 3) = size;
 	*(unsigned int *)(add + 3) = size;
 
 	// Before to do anything we must to preserver EFLAGS register
-	insert_instructions_at(target, pushfw, sizeof(pushfw), INSERT_BEFORE, &instr);
+	if(red_zone) {
+		insert_instructions_at(target, skip, sizeof(skip), INSERT_BEFORE, &instr);
+		include_in_function(target, instr);
+		first = instr;
+		insert_instructions_at(instr, pushfw, sizeof(pushfw), INSERT_AFTER, &instr);
+	} else {
+		insert_instructions_at(target, pushfw, sizeof(pushfw), INSERT_BEFORE, &instr);
+		include_in_function(target, instr);
+		first = instr;
+	}
 
 	// [SE] For the sake of correctness, any JUMP instruction toward `target` should now
 	// point to the first instruction of the trampoline's preamble.
@@ -127,7 +970,7 @@ void x86_trampoline_prepare(insn_info *target, char *function_name, int where) {
 	// Indeed, such preamble will have the lowest virtual address of all the ones that
 	// will be later installed.
 	if (!target->virtual) {
-		set_virtual_reference(target, instr);
+		set_virtual_reference(target, first);
 	}
 
 	// add the SUB instruction in order to create a sufficient stack window for the structure
@@ -141,10 +984,11 @@ void x86_trampoline_prepare(insn_info *target, char *function_name, int where) {
 		mov[3] = idx * sizeof(int);
 
 		// retrieve the next chunk of 4 bytes and embed the immediate into the instruction
-		*(unsigned int *)(mov + 4) = *((int *)entry + idx);
+		*(unsigned int *)(mov + 4) = *((int *)&batched + idx);
 
 		// create and add the new instruction to the rest of code
 		insert_instructions_at(instr, mov, sizeof(mov), INSERT_AFTER, &instr);
+		movs[idx] = instr;
 	}
 
 	// Warning! At this stage the displacement value could be zero
@@ -152,13 +996,13 @@ void x86_trampoline_prepare(insn_info *target, char *function_name, int where) {
 	// would save an incorrect value. It is necessary to look for a relocation
 	// symbol, if any, and duplicate the entry relative to the exact
 	// point where the offset will be placed in the structure
-	for (rela_node = target->reference.first; rela_node; rela_node = rela_node->next) {
+	sv_foreach(&target->reference, rela_idx, sym) {
 		hnotice(4, "A RELA node has been found to this instruction; we have to duplicate the RELA to the entry's offset\n");
-		sym = rela_node->elem;
 
-		// Note that prev*3 points to the MOV operation which is
-		// responsible for the displacement
-		symbol_instr_rela_create(sym, instr->prev->prev->prev, RELOC_ABS_32);
+		// The third MOV is the one responsible for the displacement
+		rela = symbol_instr_rela_create(sym, movs[offsetof(insn_entry, offset) / 4], RELOC_ABS_32);
+		rela->relocation.offset += MOV_IMMEDIATE_SHIFT;
+		rela->relocation.addend = sym->relocation.addend;
 	}
 
 	// Adds the pointer to the function that the trampoline module has to call at runtime
@@ -174,8 +1018,20 @@ void x86_trampoline_prepare(insn_info *target, char *function_name, int where) {
 	// which (should) be the last MOV that should pushes the calling address on the stack
 	hnotice(4, "Push the function pointer to '%s' in the trampoline structure\n", function_name);
 
-	sym = symbol_create(function_name, SYMBOL_UNDEF, SYMBOL_GLOBAL, sec, 0);
-	symbol_instr_rela_create(sym, instr->prev, RELOC_ABS_64);
+	// Each MOV only carries 32 bits of the pointer, whose upper half is left
+	// to zero: a 64-bit relocation would overwrite the opcode of the next MOV
+	sym = external_symbol(function_name, sec);
+	rela = symbol_instr_rela_create(sym, movs[(mode != TRAMPOLINE_TARGET ? offsetof(batch_entry, function) : offsetof(insn_entry, pointer)) / 4], RELOC_ABS_32);
+	rela->relocation.offset += MOV_IMMEDIATE_SHIFT;
+
+	// The function of a batched access is only handed the buffer, which
+	// the trampoline fills through the runtime, and the one of a range is
+	// handed a range made of the single access
+	if(mode != TRAMPOLINE_TARGET) {
+		sym = external_symbol(mode == TRAMPOLINE_BATCH ? "trampoline_batch_generic" : "trampoline_range_generic", sec);
+		rela = symbol_instr_rela_create(sym, movs[offsetof(insn_entry, pointer) / 4], RELOC_ABS_32);
+		rela->relocation.offset += MOV_IMMEDIATE_SHIFT;
+	}
 
 
 	hnotice(4, "Adds the call to the trampoline hijacker library function\n");
@@ -184,7 +1040,7 @@ void x86_trampoline_prepare(insn_info *target, char *function_name, int where) {
 	insert_instructions_at(target, call, sizeof(call), where, &instr);
 
 	// Checks and creates the symbol name that will be the target of the call
-	sym = symbol_create("trampoline", SYMBOL_UNDEF, SYMBOL_GLOBAL, sec, 0);
+	sym = external_symbol("trampoline", sec);
 	symbol_instr_rela_create(sym, instr, RELOC_PCREL_32);
 
 	// in order to align the stack pointer we need to insert an ADD instruction
@@ -196,6 +1052,10 @@ void x86_trampoline_prepare(insn_info *target, char *function_name, int where) {
 	// After all we need to replace the old EFLAG status
 	insert_instructions_at(instr, popfw, sizeof(popfw), INSERT_AFTER, &instr);
 
+	if(red_zone) {
+		insert_instructions_at(instr, unskip, sizeof(unskip), INSERT_AFTER, &instr);
+	}
+
 	//TODO: da verificare l'uso di instr e target! E' un po' confuso...
 
 	hnotice(2, "Trampoline call stack properly instrumented before instruction at <%#08llx>\n", target->new_addr);
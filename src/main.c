@@ -28,6 +28,10 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 
 #include <hijacker.h>
@@ -36,6 +40,8 @@
 #include <compile.h>
 #include <rules/load-rules.h>
 #include <rules/apply-rules.h>
+#include <executables/archive.h>
+#include <elf/link-elf.h>
 
 // List of registered presets
 #include <smtracer/smtracer.h>
@@ -44,17 +50,31 @@
 /// Global configuration
 configuration config;
 
-/// Information and memory map of the object being processed
+/// Job being processed by the current thread
+__thread job_context *job;
+
+/// Version of the job being built by the current thread
+__thread version_context *current_version;
+
+/// Inputs still to be processed in batch mode, along with their lock
+static linked_list pending_jobs;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 static void display_usage(char **argv) {
 	printf("%s [OPTIONS]\n\n", argv[0]);
 	printf("REQUIRED OPTIONS:\n");
 	printf("\t-c <file>, --config <file>: Configuration-rules file\n");
-	printf("\t-i <file>, --input <file>: Input file to process\n");
+	printf("\t-i <file>, --input <file>: Input file to process, either an object file or a static archive\n");
 	printf("\nADDITIONAL OPTIONS:\n");
 	printf("\t-p <path>, --path <path>: Injection path\n");
 	printf("\t-o <file>, --output <file>: Ouput file. If not set, default to '%s'\n", DEFAULT_OUT_NAME);
+	printf("\t-k <path>, --cache <path>: Directory where compiled snippets are cached across runs\n");
+	printf("\t-l, --ld: Link the output with the external '%s' rather than with the built-in linker\n", LINKER);
+	printf("\t-b <file|dir>, --batch <file|dir>: Instrument all the inputs listed in a file, one per line, or all the\n"
+	       "\t\tobject files in a directory. The output option names the directory where the results are written;\n"
+	       "\t\tif not set, each result is written next to its input with the '%s' suffix\n", DEFAULT_BATCH_SUFFIX);
+	printf("\t-j <n>, --jobs <n>: Number of worker threads in batch mode, for archive members or to decode and build the versions of a single input. If not set, default to the number of CPUs\n");
 	printf("\t-v[vv], --verbose=level: Verbose level. Any additional 'v' adds one level. \n");
 }
 
@@ -67,7 +87,17 @@ static void process_configuration(char **argv) {
 	hprint("Verbose mode active\n");
 
 	// Early check on input file
-	if(config.input == NULL) {
+	if(config.batch != NULL) {
+		if(config.input != NULL) {
+			display_usage(argv);
+			herror(true, "Input file and batch mode are mutually exclusive\n");
+		}
+		else if(!file_exists(config.batch)) {
+			display_usage(argv);
+			herror(true, "Unable to find the requested batch list or directory\n");
+		}
+	}
+	else if(config.input == NULL) {
 		display_usage(argv);
 		herror(true, "Input file must be specified\n");
 	}
@@ -106,7 +136,7 @@ static bool parse_cmd_line(int argc, char **argv) {
 		return false;
 			}
 
-	while ((c = getopt_long(argc, argv, "c:p:vi:o:", long_options, &option_index)) != -1) {
+	while ((c = getopt_long(argc, argv, "c:p:vi:o:k:lb:j:", long_options, &option_index)) != -1) {
 
 		switch (c) {
 
@@ -133,6 +163,26 @@ static bool parse_cmd_line(int argc, char **argv) {
 				config.output = optarg;
 				break;
 
+			case 'k':	// cache
+				config.cache_path = optarg;
+				break;
+
+			case 'l':	// ld
+				config.external_linker = true;
+				break;
+
+			case 'b':	// batch
+				config.batch = optarg;
+				break;
+
+			case 'j':	// jobs
+				config.workers = atoi(optarg);
+				if(config.workers == 0) {
+					display_usage(argv);
+					herror(true, "Invalid number of worker threads\n");
+				}
+				break;
+
 			case 0:
 			case '?':
 			default:
@@ -141,7 +191,7 @@ static bool parse_cmd_line(int argc, char **argv) {
 		}
 	}
 
-	if(!config.output) {
+	if(!config.output && !config.batch) {
 		config.output = "final.o";
 	}
 
@@ -164,30 +214,540 @@ static void register_presets(void) {
 
 
 /**
- * Links all the additional modules that can be found in the
- * current working directory.
+ * Links the instrumented object with the trampoline library and with the
+ * modules compiled from the Inject tags, by means of the external linker.
+ *
+ * @param object Path of the instrumented object
  */
-static void link_modules(void) {
-	hnotice(1, "Link additional modules in '%s' to the output instrumented file 'hijacked.o'\n", TEMP_PATH);
+static void link_modules_external(char *object) {
+	char linked[sizeof(TEMP_PATH) + 64];
+	char next[sizeof(TEMP_PATH) + 64];
+	ll_node *node;
+
+	sprintf(linked, "%shijacked-%d-%u-lib.o", TEMP_PATH, getpid(), job->id);
+	sprintf(next, "%shijacked-%d-%u-next.o", TEMP_PATH, getpid(), job->id);
 
 	// Step 1: link libhijacker
-	link("__temp.o", "-r", "-L", LIBDIR, "-o", "__temp_libhijacked.o", "-lhijacker");
+	link(object, "-r", "-L", LIBDIR, "-o", linked, "-lhijacker");
 
 	// Step 2: link other injected modules
-	if(file_exists("incremental.o")) {
-		link("__temp_libhijacked.o", "-r", "-L", LIBDIR, "incremental.o", "-o", config.output);
-	} else {
-		rename("__temp_libhijacked.o", config.output);
+	for(node = job->modules.first; node; node = node->next) {
+		link("-r", linked, (char *)node->elem, "-o", next);
+		rename(next, linked);
+	}
+
+	rename(linked, job->output);
+	unlink(object);
+}
+
+
+/**
+ * Links all the additional modules, i.e. the trampoline library and
+ * the ones compiled from the Inject tags, to the instrumented object.
+ * The built-in linker merges everything in memory, so that the output
+ * is written only once; the external one is used when requested or if
+ * any object cannot be handled by the built-in one.
+ */
+static void link_modules(void) {
+	char object[sizeof(TEMP_PATH) + 64];
+	link_object *objects, *last;
+	unsigned char *image;
+	FILE *file;
+	size_t size;
+	ll_node *node;
+
+	hnotice(1, "Link additional modules to the output instrumented file '%s'\n", job->output);
+
+	sprintf(object, "%shijacked-%d-%u.o", TEMP_PATH, getpid(), job->id);
+
+	if(config.external_linker) {
+		output_object_file(object);
+		link_modules_external(object);
+	}
+
+	else {
+		output_object_image(&image, &size);
+
+		objects = elf_link_new_object("hijacked", image, size);
+
+		objects->next = elf_link_load_archive(LIBDIR "/libhijacker.a");
+		if(objects->next == NULL) {
+			herror(true, "Unable to load the library '%s'\n", LIBDIR "/libhijacker.a");
+		}
+
+		for(last = objects; last->next; last = last->next);
+
+		for(node = job->modules.first; node; node = node->next) {
+			last->next = elf_link_load_object((char *)node->elem);
+			if(last->next == NULL) {
+				herror(true, "Unable to load the module '%s'\n", (char *)node->elem);
+			}
+			last = last->next;
+		}
+
+		if(!elf_link_objects(job->output, objects)) {
+			hnotice(1, "Falling back to the external linker\n");
+
+			file = fopen(object, "w");
+			if(file == NULL || fwrite(image, size, 1, file) != 1) {
+				herror(true, "Unable to write the temporary file '%s'\n", object);
+			}
+			fclose(file);
+
+			link_modules_external(object);
+		}
+
+		elf_link_free_objects(objects);
+	}
+
+	for(node = job->modules.first; node; node = node->next) {
+		unlink((char *)node->elem);
 	}
 
-	unlink("__temp.o");
-	unlink("__temp_libhijacked.o");
-	unlink("incremental.o");
 	hsuccess();
 }
 
 
+/**
+ * Instruments a single input object and writes the corresponding output.
+ * The job is bound to the calling thread for the whole processing.
+ *
+ * @param ctx Pointer to the job descriptor
+ */
+static void process_job(job_context *ctx) {
+	unsigned int version;
+
+	job = ctx;
+	current_version = &PROGRAM(v_context)[0];
+
+	// Nodes of the lists are carved out of the arenas of the program
+	ll_use_arena(&PROGRAM(arenas)[0]);
+
+	// Load executable and build a map in memory
+	load_program(job->input);
+
+	// Process executable
+	apply_rules();
+
+	// Write back executable, finalizing the output file by linking the modules,
+	// unless this is an archive member which ships them as separate members
+	if(job->member) {
+		output_object_file(job->output);
+	} else {
+		link_modules();
+	}
+
+	hprint("File ELF written in '%s'\n", job->output);
+
+	// The whole representation is released at once, so that a worker
+	// does not pile up the ones of all the inputs it has processed
+	ll_use_arena(NULL);
+
+	for(version = 0; version < MAX_VERSIONS; version++) {
+		arena_release(&PROGRAM(arenas)[version]);
+	}
+
+	unload_program();
+
+	current_version = NULL;
+	job = NULL;
+}
+
+
+/**
+ * Creates the descriptor of a job.
+ *
+ * @param input Path of the input object
+ * @param output Path of the output object
+ *
+ * @return Pointer to the new job descriptor
+ */
+static job_context *job_create(char *input, char *output) {
+	static unsigned int id;
+	job_context *ctx;
+	pthread_mutexattr_t attr;
+
+	ctx = calloc(sizeof(job_context), 1);
+	if(ctx == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	ctx->id = id++;
+	ctx->input = input;
+	ctx->output = output;
+	ctx->threads = 1;
+
+	// The versions of the program are built concurrently, and the symbols
+	// are updated from within functions that already hold the lock
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&ctx->program.lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	pthread_cond_init(&ctx->program.turn, NULL);
+
+	return ctx;
+}
+
+
+/**
+ * Computes the output path of an input in batch mode: either the file
+ * with the same name in the output directory, or the input's path where
+ * the extension is replaced by the batch suffix.
+ *
+ * @param input Path of the input object
+ *
+ * @return Newly allocated output path
+ */
+static char *batch_output(char *input) {
+	char *output, *name, *ext;
+
+	output = malloc(strlen(input) + (config.output ? strlen(config.output) : 0) + sizeof(DEFAULT_BATCH_SUFFIX) + 2);
+	if(output == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	if(config.output) {
+		name = strrchr(input, '/');
+		sprintf(output, "%s/%s", config.output, name ? name + 1 : input);
+	}
+
+	else {
+		strcpy(output, input);
+		name = strrchr(output, '/');
+		ext = strrchr(name ? name : output, '.');
+		if(ext) {
+			*ext = '\0';
+		}
+		strcat(output, DEFAULT_BATCH_SUFFIX);
+	}
+
+	return output;
+}
+
+
+/**
+ * Selects the object files of a directory in batch mode.
+ */
+static int batch_filter(const struct dirent *entry) {
+	size_t len = strlen(entry->d_name);
+
+	return len > 2 && !strcmp(entry->d_name + len - 2, ".o");
+}
+
+
+/**
+ * Builds the list of jobs in batch mode, either from the object files of
+ * a directory (in alphabetical order) or from a list file.
+ *
+ * @return Number of queued jobs
+ */
+static unsigned int batch_collect(void) {
+	struct dirent **entries;
+	struct stat info;
+	unsigned int count;
+	char line[4096];
+	char *input;
+	FILE *file;
+	size_t len;
+	int i, n;
+
+	count = 0;
+
+	if(stat(config.batch, &info) == 0 && S_ISDIR(info.st_mode)) {
+		n = scandir(config.batch, &entries, batch_filter, alphasort);
+		if(n < 0) {
+			herror(true, "Unable to read the batch directory '%s'\n", config.batch);
+		}
+
+		for(i = 0; i < n; i++) {
+			input = malloc(strlen(config.batch) + strlen(entries[i]->d_name) + 2);
+			if(input == NULL) {
+				herror(true, "Out of memory!\n");
+			}
+			sprintf(input, "%s/%s", config.batch, entries[i]->d_name);
+			free(entries[i]);
+
+			ll_push(&pending_jobs, job_create(input, batch_output(input)));
+			count++;
+		}
+
+		free(entries);
+	}
+
+	else {
+		file = fopen(config.batch, "r");
+		if(file == NULL) {
+			herror(true, "Unable to read the batch list '%s'\n", config.batch);
+		}
+
+		while(fgets(line, sizeof(line), file)) {
+			len = strcspn(line, "\r\n");
+			line[len] = '\0';
+
+			// Skip blank lines and comments
+			if(len == 0 || line[0] == '#') {
+				continue;
+			}
+
+			if(!file_exists(line)) {
+				herror(true, "Unable to find the batch input '%s'\n", line);
+			}
+
+			input = malloc(len + 1);
+			if(input == NULL) {
+				herror(true, "Out of memory!\n");
+			}
+			strcpy(input, line);
+
+			ll_push(&pending_jobs, job_create(input, batch_output(input)));
+			count++;
+		}
+
+		fclose(file);
+	}
+
+	return count;
+}
+
+
+/**
+ * Body of the worker threads in batch mode, which keep on picking
+ * the pending jobs until none is left.
+ */
+static void *batch_worker(void *arg) {
+	job_context *ctx;
+
+	(void)arg;
+
+	while(true) {
+		pthread_mutex_lock(&pending_lock);
+		ctx = ll_pop_first(&pending_jobs);
+		pthread_mutex_unlock(&pending_lock);
+
+		if(ctx == NULL) {
+			break;
+		}
+
+		process_job(ctx);
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Computes how many threads can be used: the number set on the command
+ * line, or the number of online CPUs.
+ *
+ * @return Number of available threads
+ */
+static unsigned int available_workers(void) {
+	long cpus;
+
+	if(config.workers > 0) {
+		return config.workers;
+	}
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus > 0 ? cpus : 1;
+}
+
+
+/**
+ * Runs all the pending jobs on a pool of worker threads. The rules and
+ * the presets are shared by all the jobs, as well as the cache of the
+ * snippets; a failure in any job terminates the whole process.
+ *
+ * @param count Number of pending jobs
+ */
+static void run_jobs(unsigned int count) {
+	pthread_t *workers;
+	unsigned int nworkers, i;
+
+	nworkers = available_workers();
+	if(nworkers > count) {
+		nworkers = count;
+	}
+
+	hprint("Processing %u inputs on %u worker threads\n", count, nworkers);
+
+	workers = malloc(sizeof(pthread_t) * nworkers);
+	if(workers == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	for(i = 0; i < nworkers; i++) {
+		if(pthread_create(&workers[i], NULL, batch_worker, NULL) != 0) {
+			herror(true, "Unable to create the worker threads\n");
+		}
+	}
+
+	for(i = 0; i < nworkers; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	free(workers);
+}
+
+
+/**
+ * Instruments all the inputs of the batch.
+ */
+static void process_batch(void) {
+	unsigned int count;
+
+	if(config.output) {
+		execute("mkdir", "-p", config.output);
+	}
+
+	count = batch_collect();
+	if(count == 0) {
+		herror(true, "No input found in '%s'\n", config.batch);
+	}
+
+	run_jobs(count);
+}
+
+
+/**
+ * Writes the content of an archive member to a file.
+ */
+static void member_write(archive_member *member, char *path) {
+	FILE *file;
+
+	file = fopen(path, "w");
+	if(file == NULL || fwrite(member->data, 1, member->size, file) != member->size) {
+		herror(true, "Unable to write the temporary file '%s'\n", path);
+	}
+
+	fclose(file);
+}
+
+
+/**
+ * Replaces the content of an archive member with the one of a file.
+ */
+static void member_read(archive_member *member, char *path) {
+	link_object *object;
+
+	object = elf_link_load_object(path);
+	if(object == NULL) {
+		herror(true, "Unable to read the instrumented member '%s'\n", path);
+	}
+
+	free(member->data);
+	member->data = object->data;
+	member->size = object->size;
+
+	object->data = NULL;
+	elf_link_free_objects(object);
+}
+
+
+/**
+ * Instruments a static archive. Every member with some code is a separate
+ * job, run on the worker pool; the others are copied as they are, without
+ * being decoded at all. Rather than linking them into every member, the modules compiled
+ * from the Inject tags and the members of the trampoline library are
+ * added once to the output archive, whose symbol index is rebuilt.
+ */
+static void process_archive(void) {
+	archive_member *members, *member, *last, *added;
+	job_context **jobs, *modules;
+	unsigned int nmembers, count, i;
+	char name[32];
+	char *path;
+	ll_node *node;
+
+	members = archive_load(config.input);
+	if(members == NULL) {
+		herror(true, "Unable to load the archive '%s'\n", config.input);
+	}
+
+	for(nmembers = 0, member = members; member; member = member->next) {
+		nmembers++;
+	}
+
+	jobs = calloc(sizeof(job_context *), nmembers);
+	if(jobs == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	execute("mkdir", "-p", TEMP_PATH);
+
+	count = 0;
+
+	for(i = 0, member = members; member; member = member->next, i++) {
+		// Every version clones the whole code, which the clones of the
+		// other members may call: only members without code are left alone
+		if(!archive_member_has_code(member)) {
+			hnotice(1, "Member '%s' has no code, copying it\n", member->name);
+			continue;
+		}
+
+		path = malloc(sizeof(TEMP_PATH) + 64);
+		if(path == NULL) {
+			herror(true, "Out of memory!\n");
+		}
+		sprintf(path, "%smember-%d-%u.o", TEMP_PATH, getpid(), i);
+		member_write(member, path);
+
+		jobs[i] = job_create(path, malloc(sizeof(TEMP_PATH) + 64));
+		if(jobs[i]->output == NULL) {
+			herror(true, "Out of memory!\n");
+		}
+		sprintf(jobs[i]->output, "%smember-%d-%u-out.o", TEMP_PATH, getpid(), i);
+		jobs[i]->member = true;
+
+		ll_push(&pending_jobs, jobs[i]);
+		count++;
+	}
+
+	if(count > 0) {
+		run_jobs(count);
+
+		for(i = 0, member = members; member; member = member->next, i++) {
+			if(jobs[i]) {
+				member_read(member, jobs[i]->output);
+				unlink(jobs[i]->input);
+				unlink(jobs[i]->output);
+			}
+		}
+
+		for(last = members; last->next; last = last->next);
+
+		// The modules of the Inject tags are compiled once and for all
+		modules = job_create(NULL, NULL);
+		job = modules;
+		apply_rules_injects();
+		job = NULL;
+
+		for(i = 0, node = modules->modules.first; node; node = node->next, i++) {
+			sprintf(name, "hijacker-inject-%u.o", i);
+			last->next = archive_new_member(name, NULL, 0);
+			last = last->next;
+			member_read(last, (char *)node->elem);
+			unlink((char *)node->elem);
+		}
+
+		added = archive_load(LIBDIR "/libhijacker.a");
+		if(added == NULL) {
+			herror(true, "Unable to load the library '%s'\n", LIBDIR "/libhijacker.a");
+		}
+		last->next = added;
+	}
+
+	archive_write(config.output, members);
+	archive_free(members);
+	free(jobs);
+
+	hprint("Archive written in '%s' (%u of %u members instrumented)\n", config.output, count, nmembers);
+}
+
+
 int main(int argc, char **argv) {
+	job_context *ctx;
 
 	// Welcome! :)
 	hhijacker();
@@ -203,19 +763,16 @@ int main(int argc, char **argv) {
 	// Register all the available presets
 	register_presets();
 
-	// Load executable and build a map in memory
-	load_program(config.input);
-
-	// Process executable
-	apply_rules();
-
-	// Write back executable
-	output_object_file("__temp.o");
-
-	// Finalize the output file by linking the module
-	link_modules();
-
-	hprint("File ELF written in '%s'\n", config.output);
+	if(config.batch) {
+		process_batch();
+	} else if(is_archive(config.input)) {
+		process_archive();
+	} else {
+		// A single job has all the threads for itself
+		ctx = job_create(config.input, config.output);
+		ctx->threads = available_workers();
+		process_job(ctx);
+	}
 
 	exit(EXIT_SUCCESS);
 }
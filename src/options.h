@@ -36,6 +36,10 @@ static struct option long_options[] = {
 	{"verbose",	optional_argument,	0, 'v'},
 	{"input",	required_argument,	0, 'i'},
 	{"output",	required_argument,	0, 'o'},
+	{"cache",	required_argument,	0, 'k'},
+	{"ld",		no_argument,		0, 'l'},
+	{"batch",	required_argument,	0, 'b'},
+	{"jobs",	required_argument,	0, 'j'},
 	{0,		0,			0, 0}
 };
 
@@ -34,6 +34,8 @@
 #include <elf/elf-defs.h>
 #include <elf/handle-elf.h>
 #include <smtracer/smtracer.h>
+#include <x86/liveness-x86.h>
+#include <x86/redzone-x86.h>
 
 // TODO: Ammettere varie policy di flushing
 // - Sincrona
@@ -71,15 +73,15 @@
 #define SCORE_EQUAL   11
 
 
-// Globals
-static section *tbss_sec;
-static symbol *tbss_sym;
-static symbol *tls_buffer_sym;
-static size_t tls_buffer_size;
+// Globals, private to the thread running the job
+static __thread section *tbss_sec;
+static __thread symbol *tbss_sym;
+static __thread symbol *tls_buffer_sym;
+static __thread size_t tls_buffer_size;
 
 
 // Parameters
-static struct {
+static __thread struct {
 	double block_threshold;      // Minimum score that a block must possess
 	                             // in order to be considered for instrumentation
 	double instrument_factor;    // Cost-controlling instrumentation factor,
@@ -113,7 +115,7 @@ typedef struct {
 	double *aabserr;       // Average absolute error per cycle depth
 } smt_stats_record;
 
-static struct {
+static __thread struct {
 	size_t maxcycledepth;  // Maximum number of cycles in the program
 
 	smt_stats_record all; // Per-cycle-depth averages over all blocks
@@ -156,6 +158,47 @@ inline static bool smt_is_relevant(insn_info *instr) {
 }
 
 
+/**
+ * Counterpart of <em>smt_is_relevant</em> for the columnar copy of the
+ * instructions, which only reads the flags and the packed operand.
+ */
+inline static bool smt_is_relevant_entry(insn_columns *table, size_t entry) {
+	if (smt_params.trace_stack == false) {
+		if (table->operand[entry].base == SMT_X86_RBP) {
+			return false;
+		}
+	}
+
+	return (table->flags[entry] & (I_MEMRD | I_MEMWR)) != 0;
+}
+
+
+/**
+ * Counts the relevant instructions from a first to a last one, both included.
+ *
+ * @param table Columnar copy of the instructions, or NULL if the chain must
+ * be followed because the instructions are not at the entries of their index
+ */
+static size_t smt_count_relevant(insn_columns *table, insn_info *first, insn_info *last) {
+	insn_info *instr;
+	size_t entry, count;
+
+	count = 0;
+
+	if (table != NULL) {
+		for (entry = first->index; entry <= last->index; entry++) {
+			count += smt_is_relevant_entry(table, entry);
+		}
+	} else {
+		for (instr = first; instr != last->next; instr = instr->next) {
+			count += smt_is_relevant(instr);
+		}
+	}
+
+	return count;
+}
+
+
 // inline static bool smt_is_flushpoint(insn_info *instr, function *func) {
 // 	bool is_flushpoint;
 
@@ -520,7 +563,7 @@ static void smt_tls_init(void) {
 
 	// A different buffer symbol is created for each version
 	buffer_name = malloc(MAX_NAME_LEN);
-	sprintf(buffer_name, "__smtracer_buffer_%d", PROGRAM(version));
+	sprintf(buffer_name, "__smtracer_buffer_%d", CURRENT(id));
 
 	tls_buffer_sym = symbol_create(buffer_name, SYMBOL_TLS, SYMBOL_LOCAL, tbss_sec, tbss_size);
 	tls_buffer_sym->offset = disp;
@@ -581,7 +624,7 @@ static void smt_compute_cycledepth(void) {
 
 	ll_init(&headers);
 
-	for (func = PROGRAM(v_code)[PROGRAM(version)]; func; func = func->next) {
+	for (func = PROGRAM(v_code)[CURRENT(id)]; func; func = func->next) {
 		graph_visit visit = {
 			.payload   = &headers,
 			.policy    = VISIT_DEPTH,
@@ -590,7 +633,7 @@ static void smt_compute_cycledepth(void) {
 			.post_func = NULL
 		};
 
-		block_graph_visit(func->source->in.first->elem, &visit);
+		block_graph_visit(sv_first(&func->source->in), &visit);
 	}
 
 	// Second step: discover loop bodies
@@ -614,7 +657,7 @@ static void smt_compute_cycledepth(void) {
 	// Third step: compute the number of cycles a block participates to
 	hnotice(3, "Computing cycle depth feature...\n");
 
-	for (blk = PROGRAM(blocks)[PROGRAM(version)]; blk; blk = blk->next) {
+	for (blk = PROGRAM(blocks)[CURRENT(id)]; blk; blk = blk->next) {
 		smt = blk->smtracer;
 
 		// A loop header participates in its own loop
@@ -638,7 +681,7 @@ static void smt_compute_cycledepth(void) {
 	unsigned int hottest;
 	linked_list queue = { NULL, NULL };
 
-	for (func = PROGRAM(v_code)[PROGRAM(version)]; func; func = func->next) {
+	for (func = PROGRAM(v_code)[CURRENT(id)]; func; func = func->next) {
 		if (func->calledfrom.first == NULL) {
 			ll_push(&queue, func);
 		}
@@ -680,34 +723,23 @@ static void smt_compute_cycledepth(void) {
 		}
 	}
 
-	for (func = PROGRAM(v_code)[PROGRAM(version)]; func; func = func->next) {
+	for (func = PROGRAM(v_code)[CURRENT(id)]; func; func = func->next) {
 		func->visited = false;
 	}
 }
 
 
-static void smt_compute_memratio(void) {
+static void smt_compute_memratio(insn_columns *table) {
 	block *blk;
 	smt_data *smt;
 
-	insn_info *pivot;
-	bool is_relevant;
-
 	size_t memcount, highest;
 
 	highest = 0;
 
-	for (blk = PROGRAM(blocks)[PROGRAM(version)]; blk; blk = blk->next) {
+	for (blk = PROGRAM(blocks)[CURRENT(id)]; blk; blk = blk->next) {
 		smt = blk->smtracer;
-		memcount = 0;
-
-		for (pivot = blk->begin; pivot != blk->end->next; pivot = pivot->next) {
-			is_relevant = smt_is_relevant(pivot);
-
-			if (is_relevant) {
-				memcount += 1;
-			}
-		}
+		memcount = smt_count_relevant(table, blk->begin, blk->end);
 
 		smt->memratio = memcount * memcount / blk->length;
 
@@ -718,7 +750,7 @@ static void smt_compute_memratio(void) {
 
 	highest = highest > 0 ? highest : 1;
 
-	for (blk = PROGRAM(blocks)[PROGRAM(version)]; blk; blk = blk->next) {
+	for (blk = PROGRAM(blocks)[CURRENT(id)]; blk; blk = blk->next) {
 		smt = blk->smtracer;
 
 		smt->memratio /= highest;
@@ -726,19 +758,19 @@ static void smt_compute_memratio(void) {
 }
 
 
-static void smt_compute_features(void) {
+static void smt_compute_features(insn_columns *table) {
 	block *blk;
 	smt_data *smt;
 	float highest;
 
 	// Features are computed
 	smt_compute_cycledepth();
-	smt_compute_memratio();
+	smt_compute_memratio(table);
 
 	// Compute the total absolute score
 	highest = 0;
 
-	for (blk = PROGRAM(blocks)[PROGRAM(version)]; blk; blk = blk->next) {
+	for (blk = PROGRAM(blocks)[CURRENT(id)]; blk; blk = blk->next) {
 		smt = blk->smtracer;
 
 		// smt->score = (smt->cycledepth + 1) * smt->memratio;
@@ -750,7 +782,7 @@ static void smt_compute_features(void) {
 	}
 
 	// Compute the total relative score
-	for (blk = PROGRAM(blocks)[PROGRAM(version)]; blk; blk = blk->next) {
+	for (blk = PROGRAM(blocks)[CURRENT(id)]; blk; blk = blk->next) {
 		smt = blk->smtracer;
 
 		if (highest <= 0) {
@@ -772,16 +804,30 @@ void smt_init(void) {
 	block *blk;
 	smt_data *smt;
 
+	insn_columns *table;
+
+	// The features only read the instructions, so they are scanned by
+	// their index, unless some have been added since they were numbered
+	table = insn_columns_build();
+	if (table->indexed == false) {
+		table = NULL;
+	}
+
 	// Detect the maximum size for the TLS buffer so that
 	// no relevant access will be discarded due to lack of space
 	// TODO: Dipende dalle politiche di flushing
 	highest = 0;
 
-	for (func = PROGRAM(v_code)[PROGRAM(version)]; func; func = func->next) {
+	for (func = PROGRAM(v_code)[CURRENT(id)]; func; func = func->next) {
 		count = 0;
 
-		for (instr = func->begin_insn; instr; instr = instr->next) {
-			count += smt_is_relevant(instr);
+		if (table != NULL) {
+			instr = table->insn[func->next ? func->next->begin_insn->index - 1 : table->count - 1];
+			count = smt_count_relevant(table, func->begin_insn, instr);
+		} else {
+			for (instr = func->begin_insn; instr; instr = instr->next) {
+				count += smt_is_relevant(instr);
+			}
 		}
 
 		if (count > highest) {
@@ -792,7 +838,7 @@ void smt_init(void) {
 	tls_buffer_size = highest;
 
 	// Blocks are augmented with extra information
-	for (blk = PROGRAM(blocks)[PROGRAM(version)]; blk; blk = blk->next) {
+	for (blk = PROGRAM(blocks)[CURRENT(id)]; blk; blk = blk->next) {
 		hnotice(6, "Allocating memory for smtracer at block #%u\n", blk->id);
 
 		blk->smtracer = smt = calloc(sizeof(smt_data), 1);
@@ -805,7 +851,9 @@ void smt_init(void) {
 
 	// Block-level features are computed to later instrument basic
 	// blocks according to a user-defined score threshold
-	smt_compute_features();
+	smt_compute_features(table);
+
+	insn_columns_drop();
 }
 
 
@@ -1045,7 +1093,7 @@ static void smt_compute_uniques(block *blk) {
 }
 
 
-static void smt_resolve_address(smt_access *access) {
+static void smt_resolve_address(smt_access *access, int skew) {
 	insn_info *pivot, *current;
 	insn_info_x86 *x86;
 	symbol *sym, *ref;
@@ -1057,6 +1105,12 @@ static void smt_resolve_address(smt_access *access) {
 	bool has_disp, has_fs;
 	unsigned char /* scale, */ modrm, sib;
 
+	// The stack pointer has been moved by the instrumentation, which the
+	// addresses relative to it have to make up for
+	if (!x86->has_base_register || x86->breg != 0x04) {
+		skew = 0;
+	}
+
 	hnotice(3, "Resolving address of memory reference in '%s' at <%#08llx> with %lld + (%u + %u * %lu)\n",
 		pivot->i.x86.mnemonic, pivot->orig_addr, x86->disp, x86->breg, x86->ireg, x86->scale);
 
@@ -1125,6 +1179,8 @@ static void smt_resolve_address(smt_access *access) {
 						0x48, 0x8d, modrm, sib, 0x00, 0x00, 0x00, 0x00
 					};
 
+					*(uint32_t *)(instr + 4) = skew;
+
 					insert_instructions_at(pivot, instr, sizeof(instr), INSERT_BEFORE, NULL);
 				}
 
@@ -1148,7 +1204,7 @@ static void smt_resolve_address(smt_access *access) {
 					0x48, 0x8d, modrm, sib, 0x00, 0x00, 0x00, 0x00
 				};
 
-				*(uint32_t *)(instr + 4) = x86->disp;
+				*(uint32_t *)(instr + 4) = x86->disp + skew;
 
 				insert_instructions_at(pivot, instr, sizeof(instr), INSERT_BEFORE, NULL);
 
@@ -1272,9 +1328,22 @@ static void smt_resolve_address(smt_access *access) {
 static void smt_instrument_access(block *blk, smt_access *access) {
 	insn_info *pivot, *current, *first;
 	symbol *ref;
+	bool red_zone;
 
 	pivot = access->insn;
 	current = first = NULL;
+	red_zone = x86_red_zone_skip(pivot);
+
+	// Skip the red zone
+	// -----------------
+	// LEA -0x80(%rsp), %rsp
+	if (red_zone) {
+		unsigned char instr[5] = {
+			0x48, 0x8d, 0x64, 0x24, 0x80
+		};
+
+		insert_instructions_at(pivot, instr, sizeof(instr), INSERT_BEFORE, &first);
+	}
 
 	// Protect old register values
 	// ---------------------------
@@ -1286,11 +1355,15 @@ static void smt_instrument_access(block *blk, smt_access *access) {
 
 		insert_instructions_at(pivot, instr, sizeof(instr), INSERT_BEFORE, &current);
 
+		if (first == NULL) {
+			first = current;
+		}
+
 		// If the instrumented instruction is the target of a jump, let's update
 		// the virtual reference
 		// if (pivot == block_find(pivot)->begin && !pivot->virtual) {
-		if (!ll_empty(&pivot->targetof) && !pivot->virtual) {
-			set_virtual_reference(pivot, current);
+		if (!sv_empty(&pivot->targetof) && !pivot->virtual) {
+			set_virtual_reference(pivot, first);
 		}
 	}
 
@@ -1299,7 +1372,7 @@ static void smt_instrument_access(block *blk, smt_access *access) {
 	// LEA disp(base, idx, scale), %rsi
 	// MOV addr, %rsi
 	// MOVABS addr, %rsi
-	smt_resolve_address(access);
+	smt_resolve_address(access, (red_zone ? X86_RED_ZONE : 0) + 8);
 
 	// Compute chunk address from memory address
 	// -----------------------------------------
@@ -1392,6 +1465,17 @@ static void smt_instrument_access(block *blk, smt_access *access) {
 
 		insert_instructions_at(pivot, instr, sizeof(instr), INSERT_BEFORE, NULL);
 	}
+
+	// Restore the red zone
+	// --------------------
+	// LEA 0x80(%rsp), %rsp
+	if (red_zone) {
+		unsigned char instr[8] = {
+			0x48, 0x8d, 0xa4, 0x24, 0x80, 0x00, 0x00, 0x00
+		};
+
+		insert_instructions_at(pivot, instr, sizeof(instr), INSERT_BEFORE, NULL);
+	}
 }
 
 
@@ -1622,81 +1706,129 @@ static size_t smt_log_accesses(block *blk) {
 }
 
 
+// Registers clobbered by the flushing routine, in the order they are pushed
+static const unsigned char smt_saved_regs[] = {
+	X86_RAX, X86_RCX, X86_RDX, X86_RSI, X86_RDI, 8, 9, 10, 11
+};
+
+/**
+ * Encodes the instructions saving the flags, the registers clobbered by the
+ * flushing routine and the low half of %xmm0-%xmm7, skipping the ones whose
+ * value is dead.
+ *
+ * @param dead Mask of the dead registers
+ * @param code Buffer of at least 86 bytes receiving the code
+ *
+ * @return Size of the code
+ */
+static size_t smt_save_registers(unsigned long long dead, unsigned char *code) {
+	unsigned int idx;
+	size_t size;
+
+	size = 0;
+
+	// PUSHF
+	if (!(dead & X86_FLAGS)) {
+		code[size++] = 0x9c;
+	}
+
+	// PUSH %reg
+	for (idx = 0; idx < sizeof(smt_saved_regs); idx++) {
+		if (dead & X86_REG(smt_saved_regs[idx])) {
+			continue;
+		}
+		if (smt_saved_regs[idx] >= 8) {
+			code[size++] = 0x41;
+		}
+		code[size++] = 0x50 | (smt_saved_regs[idx] & 0x7);
+	}
+
+	// SUB $16,%rsp
+	// MOVSD %xmm,(%rsp)
+	for (idx = 0; idx < 8; idx++) {
+		if (dead & X86_XMM(idx)) {
+			continue;
+		}
+		memcpy(code + size, (unsigned char []) {0x48, 0x83, 0xec, 0x10}, 4);
+		memcpy(code + size + 4, (unsigned char []) {0xf2, 0x0f, 0x11, 0x04 | (idx << 3), 0x24}, 5);
+		size += 9;
+	}
+
+	return size;
+}
+
+/**
+ * Encodes the counterpart of <em>smt_save_registers</em>.
+ *
+ * @param dead Mask of the dead registers
+ * @param code Buffer of at least 86 bytes receiving the code
+ *
+ * @return Size of the code
+ */
+static size_t smt_restore_registers(unsigned long long dead, unsigned char *code) {
+	unsigned int idx;
+	size_t size;
+
+	size = 0;
+
+	// MOVSD (%rsp),%xmm
+	// ADD $16,%rsp
+	for (idx = 8; idx > 0; idx--) {
+		if (dead & X86_XMM(idx - 1)) {
+			continue;
+		}
+		memcpy(code + size, (unsigned char []) {0xf2, 0x0f, 0x10, 0x04 | ((idx - 1) << 3), 0x24}, 5);
+		memcpy(code + size + 5, (unsigned char []) {0x48, 0x83, 0xc4, 0x10}, 4);
+		size += 9;
+	}
+
+	// POP %reg
+	for (idx = sizeof(smt_saved_regs); idx > 0; idx--) {
+		if (dead & X86_REG(smt_saved_regs[idx - 1])) {
+			continue;
+		}
+		if (smt_saved_regs[idx - 1] >= 8) {
+			code[size++] = 0x41;
+		}
+		code[size++] = 0x58 | (smt_saved_regs[idx - 1] & 0x7);
+	}
+
+	// POPF
+	if (!(dead & X86_FLAGS)) {
+		code[size++] = 0x9d;
+	}
+
+	return size;
+}
+
 static void smt_flush_accesses(unsigned int total, symbol *callfunc, insn_info *pivot) {
 	insn_info *current;
+	unsigned long long dead;
+	unsigned char code[86];
+	size_t size;
+	bool red_zone;
 
 	current = pivot;
+	dead = insn_dead_registers(pivot, INSERT_AFTER);
+	red_zone = x86_red_zone_skip(pivot);
 
-	// Protect old register values
-	// ---------------------------
-	// PUSHF
-	// PUSH %rax
-	// PUSH %rcx
-	// PUSH %rdx
-	// PUSH %rsi
-	// PUSH %rdi
-	// PUSH %r8
-	// PUSH %r9
-	// PUSH %r10
-	// PUSH %r11
-	// SUB $16,%rsp
-	// MOVSD %xmm0,(%rsp)
-	// SUB $16,%rsp
-	// MOVSD %xmm1,(%rsp)
-	// SUB $16,%rsp
-	// MOVSD %xmm2,(%rsp)
-	// SUB $16,%rsp
-	// MOVSD %xmm3,(%rsp)
-	// SUB $16,%rsp
-	// MOVSD %xmm4,(%rsp)
-	// SUB $16,%rsp
-	// MOVSD %xmm5,(%rsp)
-	// SUB $16,%rsp
-	// MOVSD %xmm6,(%rsp)
-	// SUB $16,%rsp
-	// MOVSD %xmm7,(%rsp)
-	{
-		// unsigned char instr[4] = {
-		// 	0x9c,
-		// 	0x50,
-		// 	0x56,
-		// 	0x57
-		// };
-
-		unsigned char instr[86] = {
-			0x9c,
-			0x50,
-			0x51,
-			0x52,
-			0x56,
-			0x57,
-			0x41, 0x50,
-			0x41, 0x51,
-			0x41, 0x52,
-			0x41, 0x53,
-			0x48, 0x83, 0xec, 0x10,
-			0xf2, 0x0f, 0x11, 0x04, 0x24,
-			0x48, 0x83, 0xec, 0x10,
-			0xf2, 0x0f, 0x11, 0x0c, 0x24,
-			0x48, 0x83, 0xec, 0x10,
-			0xf2, 0x0f, 0x11, 0x14, 0x24,
-			0x48, 0x83, 0xec, 0x10,
-			0xf2, 0x0f, 0x11, 0x1c, 0x24,
-			0x48, 0x83, 0xec, 0x10,
-			0xf2, 0x0f, 0x11, 0x24, 0x24,
-			0x48, 0x83, 0xec, 0x10,
-			0xf2, 0x0f, 0x11, 0x2c, 0x24,
-			0x48, 0x83, 0xec, 0x10,
-			0xf2, 0x0f, 0x11, 0x34, 0x24,
-			0x48, 0x83, 0xec, 0x10,
-			0xf2, 0x0f, 0x11, 0x3c, 0x24,
+	// Skip the red zone
+	// -----------------
+	// LEA -0x80(%rsp), %rsp
+	if (red_zone) {
+		unsigned char instr[5] = {
+			0x48, 0x8d, 0x64, 0x24, 0x80
 		};
 
-		insert_instructions_at(pivot, instr, sizeof(instr), INSERT_AFTER, &current);
+		insert_instructions_at(current, instr, sizeof(instr), INSERT_AFTER, &current);
+	}
 
-		if (!ll_empty(&pivot->targetof) && !pivot->virtual) {
-			set_virtual_reference(pivot, current);
-		}
+	// Protect the old values of the live registers among the flags, the
+	// registers clobbered by the routine and %xmm0-%xmm7 (see smt_save_registers)
+	size = smt_save_registers(dead, code);
+
+	if (size > 0) {
+		insert_instructions_at(current, code, size, INSERT_AFTER, &current);
 	}
 
 	// Load TLS storage
@@ -1769,74 +1901,29 @@ static void smt_flush_accesses(unsigned int total, symbol *callfunc, insn_info *
 		symbol_instr_rela_create(callfunc, current, RELOC_PCREL_32);
 	}
 
-	// Restore old register values
-	// ---------------------------
-	// MOVSD (%rsp), %xmm7
-	// ADD $16,%rsp
-	// MOVSD (%rsp), %xmm6
-	// ADD $16,%rsp
-	// MOVSD (%rsp), %xmm5
-	// ADD $16,%rsp
-	// MOVSD (%rsp), %xmm4
-	// ADD $16,%rsp
-	// MOVSD (%rsp), %xmm3
-	// ADD $16,%rsp
-	// MOVSD (%rsp), %xmm2
-	// ADD $16,%rsp
-	// MOVSD (%rsp), %xmm1
-	// ADD $16,%rsp
-	// MOVSD (%rsp), %xmm0
-	// ADD $16,%rsp
-	// POP %r11
-	// POP %r10
-	// POP %r9
-	// POP %r8
-	// POP %rdi
-	// POP %rsi
-	// POP %rdx
-	// POP %rcx
-	// POP %rax
-	// POPF
-	{
-		// unsigned char instr[4] = {
-		//   0x5f,
-		//   0x5e,
-		//   0x58,
-		//   0x9d
-		// };
-
-		unsigned char instr[86] = {
-			0xf2, 0x0f, 0x10, 0x3c, 0x24,
-			0x48, 0x83, 0xc4, 0x10,
-			0xf2, 0x0f, 0x10, 0x34, 0x24,
-			0x48, 0x83, 0xc4, 0x10,
-			0xf2, 0x0f, 0x10, 0x2c, 0x24,
-			0x48, 0x83, 0xc4, 0x10,
-			0xf2, 0x0f, 0x10, 0x24, 0x24,
-			0x48, 0x83, 0xc4, 0x10,
-			0xf2, 0x0f, 0x10, 0x1c, 0x24,
-			0x48, 0x83, 0xc4, 0x10,
-			0xf2, 0x0f, 0x10, 0x14, 0x24,
-			0x48, 0x83, 0xc4, 0x10,
-			0xf2, 0x0f, 0x10, 0x0c, 0x24,
-			0x48, 0x83, 0xc4, 0x10,
-			0xf2, 0x0f, 0x10, 0x04, 0x24,
-			0x48, 0x83, 0xc4, 0x10,
-			0x41, 0x5b,
-			0x41, 0x5a,
-			0x41, 0x59,
-			0x41, 0x58,
-			0x5f,
-			0x5e,
-			0x5a,
-			0x59,
-			0x58,
-			0x9d,
+	// Restore the old register values
+	size = smt_restore_registers(dead, code);
+
+	if (size > 0) {
+		insert_instructions_at(current, code, size, INSERT_AFTER, &current);
+	}
+
+	// Restore the red zone
+	// --------------------
+	// LEA 0x80(%rsp), %rsp
+	if (red_zone) {
+		unsigned char instr[8] = {
+			0x48, 0x8d, 0xa4, 0x24, 0x80, 0x00, 0x00, 0x00
 		};
 
 		insert_instructions_at(current, instr, sizeof(instr), INSERT_AFTER, &current);
 	}
 
+	// The first instruction inserted stands for the pivot
+	if (!sv_empty(&pivot->targetof) && !pivot->virtual) {
+		set_virtual_reference(pivot, pivot->next);
+	}
+
 	// TODO: Potrebbe servire aggiornare il puntatore dell'istruzione che
 	// sancisce fine del basic block, qualora essa cambi?
 
@@ -2008,7 +2095,7 @@ void smt_stats(void) {
 	nblkmem = 0;
 	nblksel = 0;
 
-	for (blk = PROGRAM(blocks)[PROGRAM(version)]; blk; blk = blk->next) {
+	for (blk = PROGRAM(blocks)[CURRENT(id)]; blk; blk = blk->next) {
 		smt = blk->smtracer;
 
 		if (smt->cycledepth > smt_stats_db.maxcycledepth) {
@@ -2029,7 +2116,7 @@ void smt_stats(void) {
 	smt_stats_record_init(&smt_stats_db.mem, nbins);
 	smt_stats_record_init(&smt_stats_db.sel, nbins);
 
-	for (blk = PROGRAM(blocks)[PROGRAM(version)]; blk; blk = blk->next) {
+	for (blk = PROGRAM(blocks)[CURRENT(id)]; blk; blk = blk->next) {
 		smt = blk->smtracer;
 
 		smt_stats_record_update(&smt_stats_db.all, smt);
@@ -2305,7 +2392,7 @@ size_t smt_run(char *name, param **params, size_t numparams) {
 	// ------------------------------------------------------------
 
 	// A weak symbol is created which represents the user-defined function
-	for (text = NULL, sec = PROGRAM(sections)[PROGRAM(version)]; sec; sec = sec->next) {
+	for (text = NULL, sec = PROGRAM(sections)[CURRENT(id)]; sec; sec = sec->next) {
 		if (sec->type == SECTION_CODE) {
 			text = sec;
 			break;
@@ -2322,7 +2409,7 @@ size_t smt_run(char *name, param **params, size_t numparams) {
 	// a representative fraction of memory accesses
 	count = 0;
 
-	for (func = PROGRAM(v_code)[PROGRAM(version)]; func; func = func->next) {
+	for (func = PROGRAM(v_code)[CURRENT(id)]; func; func = func->next) {
 
 		funccount = 0;
 
@@ -2353,43 +2440,9 @@ size_t smt_run(char *name, param **params, size_t numparams) {
 			}
 		}
 
+		// Leaf functions relying on the red zone are taken care of by
+		// x86_red_zone_skip, as each access is instrumented
 		count += funccount;
-
-		// FIXME: Currently, we don't support programs compiled
-		// without `-mno-red-zone`, so for now we skip the rest
-		// of the code in this loop iteration...
-		continue;
-
-		// If it is a leaf function and it has to be instrumented,
-		// we protect the stack in order to prevent errors resulting
-		// from the infamous 😈 Red Area 😈
-
-		if (funccount > 0 && ll_empty(&func->callto)) {
-			// Protect the stack
-			// -----------------
-			// SUB $0x80, %rsp
-
-			unsigned char instr[7] = {
-				0x48, 0x81, 0xec, 0x80, 0x00, 0x00, 0x00
-			};
-
-			insert_instructions_at(func->begin_blk->end, instr, sizeof(instr),
-				INSERT_AFTER, NULL);
-		}
-
-		if (funccount > 0 && ll_empty(&func->callto)) {
-			// Unprotect the stack
-			// -------------------
-			// ADD $0x80, %rsp
-
-			unsigned char instr[7] = {
-				0x48, 0x81, 0xc4, 0x80, 0x00, 0x00, 0x00
-			};
-
-			insert_instructions_at(func->end_blk->begin, instr, sizeof(instr),
-				INSERT_BEFORE, NULL);
-		}
-
 	}
 
 	// ------------------------------------------------------------
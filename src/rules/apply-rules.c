@@ -25,7 +25,9 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <libgen.h>
+#include <unistd.h>
 
 #include <executable.h>
 #include <hijacker.h>
@@ -33,6 +35,7 @@
 #include <compile.h>
 #include <load-rules.h>
 #include <apply-rules.h>
+#include <snippets.h>
 
 #include <elf/reverse-elf.h>
 #include <elf/handle-elf.h>
@@ -41,10 +44,15 @@
  * The Inject tag simply identifies a file that has to be compiled togeter
  * with the remainder of the program. Therefore, once the filename is retrieved,
  * this function simply compile and mark as 'to be linked' the resulting ELF.
+ * Object files are named after the process and the job, so that concurrent
+ * runs in the same directory do not clobber each other's files.
  *
  * @param tagInject Pointer to the Ibject XML tag descriptor
  */
 static void apply_rule_link (char *filename) {
+	unsigned int count;
+	char *module;
+	ll_node *node;
 
 	hnotice(2, "Entering Inject scope: compiling and linking module '%s'\n", filename);
 
@@ -52,18 +60,22 @@ static void apply_rule_link (char *filename) {
 		herror(true, "The XML rules file has specified a file that does not exists!\n");
 	}
 
+	module = malloc(sizeof(TEMP_PATH) + 64);
+	if(module == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	for (count = 0, node = job->modules.first; node; node = node->next) {
+		count++;
+	}
+
+	sprintf(module, "%smodule-%d-%u-%u.o", TEMP_PATH, getpid(), job->id, count);
+
 	// Just compile the given module's source.
 	// The resulting object file will be linked in the final stage.
-	compile(filename, "-c", "-o", "current.o");
+	compile(filename, "-c", "-o", module);
 
-	if(file_exists("incremental.o")) {
-		link("-r", "incremental.o", "current.o", "-o", "__incremental.o");
-		unlink("current.o");
-		unlink("incremental.o");
-		rename("__incremental.o", "incremental.o");
-	} else {
-		rename("current.o", "incremental.o");
-	}
+	ll_push(&job->modules, module);
 }
 
 
@@ -75,61 +87,19 @@ static void apply_rule_link (char *filename) {
  * @param filename Pointer to the file string name
  */
 static void apply_rule_inject (char *filename, insn_info *target, insn_insert_mode where) {
-	FILE *fp;
-	int fsize;
-	unsigned char *fcontent;
+	snippet *snip;
 	insn_info *insn;
 
 	// Note that 'filename' is the assembly source
 	// therefore it must be firstly translated into
-	// a binary file in order to pass it to disassemble function
-
-	// Compile the assembly into the 'bin' file
-	hnotice(6, "Compiling assembly file into binary file 'bin'\n");
-
-	// Check the file actually exists
-	if(!file_exists(filename)) {
-		herror(true, "The XML rules file has specified an inject file that does not exists!\n");
-	}
-	compile(filename, "-c", "-o", "obj");
-	execute("objcopy", "-O", "binary", "obj", "bin");
-
-	// Open the file in reading mode
-	hnotice(6, "Opening assembly binary file 'bin'\n");
-	fp = fopen("bin", "r");
-
-	// Get the file size
-	fseek(fp, 0, SEEK_END);
-	fsize = ftell(fp);
-	rewind(fp);
-
-	// Allocate the memory buffer for the file
-	fcontent = malloc(sizeof(char) * fsize);
-	if(!fcontent) {
-		execute("rm", "obj");
-		execute("rm", "bin");
-		herror(true, "Out of memory!\n");
-	}
-
-	// Copy the file into the buffer
-	if(fread(fcontent, 1, fsize, fp) != (size_t)fsize) {
-		execute("rm", "obj");
-		execute("rm", "bin");
-		herror(true, "Unable to read the file!\n");
-	}
-
+	// a binary file in order to pass it to disassemble function.
+	// This happens only the first time the snippet is met,
+	// afterwards its decoded instructions are simply cloned.
+	snip = snippet_load(filename);
 
 	// TODO: verificare la correttezza del contenuto rispetto alle specifiche (architettura, sintassi, convenzioni, etc.)
 
-	if(where == SUBSTITUTE)
-		substitute_instruction_with(target, fcontent, fsize);
-	else
-		insert_instructions_at(target, fcontent, fsize, where, &insn);
-
-	fclose(fp);
-	execute("rm", "obj");
-	execute("rm", "bin");
-	free(fcontent);
+	snippet_apply(snip, target, where, &insn);
 
 	hsuccess();
 }
@@ -142,9 +112,9 @@ static size_t apply_rule_preset(Executable *exec, Preset *tagPreset, preset *pr)
 	Param *tagParam;
 	param **params, *par;
 
-	if (pr->initialized[PROGRAM(version)] == false) {
+	if (pr->initialized[CURRENT(id)] == false) {
 		pr->init_func();
-		pr->initialized[PROGRAM(version)] = true;
+		pr->initialized[CURRENT(id)] = true;
 	}
 
 	hnotice(3, "Running preset '%s' with params:", tagPreset->name);
@@ -202,7 +172,23 @@ static void apply_rule_addcall (Call *tagCall, insn_info *target) {
 			hnotice(4, "Specified a 'target' argument to '%s' function, preparing the trampoline structure\n", tagCall->function);
 
 			// Prepare the trampoline structure on the stack
-			trampoline_prepare(target, (unsigned char *)tagCall->function, where);
+			trampoline_prepare(target, (unsigned char *)tagCall->function, where, TRAMPOLINE_TARGET);
+		}
+
+		// 'batch' means the same, but the accesses are buffered
+		// by the runtime and handed to the function in batches
+		else if(!strcmp((const char *)tagCall->arguments, "batch")) {
+			hnotice(4, "Specified a 'batch' argument to '%s' function, buffering the accesses\n", tagCall->function);
+
+			trampoline_prepare(target, (unsigned char *)tagCall->function, where, TRAMPOLINE_BATCH);
+		}
+
+		// 'range' hands the function the range of addresses an access
+		// has walked through in a loop, once the loop is over
+		else if(!strcmp((const char *)tagCall->arguments, "range")) {
+			hnotice(4, "Specified a 'range' argument to '%s' function, hoisting the accesses out of the loops\n", tagCall->function);
+
+			trampoline_prepare(target, (unsigned char *)tagCall->function, where, TRAMPOLINE_RANGE);
 		}
 
 	} else {
@@ -215,147 +201,363 @@ static void apply_rule_addcall (Call *tagCall, insn_info *target) {
 
 
 /**
- * Given a XML instruction tag, it will apply the relative rule to the current
- * internal binary representation of the ELF file.
+ * The Assembly tag specifies a sequence of instructions, written inline in
+ * the rules file, to be placed before, after or in place of the target one.
+ * The code is translated by the internal assembler, so no external tool is
+ * involved; external symbols referenced by the code become relocations.
  *
- * @param tagInstruction Pointer to the XML instruction tag maintaining the rule
+ * @param tagAssembly Pointer to the Assembly tag
+ * @param target Pointer to the pivot instruction descriptor
+ */
+static void apply_rule_assembly (Assembly *tagAssembly, insn_info *target) {
+	snippet *snip;
+	insn_info *insn;
+	insn_insert_mode where;
+	bool intel = false;
+
+	if(tagAssembly->instruction == NULL) {
+		herror(true, "The Assembly tag requires the 'instruction' attribute!\n");
+	}
+
+	if(tagAssembly->arch && strcasecmp((const char *)tagAssembly->arch, ASM_ARCH_X86)
+	    && strcasecmp((const char *)tagAssembly->arch, ASM_ARCH_X86_64)) {
+		herror(true, "Architecture '%s' is not supported by the Assembly tag!\n", tagAssembly->arch);
+	}
+
+	if(tagAssembly->syntax && !strcasecmp((const char *)tagAssembly->syntax, ASM_SYNTAX_INTEL))
+		intel = true;
+	else if(tagAssembly->syntax && strcasecmp((const char *)tagAssembly->syntax, ASM_SYNTAX_ATT))
+		herror(true, "Unknown assembly syntax '%s'!\n", tagAssembly->syntax);
+
+	if(tagAssembly->action && !strcmp((const char *)tagAssembly->action, ASM_ACTION_SUB))
+		where = SUBSTITUTE;
+	else if(tagAssembly->where && !strcmp((const char *)tagAssembly->where, ATTRIB_WHERE_AFTER))
+		where = INSERT_AFTER;
+	else // Default
+		where = INSERT_BEFORE;
+
+	hnotice(3, "Assembling '%s' (%s syntax)\n", tagAssembly->instruction, intel ? "Intel" : "AT&T");
+
+	snip = snippet_assemble((char *)tagAssembly->instruction, intel);
+
+	snippet_apply(snip, target, where, &insn);
+
+	hsuccess();
+}
+
+
+/**
+ * Applies the rule of an XML instruction tag to an instruction which matches it.
  *
- * @return The number of instrumented instructions
+ * @param tagInstruction Pointer to the XML instruction tag maintaining the rule
+ * @param insn Pointer to the matching instruction descriptor
  */
-static int apply_rule_instruction(Executable *exec, Instruction *tagInstruction, function *func) {
+static void apply_rule_instruction_at(Instruction *tagInstruction, insn_info *insn) {
 	int tag;
-	int count;
-	insn_info *insn;
 	Assembly *tagAssembly;
 	Call *tagCall;
 
-	(void)exec;
+	hnotice(4, "Instrumenting '%s' at %#08llx...\n", insn->i.x86.mnemonic, insn->new_addr);
 
-	insn = func->begin_insn;
-	count = 0;
+	// Instruction tags may be composed of several Assembly tags
+	for(tag = 0; tag < tagInstruction->nAssembly; ++tag) {
+		// Retrieve the next assembly tag and process it
+		hnotice(2, "Assembly tag met, applying the rule\n");
+		tagAssembly = tagInstruction->assembly[tag];
 
-	hnotice(2, "Entering Instruction scope; searching for instruction of type %d\n", tagInstruction->flags);
-	while(insn) {
-		hnotice(5, "Checking instruction at <%#08llx>\n", insn->new_addr);
 
-		// Check whether the instruction's type match to the rule
-		if (insn->flags & tagInstruction->flags) {
-			// If this is the case, the rules applies.
-			hnotice(3, "Instruction matching the rule specification is found:\n");
+		apply_rule_assembly(tagAssembly, insn);
+	}
 
-			// Check whether the instruction match skip flags
-			if (insn->flags & tagInstruction->skipFlags) {
-				hnotice(4, "Instruction matches skipFlags, ignored\n");
+	// Check if the Instruction tag has a Call node
+	if(tagInstruction->call) {
+		tagCall = tagInstruction->call;
+		apply_rule_addcall(tagCall, insn);
+	}
 
-				insn = insn->next;
-				continue;
-			}
+	// Check injectBefore attribute
+	if(tagInstruction->before) {
+		apply_rule_inject((char *)tagInstruction->before, insn, INSERT_BEFORE);
+	}
 
-			hnotice(4, "Instrumenting '%s' at %#08llx...\n", insn->i.x86.mnemonic, insn->new_addr);
+	// Check injectAfter attribute
+	if(tagInstruction->after) {
+		apply_rule_inject((char *)tagInstruction->after, insn, INSERT_AFTER);
+	}
 
-			// Increment the counter of instrumented instructions
-			count++;
+	// Check replace attribute
+	if(tagInstruction->replace) {
+		apply_rule_inject((char *)tagInstruction->replace, insn, SUBSTITUTE);
+	}
+}
 
 
-			// Instruction tags may be composed of several Assembly tags
-			for(tag = 0; tag < tagInstruction->nAssembly; ++tag) {
-				// Retrieve the next assembly tag and process it
-				hnotice(2, "Assembly tag met, applying the rule\n");
-				tagAssembly = tagInstruction->assembly[tag];
+/**
+ * Instruction rules which apply to a given combination of instruction flags,
+ * in the order in which they are listed.
+ */
+typedef struct _rule_dispatch {
+	unsigned long flags;
+	int count;
+	Instruction **rules;
 
+	struct _rule_dispatch *next;
+} rule_dispatch;
 
-				hnotice(3, "Parse instruction bytes '%s'\n...", tagAssembly->instruction);
-				// TODO: chiamare la funzione parse_insn_bytes()
-				// TODO: chiamare la funzione insert_instruction_at()
-			}
 
-			// Check if the Instruction tag has a Call node
-			if(tagInstruction->call) {
-				tagCall = tagInstruction->call;
-				apply_rule_addcall(tagCall, insn);
-			}
+/**
+ * A list of Instruction rules compiled into a dispatch table, which tells
+ * the rules matching each combination of flags. The entries are only built
+ * upon the first instruction having that combination, which keeps the cost
+ * of a match independent of the number of rules.
+ */
+typedef struct {
+	Instruction **rules;
+	int count;
+	hash_table dispatch;          // Entries by the hash of their flags
+	rule_dispatch *entries;       // List of all the entries, to release them
+} rule_set;
 
-			// Check injectBefore attribute
-			if(tagInstruction->before) {
-				apply_rule_inject((char *)tagInstruction->before, insn, INSERT_BEFORE);
-			}
 
-			// Check injectAfter attribute
-			if(tagInstruction->after) {
-				apply_rule_inject((char *)tagInstruction->after, insn, INSERT_AFTER);
-			}
+/**
+ * The rules of a Function tag, along with its compiled Instruction rules.
+ */
+typedef struct {
+	Function *tag;
+	rule_set instructions;
+} rule_function;
 
-			// Check replace attribute
-			if(tagInstruction->replace) {
-				apply_rule_inject((char *)tagInstruction->replace, insn, SUBSTITUTE);
-			}
+
+static void rule_set_init(rule_set *set, Instruction **rules, int count) {
+	bzero(set, sizeof(rule_set));
+
+	set->rules = rules;
+	set->count = count;
+}
+
+
+static void rule_set_release(rule_set *set) {
+	rule_dispatch *entry;
+
+	while (set->entries) {
+		entry = set->entries;
+		set->entries = entry->next;
+
+		free(entry->rules);
+		free(entry);
+	}
+
+	ht_clear(&set->dispatch);
+}
+
+
+/**
+ * Looks up the rules of a set which match a combination of flags, compiling
+ * the entry of the dispatch table if it is the first time it is met.
+ *
+ * @param set Pointer to the set of rules
+ * @param flags Flags of an instruction
+ *
+ * @return Pointer to the entry of the dispatch table
+ */
+static rule_dispatch *rule_set_match(rule_set *set, unsigned long flags) {
+	rule_dispatch *entry;
+	unsigned long long key;
+	ht_node *node;
+	int tag;
+
+	key = hash_bytes(&flags, sizeof(flags), HASH_FNV_OFFSET);
+
+	ht_foreach(&set->dispatch, key, node) {
+		entry = node->elem;
+
+		if (entry->flags == flags) {
+			return entry;
 		}
+	}
 
-		insn = insn->next;
+	entry = calloc(sizeof(rule_dispatch), 1);
+	if (!entry) {
+		herror(true, "Out of memory!\n");
 	}
 
-	if(!count) {
-		hnotice(2, "No instruction that matches the rule is found\n");
+	entry->flags = flags;
+	entry->rules = malloc(sizeof(Instruction *) * (set->count + 1));
+	if (!entry->rules) {
+		herror(true, "Out of memory!\n");
 	}
 
-	return count;
+	for (tag = 0; tag < set->count; tag++) {
+		if ((flags & set->rules[tag]->flags) && !(flags & set->rules[tag]->skipFlags)) {
+			entry->rules[entry->count++] = set->rules[tag];
+		}
+	}
+
+	hnotice(4, "Flags %#lx are matched by %d of %d instruction rules\n",
+		flags, entry->count, set->count);
+
+	entry->next = set->entries;
+	set->entries = entry;
+
+	ht_insert(&set->dispatch, key, entry);
+
+	return entry;
 }
 
 
 /**
- * Given a XML function tag, it will apply the relative rule to the current
- * internal binary representation of the ELF file. A function tag define the
- * instrument scope for embraced sub-tags, therefore a single function likely
- * has different instruction tags beneath.
- * Once the function has been identified, the instrumentation process of the
- * other sub-tags will take place.
+ * Applies the rules of a set to an instruction.
  *
- * @param tagFunction Pointer to the XML function tag maintaining the rule
+ * @param set Pointer to the set of rules
+ * @param flags Flags of the instruction, as they were before any rule was applied
+ * @param insn Pointer to the instruction descriptor
  *
- * @return The number of the instrumented instructions
+ * @return The number of rules which have been applied
  */
-static int apply_rule_function (Executable *exec, Function *tagFunction) {
-	function *func;
+static int rule_set_apply(rule_set *set, unsigned long flags, insn_info *insn) {
+	rule_dispatch *entry;
 	int tag;
+
+	if (set->count == 0) {
+		return 0;
+	}
+
+	entry = rule_set_match(set, flags);
+
+	for (tag = 0; tag < entry->count; tag++) {
+		apply_rule_instruction_at(entry->rules[tag], insn);
+	}
+
+	return entry->count;
+}
+
+
+/**
+ * Applies the Instruction and Function tags of an Executable tag to the
+ * current version, in a single pass over the columnar copy of its code.
+ * The rules are compiled up front: the Instruction rules into a dispatch
+ * table by instruction flags, and the Function tags into a table by the
+ * hash of the name of the function they apply to.
+ *
+ * Each instruction undergoes the rules of the Executable tag first, then
+ * those of the Function tags of its function, in the order in which the
+ * tags are listed. The Assembly and Call sub-tags of a Function tag are
+ * applied to the entry point after all the instructions of the function.
+ * Instructions added by a rule are never matched against another rule.
+ *
+ * @param exec Pointer to the XML executable tag
+ *
+ * @return The number of instrumented instructions
+ */
+static int apply_rules_program(Executable *exec) {
+	rule_set program;
+	rule_function *functions, **matched;
+	hash_table by_name;
+	unsigned long long key;
+	ht_node *node;
+
+	insn_columns *table;
+	function *func;
+	insn_info *insn;
+
+	int tag, sub, nmatched;
 	int count;
+	size_t position, entry;
+
+	Function *tagFunction;
+
+	if (exec->nInstructions == 0 && exec->nFunctions == 0) {
+		return 0;
+	}
+
+	rule_set_init(&program, exec->instructions, exec->nInstructions);
+
+	bzero(&by_name, sizeof(by_name));
+
+	functions = calloc(sizeof(rule_function), exec->nFunctions + 1);
+	matched = malloc(sizeof(rule_function *) * (exec->nFunctions + 1));
+	if (!functions || !matched) {
+		herror(true, "Out of memory!\n");
+	}
+
+	for (tag = 0; tag < exec->nFunctions; tag++) {
+		tagFunction = exec->functions[tag];
+
+		functions[tag].tag = tagFunction;
+		rule_set_init(&functions[tag].instructions,
+			tagFunction->instructions, tagFunction->nInstructions);
+
+		ht_insert(&by_name, hash_string(tagFunction->name), &functions[tag]);
+	}
+
+	table = insn_columns_get();
+	if (table == NULL) {
+		table = insn_columns_build();
+	}
 
-	Instruction *tagInstruction;
-	Call *tagCall;
 	count = 0;
 
-	hnotice(2, "Entering Function scope: searching '%s' function", tagFunction->name);
+	for (position = 0, func = CODE; func; position++, func = func->next) {
+		// Function tags are looked up by name, in the order they are listed
+		nmatched = 0;
 
-	func = PROGRAM(code);
-	while(func) {
-		// Look for the right function to which to apply the rule
-		if(!strcmp((const char *)func->name, (char *)tagFunction->name)) {
-			hnotice(4, "Function matching '%s' the rule name found\n", func->name);
+		if (exec->nFunctions > 0) {
+			key = hash_string(func->name);
+
+			ht_foreach(&by_name, key, node) {
+				if (str_equal(((rule_function *) node->elem)->tag->name, func->name)) {
+					matched[nmatched++] = node->elem;
+				}
+			}
+		}
+
+		if (program.count == 0 && nmatched == 0) {
+			continue;
+		}
 
-			// Retrieve the sub tags: a function may be composed of
-			// several Instruction or Assembly tags
+		hnotice(3, "Instrumenting function '%s' <%#08llx>\n",
+			func->symbol->name, func->begin_insn->new_addr);
 
-			// Iterates all over the Instruction sub-tags
-			for(tag = 0; tag < tagFunction->nInstructions; tag++) {
-				// Retrieve the next instruction tag and process it
-				hnotice(2, "Instruction tag met, applying the rule\n");
-				tagInstruction = tagFunction->instructions[tag];
-				hnotice(3, "Looking for the instruction with flags %x\n", tagInstruction->flags);
-				count += apply_rule_instruction(exec, tagInstruction, func);
+		for (entry = table->function_begin[position]; entry < table->function_begin[position + 1]; entry++) {
+			insn = table->insn[entry];
+
+			count += rule_set_apply(&program, table->flags[entry], insn);
+
+			for (sub = 0; sub < nmatched; sub++) {
+				count += rule_set_apply(&matched[sub]->instructions, table->flags[entry], insn);
 			}
+		}
 
-			// Check if a Call tag has been specified
-			if(tagFunction->call) {
-				tagCall = tagFunction->call;
-				apply_rule_addcall(tagCall, func->begin_insn);
+		for (sub = 0; sub < nmatched; sub++) {
+			tagFunction = matched[sub]->tag;
+
+			hnotice(4, "Function matching '%s' the rule name found\n", func->name);
+
+			// Assembly sub-tags are applied with respect to the function's entry point
+			for (tag = 0; tag < tagFunction->nAssembly; tag++) {
+				hnotice(2, "Assembly tag met, applying the rule\n");
+				apply_rule_assembly(tagFunction->assembly[tag], func->begin_insn);
 			}
 
+			// Check if a Call tag has been specified
+			if (tagFunction->call) {
+				apply_rule_addcall(tagFunction->call, func->begin_insn);
+			}
 		}
+	}
 
-		func = func->next;
+	rule_set_release(&program);
+
+	for (tag = 0; tag < exec->nFunctions; tag++) {
+		rule_set_release(&functions[tag].instructions);
 	}
 
-	if(!count) {
-		hnotice(2, "No function that matches the rule is found\n");
+	ht_clear(&by_name);
+	free(functions);
+	free(matched);
+
+	if (!count) {
+		hnotice(2, "No instruction that matches the rules is found\n");
 	}
 
 	return count;
@@ -388,14 +590,17 @@ static void hijack_main(unsigned char *entry_point) {
 	}
 
 	// Change the name of the original entry program's point
-	sym_main->name = sym_main->func->name = "original_main";
+	symbol_rename(sym_main, "original_main");
+	sym_main->func->name = "original_main";
 
 	// Change all relocations toward the main symbol (if any)
+	pthread_mutex_lock(&PROGRAM(lock));
 	for (sym = PROGRAM(symbols); sym; sym = sym->next) {
 		if (str_equal(sym->name, "main")) {
-			sym->name = "original_main";
+			symbol_rename(sym, "original_main");
 		}
 	}
+	pthread_mutex_unlock(&PROGRAM(lock));
 
 	// Creates a new stub function that acts as the new main
 	main = function_create_from_bytes("main", code2, sizeof(code2), text);
@@ -411,46 +616,137 @@ static void hijack_main(unsigned char *entry_point) {
 
 
 /**
- * Given a rule, applies it by calling the correspondent function
+ * Applies the rules of a version to its own copy of the program.
+ *
+ * @param version The version whose rules are applied
  */
-void apply_rules(void) {
-	function *func;
+static void apply_rules_version(int version) {
 	preset *preset;
 
 	int tag;
-	int version;
 	int instrumented;
 
-	char *module;
 	Executable *exec;
 	Preset *tagPreset;
-	Instruction *tagInstruction;
-	Function *tagFunction;
 
-	hprint("Start applying rules...\n\n");
+	hnotice(1, "Executable version %d\n", version);
 
-	unsigned char *entry_point;
+	// Reset the counter of the overall instrumented instructions
+	instrumented = 0;
 
-	// Create a temporary directory to place object files;
-	execute("mkdir", "-p", TEMP_PATH);
+	// Get the new version executable's rules
+	exec = config.rules[version];
 
+	// Clone the intermediate binary representation
+	// Version 0 is reserved to the original plain copy of the application,
+	// which has been previously cloned during the ELF parsing
+	switch_executable_version(version);
 
-	// Iterates all over executable versions
-	for (version = 0; version < config.nExecutables; version++) {
-		hnotice(1, "Executable version %d\n", version);
+	// Insertions made by the rules and the presets are batched, so
+	// that the addresses are laid out only once for the whole version
+	insn_batch_begin();
 
-		// Reset the counter of the overall instrumented instructions
-		instrumented = 0;
+	// Iterates all over the XML Preset tag in the Executable
+	for (tag = 0; tag < exec->nPresets; tag++) {
+		// Retrieve the next instruction tag and process it
+		hnotice(2, "Preset tag met, applying the rule\n");
+		tagPreset = exec->presets[tag];
+		hnotice(3, "Looking for the preset with name %s\n", tagPreset->name);
+		preset = preset_find(tagPreset->name);
 
-		// Get the new version executable's rules
-		exec = config.rules[version];
+		if (preset == NULL) {
+			herror(true, "Unable to find preset with name %s\n", tagPreset->name);
+		} else {
+			instrumented += apply_rule_preset(exec, tagPreset, preset);
+		}
+	}
+
+	// Instruction and Function tags are applied in a single pass
+	instrumented += apply_rules_program(exec);
+
+	insn_columns_drop();
+
+	// Check for a new entry point to be selected, if any
+	if(exec->entryPoint != NULL) {
+		hnotice(1, "A new entry point has been detected to function'%s'\n", exec->entryPoint);
+		hijack_main(exec->entryPoint);
+	}
+
+	insn_batch_commit();
+
+	hnotice(1, "Instrumentation of executable version %d terminated: %d instructions have been instrumented\n",
+		version, instrumented);
+
+	hsuccess();
+}
+
+
+/**
+ * Shared state of the threads building the instrumented versions.
+ */
+typedef struct {
+	job_context *job;            // Job owning the versions
+	int next;                    // Next version to be built
+	pthread_mutex_t lock;
+} version_pool;
+
+
+static void *apply_rules_worker(void *arg) {
+	version_pool *pool = (version_pool *) arg;
+	int version;
 
-		// Clone the intermediate binary representation
-		// Version 0 is reserved to the original plain copy of the application,
-		// which has been previously cloned during the ELF parsing
-		switch_executable_version(version);
+	job = pool->job;
+
+	while (true) {
+		pthread_mutex_lock(&pool->lock);
+		version = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (version >= config.nExecutables) {
+			break;
+		}
+
+		apply_rules_version(version);
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Given a rule, applies it by calling the correspondent function.
+ * Version 0 is built first, as all the others are cloned from it; the
+ * instrumented versions only share the symbols with each other, hence
+ * they are built concurrently, on as many threads as the job is given.
+ */
+void apply_rules(void) {
+	version_pool pool;
+	pthread_t *threads;
+	unsigned int nthreads, count, i;
+
+	int tag;
+	int version;
+
+	char *module;
+	Executable *exec;
+
+	hprint("Start applying rules...\n\n");
+
+	// Create a temporary directory to place object files;
+	execute("mkdir", "-p", TEMP_PATH);
+
+	// As well as the directory of the snippet cache, if any
+	if (config.cache_path) {
+		execute("mkdir", "-p", config.cache_path);
+	}
+
+	// Iterates all over the XML inject tags of the Executables; archive
+	// members leave them to apply_rules_injects(), as the modules are
+	// shared by all of them. They are compiled in version order, which
+	// is the order of the modules in the link
+	for (version = 0; version < config.nExecutables && !job->member; version++) {
+		exec = config.rules[version];
 
-		// Iterates all over the XML inject tag in the Executable
 		for (tag = 0; tag < exec->nInjects; tag++) {
 			// Retrieve the next inject tag and process it
 			hnotice(2, "Inject tag met, applying the rule\n");
@@ -458,54 +754,129 @@ void apply_rules(void) {
 			hnotice(3, "Looking for the instruction with flags '%s'\n", module);
 			apply_rule_link(module);
 		}
+	}
 
-		// Iterates all over the XML Preset tag in the Executable
-		for (tag = 0; tag < exec->nPresets; tag++) {
-			// Retrieve the next instruction tag and process it
-			hnotice(2, "Preset tag met, applying the rule\n");
-			tagPreset = exec->presets[tag];
-			hnotice(3, "Looking for the preset with name %s\n", tagPreset->name);
-			preset = preset_find(tagPreset->name);
-
-			if (preset == NULL) {
-				herror(true, "Unable to find preset with name %s\n", tagPreset->name);
-			} else {
-				instrumented += apply_rule_preset(exec, tagPreset, preset);
-			}
+	apply_rules_version(0);
+
+	count = config.nExecutables - 1;
+
+	if (count > 0) {
+		pool.job = job;
+		pool.next = 1;
+		pthread_mutex_init(&pool.lock, NULL);
+
+		nthreads = job->threads < count ? job->threads : count;
+
+		hnotice(1, "Building %u instrumented versions on %u threads\n", count, nthreads ? nthreads : 1);
+
+		threads = malloc(sizeof(pthread_t) * (nthreads + 1));
+		if (threads == NULL) {
+			herror(true, "Out of memory!\n");
 		}
 
-		// Iterates all over the instructions in the Executable XML tag
-		for (tag = 0; tag < exec->nInstructions; tag++) {
-			// Retrieve the next instruction tag and process it
-			hnotice(2, "Instruction tag met, applying the rule\n");
-			tagInstruction = exec->instructions[tag];
-			hnotice(3, "Looking for the instruction with flags %x\n", tagInstruction->flags);
-			func = PROGRAM(code);
-			while(func) {
-				hnotice(3, "Instrumenting function '%s' <%#08llx>\n",
-					func->symbol->name, func->begin_insn->new_addr);
-				instrumented += apply_rule_instruction(exec, tagInstruction, func);
-				func = func->next;
+		symbol_versions_begin(1, count);
+
+		// The calling thread builds versions as well
+		for (i = 1; i < nthreads; i++) {
+			if (pthread_create(&threads[i], NULL, apply_rules_worker, &pool) != 0) {
+				herror(true, "Unable to create the threads building the versions\n");
 			}
 		}
 
-		for (tag = 0; tag < exec->nFunctions; tag++) {
-			// Retrieve the next function tag and process it
-			hnotice(2, "Function tag met, applying the rule\n");
-			tagFunction = exec->functions[tag];
-			hnotice(3, "Looking for the function '%s'\n", tagFunction->name);
-			instrumented += apply_rule_function(exec, tagFunction);
+		apply_rules_worker(&pool);
+
+		for (i = 1; i < nthreads; i++) {
+			pthread_join(threads[i], NULL);
 		}
 
-		// Check for a new entry point to be selected, if any
-		if(exec->entryPoint != NULL) {
-			hnotice(1, "A new entry point has been detected to function'%s'\n", exec->entryPoint);
-			hijack_main(exec->entryPoint);
+		symbol_versions_end(1, count);
+
+		pthread_mutex_destroy(&pool.lock);
+		free(threads);
+	}
+
+	// The calling thread may be left on any of the versions it has built
+	switch_executable_version(0);
+
+	snippet_stats();
+}
+
+
+/**
+ * Tells whether the rules of a version may instrument a function. Instruction
+ * and Preset tags at the Executable level scan the whole program, whereas
+ * Function tags only touch the function they name, either in the plain version
+ * or in the version they belong to (i.e. with that version's suffix).
+ *
+ * @param func Pointer to the function descriptor, in the plain version
+ * @param version The version whose rules are checked
+ *
+ * @return True if some rule of the version may instrument the function
+ */
+bool rules_reach_function_in(function *func, int version) {
+	Executable *exec;
+	char *name, *suffix;
+	size_t length;
+	int tag;
+
+	exec = config.rules[version];
+
+	if (exec->nInstructions > 0 || exec->nPresets > 0) {
+		return true;
+	}
+
+	length = strlen(func->name);
+	suffix = (char *)exec->suffix;
+
+	for (tag = 0; tag < exec->nFunctions; tag++) {
+		name = (char *)exec->functions[tag]->name;
+
+		if (str_equal(name, func->name)) {
+			return true;
 		}
 
-		hnotice(1, "Instrumentation of executable version %d terminated: %d instructions have been instrumented\n",
-			version, instrumented);
+		if (version > 0 && suffix && !strncmp(name, func->name, length)
+		    && name[length] == '_' && str_equal(name + length + 1, suffix)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
 
-		hsuccess();
+/**
+ * Tells whether the rules of any version may instrument a function.
+ *
+ * @param func Pointer to the function descriptor, in the plain version
+ *
+ * @return True if some rule may instrument the function
+ */
+bool rules_reach_function(function *func) {
+	int version;
+
+	for (version = 0; version < config.nExecutables; version++) {
+		if (rules_reach_function_in(func, version)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+void apply_rules_injects(void) {
+	Executable *exec;
+	int version;
+	int tag;
+
+	execute("mkdir", "-p", TEMP_PATH);
+
+	for (version = 0; version < config.nExecutables; version++) {
+		exec = config.rules[version];
+
+		for (tag = 0; tag < exec->nInjects; tag++) {
+			apply_rule_link((char *)exec->injectFiles[tag]);
+		}
 	}
 }
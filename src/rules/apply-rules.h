@@ -27,8 +27,40 @@
 #ifndef _APPLY_RULES_H
 #define _APPLY_RULES_H
 
+#include <stdbool.h>
+
+#include <ibr.h>
+
 #define TEMP_PATH "./"
 
 void apply_rules(void);
 
+/**
+ * Compiles the modules of the Inject tags of all the versions, without
+ * touching the program. This is used when the modules are not linked to
+ * each instrumented object, but shipped once (e.g. as archive members).
+ */
+void apply_rules_injects(void);
+
+/**
+ * Tells whether the rules may instrument a function, so that functions
+ * that no rule can reach need not be decoded any further.
+ *
+ * @param func Pointer to the function descriptor
+ *
+ * @return True if some rule may instrument the function
+ */
+bool rules_reach_function(function *func);
+
+/**
+ * Tells whether the rules of a single version may instrument a function,
+ * so that the version can carry the functions they cannot reach as they are.
+ *
+ * @param func Pointer to the function descriptor, in the plain version
+ * @param version The version whose rules are checked
+ *
+ * @return True if some rule of the version may instrument the function
+ */
+bool rules_reach_function_in(function *func, int version);
+
 #endif /* _APPLY_RULES_H */
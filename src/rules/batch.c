@@ -0,0 +1,162 @@
+/**
+*                       Copyright (C) 2008-2015 HPDCS Group
+*                       http://www.dis.uniroma1.it/~hpdcs
+*
+*
+* This file is part of the Hijacker static binary instrumentation tool.
+*
+* Hijacker is free software; you can redistribute it and/or modify it under the
+* terms of the GNU General Public License as published by the Free Software
+* Foundation; either version 3 of the License, or (at your option) any later
+* version.
+*
+* Hijacker is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+* A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* hijacker; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*
+* @file batch.c
+* @brief Runtime buffering the accesses which are handed in batches to the
+* 	 functions of the AddCall tags
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <trampoline.h>
+
+
+typedef void (*batch_function)(const batch_record *records, size_t count);
+
+_Static_assert(sizeof(batch_record) == BATCH_RECORD_SIZE, "trampoline_batch relies on the size of the records");
+
+
+// Accesses buffered by the thread. The call sites append them through
+// trampoline_batch, which only knows the end of the buffer in bytes
+__thread batch_record trampoline_batch_buffer[BATCH_RECORDS];
+__thread unsigned long trampoline_batch_end;
+
+// Copy of the buffer, grouped by function, which the batches are handed from
+static __thread batch_record batch_grouped[BATCH_RECORDS];
+
+static __thread int batch_registered;
+static __thread int batch_flushing;
+
+static pthread_key_t batch_key;
+static pthread_once_t batch_once = PTHREAD_ONCE_INIT;
+
+
+void hijacker_flush(void);
+
+
+static void batch_thread_exit(void *unused) {
+	(void) unused;
+	hijacker_flush();
+}
+
+
+static void batch_process_exit(void) {
+	hijacker_flush();
+}
+
+
+static void batch_init(void) {
+	pthread_key_create(&batch_key, batch_thread_exit);
+	atexit(batch_process_exit);
+}
+
+
+/**
+ * Called by trampoline_batch whenever it appends an access to an empty
+ * buffer. The first time a thread gets here, the buffer is bound to the
+ * exit of the thread, so that the accesses left in it are not lost.
+ */
+void trampoline_batch_start(void) {
+	if(batch_registered)
+		return;
+
+	pthread_once(&batch_once, batch_init);
+	pthread_setspecific(batch_key, (void *) 1);
+
+	batch_registered = 1;
+}
+
+
+/**
+ * Hands the accesses buffered by the calling thread to their functions, one
+ * batch per function, and empties the buffer. Within a batch the accesses
+ * keep the order in which they were made.
+ *
+ * Accesses recorded by the functions themselves while they are handled a
+ * batch (i.e. if they are instrumented too) are dropped.
+ */
+void hijacker_flush(void) {
+	size_t count, grouped, first, idx;
+	batch_function function;
+
+	count = trampoline_batch_end / sizeof(batch_record);
+	trampoline_batch_end = 0;
+
+	if(batch_flushing || count == 0)
+		return;
+
+	batch_flushing = 1;
+
+	// The buffer is scanned once per distinct function, which are
+	// usually as few as the AddCall tags of the rules
+	grouped = 0;
+	for(first = 0; first < count; first++) {
+		function = trampoline_batch_buffer[first].function;
+		if(function == NULL)
+			continue;
+
+		for(idx = first; idx < count; idx++) {
+			if(trampoline_batch_buffer[idx].function == function) {
+				batch_grouped[grouped++] = trampoline_batch_buffer[idx];
+				trampoline_batch_buffer[idx].function = NULL;
+			}
+		}
+	}
+
+	for(first = 0; first < grouped; first = idx) {
+		function = batch_grouped[first].function;
+		for(idx = first; idx < grouped && batch_grouped[idx].function == function; idx++);
+
+		function(batch_grouped + first, idx - first);
+	}
+
+	// Whatever the functions have recorded meanwhile is not handed over
+	trampoline_batch_end = 0;
+	batch_flushing = 0;
+}
+
+
+/**
+ * Buffers an access on behalf of the generic trampoline, which is used by
+ * the call sites unable to compute the address of the access in place.
+ *
+ * @param address Address of the access
+ * @param size Size of the access
+ * @param entry Structure the call site has pushed on the stack
+ */
+void trampoline_batch_generic(unsigned long long address, unsigned long size, batch_entry *entry) {
+	batch_record *record;
+
+	if(trampoline_batch_end == 0)
+		trampoline_batch_start();
+
+	record = &trampoline_batch_buffer[trampoline_batch_end / sizeof(batch_record)];
+	record->address = address;
+	record->size = size;
+	record->site = entry->site;
+	record->function = (void *) entry->function;
+
+	trampoline_batch_end += sizeof(batch_record);
+
+	if(trampoline_batch_end == sizeof(trampoline_batch_buffer))
+		hijacker_flush();
+}
@@ -43,7 +43,7 @@ static function * get_function (insn_info *target) {
 
 	// TODO: da testare se funziona!!
 	// find the function to which the instrumented instruction belongs
-	cur = PROGRAM(code);
+	cur = CODE;
 	while(cur) {
 		if(cur->new_addr > target->new_addr) {
 			break;
@@ -136,7 +136,7 @@ static void update_instruction_references(insn_info *target, int shift) {
 	// variable holds the incremental address which takes into account the sizes of each
 	// instruction encountered.
 	//foo = func;
-	foo = PROGRAM(code);
+	foo = CODE;
 	offset = 0;
 	while(foo) {
 
@@ -174,7 +174,7 @@ static void update_instruction_references(insn_info *target, int shift) {
 	// update jump refs, if any, from this function to end of code
 	hnotice(4, "Check jump displacements\n");
 
-	foo = PROGRAM(code);
+	foo = CODE;
 	while(foo) {
 
 		hnotice(5, "In function '%s'\n", foo->name);
@@ -288,12 +288,12 @@ static void update_instruction_references(insn_info *target, int shift) {
 		if(!strncmp((const char *)sym->name, ".text", 5)) {
 
 			// Update only those relocation beyond the code affected by current instrumentation and version
-			if(sym->relocation.addend > (long long)(target->new_addr - shift) && sym->version == PROGRAM(version)) {
+			if(sym->relocation.addend > (long long)(target->new_addr - shift) && sym->version == CURRENT(id)) {
 
 				sym->relocation.addend += shift;
 
 				printf("update .rela.rodata :: offset= %08llx, instr_addr= %08llx (%08llx), addend=%lx (%lx %+d), version=%d(%d)\n",
-					sym->relocation.offset, target->new_addr, target->new_addr - shift, sym->relocation.addend, sym->relocation.addend-shift, shift, sym->version, PROGRAM(version));
+					sym->relocation.offset, target->new_addr, target->new_addr - shift, sym->relocation.addend, sym->relocation.addend-shift, shift, sym->version, CURRENT(id));
 
 				hnotice(6, "Relocation to symbol %d (%s) at offset %#08llx addend updated %#0lx (%+d)\n",
 					sym->index, sym->name, sym->position, sym->relocation.addend, shift);
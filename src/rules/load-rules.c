@@ -243,7 +243,7 @@ static unsigned int parseInstructionFlags(xmlChar *str) {
 	int flags = 0;
 
 	if (str == NULL)
-		return;
+		return 0;
 
 	// Make a temporary copy
 	source = (char *)malloc(strlen((char *)str) + 1);
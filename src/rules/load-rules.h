@@ -45,6 +45,10 @@
 #define ATTRIB_WHERE_AFTER	"after"
 #define ASM_ACTION_INS		"insert"
 #define ASM_ACTION_SUB		"substitute"
+#define ASM_SYNTAX_ATT		"att"
+#define ASM_SYNTAX_INTEL	"intel"
+#define ASM_ARCH_X86		"x86"
+#define ASM_ARCH_X86_64		"x86_64"
 
 #define MAX_CHILDREN	256
 
@@ -0,0 +1,51 @@
+/**
+*                       Copyright (C) 2008-2015 HPDCS Group
+*                       http://www.dis.uniroma1.it/~hpdcs
+*
+*
+* This file is part of the Hijacker static binary instrumentation tool.
+*
+* Hijacker is free software; you can redistribute it and/or modify it under the
+* terms of the GNU General Public License as published by the Free Software
+* Foundation; either version 3 of the License, or (at your option) any later
+* version.
+*
+* Hijacker is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+* A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* hijacker; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*
+* @file range.c
+* @brief Runtime of the accesses which are handed as ranges to the functions
+* 	 of the AddCall tags
+*/
+
+#include <trampoline.h>
+
+
+typedef void (*range_function)(unsigned long long start, unsigned long long end, long long stride, unsigned int size);
+
+
+// Address of the first iteration of every access hoisted out of a loop, which
+// each entry of the loop stores into the slot of its call site
+__thread unsigned long long trampoline_range_start[RANGE_SITES];
+
+
+/**
+ * Hands an access as a range of a single element on behalf of the generic
+ * trampoline, which is used by the call sites unable to compute the address
+ * of the access in place.
+ *
+ * @param address Address of the access
+ * @param size Size of the access
+ * @param entry Structure the call site has pushed on the stack
+ */
+void trampoline_range_generic(unsigned long long address, unsigned long size, batch_entry *entry) {
+	range_function function;
+
+	function = (range_function) entry->function;
+	function(address, address + size, size, size);
+}
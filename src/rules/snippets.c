@@ -0,0 +1,508 @@
+/**
+*                       Copyright (C) 2008-2015 HPDCS Group
+*                       http://www.dis.uniroma1.it/~hpdcs
+*
+*
+* This file is part of the Hijacker static binary instrumentation tool.
+*
+* Hijacker is free software; you can redistribute it and/or modify it under the
+* terms of the GNU General Public License as published by the Free Software
+* Foundation; either version 3 of the License, or (at your option) any later
+* version.
+*
+* Hijacker is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+* A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* hijacker; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*
+* @file snippets.c
+* @brief Cache of the compiled and decoded code snippets injected by the rules
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <libgen.h>
+
+#include <hijacker.h>
+#include <prints.h>
+#include <compile.h>
+#include <utils.h>
+#include <apply-rules.h>
+#include <snippets.h>
+#include <x86/assemble-x86.h>
+
+
+/// List of the snippets already loaded in this run, shared by all the jobs
+static snippet *snippets;
+
+/// Serializes the accesses to the list and to the counters
+static pthread_mutex_t snippets_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Cache counters
+static struct {
+	unsigned int hits;        // Snippet found in memory
+	unsigned int disk_hits;   // Binary image found in the on-disk cache
+	unsigned int misses;      // Snippet compiled from scratch
+} stats;
+
+
+/**
+ * Reads the whole content of a file into a newly allocated buffer.
+ *
+ * @param filename Path of the file to read
+ * @param size Pointer to a variable which will hold the buffer size
+ *
+ * @return Pointer to the buffer, or NULL if the file cannot be opened
+ */
+static unsigned char *snippet_read_file(char *filename, size_t *size) {
+	FILE *fp;
+	long fsize;
+	unsigned char *content;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		return NULL;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	fsize = ftell(fp);
+	rewind(fp);
+
+	// One extra byte, so that empty files still get a valid buffer
+	content = malloc(fsize + 1);
+	if (content == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	if (fread(content, 1, fsize, fp) != (size_t)fsize) {
+		herror(true, "Unable to read the file '%s'!\n", filename);
+	}
+
+	fclose(fp);
+
+	*size = fsize;
+	return content;
+}
+
+
+/**
+ * Stores the binary image of a snippet into the on-disk cache. The image
+ * is first written to a private file which is then atomically renamed, so
+ * concurrent hijacker runs sharing the same directory never see partial files.
+ *
+ * @param cached Path of the cache entry
+ * @param snip Pointer to the snippet descriptor
+ */
+static void snippet_store(char *cached, snippet *snip) {
+	FILE *fp;
+	char temp[strlen(cached) + 32];
+
+	sprintf(temp, "%s.%d", cached, getpid());
+
+	fp = fopen(temp, "w");
+	if (fp == NULL) {
+		hnotice(3, "Unable to write the cache entry '%s', skipped\n", cached);
+		return;
+	}
+
+	if (fwrite(snip->code, 1, snip->size, fp) != snip->size) {
+		fclose(fp);
+		unlink(temp);
+		hnotice(3, "Unable to write the cache entry '%s', skipped\n", cached);
+		return;
+	}
+
+	fclose(fp);
+	rename(temp, cached);
+}
+
+
+/**
+ * Compiles the snippet's source and extracts its raw binary image.
+ * Temporary files are named after the process and the content hash,
+ * so that neither different snippets nor concurrent runs clobber them.
+ *
+ * @param snip Pointer to the snippet descriptor
+ */
+static void snippet_compile(snippet *snip) {
+	char obj[sizeof(TEMP_PATH) + 64];
+	char bin[sizeof(TEMP_PATH) + 64];
+
+	sprintf(obj, "%ssnippet-%d-%016llx.o", TEMP_PATH, getpid(), snip->hash);
+	sprintf(bin, "%ssnippet-%d-%016llx.bin", TEMP_PATH, getpid(), snip->hash);
+
+	hnotice(6, "Compiling assembly file '%s' into binary file '%s'\n", snip->path, bin);
+
+	compile(snip->path, "-c", "-o", obj);
+	execute("objcopy", "-O", "binary", obj, bin);
+
+	snip->code = snippet_read_file(bin, &snip->size);
+
+	unlink(obj);
+	unlink(bin);
+
+	if (snip->code == NULL) {
+		herror(true, "Unable to read the binary image of '%s'!\n", snip->path);
+	}
+}
+
+
+/**
+ * Decodes the binary image of a snippet into a chain of instruction
+ * descriptors, which will be used as model for any later insertion.
+ *
+ * @param snip Pointer to the snippet descriptor
+ */
+static void snippet_decode(snippet *snip) {
+	insn_info *instr, *prev;
+	unsigned long int pos;
+
+	pos = 0;
+	prev = NULL;
+
+	while (pos < snip->size) {
+		instr = calloc(sizeof(insn_info), 1);
+		if (instr == NULL) {
+			herror(true, "Out of memory!\n");
+		}
+
+		parse_instruction_bytes(snip->code, &pos, &instr);
+
+		if (prev) {
+			prev->next = instr;
+			instr->prev = prev;
+		} else {
+			snip->insns = instr;
+		}
+
+		prev = instr;
+		snip->ninsns++;
+	}
+
+	hnotice(4, "Snippet '%s' decoded into %u instructions (%zd bytes)\n",
+		snip->path, snip->ninsns, snip->size);
+}
+
+
+snippet *snippet_load(char *filename) {
+	snippet *snip;
+	unsigned char *source;
+	size_t size;
+	char *ext;
+
+	// The contents of the source files are not expected to change during
+	// a single run, so the in-memory lookup is keyed on the path only
+	// Snippets are built while holding the lock, so that the jobs
+	// needing the same one wait for it rather than building it again
+	pthread_mutex_lock(&snippets_lock);
+
+	for (snip = snippets; snip; snip = snip->next) {
+		if (str_equal(snip->path, filename)) {
+			stats.hits++;
+			pthread_mutex_unlock(&snippets_lock);
+			return snip;
+		}
+	}
+
+	source = snippet_read_file(filename, &size);
+	if (source == NULL) {
+		herror(true, "The XML rules file has specified an inject file that does not exists!\n");
+	}
+
+	snip = calloc(sizeof(snippet), 1);
+	if (snip == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	snip->path = filename;
+
+	// The extension drives the compiler's language selection,
+	// therefore it contributes to the key as well
+	ext = strrchr(basename(filename), '.');
+	snip->hash = hash_bytes(ext ? ext : "", ext ? strlen(ext) : 0, HASH_FNV_OFFSET);
+	snip->hash = hash_bytes(source, size, snip->hash);
+
+	free(source);
+
+	if (config.cache_path) {
+		char cached[strlen(config.cache_path) + 32];
+
+		sprintf(cached, "%s/%016llx" SNIPPET_CACHE_EXT, config.cache_path, snip->hash);
+
+		snip->code = snippet_read_file(cached, &snip->size);
+
+		if (snip->code) {
+			hnotice(4, "Snippet '%s' found in the cache as '%s'\n", filename, cached);
+			stats.disk_hits++;
+		} else {
+			snippet_compile(snip);
+			snippet_store(cached, snip);
+			stats.misses++;
+		}
+	} else {
+		snippet_compile(snip);
+		stats.misses++;
+	}
+
+	snippet_decode(snip);
+
+	snip->next = snippets;
+	snippets = snip;
+
+	pthread_mutex_unlock(&snippets_lock);
+
+	return snip;
+}
+
+
+/**
+ * Resolves the references of an assembled snippet to its own instructions
+ * and to external symbols. Jumps whose target lies within the snippet are
+ * later linked to the corresponding clone, so that their displacements
+ * are kept up to date by the usual jump correction pass.
+ *
+ * @param snip Pointer to the snippet descriptor
+ * @param fixups Array of symbolic references emitted by the assembler
+ * @param nfixups Number of symbolic references
+ */
+static void snippet_resolve(snippet *snip, x86_fixup *fixups, unsigned int nfixups) {
+	insn_info *instr;
+	unsigned long long start[snip->ninsns + 1];
+	unsigned long long dest;
+	unsigned int idx, j, k;
+
+	snip->jumps = malloc(sizeof(unsigned int) * (snip->ninsns ? snip->ninsns : 1));
+	snip->relocs = malloc(sizeof(snippet_reloc) * (nfixups ? nfixups : 1));
+	if (snip->jumps == NULL || snip->relocs == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	// Start offset of every instruction within the binary image
+	start[0] = 0;
+	for (idx = 0, instr = snip->insns; instr; idx++, instr = instr->next) {
+		start[idx + 1] = start[idx] + instr->size;
+	}
+
+	for (k = 0; k < nfixups; k++) {
+		for (idx = 0; idx < snip->ninsns && start[idx] != fixups[k].offset; idx++);
+
+		if (idx == snip->ninsns) {
+			hinternal();
+		}
+
+		snip->relocs[k].insn = idx;
+		snip->relocs[k].name = strdup(fixups[k].name);
+		snip->relocs[k].type = fixups[k].type;
+		snip->relocs[k].addend = fixups[k].addend;
+
+		if (snip->relocs[k].name == NULL) {
+			herror(true, "Out of memory!\n");
+		}
+	}
+	snip->nrelocs = nfixups;
+
+	for (idx = 0, instr = snip->insns; instr; idx++, instr = instr->next) {
+		snip->jumps[idx] = SNIPPET_NO_JUMP;
+
+		if (!IS_JUMP(instr) || IS_JUMPIND(instr)) {
+			continue;
+		}
+
+		// Jumps towards external symbols are handled by their relocation
+		for (k = 0; k < nfixups && snip->relocs[k].insn != idx; k++);
+		if (k < nfixups) {
+			continue;
+		}
+
+		dest = start[idx] + instr->size + instr->i.x86.jump_dest;
+
+		for (j = 0; j <= snip->ninsns && start[j] != dest; j++);
+
+		if (j > snip->ninsns) {
+			herror(true, "Jump at offset %#llx of the assembly snippet lands in the middle "
+				"of an instruction or outside the snippet!\n", start[idx]);
+		}
+
+		snip->jumps[idx] = j;
+	}
+}
+
+
+snippet *snippet_assemble(char *source, bool intel) {
+	snippet *snip;
+	x86_fixup fixups[X86_ASM_MAX_FIXUPS];
+	unsigned int nfixups;
+	size_t size;
+
+	pthread_mutex_lock(&snippets_lock);
+
+	for (snip = snippets; snip; snip = snip->next) {
+		if (snip->assembled && snip->intel == intel && str_equal(snip->path, source)) {
+			stats.hits++;
+			pthread_mutex_unlock(&snippets_lock);
+			return snip;
+		}
+	}
+
+	snip = calloc(sizeof(snippet), 1);
+	if (snip == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	snip->path = source;
+	snip->assembled = true;
+	snip->intel = intel;
+	snip->hash = hash_bytes(source, strlen(source), HASH_FNV_OFFSET);
+
+	// No x86-64 instruction is longer than 15 bytes, and each one
+	// takes at least a character of the source
+	size = 16 * (strlen(source) + 1);
+	snip->code = malloc(size);
+	if (snip->code == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	hnotice(6, "Assembling snippet '%s'\n", source);
+
+	snip->size = x86_assemble(source, intel, snip->code, size, fixups, &nfixups);
+	stats.misses++;
+
+	snippet_decode(snip);
+	snippet_resolve(snip, fixups, nfixups);
+
+	snip->next = snippets;
+	snippets = snip;
+
+	pthread_mutex_unlock(&snippets_lock);
+
+	return snip;
+}
+
+
+int snippet_apply(snippet *snip, insn_info *target, insn_insert_mode mode, insn_info **last) {
+	insn_info *clones[snip->ninsns + 1];
+	insn_info *instr, *tail;
+	function *func;
+	section *sec;
+	symbol *sym;
+	snippet_reloc *rel;
+	unsigned int idx, count;
+	int inserted;
+
+	hdump(5, "Snippet", snip->code, snip->size);
+
+	inserted = insert_instruction_clones_at(target, snip->insns, mode, &tail);
+
+	if (last) {
+		*last = tail;
+	}
+
+	if (!snip->assembled || snip->ninsns == 0) {
+		return inserted;
+	}
+
+	// Collects the clones in the snippet's order
+	if (mode == SUBSTITUTE) {
+		clones[0] = target;
+		count = 1;
+	} else if (mode == INSERT_AFTER) {
+		count = snip->ninsns;
+		instr = tail;
+		for (idx = 0; idx < count; idx++) {
+			clones[count - idx - 1] = instr;
+			instr = instr->prev;
+		}
+	} else {
+		count = snip->ninsns;
+		instr = tail;
+		for (idx = 0; idx < count; idx++) {
+			clones[count - idx - 1] = instr;
+			instr = instr->next;
+		}
+
+		// Each clone is placed just before the previous one, hence the chain
+		// comes out reversed; unlike injected files, inline assembly is made
+		// of dependent instructions, so the original order is restored
+		instr = clones[count - 1]->prev;
+		for (idx = 0; idx < count; idx++) {
+			clones[idx]->prev = idx ? clones[idx - 1] : instr;
+			clones[idx]->next = idx < count - 1 ? clones[idx + 1] : target;
+		}
+
+		if (instr) {
+			instr->next = clones[0];
+		} else {
+			// The code has been placed before the entry point of a function,
+			// which must include it; this is also needed to look the function
+			// up from the clones when creating their relocation entries
+			func = find_func_from_instr(target, NEW_ADDR);
+			if (func && func->begin_insn == target) {
+				func->begin_insn = clones[0];
+			}
+		}
+		target->prev = clones[count - 1];
+
+		if (last) {
+			*last = clones[count - 1];
+		}
+	}
+
+	for (sec = PROGRAM(sections)[CURRENT(id)]; sec; sec = sec->next) {
+		if (sec->type == SECTION_CODE) {
+			break;
+		}
+	}
+
+	if (sec == NULL) {
+		hinternal();
+	}
+
+	for (idx = 0; idx < snip->nrelocs; idx++) {
+		rel = &snip->relocs[idx];
+
+		if (rel->insn >= count) {
+			continue;
+		}
+
+		sym = find_symbol_by_name(rel->name);
+		if (sym == NULL) {
+			sym = symbol_create(rel->name, SYMBOL_UNDEF, SYMBOL_GLOBAL, sec, 0);
+		}
+
+		sym = symbol_instr_rela_create(sym, clones[rel->insn], rel->type);
+		sym->relocation.addend += rel->addend;
+	}
+
+	for (idx = 0; idx < count; idx++) {
+		if (snip->jumps[idx] == SNIPPET_NO_JUMP) {
+			continue;
+		}
+
+		if (snip->jumps[idx] < count) {
+			instr = clones[snip->jumps[idx]];
+		} else if (mode == INSERT_BEFORE) {
+			instr = target;
+		} else {
+			instr = clones[count - 1]->next;
+		}
+
+		if (instr == NULL) {
+			herror(true, "The assembly snippet jumps past the end of the function!\n");
+		}
+
+		set_jumpto_reference(clones[idx], instr);
+	}
+
+	return inserted;
+}
+
+
+void snippet_stats(void) {
+	hnotice(1, "Snippet cache: %u hits, %u disk hits, %u misses\n",
+		stats.hits, stats.disk_hits, stats.misses);
+}
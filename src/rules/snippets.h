@@ -0,0 +1,119 @@
+/**
+*                       Copyright (C) 2008-2015 HPDCS Group
+*                       http://www.dis.uniroma1.it/~hpdcs
+*
+*
+* This file is part of the Hijacker static binary instrumentation tool.
+*
+* Hijacker is free software; you can redistribute it and/or modify it under the
+* terms of the GNU General Public License as published by the Free Software
+* Foundation; either version 3 of the License, or (at your option) any later
+* version.
+*
+* Hijacker is distributed in the hope that it will be useful, but WITHOUT ANY
+* WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+* A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along with
+* hijacker; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*
+* @file snippets.h
+* @brief Cache of the compiled and decoded code snippets injected by the rules
+*/
+
+#pragma once
+#ifndef _SNIPPETS_H
+#define _SNIPPETS_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <ibr.h>
+
+/// Extension of the binary images stored in the on-disk cache
+#define SNIPPET_CACHE_EXT ".bin"
+
+/// Marks an instruction which is not a jump within the snippet
+#define SNIPPET_NO_JUMP ((unsigned int) -1)
+
+
+/**
+ * Symbolic reference of a snippet instruction, to be turned into a
+ * relocation entry every time the instruction is cloned.
+ */
+typedef struct {
+	unsigned int insn;           // Index of the referencing instruction
+	char *name;                  // Referenced symbol
+	reloc_type type;             // Kind of relocation
+	long addend;                 // Constant added to the symbol's value
+} snippet_reloc;
+
+
+/**
+ * A snippet is a source file referenced by an Instruction rule (before, after
+ * or replace attribute) which is compiled and decoded only once per run.
+ * Every match of the rule just clones the decoded instruction chain.
+ */
+typedef struct _snippet {
+	char *path;                  // Source file, or source code for inline assembly
+	unsigned long long hash;     // Hash of the source contents
+	bool assembled;              // Built by the internal assembler
+	bool intel;                  // Inline assembly uses the Intel syntax
+
+	unsigned char *code;         // Raw binary image of the snippet
+	size_t size;                 // Size of the binary image
+
+	insn_info *insns;            // Pre-decoded instruction chain
+	unsigned int ninsns;         // Number of decoded instructions
+
+	unsigned int *jumps;         // Index of the target of each local jump, where
+	                             // 'ninsns' is the instruction following the snippet
+	snippet_reloc *relocs;       // Symbolic references
+	unsigned int nrelocs;
+
+	struct _snippet *next;
+} snippet;
+
+
+/**
+ * Retrieves the snippet compiled from the given source file. The lookup
+ * is first performed in memory, then in the on-disk cache (if configured),
+ * and only as a last resort the compiler is invoked.
+ *
+ * @param filename Path of the snippet's source file
+ *
+ * @return Pointer to the snippet descriptor
+ */
+snippet *snippet_load(char *filename);
+
+/**
+ * Retrieves the snippet built from inline assembly code, as found in the
+ * Assembly rule tags. The code is assembled in-process and decoded only
+ * the first time it is met.
+ *
+ * @param source String containing the assembly instructions
+ * @param intel True if the source uses the Intel syntax, false for AT&T
+ *
+ * @return Pointer to the snippet descriptor
+ */
+snippet *snippet_assemble(char *source, bool intel);
+
+/**
+ * Clones the snippet's instructions into the intermediate representation.
+ *
+ * @param snip Pointer to the snippet descriptor
+ * @param target Pointer to the pivot instruction descriptor
+ * @param mode Whether to insert before, after or in place of the target
+ * @param last Pointer to a variable which will hold the last inserted instruction
+ *
+ * @return Number of newly inserted instructions
+ */
+int snippet_apply(snippet *snip, insn_info *target, insn_insert_mode mode, insn_info **last);
+
+/**
+ * Prints out the cache hit/miss counters.
+ */
+void snippet_stats(void);
+
+#endif /* _SNIPPETS_H */
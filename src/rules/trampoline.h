@@ -41,6 +41,37 @@
 #define has_idx(f)		((f) & IDX)
 #define is_rip_rel(f)	((f) & RIP)
 
+// Number of accesses each thread buffers before handing them to the functions
+// of the AddCall tags whose arguments are 'batch'
+#define BATCH_RECORDS	1024
+
+// Size in bytes of a buffered access, see batch_record
+#define BATCH_RECORD_SIZE	24
+
+// Call sites which can be hoisted out of the loops for the AddCall tags whose
+// arguments are 'range': the accesses of the others are handed one at a time
+#define RANGE_SITES	1024
+
+
+#ifndef __ASSEMBLER__
+
+/**
+ * How the accesses are handed to the function of an AddCall tag, after its
+ * arguments.
+ *
+ * Ranges are handed as <code>void function(unsigned long long start,
+ * unsigned long long end, long long stride, unsigned int size)</code>: the
+ * access has been made on size bytes at start, start + stride and so on, up
+ * to end excluded. Accesses which move by a stride in a loop are handed once
+ * the loop is over, the others one at a time, as a range whose stride is the
+ * size. A stride of zero tells that the address has been the same at every
+ * iteration, and end is then equal to start.
+ */
+typedef enum {
+	TRAMPOLINE_TARGET,		// One at a time
+	TRAMPOLINE_BATCH,		// In batches, see batch_record
+	TRAMPOLINE_RANGE		// As ranges
+} trampoline_mode;
 
 typedef struct {
 	unsigned int size;		// Dimensione in byte della scrittura
@@ -52,4 +83,30 @@ typedef struct {
 	long long pointer;		// The pointer to the function that has to be called
 } insn_entry;
 
+/**
+ * Structure the generic trampoline receives from the call sites of the batched
+ * accesses. The entry makes it call <em>trampoline_batch_generic</em>, which
+ * buffers the access on behalf of the function the user has specified.
+ */
+typedef struct {
+	insn_entry entry;
+	long long function;		// The function the batch is handed to
+	unsigned int site;		// Identifier of the call site
+	unsigned int padding;
+} batch_entry;
+
+/**
+ * An access buffered by the runtime. Batches are handed to the user function
+ * as <code>void function(const batch_record *records, size_t count)</code>,
+ * holding the accesses of the calling thread in the order they were made.
+ */
+typedef struct {
+	unsigned long long address;	// Address of the access
+	unsigned int size;		// Size in bytes of the access
+	unsigned int site;		// Call site which has recorded the access
+	void *function;			// Function the record is handed to
+} batch_record;
+
+#endif // __ASSEMBLER__
+
 #endif // _MONITOR64_H
\ No newline at end of file
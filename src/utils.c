@@ -27,6 +27,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <utils.h>
 #include <prints.h>
 
@@ -111,6 +112,147 @@ void hexdump (void *addr, int len) {
 	printf ("  |%s|\n", buff);
 }
 
+/// Bytes of each chunk of an arena, unless a larger block is requested
+#define ARENA_CHUNK_SIZE	(1 << 20)
+
+/// Alignment of the blocks carved out of an arena
+#define ARENA_ALIGN		16
+
+// Space taken by the header of a chunk, which is followed by its blocks
+#define ARENA_HEADER_SIZE	((sizeof(arena_chunk) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/**
+ * Carves a zeroed block out of an arena.
+ *
+ * @param pool Pointer to the arena
+ * @param size Size of the block
+ *
+ * @return Pointer to the block
+ */
+void *arena_alloc(arena *pool, size_t size) {
+	arena_chunk *chunk;
+	size_t length;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	chunk = pool->chunks;
+
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		length = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+
+		chunk = calloc(ARENA_HEADER_SIZE + length, 1);
+		if (chunk == NULL) {
+			herror(true, "Out of memory!\n");
+		}
+
+		chunk->size = length;
+
+		// Oversized blocks get a chunk of their own, which is put
+		// behind the one being carved so that it is not wasted
+		if (length > ARENA_CHUNK_SIZE && pool->chunks != NULL) {
+			chunk->next = pool->chunks->next;
+			pool->chunks->next = chunk;
+		} else {
+			chunk->next = pool->chunks;
+			pool->chunks = chunk;
+		}
+	}
+
+	chunk->used += size;
+
+	return (unsigned char *) chunk + ARENA_HEADER_SIZE + chunk->used - size;
+}
+
+/**
+ * Moves all the blocks of an arena to another one, which will release
+ * them. The source arena is left empty.
+ *
+ * @param to Pointer to the destination arena
+ * @param from Pointer to the source arena
+ */
+void arena_merge(arena *to, arena *from) {
+	arena_chunk *last;
+
+	if (from->chunks == NULL) {
+		return;
+	}
+
+	for (last = from->chunks; last->next; last = last->next);
+
+	// The chunk being carved in the destination stays in front
+	if (to->chunks != NULL) {
+		last->next = to->chunks->next;
+		to->chunks->next = from->chunks;
+	} else {
+		to->chunks = from->chunks;
+	}
+
+	from->chunks = NULL;
+}
+
+/**
+ * Releases all the blocks of an arena at once.
+ *
+ * @param pool Pointer to the arena
+ */
+void arena_release(arena *pool) {
+	arena_chunk *chunk;
+
+	while (pool->chunks) {
+		chunk = pool->chunks;
+		pool->chunks = chunk->next;
+		free(chunk);
+	}
+}
+
+
+// Nodes of the lists and arrays of the small vectors are carved out of the
+// arena set by the calling thread, if any, and the nodes removed from a list
+// are kept aside to be reused
+static __thread arena *ll_arena;
+static __thread ll_node *ll_spare;
+
+/**
+ * Makes the calling thread carve the nodes of the lists, as well as the
+ * arrays of the small vectors, out of an arena, or allocate them on the heap
+ * if <em>pool</em> is NULL. Nodes carved out of an arena must not be removed
+ * from their lists once the thread stops using it.
+ *
+ * @param pool Pointer to the arena, or NULL
+ */
+void ll_use_arena(arena *pool) {
+	ll_arena = pool;
+	ll_spare = NULL;
+}
+
+static ll_node *ll_node_alloc(void) {
+	ll_node *node;
+
+	if (ll_arena == NULL) {
+		node = calloc(sizeof(ll_node), 1);
+	} else if (ll_spare != NULL) {
+		node = ll_spare;
+		ll_spare = node->next;
+		bzero(node, sizeof(ll_node));
+	} else {
+		node = arena_alloc(ll_arena, sizeof(ll_node));
+	}
+
+	if (node == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	return node;
+}
+
+static void ll_node_release(ll_node *node) {
+	if (ll_arena == NULL) {
+		free(node);
+	} else {
+		node->next = ll_spare;
+		ll_spare = node;
+	}
+}
+
 inline void ll_init(linked_list *list) {
 	list->first = list->last = NULL;
 }
@@ -129,7 +271,7 @@ inline bool ll_empty(linked_list *list) {
 void ll_push(linked_list *list, void *elem) {
 	ll_node *node;
 
-	node = calloc(sizeof(ll_node), 1);
+	node = ll_node_alloc();
 	node->elem = elem;
 
 	if (ll_empty(list)) {
@@ -149,7 +291,7 @@ void ll_push(linked_list *list, void *elem) {
 void ll_push_first(linked_list *list, void *elem) {
 	ll_node *node;
 
-	node = calloc(sizeof(ll_node), 1);
+	node = ll_node_alloc();
 	node->elem = elem;
 
 	if (ll_empty(list)) {
@@ -167,8 +309,8 @@ void ll_push_first(linked_list *list, void *elem) {
 }
 
 void *ll_pop(linked_list *list) {
-	ll_node *node;
-	void *elem;
+	ll_node *node = NULL;
+	void *elem = NULL;
 
 	if (!ll_empty(list)) {
 		if (list->first == list->last) {
@@ -189,15 +331,15 @@ void *ll_pop(linked_list *list) {
 
 	if (node) {
 		elem = node->elem;
-		free(node);
+		ll_node_release(node);
 	}
 
 	return elem;
 }
 
 void *ll_pop_first(linked_list *list) {
-	ll_node *node;
-	void *elem;
+	ll_node *node = NULL;
+	void *elem = NULL;
 
 	if (!ll_empty(list)) {
 		if (list->first == list->last) {
@@ -218,12 +360,148 @@ void *ll_pop_first(linked_list *list) {
 
 	if (node) {
 		elem = node->elem;
-		free(node);
+		ll_node_release(node);
+	}
+
+	return elem;
+}
+
+bool ll_remove(linked_list *list, void *elem) {
+	ll_node *node;
+
+	for (node = list->first; node; node = node->next) {
+		if (node->elem == elem) {
+			break;
+		}
+	}
+
+	if (node == NULL) {
+		return false;
+	}
+
+	if (node->prev) {
+		node->prev->next = node->next;
+	} else {
+		list->first = node->next;
+	}
+
+	if (node->next) {
+		node->next->prev = node->prev;
+	} else {
+		list->last = node->prev;
+	}
+
+	ll_node_release(node);
+
+	return true;
+}
+
+/**
+ * Appends an element to a small vector, moving its elements to a larger
+ * array whenever it is full.
+ *
+ * @param vec Pointer to the vector
+ * @param elem The element
+ */
+void sv_push(small_vector *vec, void *elem) {
+	unsigned int capacity;
+	void **elems;
+
+	capacity = vec->capacity ? vec->capacity : SV_INLINE_SIZE;
+
+	if (vec->count == capacity) {
+		capacity *= 2;
+
+		// Arrays carved out of an arena are just left behind
+		if (ll_arena != NULL) {
+			elems = arena_alloc(ll_arena, sizeof(void *) * capacity);
+		} else {
+			elems = malloc(sizeof(void *) * capacity);
+		}
+
+		if (elems == NULL) {
+			herror(true, "Out of memory!\n");
+		}
+
+		memcpy(elems, sv_elems(vec), sizeof(void *) * vec->count);
+
+		if (vec->capacity && !vec->pooled) {
+			free(vec->u.elems);
+		}
+
+		vec->u.elems = elems;
+		vec->capacity = capacity;
+		vec->pooled = (ll_arena != NULL);
 	}
 
+	sv_elems(vec)[vec->count++] = elem;
+}
+
+void *sv_pop(small_vector *vec) {
+	if (sv_empty(vec)) {
+		return NULL;
+	}
+
+	return sv_elems(vec)[--vec->count];
+}
+
+void *sv_pop_first(small_vector *vec) {
+	void **elems;
+	void *elem;
+
+	if (sv_empty(vec)) {
+		return NULL;
+	}
+
+	elems = sv_elems(vec);
+	elem = elems[0];
+
+	memmove(elems, elems + 1, sizeof(void *) * --vec->count);
+
 	return elem;
 }
 
+/**
+ * Removes the first occurrence of an element from a small vector,
+ * keeping the order of the others.
+ *
+ * @param vec Pointer to the vector
+ * @param elem The element
+ *
+ * @return True if the element was found
+ */
+bool sv_remove(small_vector *vec, void *elem) {
+	void **elems;
+	unsigned int i;
+
+	elems = sv_elems(vec);
+
+	for (i = 0; i < vec->count; i++) {
+		if (elems[i] == elem) {
+			memmove(elems + i, elems + i + 1, sizeof(void *) * (vec->count - i - 1));
+			vec->count--;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void sv_move(small_vector *from, small_vector *to) {
+	sv_clear(to);
+
+	*to = *from;
+	bzero(from, sizeof(small_vector));
+}
+
+void sv_clear(small_vector *vec) {
+	if (vec->capacity && !vec->pooled) {
+		free(vec->u.elems);
+	}
+
+	bzero(vec, sizeof(small_vector));
+}
+
 char *add_suffix(char *base, char *delim, char *suffix) {
 	char *new_string;
 	int length;
@@ -237,4 +515,163 @@ char *add_suffix(char *base, char *delim, char *suffix) {
 	sprintf(new_string, "%s%s%s", base, delim, suffix);
 
 	return new_string;
-}
\ No newline at end of file
+}
+
+// Initial number of buckets of a hash table
+#define HT_INITIAL_SIZE 64
+
+static void ht_grow(hash_table *table) {
+	ht_node **buckets, **tails, *node, *next;
+	size_t size, i, b;
+
+	size = table->size ? table->size * 2 : HT_INITIAL_SIZE;
+
+	buckets = calloc(sizeof(ht_node *), size);
+	tails = calloc(sizeof(ht_node *), size);
+	if (buckets == NULL || tails == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	// Nodes are moved in order, so that elements sharing
+	// a key keep their insertion order
+	for (i = 0; i < table->size; i++) {
+		for (node = table->buckets[i]; node; node = next) {
+			next = node->next;
+			node->next = NULL;
+
+			b = node->key & (size - 1);
+			if (tails[b]) {
+				tails[b]->next = node;
+			} else {
+				buckets[b] = node;
+			}
+			tails[b] = node;
+		}
+	}
+
+	free(table->buckets);
+	free(table->tails);
+	table->buckets = buckets;
+	table->tails = tails;
+	table->size = size;
+}
+
+void ht_insert(hash_table *table, unsigned long long key, void *elem) {
+	ht_node *node;
+	size_t b;
+
+	if (table->count >= table->size) {
+		ht_grow(table);
+	}
+
+	node = calloc(sizeof(ht_node), 1);
+	if (node == NULL) {
+		herror(true, "Out of memory!\n");
+	}
+
+	node->key = key;
+	node->elem = elem;
+
+	b = key & (table->size - 1);
+	if (table->tails[b]) {
+		table->tails[b]->next = node;
+	} else {
+		table->buckets[b] = node;
+	}
+	table->tails[b] = node;
+
+	table->count++;
+}
+
+bool ht_remove(hash_table *table, unsigned long long key, void *elem) {
+	ht_node *node, *prev;
+	size_t b;
+
+	if (table->size == 0) {
+		return false;
+	}
+
+	b = key & (table->size - 1);
+
+	for (prev = NULL, node = table->buckets[b]; node; prev = node, node = node->next) {
+		if (node->key == key && node->elem == elem) {
+			if (prev) {
+				prev->next = node->next;
+			} else {
+				table->buckets[b] = node->next;
+			}
+
+			if (table->tails[b] == node) {
+				table->tails[b] = prev;
+			}
+
+			free(node);
+			table->count--;
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+ht_node *ht_first(hash_table *table, unsigned long long key) {
+	ht_node *node;
+
+	if (table->size == 0) {
+		return NULL;
+	}
+
+	for (node = table->buckets[key & (table->size - 1)]; node; node = node->next) {
+		if (node->key == key) {
+			return node;
+		}
+	}
+
+	return NULL;
+}
+
+ht_node *ht_next(ht_node *node, unsigned long long key) {
+	for (node = node->next; node; node = node->next) {
+		if (node->key == key) {
+			return node;
+		}
+	}
+
+	return NULL;
+}
+
+void ht_clear(hash_table *table) {
+	ht_node *node, *next;
+	size_t i;
+
+	for (i = 0; i < table->size; i++) {
+		for (node = table->buckets[i]; node; node = next) {
+			next = node->next;
+			free(node);
+		}
+	}
+
+	free(table->buckets);
+	free(table->tails);
+	table->buckets = table->tails = NULL;
+	table->size = table->count = 0;
+}
+
+unsigned long long hash_bytes(const void *data, size_t len, unsigned long long seed) {
+	const unsigned char *bytes;
+	unsigned long long hash;
+	size_t i;
+
+	// 64-bit FNV-1a, chained through 'seed' so that
+	// several buffers can be folded into a single key
+	bytes = data;
+	hash = seed;
+
+	for (i = 0; i < len; i++) {
+		hash ^= bytes[i];
+		hash *= HASH_FNV_PRIME;
+	}
+
+	return hash;
+}
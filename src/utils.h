@@ -29,6 +29,8 @@
 #define _UTILS_H_
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 
 // Checks whether two strings have the same sequence of characters
@@ -54,6 +56,54 @@
 void hexdump (void *addr, int len);
 
 
+// Hashing
+// -------
+
+// Initial value and multiplier of the 64-bit FNV-1a hash
+#define HASH_FNV_OFFSET 0xcbf29ce484222325ULL
+#define HASH_FNV_PRIME  0x100000001b3ULL
+
+// Hash table
+// ----------
+
+// Chained hash table mapping 64-bit keys to elements. Several elements
+// may share the same key; they are kept in insertion order. An all-zero
+// table is a valid empty table.
+
+typedef struct ht_node {
+	unsigned long long key;
+	void *elem;
+	struct ht_node *next;
+} ht_node;
+
+typedef struct {
+	ht_node **buckets;
+	ht_node **tails;              // Last node of each bucket, for appending
+	size_t size;
+	size_t count;
+} hash_table;
+
+// Iterates over the elements whose key is 'k'
+#define ht_foreach(table, k, node) \
+  for ((node) = ht_first((table), (k)); (node); (node) = ht_next((node), (k)))
+
+// Arena
+// -----
+
+// Pool of zeroed blocks carved out of large chunks by bumping a pointer.
+// Blocks are not released one by one, but all together along with the
+// arena. An all-zero arena is a valid empty arena.
+
+typedef struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;                  // Bytes which can be carved out of the chunk
+	size_t used;
+} arena_chunk;
+
+typedef struct {
+	arena_chunk *chunks;          // The chunk being carved comes first
+} arena;
+
 // Linked list
 // -----------
 
@@ -68,6 +118,35 @@ typedef struct {
 	ll_node *last;
 } linked_list;
 
+// Small vector
+// ------------
+
+// Sequence of elements with room for two of them inline, which spills to
+// an array only when it grows larger. Most of the edges of the program
+// have no more than two elements. An all-zero vector is a valid empty vector.
+
+#define SV_INLINE_SIZE 2
+
+typedef struct {
+	unsigned int count;
+	unsigned int capacity : 31;   // Size of the array, zero while inline
+	unsigned int pooled : 1;      // Whether the array is carved out of an arena
+	union {
+		void *inline_elems[SV_INLINE_SIZE];
+		void **elems;
+	} u;
+} small_vector;
+
+#define sv_elems(vec) ((vec)->capacity ? (vec)->u.elems : (vec)->u.inline_elems)
+#define sv_size(vec) ((vec)->count)
+#define sv_empty(vec) ((vec)->count == 0)
+#define sv_at(vec, i) (sv_elems(vec)[(i)])
+#define sv_first(vec) (sv_empty(vec) ? NULL : sv_at((vec), 0))
+
+// Iterates over the elements, including the ones appended meanwhile
+#define sv_foreach(vec, i, e) \
+  for ((i) = 0; (i) < (vec)->count && ((e) = sv_at((vec), (i)), true); (i)++)
+
 // Graph
 // -----
 
@@ -93,7 +172,12 @@ typedef struct {
   graph_visit_func post_func;
 } graph_visit;
 
+extern void *arena_alloc(arena *pool, size_t size);
+extern void arena_merge(arena *to, arena *from);
+extern void arena_release(arena *pool);
+
 extern void ll_init(linked_list *list);
+extern void ll_use_arena(arena *pool);
 
 extern void ll_move(linked_list *from, linked_list *to);
 extern bool ll_empty(linked_list *list);
@@ -103,7 +187,44 @@ extern void ll_push_first(linked_list *list, void *elem);
 
 extern void *ll_pop(linked_list *list);
 extern void *ll_pop_first(linked_list *list);
+extern bool ll_remove(linked_list *list, void *elem);
+
+extern void sv_push(small_vector *vec, void *elem);
+extern void *sv_pop(small_vector *vec);
+extern void *sv_pop_first(small_vector *vec);
+extern bool sv_remove(small_vector *vec, void *elem);
+extern void sv_move(small_vector *from, small_vector *to);
+extern void sv_clear(small_vector *vec);
 
 extern char *add_suffix(char *base, char *delim, char *suffix);
 
+extern void ht_insert(hash_table *table, unsigned long long key, void *elem);
+extern bool ht_remove(hash_table *table, unsigned long long key, void *elem);
+extern ht_node *ht_first(hash_table *table, unsigned long long key);
+extern ht_node *ht_next(ht_node *node, unsigned long long key);
+extern void ht_clear(hash_table *table);
+
+/**
+ * Computes the 64-bit FNV-1a hash of a buffer.
+ *
+ * @param data Pointer to the buffer to hash
+ * @param len Number of bytes to read
+ * @param seed Initial hash value, either HASH_FNV_OFFSET or the hash of a
+ * previous buffer which has to be chained with this one
+ *
+ * @return The hash value
+ */
+extern unsigned long long hash_bytes(const void *data, size_t len, unsigned long long seed);
+
+// Hash of a NUL-terminated string
+#define hash_string(str) \
+  hash_bytes((str), strlen((const char *) (str)), HASH_FNV_OFFSET)
+
+// Key of a pointer, which spreads the aligned low bits across the buckets;
+// the mapping is bijective, so distinct pointers get distinct keys
+#define hash_pointer(ptr) \
+  ((unsigned long long) (uintptr_t) (ptr) \
+   ^ ((unsigned long long) (uintptr_t) (ptr) >> 4) \
+   ^ ((unsigned long long) (uintptr_t) (ptr) >> 12))
+
 #endif /* _UTILS_H_ */